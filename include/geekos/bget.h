@@ -39,6 +39,9 @@ void	bstats	    _((bufsize *curalloc, bufsize *totfree, bufsize *maxfree,
 		       long *nget, long *nrel));
 void	bstatse     _((bufsize *pool_incr, long *npool, long *npget,
 		       long *nprel, long *ndget, long *ndrel));
+#if defined (GEEKOS)
+void	bstatspeak  _((bufsize *peakalloc));
+#endif
 void	bufdump     _((void *buf));
 void	bpoold	    _((void *pool, int dumpalloc, int dumpfree));
 int	bpoolv	    _((void *pool));
@@ -15,6 +15,7 @@
 #include <geekos/kthread.h>
 #include <geekos/list.h>
 #include <geekos/fileio.h>
+#include <geekos/iostat.h>
 
 #ifdef GEEKOS
 
@@ -32,6 +33,16 @@ enum Request_State {
     PENDING, COMPLETED, ERROR
 };
 
+/*
+ * Policy used to choose the order in which a device's
+ * queued requests are handed to its driver.
+ */
+enum Block_Scheduler_Policy {
+    BLOCK_SCHED_FIFO,		/* arrival order */
+    BLOCK_SCHED_CLOOK,		/* ascending block order, then wrap around */
+    BLOCK_SCHED_DEADLINE,	/* C-LOOK, but expired requests go first */
+};
+
 struct Block_Request;
 
 /*
@@ -39,6 +50,11 @@ struct Block_Request;
  */
 DEFINE_LIST(Block_Request_List, Block_Request);
 
+/*
+ * Function called when an asynchronous request completes.
+ */
+typedef void Block_Request_Callback(struct Block_Request *request);
+
 /*
  * An I/O request for a block device.
  */
@@ -46,10 +62,21 @@ struct Block_Request {
     struct Block_Device *dev;
     enum Request_Type type;
     int blockNum;
+    int numBlocks;
+    int xferBlocks;			 /* blocks the driver transfers, including merged requests */
     void *buf;
     volatile enum Request_State state;
     volatile int errorCode;
     struct Thread_Queue waitQueue;
+    ulong_t deadline;			 /* tick by which a deadline scheduler serves it */
+    struct Block_Request *mergedNext;	 /* requests merged into this one */
+    Block_Request_Callback *callback;	 /* called on completion, if set */
+    void *callbackData;			 /* for use by the callback */
+
+    /* Time stamp counter readings, for the device statistics */
+    unsigned long long postTime;
+    unsigned long long dequeueTime;
+    unsigned long long completionTime;
 
     DEFINE_LINK(Block_Request_List, Block_Request);
 };
@@ -71,6 +98,12 @@ struct Block_Device {
     struct Thread_Queue *waitQueue;
     struct Block_Request_List *requestQueue;
 
+    /* I/O scheduler state */
+    enum Block_Scheduler_Policy policy;
+    int headPosition;			 /* block following the last one dispatched */
+
+    struct Block_Device_Stats stats;
+
     DEFINE_LINK(Block_Device_List, Block_Device);
 };
 
@@ -81,6 +114,14 @@ struct Block_Device_Ops {
     int (*Open)(struct Block_Device *dev);
     int (*Close)(struct Block_Device *dev);
     int (*Get_Num_Blocks)(struct Block_Device *dev);
+
+    /*
+     * Largest number of consecutive blocks the driver will
+     * transfer in a single request.  Zero means the driver only
+     * handles single block requests, and ranges are split up
+     * for it by the block device layer.
+     */
+    int maxRequestBlocks;
 };
 
 /*
@@ -89,11 +130,14 @@ struct Block_Device_Ops {
  */
 int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
     int unit, void *driverData, struct Thread_Queue *waitQueue,
-    struct Block_Request_List *requestQueue);
+    struct Block_Request_List *requestQueue, enum Block_Scheduler_Policy policy);
 int Open_Block_Device(const char *name, struct Block_Device **pDev);
 int Close_Block_Device(struct Block_Device *dev);
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
     int blockNum, void *buf);
+struct Block_Request *Create_Range_Request(struct Block_Device *dev, enum Request_Type type,
+    int blockNum, int numBlocks, void *buf);
+void Release_Request(struct Block_Request *request);
 void Post_Request_And_Wait(struct Block_Request *request);
 struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
     struct Thread_Queue *waitQueue);
@@ -105,7 +149,21 @@ void Notify_Request_Completion(struct Block_Request *request, enum Request_State
  */
 int Block_Read(struct Block_Device *dev, int blockNum, void *buf);
 int Block_Write(struct Block_Device *dev, int blockNum, void *buf);
+int Block_Read_Range(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
+int Block_Write_Range(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
 int Get_Num_Blocks(struct Block_Device *dev);
+int Get_Max_Request_Blocks(struct Block_Device *dev);
+int Get_Block_Device_Stats(struct Block_Device_Stats *statsList, int maxDevices);
+
+/*
+ * Asynchronous block device API.
+ * Requests are created with Create_Request() or Create_Range_Request(),
+ * and returned with Release_Request() once complete.
+ */
+void Submit_Block_Request(struct Block_Request *request,
+    Block_Request_Callback *callback, void *callbackData);
+int Wait_For_Request(struct Block_Request *request);
+int Wait_For_Requests(struct Block_Request **requestList, int numRequests);
 
 /*
  * Misc. routines
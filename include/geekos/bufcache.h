@@ -0,0 +1,70 @@
+/*
+ * Filesystem buffer cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_BUFCACHE_H
+#define GEEKOS_BUFCACHE_H
+
+#include <geekos/ktypes.h>
+#include <geekos/list.h>
+#include <geekos/blockdev.h>
+
+#ifdef GEEKOS
+
+/*
+ * Default limit on the memory used by cached buffers, in bytes.
+ * The limit actually used is g_bufferCacheMaxBytes.
+ */
+#define BUFFER_CACHE_DEFAULT_MAX_BYTES	(256 * 1024)
+
+/*
+ * Buffer flags.
+ */
+#define FS_BUFFER_DIRTY		0x01	 /* modified, not yet written to the device */
+#define FS_BUFFER_LOADING	0x02	 /* being read from the device */
+#define FS_BUFFER_INVALID	0x04	 /* read failed; contents are garbage */
+
+struct FS_Buffer;
+struct FS_Buffer_Cache;
+
+DEFINE_LIST(FS_Buffer_List, FS_Buffer);
+
+/*
+ * A cached filesystem block.
+ * The contents may be used between Get_FS_Buffer() and
+ * Release_FS_Buffer(); the buffer is pinned in the cache meanwhile.
+ * The buffer cache doesn't lock buffer contents, so filesystems
+ * must serialize concurrent modifications themselves.
+ */
+struct FS_Buffer {
+    struct FS_Buffer_Cache *cache;
+    ulong_t fsBlockNum;			 /* block number, in filesystem blocks */
+    void *data;				 /* contents of the block */
+    uint_t flags;
+    int refCount;			 /* number of users; 0 if on the LRU list */
+    struct FS_Buffer *hashNext;		 /* next in hash chain */
+
+    DEFINE_LINK(FS_Buffer_List, FS_Buffer);
+};
+
+IMPLEMENT_LIST(FS_Buffer_List, FS_Buffer);
+
+extern ulong_t g_bufferCacheMaxBytes;
+
+void Init_Buffer_Cache(void);
+
+struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t fsBlockSize);
+int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
+int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
+
+int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf);
+void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+int Sync_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+
+#endif  /* GEEKOS */
+
+#endif  /* GEEKOS_BUFCACHE_H */
@@ -20,6 +20,8 @@ enum DMA_Direction {
 void Init_DMA(void);
 bool Reserve_DMA(int chan);
 void Setup_DMA(enum DMA_Direction direction, int chan, void *addr, ulong_t size);
+ulong_t DMA_Bytes_Before_Boundary(void *addr, ulong_t size);
+void *Alloc_DMA_Buffer(ulong_t size);
 
 void Mask_DMA(int chan);
 void Unmask_DMA(int chan);
@@ -69,6 +69,12 @@ struct VFS_Dir_Entry {
     struct VFS_File_Stat stats;
 };
 
+/*
+ * Returned by Read_Entry() function to indicate that there
+ * are no more directory entries.
+ */
+#define VFS_NO_MORE_DIR_ENTRIES 1
+
 /*
  * A request to mount a filesystem.
  * This is passed as a struct because it would require too many registers
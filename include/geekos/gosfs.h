@@ -0,0 +1,164 @@
+/*
+ * Header file for GOSFS, the GeekOS filesystem.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_GOSFS_H
+#define GEEKOS_GOSFS_H
+
+/*
+ * On-disk layout, in 4K filesystem blocks:
+ *
+ *   superblock | journal | block bitmap | inode bitmap | inodes | data
+ *
+ * Files are described by inodes, which map their blocks as extents:
+ * runs of consecutive blocks.  The first few extents are in the
+ * inode itself, the rest in a single extent block.  Directories are
+ * files holding fixed size entries.
+ *
+ * Changes to the metadata (everything before the data blocks, plus
+ * directory and extent blocks) are made atomic by the journal: the
+ * modified blocks are written to the journal, then a header listing
+ * them, and only then to their home locations.  A header whose
+ * checksum matches the blocks in the journal is replayed when the
+ * filesystem is mounted.
+ *
+ * The structures here are shared with the mkgosfs tool, so they
+ * only use the basic C types.
+ */
+
+#define GOSFS_MAGIC			0x474f5346	/* "GOSF" */
+#define GOSFS_JOURNAL_MAGIC		0x4a524e4c	/* "JRNL" */
+
+#define GOSFS_BLOCK_SIZE		4096
+#define GOSFS_SECTORS_PER_BLOCK		(GOSFS_BLOCK_SIZE / 512)
+#define GOSFS_BITS_PER_BLOCK		(GOSFS_BLOCK_SIZE * 8)
+
+/* Most blocks changed by one transaction; the journal holds one transaction. */
+#define GOSFS_MAX_TRANSACTION_BLOCKS	32
+
+/*
+ * The block bitmap is limited so that freeing any file's blocks
+ * fits in one transaction.  This allows filesystems up to 2G.
+ */
+#define GOSFS_MAX_BITMAP_BLOCKS		16
+#define GOSFS_MAX_BLOCKS		(GOSFS_MAX_BITMAP_BLOCKS * GOSFS_BITS_PER_BLOCK)
+
+/* Smallest filesystem worth creating, besides its metadata. */
+#define GOSFS_MIN_DATA_BLOCKS		16
+
+/* One inode for each this many blocks. */
+#define GOSFS_BLOCKS_PER_INODE		4
+
+/* Inode 0 means "no inode"; the root directory is inode 1. */
+#define GOSFS_ROOT_INODE		1
+
+#define GOSFS_INODE_FILE		1
+#define GOSFS_INODE_DIRECTORY		2
+
+#define GOSFS_NUM_DIRECT_EXTENTS	12
+#define GOSFS_MAX_NAME_LEN		59
+
+struct GOSFS_Superblock {
+    unsigned int magic;
+    unsigned int blockSize;
+    unsigned int numBlocks;		/* Size of the filesystem */
+    unsigned int journalStart;
+    unsigned int journalBlocks;		/* Header, then room for one transaction */
+    unsigned int bitmapStart;
+    unsigned int bitmapBlocks;
+    unsigned int inodeBitmapStart;
+    unsigned int inodeBitmapBlocks;
+    unsigned int inodeStart;
+    unsigned int inodeBlocks;
+    unsigned int numInodes;
+    unsigned int dataStart;		/* First block available for files */
+};
+
+/* A run of consecutive blocks. */
+struct GOSFS_Extent {
+    unsigned int start;
+    unsigned int length;
+};
+
+struct GOSFS_Inode {
+    unsigned short type;		/* GOSFS_INODE_FILE or GOSFS_INODE_DIRECTORY, 0 if free */
+    unsigned short reserved0;
+    unsigned int size;			/* Size in bytes */
+    unsigned int numBlocks;		/* Blocks allocated to the file */
+    unsigned int numExtents;
+    unsigned int extentBlock;		/* Block holding extents past the direct ones, or 0 */
+    struct GOSFS_Extent extents[GOSFS_NUM_DIRECT_EXTENTS];
+    unsigned int reserved[3];
+};
+
+struct GOSFS_Dir_Entry {
+    unsigned int inode;			/* 0 if the slot is free */
+    char name[GOSFS_MAX_NAME_LEN + 1];
+};
+
+/*
+ * First block of the journal.  The transaction is committed once
+ * the header is written with the checksum of its blocks, which
+ * are in the blocks following the header, in homeBlock order.
+ */
+struct GOSFS_Journal_Header {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int numBlocks;		/* 0 if there is nothing to replay */
+    unsigned int checksum;		/* crc32 of the logged blocks */
+    unsigned int homeBlock[GOSFS_MAX_TRANSACTION_BLOCKS];
+};
+
+#define GOSFS_INODES_PER_BLOCK		(GOSFS_BLOCK_SIZE / sizeof(struct GOSFS_Inode))
+#define GOSFS_EXTENTS_PER_BLOCK		(GOSFS_BLOCK_SIZE / sizeof(struct GOSFS_Extent))
+#define GOSFS_MAX_EXTENTS		(GOSFS_NUM_DIRECT_EXTENTS + GOSFS_EXTENTS_PER_BLOCK)
+#define GOSFS_DIR_ENTRIES_PER_BLOCK	(GOSFS_BLOCK_SIZE / sizeof(struct GOSFS_Dir_Entry))
+
+/*
+ * Lay out a filesystem of given size in blocks.
+ * Used by both Format() and mkgosfs.
+ */
+static __inline__ void GOSFS_Init_Superblock(struct GOSFS_Superblock *super, unsigned int numBlocks)
+{
+    if (numBlocks > GOSFS_MAX_BLOCKS)
+	numBlocks = GOSFS_MAX_BLOCKS;
+
+    super->magic = GOSFS_MAGIC;
+    super->blockSize = GOSFS_BLOCK_SIZE;
+    super->numBlocks = numBlocks;
+    super->journalStart = 1;
+    super->journalBlocks = 1 + GOSFS_MAX_TRANSACTION_BLOCKS;
+    super->bitmapStart = super->journalStart + super->journalBlocks;
+    super->bitmapBlocks = (numBlocks + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+    super->numInodes = (numBlocks / GOSFS_BLOCKS_PER_INODE + GOSFS_INODES_PER_BLOCK - 1) /
+	GOSFS_INODES_PER_BLOCK * GOSFS_INODES_PER_BLOCK;
+    super->inodeBitmapStart = super->bitmapStart + super->bitmapBlocks;
+    super->inodeBitmapBlocks = (super->numInodes + GOSFS_BITS_PER_BLOCK - 1) / GOSFS_BITS_PER_BLOCK;
+    super->inodeStart = super->inodeBitmapStart + super->inodeBitmapBlocks;
+    super->inodeBlocks = super->numInodes / GOSFS_INODES_PER_BLOCK;
+    super->dataStart = super->inodeStart + super->inodeBlocks;
+}
+
+/*
+ * Fill in block number index of a new bitmap, in which the bits
+ * below firstFree and from numBits onwards are set.
+ */
+static __inline__ void GOSFS_Init_Bitmap_Block(unsigned char *block, unsigned int index,
+    unsigned int firstFree, unsigned int numBits)
+{
+    unsigned int first = index * GOSFS_BITS_PER_BLOCK, i;
+
+    for (i = 0; i < GOSFS_BLOCK_SIZE; ++i)
+	block[i] = 0;
+    for (i = 0; i < GOSFS_BITS_PER_BLOCK; ++i) {
+	if (first + i < firstFree || first + i >= numBits)
+	    block[i / 8] |= 1 << (i % 8);
+    }
+}
+
+void Init_GOSFS(void);
+
+#endif  /* GEEKOS_GOSFS_H */
@@ -0,0 +1,49 @@
+/*
+ * Block device statistics shared between kernel/user space
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_IOSTAT_H
+#define GEEKOS_IOSTAT_H
+
+#include <geekos/ktypes.h>
+#include <geekos/fileio.h>
+
+/* Maximum number of devices reported by one IOStats system call. */
+#define IOSTAT_MAX_DEVICES 8
+
+/*
+ * Number of buckets in a latency histogram.
+ * Bucket 0 counts latencies below 2 microseconds, and bucket n
+ * those from 2^n up to 2^(n+1) microseconds; the last bucket
+ * also counts everything longer.
+ */
+#define IOSTAT_NUM_BUCKETS 20
+
+/*
+ * Activity of one block device, as returned by the IOStats system call.
+ * Times are in microseconds, measured with the processor's
+ * time stamp counter, and wrap around like the counts do.
+ */
+struct Block_Device_Stats {
+    char name[BLOCKDEV_MAX_NAME_LEN];
+    ulong_t numRequests;	/* Requests posted */
+    ulong_t numMerges;		/* Requests merged into another one */
+    ulong_t numReads;		/* Read commands completed by the driver */
+    ulong_t numWrites;		/* Write commands completed by the driver */
+    ulong_t sectorsRead;
+    ulong_t sectorsWritten;
+    ulong_t numErrors;		/* Commands which failed */
+    ulong_t busyTime;		/* Time the driver spent on commands */
+    ulong_t waitTime;		/* Time requests spent queued */
+    int queueDepth;		/* Requests currently queued */
+    int maxQueueDepth;
+
+    /* Latency from posting to completion of each request */
+    ulong_t readLatency[IOSTAT_NUM_BUCKETS];
+    ulong_t writeLatency[IOSTAT_NUM_BUCKETS];
+};
+
+#endif  /* GEEKOS_IOSTAT_H */
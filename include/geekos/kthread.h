@@ -24,6 +24,11 @@ struct Interrupt_State;
  */
 DEFINE_LIST(Thread_Queue, Kernel_Thread);
 
+/*
+ * Static initializer for an empty Thread_Queue.
+ */
+#define THREAD_QUEUE_INITIALIZER { 0, 0 }
+
 /*
  * List which includes all threads.
  */
@@ -112,6 +117,8 @@ struct Kernel_Thread* Start_Kernel_Thread(
     bool detached
 );
 struct Kernel_Thread* Start_User_Thread(struct User_Context* userContext, bool detached);
+struct Kernel_Thread* Start_Forked_User_Thread(struct User_Context* userContext,
+    struct Interrupt_State* state, bool detached);
 void Make_Runnable(struct Kernel_Thread* kthread);
 void Make_Runnable_Atomic(struct Kernel_Thread* kthread);
 struct Kernel_Thread* Get_Current(void);
@@ -121,6 +128,8 @@ void Yield(void);
 void Exit(int exitCode) __attribute__ ((noreturn));
 int Join(struct Kernel_Thread* kthread);
 struct Kernel_Thread* Lookup_Thread(int pid);
+struct Process_Mem_Stats;
+int Get_Process_Mem_Stats(struct Process_Mem_Stats *procList, int maxProcs);
 
 /*
  * Thread context switch function, defined in lowlevel.asm
@@ -30,7 +30,7 @@ typedef unsigned char uchar_t;
  * evaulate their arguments only once.
  */
 #define MIN(a,b) ({typeof (a) _a = (a); typeof (b) _b = (b); (_a < _b) ? _a : _b; })
-#define MAX(a,b) ({typeof (a) _a = (a); typeof (b) _b = (b); (_a < _b) ? _a : _b; })
+#define MAX(a,b) ({typeof (a) _a = (a); typeof (b) _b = (b); (_a > _b) ? _a : _b; })
 
 /*
  * Some ASCII character access and manipulation macros.
@@ -16,4 +16,7 @@ void Init_Heap(ulong_t start, ulong_t size);
 void* Malloc(ulong_t size);
 void Free(void* buf);
 
+struct Mem_Stats;
+void Get_Heap_Stats(struct Mem_Stats *stats);
+
 #endif  /* GEEKOS_MALLOC_H */
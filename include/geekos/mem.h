@@ -16,6 +16,7 @@
 #include <geekos/list.h>
 
 struct Boot_Info;
+struct Mem_Stats;
 
 /*
  * Page flags
@@ -26,6 +27,7 @@ struct Boot_Info;
 #define PAGE_ALLOCATED 0x0004	 /* page is allocated */
 #define PAGE_UNUSED    0x0008	 /* page is unused */
 #define PAGE_HEAP      0x0010	 /* page is in kernel heap */
+#define PAGE_MALLOC    0x0020	 /* page holds Malloc() size class blocks */
 
 /*
  * PC memory map
@@ -58,6 +60,9 @@ DEFINE_LIST(Page_List, Page);
 struct Page {
     unsigned flags;			 /* Flags indicating state of page */
     DEFINE_LINK(Page_List, Page);	 /* Link fields for Page_List */
+    void *freeBlocks;			 /* PAGE_MALLOC: list of free blocks */
+    ushort_t numInUse;			 /* PAGE_MALLOC: blocks handed out */
+    ushort_t sizeClass;			 /* PAGE_MALLOC: index of size class */
 };
 
 IMPLEMENT_LIST(Page_List, Page);
@@ -65,7 +70,10 @@ IMPLEMENT_LIST(Page_List, Page);
 void Init_Mem(struct Boot_Info* bootInfo);
 void Init_BSS(void);
 void* Alloc_Page(void);
+void* Alloc_Zeroed_Page(void);
 void Free_Page(void* pageAddr);
+bool Zero_Free_Page(void);
+void Get_Page_Stats(struct Mem_Stats *stats);
 
 /*
  * Determine if given address is a multiple of the page size.
@@ -0,0 +1,48 @@
+/*
+ * Memory statistics shared between kernel/user space
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_MEMSTAT_H
+#define GEEKOS_MEMSTAT_H
+
+#include <geekos/ktypes.h>
+
+/* Maximum number of processes reported by one MemStats system call. */
+#define MEMSTAT_MAX_PROCESSES 64
+
+/*
+ * System-wide memory usage, as returned by the MemStats system call.
+ * Page counts are by the type of use recorded in the page flags.
+ */
+struct Mem_Stats {
+    ulong_t numPages;		/* Total physical pages */
+    ulong_t freePages;		/* Pages on the freelist */
+    ulong_t zeroedPages;	/* Free pages already zeroed (part of freePages) */
+    ulong_t kernelPages;	/* Kernel code, data and page list */
+    ulong_t heapPages;		/* Kernel heap */
+    ulong_t hardwarePages;	/* ISA hole */
+    ulong_t allocatedPages;	/* Allocated with Alloc_Page() */
+    ulong_t mallocPages;	/* Malloc() size classes (part of allocatedPages) */
+    ulong_t unusedPages;	/* Never used (e.g., page 0) */
+
+    ulong_t heapSize;		/* Bytes in kernel heap */
+    ulong_t heapInUse;		/* Bytes currently allocated from heap */
+    ulong_t heapPeak;		/* Most bytes ever allocated from heap */
+    ulong_t heapFree;		/* Bytes free in heap */
+    ulong_t heapLargestFree;	/* Largest free block in heap */
+    ulong_t numHeapAllocs;	/* Allocations made from heap */
+    ulong_t numHeapFrees;	/* Buffers released to heap */
+};
+
+/*
+ * Memory used by one user process.
+ */
+struct Process_Mem_Stats {
+    int pid;
+    ulong_t size;		/* Bytes in the process's segment */
+};
+
+#endif  /* GEEKOS_MEMSTAT_H */
@@ -0,0 +1,63 @@
+/*
+ * File page cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_PAGECACHE_H
+#define GEEKOS_PAGECACHE_H
+
+#include <geekos/ktypes.h>
+#include <geekos/list.h>
+#include <geekos/mem.h>
+#include <geekos/fileio.h>
+
+#ifdef GEEKOS
+
+/*
+ * Default limit on the number of cached pages.
+ * The limit actually used is g_pageCacheMaxPages.
+ */
+#define PAGE_CACHE_DEFAULT_MAX_PAGES	256
+
+/* Number of device blocks held by one page. */
+#define BLOCKS_PER_PAGE		(PAGE_SIZE / SECTOR_SIZE)
+
+struct Cache_Page;
+
+DEFINE_LIST(Cache_Page_List, Cache_Page);
+
+/*
+ * A cached page of file contents.
+ * Pages are identified by an owner (such as a filesystem's
+ * in-memory file object) and the index of the page in the file.
+ * A page is allocated empty, and its blocks are filled in by the
+ * owner as they are read; validMask has a bit set for each block
+ * of the page holding valid data.  The page cache doesn't lock page
+ * contents or validMask, so owners must serialize access themselves.
+ */
+struct Cache_Page {
+    void *owner;
+    ulong_t index;			 /* page number within the file */
+    char *data;				 /* contents of the page */
+    uint_t validMask;			 /* which blocks of the page are valid */
+    int refCount;			 /* number of users; 0 if on the LRU list */
+    struct Cache_Page *hashNext;	 /* next in hash chain */
+
+    DEFINE_LINK(Cache_Page_List, Cache_Page);
+};
+
+IMPLEMENT_LIST(Cache_Page_List, Cache_Page);
+
+extern ulong_t g_pageCacheMaxPages;
+
+void Init_Page_Cache(void);
+
+int Get_Cache_Page(void *owner, ulong_t index, struct Cache_Page **pPage);
+void Release_Cache_Page(struct Cache_Page *page);
+void Discard_Cache_Pages(void *owner);
+
+#endif  /* GEEKOS */
+
+#endif  /* GEEKOS_PAGECACHE_H */
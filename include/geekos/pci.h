@@ -0,0 +1,48 @@
+/*
+ * PCI configuration space access
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_PCI_H
+#define GEEKOS_PCI_H
+
+#include <geekos/ktypes.h>
+
+/*
+ * Offsets of fields in the configuration header.
+ */
+#define PCI_VENDOR_ID		0x00
+#define PCI_DEVICE_ID		0x02
+#define PCI_COMMAND		0x04
+#define PCI_PROG_IF		0x09
+#define PCI_SUBCLASS		0x0A
+#define PCI_CLASS		0x0B
+#define PCI_HEADER_TYPE		0x0E
+#define PCI_BAR0		0x10
+#define PCI_BAR(n)		(PCI_BAR0 + (n) * 4)
+
+/* Bits of the command register */
+#define PCI_COMMAND_IO		0x0001
+#define PCI_COMMAND_MEMORY	0x0002
+#define PCI_COMMAND_BUS_MASTER	0x0004
+
+/* An I/O space BAR has bit 0 set; the rest is the port base */
+#define PCI_BAR_IO		0x0001
+#define PCI_BAR_IO_MASK		0xFFFFFFFCUL
+
+/*
+ * Location and identity of a PCI function.
+ */
+struct PCI_Device {
+    int bus, slot, func;
+    ushort_t vendorId, deviceId;
+    uchar_t classCode, subclass, progIf;
+};
+
+ulong_t PCI_Read_Config(struct PCI_Device *dev, int offset);
+void PCI_Write_Config(struct PCI_Device *dev, int offset, ulong_t value);
+bool Find_PCI_Device(uchar_t classCode, uchar_t subclass, struct PCI_Device *dev);
+
+#endif  /* GEEKOS_PCI_H */
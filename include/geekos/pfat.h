@@ -46,6 +46,13 @@ typedef struct {
 #define FAT_ENTRY_FREE		0
 #define FAT_ENTRY_EOF		1
 
+/*
+ * Subdirectories are files holding directory entries.
+ * Entries don't cross block boundaries, so each 512 byte block
+ * holds this many, and the rest of it is unused.
+ */
+#define PFAT_DIR_ENTRIES_PER_BLOCK	(512 / sizeof(directoryEntry))
+
 /* magic number to indicate its a PFAT disk */
 #define PFAT_MAGIC		0x78320000
 
@@ -0,0 +1,28 @@
+/*
+ * RAM disk driver
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_RAMDISK_H
+#define GEEKOS_RAMDISK_H
+
+#ifdef GEEKOS
+
+/*
+ * Largest size of the RAM disk, in blocks (8M).  The actual size
+ * is chosen at boot, from the free memory and the size of the
+ * device it is loaded from.
+ */
+#define RAMDISK_MAX_BLOCKS	16384
+
+/*
+ * Functions
+ */
+void Init_Ramdisk(void);
+int Load_Ramdisk(const char *devName);
+
+#endif  /* GEEKOS */
+
+#endif  /* GEEKOS_RAMDISK_H */
@@ -53,6 +53,17 @@ enum {
     SYS_P,		 /* P (acquire semaphore) system call  */
     SYS_V,		 /* V (release semaphore) system call  */
     SYS_DESTROYSEMAPHORE,  /* Destroy semaphore system call  */
+    SYS_FORK,		 /* Fork (duplicate process) system call  */
+    SYS_MEMSTATS,	 /* Get memory usage statistics system call  */
+    SYS_IOSTATS,	 /* Get block device statistics system call  */
+    SYS_OPEN,		 /* Open file system call  */
+    SYS_OPENDIRECTORY,	 /* Open directory system call  */
+    SYS_CLOSE,		 /* Close file or directory system call  */
+    SYS_READ,		 /* Read from file system call  */
+    SYS_WRITE,		 /* Write to file system call  */
+    SYS_SEEK,		 /* Set file position system call  */
+    SYS_STAT,		 /* Get file metadata system call  */
+    SYS_READENTRY,	 /* Read directory entry system call  */
 };
 
 /*
@@ -20,6 +20,18 @@ void Init_Timer(void);
 
 void Micro_Delay(int us);
 
+/*
+ * Read the processor's time stamp counter.
+ */
+static __inline__ unsigned long long Read_TSC(void)
+{
+    unsigned long long count;
+    __asm__ __volatile__ ("rdtsc" : "=A" (count));
+    return count;
+}
+
+ulong_t Cycles_To_Microseconds(unsigned long long cycles);
+
 typedef struct {
     int ticks;				 /* timer code decrements this */
     int id;				 /* unqiue id for this timer even */
@@ -68,6 +68,9 @@ struct User_Context {
      */
     int refCount;
 
+    /* Open files, indexed by file descriptor; 0 for a free descriptor */
+    struct File *fileList[USER_MAX_FILES];
+
 #if 0
     int *semaphores;
 #endif
@@ -83,6 +86,7 @@ struct Interrupt_State;
 void Attach_User_Context(struct Kernel_Thread* kthread, struct User_Context* context);
 void Detach_User_Context(struct Kernel_Thread* kthread);
 int Spawn(const char *program, const char *command, struct Kernel_Thread **pThread);
+int Fork(struct Interrupt_State *state, struct Kernel_Thread **pThread);
 void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_State* state);
 
 /*
@@ -90,11 +94,14 @@ void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_Stat
  */
 
 void Destroy_User_Context(struct User_Context* context);
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+void Close_User_Files(struct User_Context* context);
+int Load_User_Program(struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext);
+int Clone_User_Context(struct User_Context *parent, struct User_Context **pUserContext);
 bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t bufSize);
 bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize);
+void* User_To_Kernel(ulong_t userAddr, ulong_t bufSize);
 void Switch_To_Address_Space(struct User_Context *userContext);
 
 
@@ -18,12 +18,6 @@
 #include <geekos/fileio.h>
 #include <geekos/blockdev.h>
 
-/*
- * Returned by Read_Entry() function to indicate that there
- * are no more directory entries.
- */
-#define VFS_NO_MORE_DIR_ENTRIES 1
-
 struct Mount_Point;
 struct File;
 struct Mount_Point_Ops;
@@ -85,6 +79,7 @@ struct File_Ops {
     int (*Seek)(struct File *file, ulong_t pos);
     int (*Close)(struct File *file);
     int (*Read_Entry)(struct File *dir, struct VFS_Dir_Entry *entry);  /* Read next directory entry. */
+    int (*Truncate)(struct File *file, ulong_t size);
 };
 
 /*
@@ -114,6 +109,8 @@ int Open(const char *path, int mode, struct File **pFile);
 int Close(struct File *file);
 int Stat(const char *path, struct VFS_File_Stat *stat);
 int Sync(void);
+int Delete(const char *path);
+ulong_t Get_File_Change_Count(void);
 
 /* File operations. */
 struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *fsData,
@@ -121,6 +118,8 @@ struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *
 int FStat(struct File *file, struct VFS_File_Stat *stat);
 int Read(struct File *file, void *buf, ulong_t len);
 int Write(struct File *file, void *buf, ulong_t len);
+int Seek(struct File *file, ulong_t len);
+int Truncate(struct File *file, ulong_t size);
 int Read_Fully(const char *path, void **pBuffer, ulong_t *pLen);
 
 /* Directory operations. */
@@ -0,0 +1,22 @@
+/*
+ * User-mode file I/O
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <geekos/fileio.h>
+
+int Open(const char *path, int mode);
+int Open_Directory(const char *path);
+int Close(int fd);
+int Read(int fd, void *buf, ulong_t len);
+int Write(int fd, const void *buf, ulong_t len);
+int Seek(int fd, ulong_t pos);
+int Stat(const char *path, struct VFS_File_Stat *stat);
+int Read_Entry(int fd, struct VFS_Dir_Entry *entry);
+
+#endif  /* FILEIO_H */
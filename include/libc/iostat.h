@@ -0,0 +1,15 @@
+/*
+ * Block device statistics
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <geekos/iostat.h>
+
+int Get_IO_Stats(struct Block_Device_Stats *statsList, int maxDevices);
+
+#endif  /* IOSTAT_H */
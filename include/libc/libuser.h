@@ -5,4 +5,5 @@
 #include <conio.h>
 #include <sema.h>
 #include <sched.h>
+#include <fileio.h>
 
@@ -0,0 +1,15 @@
+/*
+ * Memory statistics
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <geekos/memstat.h>
+
+int Get_Mem_Stats(struct Mem_Stats *stats, struct Process_Mem_Stats *procList, int maxProcs);
+
+#endif  /* MEMSTAT_H */
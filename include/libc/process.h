@@ -17,6 +17,7 @@ int Spawn_Program(const char* program, const char* command);
 int Spawn_With_Path(const char *program, const char *command, const char *path);
 int Wait(int pid);
 int Get_PID(void);
+int Fork(void);
 
 #endif  /* PROCESS_H */
 
@@ -428,7 +428,7 @@
 					 dumping the contents of an allocated
 					 or free buffer. */
 
-/*#define BufStats    1*/		      /* Define this symbol to enable the
+#define BufStats    1		      /* Define this symbol to enable the
 					 bstats() function which calculates
 					 the total free space in the buffer
 					 pool, the largest available
@@ -534,6 +534,9 @@ static struct bfhead freelist = {     /* List of free buffers */
 #ifdef BufStats
 static bufsize totalloc = 0;	      /* Total space currently allocated */
 static long numget = 0, numrel = 0;   /* Number of bget() and brel() calls */
+#if defined (GEEKOS)
+static bufsize maxalloc = 0;	      /* Highest value of totalloc so far */
+#endif
 #ifdef BECtl
 static long numpblk = 0;	      /* Number of pool blocks */
 static long numpget = 0, numprel = 0; /* Number of block gets and rels */
@@ -658,6 +661,10 @@ void *bget(requested_size)
 #ifdef BufStats
 		    totalloc += size;
 		    numget++;		  /* Increment number of bget() calls */
+#if defined (GEEKOS)
+		    if (totalloc > maxalloc)
+			maxalloc = totalloc;
+#endif
 #endif
 		    buf = (void *) ((((char *) ba) + sizeof(struct bhead)));
 		    return buf;
@@ -678,6 +685,10 @@ void *bget(requested_size)
 #ifdef BufStats
 		    totalloc += b->bh.bsize;
 		    numget++;		  /* Increment number of bget() calls */
+#if defined (GEEKOS)
+		    if (totalloc > maxalloc)
+			maxalloc = totalloc;
+#endif
 #endif
 		    /* Negate size to mark buffer allocated. */
 		    b->bh.bsize = -(b->bh.bsize);
@@ -1078,6 +1089,16 @@ void bstats(curalloc, totfree, maxfree, nget, nrel)
     }
 }
 
+#if defined (GEEKOS)
+
+/*  BSTATSPEAK  --  Return the most space ever allocated at once.  */
+
+void bstatspeak(bufsize *peakalloc)
+{
+    *peakalloc = maxalloc;
+}
+#endif
+
 #ifdef BECtl
 
 /*  BSTATSE  --  Return extended statistics  */
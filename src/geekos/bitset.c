@@ -72,7 +72,7 @@ int Find_First_Free_Bit(void *bitSet, ulong_t totalBits)
 	    uint_t bit;
 	    for (bit = 0; bit < 8; ++bit) {
 		if ((bits[offset] & (1 << bit)) == 0)
-		    return (offset * 8) + bit;
+		    return (offset * 8) + bit < totalBits ? (offset * 8) + bit : -1;
 	    }
 	    KASSERT(false);
 	}
@@ -82,24 +82,49 @@ int Find_First_Free_Bit(void *bitSet, ulong_t totalBits)
 }
 
 /*
- * This is slow!!
+ * Find the first run of runLength clear bits.
+ * Whole bytes are skipped (or counted) at a time,
+ * so sparse and full regions of the set go quickly.
  */
 int Find_First_N_Free(void *bitSet, uint_t runLength, ulong_t totalBits)
 {
-    uint_t i,j;
-
-    for (i=0; i < totalBits - runLength; i++) {
-        if (!Is_Bit_Set(bitSet, i)) {
-	    for (j=1; j < runLength; j++) {
-	        if (Is_Bit_Set(bitSet, i+j)) {
-		    break;
-		}
+    uchar_t *bits = (uchar_t*) bitSet;
+    ulong_t i = 0, runStart = 0, run = 0;
+
+    if (runLength == 0)
+	return 0;
+
+    while (i < totalBits) {
+	if (i % 8 == 0 && i + 8 <= totalBits) {
+	    uchar_t byte = bits[i / 8];
+
+	    if (byte == 0xff) {
+		run = 0;
+		i += 8;
+		continue;
 	    }
-	    if (j == runLength) {
-	        return i;
+	    if (byte == 0) {
+		if (run == 0)
+		    runStart = i;
+		run += 8;
+		i += 8;
+		if (run >= runLength)
+		    return runStart;
+		continue;
 	    }
 	}
+
+	if (Is_Bit_Set(bitSet, i))
+	    run = 0;
+	else {
+	    if (run == 0)
+		runStart = i;
+	    if (++run >= runLength)
+		return runStart;
+	}
+	++i;
     }
+
     return -1;
 }
 
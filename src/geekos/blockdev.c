@@ -14,6 +14,7 @@
 #include <geekos/int.h>
 #include <geekos/kthread.h>
 #include <geekos/synch.h>
+#include <geekos/timer.h>
 #include <geekos/blockdev.h>
 
 /*#define BLOCKDEV_DEBUG */
@@ -45,20 +46,228 @@ IMPLEMENT_LIST(Block_Device_List, Block_Device);
 static struct Block_Device_List s_deviceList;
 
 /*
- * Perform a block IO request.
- * Returns 0 if successful, error code on failure.
+ * How long (in ticks) the deadline scheduler lets a request wait
+ * before serving it out of order.  Reads have someone waiting on
+ * them, so they expire sooner than writes.
+ */
+#define READ_EXPIRE_TICKS	9
+#define WRITE_EXPIRE_TICKS	90
+
+/*
+ * Released requests are kept for reuse, up to this many.
+ */
+#define REQUEST_POOL_MAX	32
+static struct Block_Request_List s_requestPool;
+static int s_requestPoolSize;
+
+/*
+ * Number of requests Do_Request() keeps in flight
+ * when a range must be split up for the driver.
+ */
+#define MAX_REQUESTS_IN_FLIGHT	8
+
+/*
+ * An I/O scheduler picks which of a device's queued requests
+ * the driver should handle next.
  */
-static int Do_Request(struct Block_Device *dev, enum Request_Type type, int blockNum, void *buf)
+struct Block_Scheduler {
+    const char *name;
+    struct Block_Request *(*Select)(struct Block_Request_List *queue, struct Block_Device *dev);
+};
+
+/*
+ * FIFO: the device's oldest request.
+ */
+static struct Block_Request *FIFO_Select(struct Block_Request_List *queue, struct Block_Device *dev)
+{
+    struct Block_Request *request = Get_Front_Of_Block_Request_List(queue);
+
+    while (request->dev != dev)
+	request = Get_Next_In_Block_Request_List(request);
+    return request;
+}
+
+/*
+ * C-LOOK: the nearest request at or beyond the last position,
+ * or the lowest numbered request once the sweep reaches the end.
+ */
+static struct Block_Request *CLOOK_Select(struct Block_Request_List *queue, struct Block_Device *dev)
+{
+    struct Block_Request *request, *next = 0, *lowest = 0;
+
+    for (request = Get_Front_Of_Block_Request_List(queue);
+	 request != 0;
+	 request = Get_Next_In_Block_Request_List(request)) {
+	if (request->dev != dev)
+	    continue;
+	if (lowest == 0 || request->blockNum < lowest->blockNum)
+	    lowest = request;
+	if (request->blockNum >= dev->headPosition &&
+	    (next == 0 || request->blockNum < next->blockNum))
+	    next = request;
+    }
+
+    return next != 0 ? next : lowest;
+}
+
+/*
+ * Deadline: C-LOOK, except that the oldest expired request
+ * goes first.  The queue is in arrival order.
+ */
+static struct Block_Request *Deadline_Select(struct Block_Request_List *queue, struct Block_Device *dev)
 {
     struct Block_Request *request;
-    int rc;
 
-    request = Create_Request(dev, type, blockNum, buf);
-    if (request == 0)
-	return ENOMEM;
-    Post_Request_And_Wait(request);
-    rc = request->errorCode;
-    Free(request);
+    for (request = Get_Front_Of_Block_Request_List(queue);
+	 request != 0;
+	 request = Get_Next_In_Block_Request_List(request)) {
+	if (request->dev == dev && (long) (g_numTicks - request->deadline) >= 0)
+	    return request;
+    }
+
+    return CLOOK_Select(queue, dev);
+}
+
+/*
+ * Schedulers, indexed by enum Block_Scheduler_Policy.
+ */
+static struct Block_Scheduler s_schedulerTable[] = {
+    { "fifo", &FIFO_Select },
+    { "c-look", &CLOOK_Select },
+    { "deadline", &Deadline_Select },
+};
+
+/*
+ * Find the latency histogram bucket for a time in microseconds.
+ */
+static int Latency_Bucket(ulong_t time)
+{
+    int bucket = 0;
+
+    while (time > 1 && bucket < IOSTAT_NUM_BUCKETS - 1) {
+	time >>= 1;
+	++bucket;
+    }
+    return bucket;
+}
+
+/*
+ * Account for a request completed by the driver, along with
+ * the requests merged into it.  Each request has its
+ * completion time set.
+ * Must be called with interrupts disabled.
+ */
+static void Update_Device_Stats(struct Block_Request *request, enum Request_State state)
+{
+    struct Block_Device_Stats *stats = &request->dev->stats;
+    unsigned long long now = Read_TSC();
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (state == ERROR)
+	++stats->numErrors;
+    else if (request->type == BLOCK_READ) {
+	++stats->numReads;
+	stats->sectorsRead += request->xferBlocks;
+    } else {
+	++stats->numWrites;
+	stats->sectorsWritten += request->xferBlocks;
+    }
+    stats->busyTime += Cycles_To_Microseconds(now - request->dequeueTime);
+
+    for (; request != 0; request = request->mergedNext) {
+	ulong_t latency = Cycles_To_Microseconds(now - request->postTime);
+
+	request->completionTime = now;
+	stats->waitTime += Cycles_To_Microseconds(request->dequeueTime - request->postTime);
+	if (request->type == BLOCK_READ)
+	    ++stats->readLatency[Latency_Bucket(latency)];
+	else
+	    ++stats->writeLatency[Latency_Bucket(latency)];
+    }
+}
+
+/*
+ * Grow a request by absorbing queued requests for the blocks
+ * (and buffer space) that immediately follow it, so the driver
+ * can transfer them with a single command.
+ * Must be called with interrupts disabled.
+ */
+static void Merge_Requests(struct Block_Request_List *queue, struct Block_Request *request)
+{
+    struct Block_Device *dev = request->dev;
+    struct Block_Request *last = request, *other;
+
+    KASSERT(!Interrupts_Enabled());
+
+    other = Get_Front_Of_Block_Request_List(queue);
+    while (other != 0) {
+	if (other->dev == dev && other->type == request->type &&
+	    other->blockNum == request->blockNum + request->xferBlocks &&
+	    other->buf == (char*) request->buf + request->xferBlocks * SECTOR_SIZE &&
+	    request->xferBlocks + other->numBlocks <= dev->ops->maxRequestBlocks) {
+	    Debug("Merging request for block %d into request for block %d\n",
+		other->blockNum, request->blockNum);
+	    Remove_From_Block_Request_List(queue, other);
+	    request->xferBlocks += other->numBlocks;
+	    other->dequeueTime = request->dequeueTime;
+	    last->mergedNext = other;
+	    last = other;
+	    --dev->stats.queueDepth;
+	    ++dev->stats.numMerges;
+
+	    /* The request has grown, so look again from the start */
+	    other = Get_Front_Of_Block_Request_List(queue);
+	} else
+	    other = Get_Next_In_Block_Request_List(other);
+    }
+}
+
+/*
+ * Perform a block IO request covering numBlocks consecutive blocks.
+ * Ranges larger than the driver can handle at once are
+ * broken into a sequence of requests, several of which are
+ * submitted together so the driver can work through them
+ * without waiting for us.
+ * Returns 0 if successful, error code on failure.
+ */
+static int Do_Request(struct Block_Device *dev, enum Request_Type type,
+    int blockNum, int numBlocks, void *buf)
+{
+    struct Block_Request *requestList[MAX_REQUESTS_IN_FLIGHT];
+    int maxBlocks = Get_Max_Request_Blocks(dev);
+    int rc = 0;
+
+    if (numBlocks < 0)
+	return EINVALID;
+
+    while (numBlocks > 0 && rc == 0) {
+	int numRequests = 0, rc2, i;
+
+	while (numBlocks > 0 && numRequests < MAX_REQUESTS_IN_FLIGHT) {
+	    int count = numBlocks < maxBlocks ? numBlocks : maxBlocks;
+	    struct Block_Request *request;
+
+	    request = Create_Range_Request(dev, type, blockNum, count, buf);
+	    if (request == 0) {
+		rc = ENOMEM;
+		break;
+	    }
+	    Submit_Block_Request(request, 0, 0);
+	    requestList[numRequests++] = request;
+
+	    blockNum += count;
+	    numBlocks -= count;
+	    buf = ((char*) buf) + count * SECTOR_SIZE;
+	}
+
+	rc2 = Wait_For_Requests(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+	for (i = 0; i < numRequests; ++i)
+	    Release_Request(requestList[i]);
+    }
+
     return rc;
 }
 
@@ -74,13 +283,14 @@ static int Do_Request(struct Block_Device *dev, enum Request_Type type, int bloc
  */
 int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
     int unit, void *driverData, struct Thread_Queue *waitQueue,
-    struct Block_Request_List *requestQueue)
+    struct Block_Request_List *requestQueue, enum Block_Scheduler_Policy policy)
 {
     struct Block_Device *dev;
 
     KASSERT(ops != 0);
     KASSERT(waitQueue != 0);
     KASSERT(requestQueue != 0);
+    KASSERT(policy >= BLOCK_SCHED_FIFO && policy <= BLOCK_SCHED_DEADLINE);
 
     dev = (struct Block_Device*) Malloc(sizeof(*dev));
     if (dev == 0)
@@ -93,10 +303,15 @@ int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
     dev->driverData = driverData;
     dev->waitQueue = waitQueue;
     dev->requestQueue = requestQueue;
+    dev->policy = policy;
+    dev->headPosition = 0;
+    memset(&dev->stats, '\0', sizeof(dev->stats));
+    strcpy(dev->stats.name, name);
 
     Mutex_Lock(&s_blockdevLock);
     /* FIXME: handle name conflict with existing device */
-    Debug("Registering block device %s\n", dev->name);
+    Debug("Registering block device %s (%s scheduler)\n", dev->name,
+	s_schedulerTable[policy].name);
     Add_To_Back_Of_Block_Device_List(&s_deviceList, dev);
     Mutex_Unlock(&s_blockdevLock);
 
@@ -164,40 +379,186 @@ int Close_Block_Device(struct Block_Device *dev)
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
     int blockNum, void *buf)
 {
-    struct Block_Request *request = Malloc(sizeof(*request));
+    return Create_Range_Request(dev, type, blockNum, 1, buf);
+}
+
+/*
+ * Create a block device request to transfer numBlocks consecutive
+ * blocks to or from a contiguous buffer.  The count must not
+ * exceed what the device's driver accepts.
+ */
+struct Block_Request *Create_Range_Request(struct Block_Device *dev, enum Request_Type type,
+    int blockNum, int numBlocks, void *buf)
+{
+    struct Block_Request *request;
+
+    bool iflag;
+
+    KASSERT(numBlocks > 0);
+    KASSERT(numBlocks <= Get_Max_Request_Blocks(dev));
+
+    /* Reuse a pooled request if there is one */
+    iflag = Begin_Int_Atomic();
+    request = Get_Front_Of_Block_Request_List(&s_requestPool);
+    if (request != 0) {
+	Remove_From_Front_Of_Block_Request_List(&s_requestPool);
+	--s_requestPoolSize;
+    }
+    End_Int_Atomic(iflag);
+
+    if (request == 0)
+	request = Malloc(sizeof(*request));
     if (request != 0) {
 	request->dev = dev;
 	request->type = type;
 	request->blockNum = blockNum;
+	request->numBlocks = numBlocks;
+	request->xferBlocks = numBlocks;
 	request->buf = buf;
 	request->state = PENDING;
+	request->mergedNext = 0;
+	request->callback = 0;
+	request->callbackData = 0;
 	Clear_Thread_Queue(&request->waitQueue);
     }
     return request;
 }
 
+/*
+ * Dispose of a request which is no longer pending.
+ */
+void Release_Request(struct Block_Request *request)
+{
+    bool iflag;
+
+    KASSERT(request->state != PENDING);
+
+    iflag = Begin_Int_Atomic();
+    if (s_requestPoolSize < REQUEST_POOL_MAX) {
+	Add_To_Front_Of_Block_Request_List(&s_requestPool, request);
+	++s_requestPoolSize;
+	request = 0;
+    }
+    End_Int_Atomic(iflag);
+
+    if (request != 0)
+	Free(request);
+}
+
 /*
  * Send a block IO request to a device and wait for it to be handled.
  * Returns when the driver completes the requests or signals
  * an error.
  */
 void Post_Request_And_Wait(struct Block_Request *request)
+{
+    Submit_Block_Request(request, 0, 0);
+    Wait_For_Request(request);
+}
+
+/*
+ * Wait for a block request to arrive.
+ * Devices take turns in the order their oldest requests arrived;
+ * the device's scheduler chooses which of its requests is next,
+ * and requests adjacent to it are merged into it.  The driver
+ * transfers the returned request's xferBlocks blocks, which cover
+ * the merged requests as well; each request's numBlocks stays
+ * as submitted.
+ */
+struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
+    struct Thread_Queue *waitQueue)
+{
+    struct Block_Request *request;
+    struct Block_Device *dev;
+
+    Disable_Interrupts();
+    while (Is_Block_Request_List_Empty(requestQueue))
+	Wait(waitQueue);
+    dev = Get_Front_Of_Block_Request_List(requestQueue)->dev;
+    request = s_schedulerTable[dev->policy].Select(requestQueue, dev);
+    Remove_From_Block_Request_List(requestQueue, request);
+    request->dequeueTime = Read_TSC();
+    --dev->stats.queueDepth;
+    request->xferBlocks = request->numBlocks;
+    Merge_Requests(requestQueue, request);
+    dev->headPosition = request->blockNum + request->xferBlocks;
+    Enable_Interrupts();
+
+    return request;
+}
+
+/*
+ * Signal the completion of a block request,
+ * and of any requests merged into it.
+ * Completion callbacks run here, in the driver's request thread.
+ */
+void Notify_Request_Completion(struct Block_Request *request, enum Request_State state, int errorCode)
+{
+    Disable_Interrupts();
+    Update_Device_Stats(request, state);
+    Enable_Interrupts();
+
+    while (request != 0) {
+	struct Block_Request *next = request->mergedNext;
+	Block_Request_Callback *callback = request->callback;
+
+	Disable_Interrupts();
+	request->state = state;
+	request->errorCode = errorCode;
+	Wake_Up(&request->waitQueue);
+	Enable_Interrupts();
+
+	/*
+	 * Once the state is set, a waiting thread may release the
+	 * request; a request with a callback belongs to the callback.
+	 */
+	if (callback != 0)
+	    callback(request);
+	request = next;
+    }
+}
+
+/*
+ * Send a block IO request to a device without waiting for it.
+ * If callback is not null, it is called with the request when the
+ * request completes; it runs in the driver's request thread, so it
+ * should do little more than record the result and wake up a thread.
+ * Otherwise, use Wait_For_Request() to find out the result.
+ */
+void Submit_Block_Request(struct Block_Request *request,
+    Block_Request_Callback *callback, void *callbackData)
 {
     struct Block_Device *dev;
 
     KASSERT(request != 0);
+    KASSERT(request->state == PENDING);
 
     dev = request->dev;
     KASSERT(dev != 0);
 
+    request->callback = callback;
+    request->callbackData = callbackData;
+
     /* Send request to the driver */
     Debug("Posting block device request [@%x]...\n", request);
     Disable_Interrupts();
+    request->deadline = g_numTicks +
+	(request->type == BLOCK_READ ? READ_EXPIRE_TICKS : WRITE_EXPIRE_TICKS);
+    request->postTime = Read_TSC();
     Add_To_Back_Of_Block_Request_List(dev->requestQueue, request);
+    ++dev->stats.numRequests;
+    if (++dev->stats.queueDepth > dev->stats.maxQueueDepth)
+	dev->stats.maxQueueDepth = dev->stats.queueDepth;
     Wake_Up(dev->waitQueue);
     Enable_Interrupts();
+}
 
-    /* Wait for request to be processed */
+/*
+ * Wait for a submitted request to be handled.
+ * Return 0 if it was successful, error code on error.
+ */
+int Wait_For_Request(struct Block_Request *request)
+{
     Disable_Interrupts();
     while (request->state == PENDING) {
 	Debug("Waiting, state=%d\n", request->state);
@@ -205,54 +566,64 @@ void Post_Request_And_Wait(struct Block_Request *request)
     }
     Debug("Wait completed!\n");
     Enable_Interrupts();
+
+    return request->errorCode;
 }
 
 /*
- * Wait for a block request to arrive.
+ * Wait for all of the given submitted requests to be handled.
+ * Return 0 if they were all successful, otherwise the
+ * error code of the first one that failed.
  */
-struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
-    struct Thread_Queue *waitQueue)
+int Wait_For_Requests(struct Block_Request **requestList, int numRequests)
 {
-    struct Block_Request *request;
+    int i, rc = 0;
 
-    Disable_Interrupts();
-    while (Is_Block_Request_List_Empty(requestQueue))
-	Wait(waitQueue);
-    request = Get_Front_Of_Block_Request_List(requestQueue);
-    Remove_From_Front_Of_Block_Request_List(requestQueue);
-    Enable_Interrupts();
+    for (i = 0; i < numRequests; ++i) {
+	int rc2 = Wait_For_Request(requestList[i]);
+	if (rc == 0)
+	    rc = rc2;
+    }
 
-    return request;
+    return rc;
 }
 
 /*
- * Signal the completion of a block request.
+ * Read a block from given device.
+ * Return 0 if successful, error code on error.
  */
-void Notify_Request_Completion(struct Block_Request *request, enum Request_State state, int errorCode)
+int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
 {
-    Disable_Interrupts();
-    request->state = state;
-    request->errorCode = errorCode;
-    Wake_Up(&request->waitQueue);
-    Enable_Interrupts();
+    return Do_Request(dev, BLOCK_READ, blockNum, 1, buf);
 }
 
 /*
- * Read a block from given device.
+ * Write a block to given device.
  * Return 0 if successful, error code on error.
  */
-int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
+int Block_Write(struct Block_Device *dev, int blockNum, void *buf)
 {
-    return Do_Request(dev, BLOCK_READ, blockNum, buf);
+    return Do_Request(dev, BLOCK_WRITE, blockNum, 1, buf);
 }
 
 /*
- * Write a block to given device.
+ * Read numBlocks consecutive blocks, starting at blockNum,
+ * into given buffer.
  * Return 0 if successful, error code on error.
  */
-int Block_Write(struct Block_Device *dev, int blockNum, void *buf)
+int Block_Read_Range(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
 {
-    return Do_Request(dev, BLOCK_WRITE, blockNum, buf);
+    return Do_Request(dev, BLOCK_READ, blockNum, numBlocks, buf);
+}
+
+/*
+ * Write numBlocks consecutive blocks, starting at blockNum,
+ * from given buffer.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Write_Range(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
+{
+    return Do_Request(dev, BLOCK_WRITE, blockNum, numBlocks, buf);
 }
 
 /*
@@ -263,3 +634,36 @@ int Get_Num_Blocks(struct Block_Device *dev)
     return dev->ops->Get_Num_Blocks(dev);
 }
 
+/*
+ * Get the largest number of blocks a single request
+ * to given device may transfer.
+ */
+int Get_Max_Request_Blocks(struct Block_Device *dev)
+{
+    return dev->ops->maxRequestBlocks > 0 ? dev->ops->maxRequestBlocks : 1;
+}
+
+
+/*
+ * Get the statistics of up to maxDevices registered block devices.
+ * Returns the number of devices reported.
+ */
+int Get_Block_Device_Stats(struct Block_Device_Stats *statsList, int maxDevices)
+{
+    struct Block_Device *dev;
+    int count = 0;
+
+    Mutex_Lock(&s_blockdevLock);
+
+    for (dev = Get_Front_Of_Block_Device_List(&s_deviceList);
+	 dev != 0 && count < maxDevices;
+	 dev = Get_Next_In_Block_Device_List(dev)) {
+	bool iflag = Begin_Int_Atomic();
+	memcpy(&statsList[count++], &dev->stats, sizeof(dev->stats));
+	End_Int_Atomic(iflag);
+    }
+
+    Mutex_Unlock(&s_blockdevLock);
+
+    return count;
+}
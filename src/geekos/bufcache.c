@@ -0,0 +1,524 @@
+/*
+ * Filesystem buffer cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * NOTES:
+ * - All buffer caches share one pool of memory, bounded by
+ *   g_bufferCacheMaxBytes.  Unused buffers are kept on a single
+ *   LRU list, and the least recently used one is reclaimed when
+ *   a new buffer would exceed the limit.  Pinned and dirty buffers
+ *   are never reclaimed, so the limit may be exceeded while many
+ *   are pinned, or until the flush thread writes dirty ones back.
+ * - Modified buffers are written back by Sync_FS_Buffer() and
+ *   Sync_FS_Buffer_Cache() (which filesystems call from their
+ *   Sync operation), and by a flush thread every few seconds.
+ */
+
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/string.h>
+#include <geekos/malloc.h>
+#include <geekos/mem.h>
+#include <geekos/int.h>
+#include <geekos/kthread.h>
+#include <geekos/synch.h>
+#include <geekos/timer.h>
+#include <geekos/blockdev.h>
+#include <geekos/bufcache.h>
+
+/*#define BUFCACHE_DEBUG */
+#ifdef BUFCACHE_DEBUG
+#  define Debug(args...) Print(args)
+#else
+#  define Debug(args...)
+#endif
+
+/* ----------------------------------------------------------------------
+ * Private data and functions
+ * ---------------------------------------------------------------------- */
+
+#define BUFFER_HASH_SIZE	256
+
+/* Ticks between runs of the flush thread (about five seconds) */
+#define FLUSH_INTERVAL_TICKS	90
+
+/* Most buffers written together by Sync_FS_Buffer_Cache() */
+#define SYNC_BATCH_SIZE		16
+
+struct FS_Buffer_Cache;
+DEFINE_LIST(FS_Buffer_Cache_List, FS_Buffer_Cache);
+
+/*
+ * The buffer cache of one filesystem.
+ */
+struct FS_Buffer_Cache {
+    struct Block_Device *dev;
+    uint_t fsBlockSize;
+    int sectorsPerBlock;
+    int numBuffers;
+
+    DEFINE_LINK(FS_Buffer_Cache_List, FS_Buffer_Cache);
+};
+
+IMPLEMENT_LIST(FS_Buffer_Cache_List, FS_Buffer_Cache);
+
+ulong_t g_bufferCacheMaxBytes = BUFFER_CACHE_DEFAULT_MAX_BYTES;
+
+/*
+ * Protects all buffers, the hash table and the LRU list.
+ * s_bufferCond is signaled when a buffer finishes loading.
+ */
+static struct Mutex s_bufferLock;
+static struct Condition s_bufferCond;
+
+static struct FS_Buffer *s_bufferHash[BUFFER_HASH_SIZE];
+static struct FS_Buffer_List s_lruList;
+static ulong_t s_numBytes;
+
+/*
+ * List of all buffer caches.  Held while the flush thread
+ * works through them, so caches can't be destroyed meanwhile.
+ * Acquired before s_bufferLock.
+ */
+static struct Mutex s_cacheListLock;
+static struct FS_Buffer_Cache_List s_cacheList;
+
+static struct Thread_Queue s_flushWaitQueue;
+
+static __inline__ struct FS_Buffer **Hash_Chain(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum)
+{
+    return &s_bufferHash[(((ulong_t) cache >> 4) ^ fsBlockNum) % BUFFER_HASH_SIZE];
+}
+
+static struct FS_Buffer *Find_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum)
+{
+    struct FS_Buffer *buf;
+
+    for (buf = *Hash_Chain(cache, fsBlockNum); buf != 0; buf = buf->hashNext) {
+	if (buf->cache == cache && buf->fsBlockNum == fsBlockNum)
+	    break;
+    }
+    return buf;
+}
+
+static void Remove_From_Hash(struct FS_Buffer *buf)
+{
+    struct FS_Buffer **pBuf = Hash_Chain(buf->cache, buf->fsBlockNum);
+
+    while (*pBuf != buf)
+	pBuf = &(*pBuf)->hashNext;
+    *pBuf = buf->hashNext;
+}
+
+/*
+ * Take a reference to a buffer, removing it from the LRU list
+ * if it was unused.
+ */
+static void Pin_Buffer(struct FS_Buffer *buf)
+{
+    KASSERT(IS_HELD(&s_bufferLock));
+    if (buf->refCount++ == 0)
+	Remove_From_FS_Buffer_List(&s_lruList, buf);
+}
+
+/*
+ * Buffer data comes from the page allocator when a block
+ * fills a page, so large caches don't crowd the kernel heap.
+ */
+static void *Alloc_Buffer_Data(uint_t size)
+{
+    return size == PAGE_SIZE ? Alloc_Page() : Malloc(size);
+}
+
+static void Free_Buffer_Data(void *data, uint_t size)
+{
+    if (size == PAGE_SIZE)
+	Free_Page(data);
+    else
+	Free(data);
+}
+
+/*
+ * Free a buffer that is out of the hash table and unused.
+ */
+static void Free_Buffer(struct FS_Buffer *buf)
+{
+    KASSERT(buf->refCount == 0);
+    s_numBytes -= buf->cache->fsBlockSize;
+    --buf->cache->numBuffers;
+    Free_Buffer_Data(buf->data, buf->cache->fsBlockSize);
+    Free(buf);
+}
+
+/*
+ * Transfer a buffer to or from the device.
+ */
+static int Do_Buffer_IO(struct FS_Buffer *buf, enum Request_Type type)
+{
+    struct FS_Buffer_Cache *cache = buf->cache;
+    int blockNum = buf->fsBlockNum * cache->sectorsPerBlock;
+
+    return type == BLOCK_READ
+	? Block_Read_Range(cache->dev, blockNum, cache->sectorsPerBlock, buf->data)
+	: Block_Write_Range(cache->dev, blockNum, cache->sectorsPerBlock, buf->data);
+}
+
+/*
+ * Reclaim least recently used clean buffers until a buffer of
+ * given size fits within the cache size limit, or there is nothing
+ * left to reclaim.  Dirty buffers are left for the flush thread,
+ * so nobody waits for a write while holding the buffer lock.
+ */
+static void Reclaim_Buffers(uint_t size)
+{
+    struct FS_Buffer *buf, *next;
+
+    KASSERT(IS_HELD(&s_bufferLock));
+
+    for (buf = Get_Front_Of_FS_Buffer_List(&s_lruList);
+	 buf != 0 && s_numBytes + size > g_bufferCacheMaxBytes;
+	 buf = next) {
+	next = Get_Next_In_FS_Buffer_List(buf);
+	if (buf->flags & FS_BUFFER_DIRTY)
+	    continue;
+
+	Debug("Reclaiming block %lu of %s\n", buf->fsBlockNum, buf->cache->dev->name);
+	Remove_From_FS_Buffer_List(&s_lruList, buf);
+	Remove_From_Hash(buf);
+	Free_Buffer(buf);
+    }
+}
+
+/*
+ * Write back all dirty buffers of every cache.
+ */
+static void Sync_All_Buffer_Caches(void)
+{
+    struct FS_Buffer_Cache *cache;
+
+    Mutex_Lock(&s_cacheListLock);
+    for (cache = Get_Front_Of_FS_Buffer_Cache_List(&s_cacheList);
+	 cache != 0;
+	 cache = Get_Next_In_FS_Buffer_Cache_List(cache)) {
+	Sync_FS_Buffer_Cache(cache);
+    }
+    Mutex_Unlock(&s_cacheListLock);
+}
+
+static void Flush_Timer_Callback(int id)
+{
+    Cancel_Timer(id);
+    Wake_Up(&s_flushWaitQueue);
+}
+
+/*
+ * Periodically write back dirty buffers, so modifications
+ * reach the disk even if nobody calls Sync().
+ */
+static void Flush_Thread(ulong_t arg)
+{
+    for (;;) {
+	/* If no timer is free, let other threads run and try again */
+	Disable_Interrupts();
+	while (Start_Timer(FLUSH_INTERVAL_TICKS, &Flush_Timer_Callback) < 0) {
+	    Enable_Interrupts();
+	    Yield();
+	    Disable_Interrupts();
+	}
+	Wait(&s_flushWaitQueue);
+	Enable_Interrupts();
+
+	Sync_All_Buffer_Caches();
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Initialize the buffer cache and start the flush thread.
+ */
+void Init_Buffer_Cache(void)
+{
+    Mutex_Init(&s_bufferLock);
+    Cond_Init(&s_bufferCond);
+    Mutex_Init(&s_cacheListLock);
+    Start_Kernel_Thread(Flush_Thread, 0, PRIORITY_NORMAL, true);
+}
+
+/*
+ * Create a buffer cache for a filesystem on given device.
+ * The block size must be a multiple of the sector size,
+ * no larger than a page.
+ * Returns null if out of memory.
+ */
+struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t fsBlockSize)
+{
+    struct FS_Buffer_Cache *cache;
+
+    KASSERT(fsBlockSize > 0 && fsBlockSize % SECTOR_SIZE == 0 && fsBlockSize <= PAGE_SIZE);
+
+    cache = (struct FS_Buffer_Cache*) Malloc(sizeof(*cache));
+    if (cache == 0)
+	return 0;
+
+    cache->dev = dev;
+    cache->fsBlockSize = fsBlockSize;
+    cache->sectorsPerBlock = fsBlockSize / SECTOR_SIZE;
+    cache->numBuffers = 0;
+
+    Mutex_Lock(&s_cacheListLock);
+    Add_To_Back_Of_FS_Buffer_Cache_List(&s_cacheList, cache);
+    Mutex_Unlock(&s_cacheListLock);
+
+    return cache;
+}
+
+/*
+ * Write back all dirty buffers in given cache.
+ * Returns 0 if successful, error code if a write failed.
+ */
+int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
+{
+    struct FS_Buffer *batch[SYNC_BATCH_SIZE];
+    struct Block_Request *requestList[SYNC_BATCH_SIZE];
+    bool async = cache->sectorsPerBlock <= Get_Max_Request_Blocks(cache->dev);
+    int rc = 0;
+
+    while (rc == 0) {
+	int numBuffers = 0, numRequests = 0, i;
+
+	/* Collect and pin a batch of dirty buffers */
+	Mutex_Lock(&s_bufferLock);
+	for (i = 0; i < BUFFER_HASH_SIZE && numBuffers < SYNC_BATCH_SIZE; ++i) {
+	    struct FS_Buffer *buf;
+	    for (buf = s_bufferHash[i]; buf != 0 && numBuffers < SYNC_BATCH_SIZE; buf = buf->hashNext) {
+		if (buf->cache == cache && (buf->flags & FS_BUFFER_DIRTY)) {
+		    Pin_Buffer(buf);
+		    buf->flags &= ~(FS_BUFFER_DIRTY);
+		    batch[numBuffers++] = buf;
+		}
+	    }
+	}
+	Mutex_Unlock(&s_bufferLock);
+
+	if (numBuffers == 0)
+	    break;
+
+	/*
+	 * Write them, keeping the whole batch in flight at once
+	 * if each buffer fits in a single request.
+	 */
+	Debug("Writing %d buffers to %s\n", numBuffers, cache->dev->name);
+	if (async) {
+	    for (i = 0; i < numBuffers; ++i) {
+		struct Block_Request *request = Create_Range_Request(cache->dev, BLOCK_WRITE,
+		    batch[i]->fsBlockNum * cache->sectorsPerBlock, cache->sectorsPerBlock,
+		    batch[i]->data);
+		if (request == 0) {
+		    rc = ENOMEM;
+		    break;
+		}
+		Submit_Block_Request(request, 0, 0);
+		requestList[numRequests++] = request;
+	    }
+	    Wait_For_Requests(requestList, numRequests);
+	}
+
+	/* Unpin them; any that could not be written are dirty again */
+	for (i = 0; i < numBuffers; ++i) {
+	    int result = ENOMEM;
+
+	    if (!async)
+		result = Do_Buffer_IO(batch[i], BLOCK_WRITE);
+	    else if (i < numRequests) {
+		result = requestList[i]->errorCode;
+		Release_Request(requestList[i]);
+	    }
+	    if (result != 0) {
+		Mutex_Lock(&s_bufferLock);
+		batch[i]->flags |= FS_BUFFER_DIRTY;
+		Mutex_Unlock(&s_bufferLock);
+		if (rc == 0)
+		    rc = result;
+	    }
+	    Release_FS_Buffer(cache, batch[i]);
+	}
+    }
+
+    return rc;
+}
+
+/*
+ * Write back and discard all buffers in given cache,
+ * and destroy it.  None of its buffers may be in use.
+ * Returns 0 if successful, error code if a write failed
+ * (in which case the cache is not destroyed).
+ */
+int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
+{
+    int rc, i;
+
+    Mutex_Lock(&s_cacheListLock);
+
+    rc = Sync_FS_Buffer_Cache(cache);
+    if (rc == 0) {
+	Mutex_Lock(&s_bufferLock);
+	for (i = 0; i < BUFFER_HASH_SIZE; ++i) {
+	    struct FS_Buffer **pBuf = &s_bufferHash[i];
+	    while (*pBuf != 0) {
+		struct FS_Buffer *buf = *pBuf;
+		if (buf->cache == cache) {
+		    KASSERT(buf->refCount == 0);
+		    *pBuf = buf->hashNext;
+		    Remove_From_FS_Buffer_List(&s_lruList, buf);
+		    Free_Buffer(buf);
+		} else
+		    pBuf = &buf->hashNext;
+	    }
+	}
+	Mutex_Unlock(&s_bufferLock);
+
+	KASSERT(cache->numBuffers == 0);
+	Remove_From_FS_Buffer_Cache_List(&s_cacheList, cache);
+	Free(cache);
+    }
+
+    Mutex_Unlock(&s_cacheListLock);
+    return rc;
+}
+
+/*
+ * Get the buffer for given filesystem block, reading it from
+ * the device if it isn't cached.  The buffer is pinned until
+ * the caller calls Release_FS_Buffer().
+ * Returns 0 if successful, error code otherwise.
+ */
+int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
+{
+    struct FS_Buffer *buf;
+    int rc = 0;
+
+    Mutex_Lock(&s_bufferLock);
+
+    buf = Find_Buffer(cache, fsBlockNum);
+    if (buf != 0) {
+	/* Cached; if another thread is still reading it, wait */
+	Pin_Buffer(buf);
+	while (buf->flags & FS_BUFFER_LOADING)
+	    Cond_Wait(&s_bufferCond, &s_bufferLock);
+
+	if (buf->flags & FS_BUFFER_INVALID) {
+	    if (--buf->refCount == 0)
+		Free_Buffer(buf);
+	    rc = EIO;
+	}
+    } else {
+	/* Not cached: make room, and read it */
+	Reclaim_Buffers(cache->fsBlockSize);
+
+	buf = (struct FS_Buffer*) Malloc(sizeof(*buf));
+	if (buf != 0 && (buf->data = Alloc_Buffer_Data(cache->fsBlockSize)) == 0) {
+	    Free(buf);
+	    buf = 0;
+	}
+	if (buf == 0) {
+	    rc = ENOMEM;
+	    goto done;
+	}
+
+	buf->cache = cache;
+	buf->fsBlockNum = fsBlockNum;
+	buf->flags = FS_BUFFER_LOADING;
+	buf->refCount = 1;
+	buf->hashNext = *Hash_Chain(cache, fsBlockNum);
+	*Hash_Chain(cache, fsBlockNum) = buf;
+	s_numBytes += cache->fsBlockSize;
+	++cache->numBuffers;
+
+	/* Don't hold up other buffers while the device works */
+	Mutex_Unlock(&s_bufferLock);
+	rc = Do_Buffer_IO(buf, BLOCK_READ);
+	Mutex_Lock(&s_bufferLock);
+
+	buf->flags &= ~(FS_BUFFER_LOADING);
+	if (rc != 0) {
+	    /* Threads waiting for it will see that it is invalid */
+	    buf->flags |= FS_BUFFER_INVALID;
+	    Remove_From_Hash(buf);
+	    if (--buf->refCount == 0)
+		Free_Buffer(buf);
+	}
+	Cond_Broadcast(&s_bufferCond);
+    }
+
+    if (rc == 0)
+	*pBuf = buf;
+
+done:
+    Mutex_Unlock(&s_bufferLock);
+    return rc;
+}
+
+/*
+ * Mark a pinned buffer as modified, so it will be written back.
+ */
+void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(buf->cache == cache);
+    KASSERT(buf->refCount > 0);
+
+    Mutex_Lock(&s_bufferLock);
+    buf->flags |= FS_BUFFER_DIRTY;
+    Mutex_Unlock(&s_bufferLock);
+}
+
+/*
+ * Write a pinned buffer back to the device now, if it is dirty.
+ * Returns 0 if successful, error code otherwise.
+ */
+int Sync_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    int rc = 0;
+    bool dirty;
+
+    KASSERT(buf->cache == cache);
+    KASSERT(buf->refCount > 0);
+
+    Mutex_Lock(&s_bufferLock);
+    dirty = (buf->flags & FS_BUFFER_DIRTY) != 0;
+    buf->flags &= ~(FS_BUFFER_DIRTY);
+    Mutex_Unlock(&s_bufferLock);
+
+    if (dirty) {
+	rc = Do_Buffer_IO(buf, BLOCK_WRITE);
+	if (rc != 0) {
+	    Mutex_Lock(&s_bufferLock);
+	    buf->flags |= FS_BUFFER_DIRTY;
+	    Mutex_Unlock(&s_bufferLock);
+	}
+    }
+
+    return rc;
+}
+
+/*
+ * Unpin a buffer obtained from Get_FS_Buffer().
+ * It stays cached until it is reclaimed.
+ */
+void Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    KASSERT(buf->cache == cache);
+
+    Mutex_Lock(&s_bufferLock);
+    KASSERT(buf->refCount > 0);
+    if (--buf->refCount == 0)
+	Add_To_Back_Of_FS_Buffer_List(&s_lruList, buf);
+    Mutex_Unlock(&s_bufferLock);
+}
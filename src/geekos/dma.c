@@ -33,6 +33,7 @@
  */
 
 #include <geekos/screen.h>
+#include <geekos/malloc.h>
 #include <geekos/range.h>
 #include <geekos/int.h>
 #include <geekos/io.h>
@@ -179,7 +180,7 @@ void Setup_DMA(enum DMA_Direction direction, int chan, void *addr_, ulong_t size
     KASSERT(IS_RESERVED(chan));
     KASSERT(VALID_MEM(addr, size));
     KASSERT(size > 0);
-    KASSERT(size <= (0xffff - (addr & 0xffff)));  /* can't cross 64K boundary */
+    KASSERT(DMA_Bytes_Before_Boundary(addr_, size) == size);  /* can't cross 64K boundary */
 
     /* Set up transfer mode */
     mode |= DMA_MODE_SINGLE;
@@ -221,6 +222,51 @@ void Setup_DMA(enum DMA_Direction direction, int chan, void *addr_, ulong_t size
     Unmask_DMA(chan);
 }
 
+/**
+ * Allocate a buffer suitable for 8237A DMA transfers: below 16M,
+ * and not crossing a 64K boundary.  The buffer is meant to be
+ * kept for the life of the driver, and can't be freed.
+ * @param size number of bytes needed (at most 64K)
+ * @return the buffer, or null if out of memory
+ */
+void *Alloc_DMA_Buffer(ulong_t size)
+{
+    ulong_t addr;
+
+    KASSERT(size > 0 && size <= 0x10000UL);
+
+    /*
+     * Twice the size always contains a suitable range:
+     * if the start of the block is too close to a 64K
+     * boundary, the range starting at the boundary fits.
+     */
+    addr = (ulong_t) Malloc(size * 2);
+    if (addr == 0)
+	return 0;
+    if (DMA_Bytes_Before_Boundary((void*) addr, size) < size)
+	addr = (addr + 0xFFFF) & ~0xFFFFUL;
+
+    KASSERT(VALID_MEM(addr, size));
+    return (void*) addr;
+}
+
+/**
+ * Find how much of a buffer can be covered by a single DMA
+ * transfer.  Neither the 8237A nor PCI bus master IDE (PRD
+ * entries) can cross a 64K boundary in one transfer, so a
+ * buffer that straddles one must be split there.
+ * @param addr the address of the buffer
+ * @param size number of bytes in the buffer
+ * @return number of bytes from addr up to the next 64K boundary,
+ *   or size if the buffer ends before it
+ */
+ulong_t DMA_Bytes_Before_Boundary(void *addr, ulong_t size)
+{
+    ulong_t toBoundary = 0x10000UL - ((ulong_t) addr & 0xFFFF);
+
+    return size < toBoundary ? size : toBoundary;
+}
+
 /**
  * Mask given DMA channel.
  * The channel must have already been reserved.
@@ -21,9 +21,11 @@
 
 /**
  * From the data of an ELF executable, determine how its segments
- * need to be loaded into memory.
- * @param exeFileData buffer containing the executable file
- * @param exeFileLength length of the executable file in bytes
+ * need to be loaded into memory.  Only the headers are needed:
+ * the data may be just the start of the file, as long as it
+ * includes the program headers.
+ * @param exeFileData buffer containing the start of the executable file
+ * @param exeFileLength number of bytes in exeFileData
  * @param exeFormat structure describing the executable's segments
  *   and entry address; to be filled in
  * @return 0 if successful, < 0 on error
@@ -34,6 +36,13 @@ int Parse_ELF_Executable(char *exeFileData, ulong_t exeFileLength,
     //TODO("Parse an ELF executable image");
 	//利用ELF头部结构体指向可执行文件头部，便于获取相关信息
 	elfHeader *ehdr = (elfHeader*)exeFileData;
+	//检查ELF头部及程序头部表是否完整且合法
+	if (exeFileLength < sizeof(elfHeader) ||
+	    memcmp(ehdr->ident, "\177ELF", 4) != 0 ||
+	    ehdr->phnum > EXE_MAX_SEGMENTS ||
+	    ehdr->phoff > exeFileLength ||
+	    ehdr->phnum * sizeof(programHeader) > exeFileLength - ehdr->phoff)
+		return ENOEXEC;
 	//段的个数
 	exeFormat->numSegments = ehdr->phnum;
 	//代码入口地址
@@ -45,6 +54,10 @@ int Parse_ELF_Executable(char *exeFileData, ulong_t exeFileLength,
 	for(i = 0; i < exeFormat->numSegments; i++, phdr++)
 	{
 		struct Exe_Segment *segment = &exeFormat->segmentList[i];
+		//段在文件中的数据不能超过其在内存中的大小
+		if (phdr->fileSize > phdr->memSize ||
+		    phdr->vaddr + phdr->memSize < phdr->vaddr)
+			return ENOEXEC;
 		//获取该段在文件中的偏移量*
 		segment->offsetInFile = phdr->offset;
 		//获取该段的数据在文件中的长度
@@ -60,3 +73,4 @@ int Parse_ELF_Executable(char *exeFileData, ulong_t exeFileLength,
 
 }
 
+
@@ -46,6 +46,9 @@
  * History:
  * 23-Oct-2003: Works under Bochs 2.0 for read transfers.
  * 12-Nov-2003: Modified to use block device API.
+ *
+ * Reads transfer a whole track into a track cache, and the motor
+ * is left running until the drive has been idle for a few seconds.
  */
 
 /* ----------------------------------------------------------------------
@@ -123,6 +126,24 @@
 
 enum { FLOPPY_READ, FLOPPY_WRITE };
 
+/*
+ * Most sectors on a track of any supported floppy type;
+ * sizes the track cache.
+ */
+#define FLOPPY_MAX_SECTORS		18
+
+/*
+ * Most blocks per request: a cylinder's worth.
+ */
+#define FLOPPY_MAX_REQUEST_BLOCKS	(FLOPPY_MAX_SECTORS * 2)
+
+/*
+ * Timer ticks (of about 55ms) to let the motor spin up,
+ * and to keep it running after the last request.
+ */
+#define MOTOR_SPINUP_TICKS		1
+#define MOTOR_OFF_TICKS			54
+
 /*#define FLOPPY_DEBUG */
 #ifdef FLOPPY_DEBUG
 #  define Debug(args...) Print(args)
@@ -167,6 +188,7 @@ static struct Floppy_Parameters s_floppyParamsTable[] = {
  */
 struct Floppy_Drive {
     struct Floppy_Parameters *params;
+    int cylinder;		 /* where the heads are, or -1 if unknown */
 };
 
 /*
@@ -181,9 +203,26 @@ struct Floppy_Drive s_driveTable[2];
 static struct Thread_Queue s_floppyInterruptWaitQueue;
 
 /*
- * Page of memory used for floppy DMA.
+ * Thread queue where the request thread sleeps while
+ * waiting for the motor to spin up.
+ */
+static struct Thread_Queue s_floppyDelayWaitQueue;
+
+/*
+ * Track cache.  It doubles as the DMA buffer: tracks are read
+ * straight into it, and written sectors are copied into their
+ * slots in it before being written.
+ */
+static uchar_t *s_trackBuf;
+static bool s_trackValid;
+static int s_trackDrive, s_trackCylinder, s_trackHead;
+
+/*
+ * Motor state.  The motor is turned off by a timer
+ * once the drive has been idle for a while.
  */
-static uchar_t *s_transferBuf;
+static bool s_motorOn;
+static int s_motorTimerId = -1;
 
 /*
  * Queue of floppy block I/O requests.
@@ -224,7 +263,7 @@ static int Floppy_Close(struct Block_Device *dev)
 static int Floppy_Get_Num_Blocks(struct Block_Device *dev)
 {
     struct Floppy_Drive *drive;
-    struct Floppy_Parameters *params = drive->params;
+    struct Floppy_Parameters *params;
 
     KASSERT(dev->unit >= 0 && dev->unit <= 1);
     drive = &s_driveTable[dev->unit];
@@ -242,6 +281,7 @@ static struct Block_Device_Ops s_floppyDeviceOps = {
     Floppy_Open,
     Floppy_Close,
     Floppy_Get_Num_Blocks,
+    FLOPPY_MAX_REQUEST_BLOCKS,
 };
 
 /*
@@ -274,10 +314,12 @@ static void Setup_Drive_Parameters(int drive, int type)
 	Print("    %s: cyl=%d, heads=%d, sectors=%d\n", devname,
 		 params->cylinders, params->heads, params->sectors);
 	s_driveTable[drive].params = params;
+	s_driveTable[drive].cylinder = -1;
+	KASSERT(params->sectors <= FLOPPY_MAX_SECTORS);
 
 	/* Register the block device. */
 	rc = Register_Block_Device(devname, &s_floppyDeviceOps, drive, 0,
-	    &s_floppyWaitQueue, &s_floppyRequestQueue);
+	    &s_floppyWaitQueue, &s_floppyRequestQueue, BLOCK_SCHED_CLOOK);
 	if (rc != 0)
 	    Print("  Error: could not create block device for %s\n", devname);
     }
@@ -396,6 +438,75 @@ static void Stop_Motor(int drive)
 	FDC_DOR_DMA_ENABLE | FDC_DOR_RESET_DISABLE | FDC_DOR_DRIVE_SELECT(0));
 }
 
+static void Delay_Timer_Callback(int id)
+{
+    Cancel_Timer(id);
+    Wake_Up(&s_floppyDelayWaitQueue);
+}
+
+/*
+ * Sleep for given number of timer ticks.
+ */
+static void Floppy_Delay(int ticks)
+{
+    Disable_Interrupts();
+    if (Start_Timer(ticks, &Delay_Timer_Callback) >= 0)
+	Wait(&s_floppyDelayWaitQueue);
+    else
+	Micro_Delay(8000);  /* no timer available; spin for the minimum */
+    Enable_Interrupts();
+}
+
+/*
+ * Timer callback which turns the motor off after the drive
+ * has been idle.  Called with interrupts disabled.
+ */
+static void Motor_Off_Callback(int id)
+{
+    Cancel_Timer(id);
+    s_motorTimerId = -1;
+    s_motorOn = false;
+    Stop_Motor(0);
+    Debug("Motor off\n");
+}
+
+/*
+ * Make sure the motor is running before an I/O operation.
+ * If it was off, wait for it to spin up.
+ */
+static void Motor_On(int drive)
+{
+    Disable_Interrupts();
+    if (s_motorTimerId >= 0) {
+	Cancel_Timer(s_motorTimerId);
+	s_motorTimerId = -1;
+    }
+    Enable_Interrupts();
+
+    if (!s_motorOn) {
+	Start_Motor(drive);
+	s_motorOn = true;
+
+	/*
+	 * According to The Undocumented PC, we should wait 8 millis
+	 * before attempting a read or write.
+	 */
+	Floppy_Delay(MOTOR_SPINUP_TICKS);
+    }
+}
+
+/*
+ * Arrange for the motor to be turned off if no further
+ * I/O operation arrives soon.
+ */
+static void Motor_Idle(int drive)
+{
+    Disable_Interrupts();
+    if (s_motorOn && s_motorTimerId < 0)
+	s_motorTimerId = Start_Timer(MOTOR_OFF_TICKS, &Motor_Off_Callback);
+    Enable_Interrupts();
+}
+
 /*
  * Reset and calibrate the controller.
  * Return true is successful, false otherwise.
@@ -421,12 +532,13 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
     int numAttempts = 4;
     bool success = false;
 
+    /* Heads are selected by the transfer command; only cylinders need a seek */
+    if (s_driveTable[drive].cylinder == cylinder)
+	return true;
+
     Debug("Floppy_Seek(%d,%d,%d)\n", drive, cylinder, head);
 
     while (numAttempts-- > 0) {
-	Start_Motor(drive);
-	/*Micro_Delay(1000); */
-
 	Disable_Interrupts();
 
 	Floppy_Out(FDC_COMMAND_SEEK);
@@ -439,8 +551,6 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
 
 	Enable_Interrupts();
 
-	Stop_Motor(drive);
-
 	Sense_Interrupt_Status(&st0, &pcn);
 	if (st0 & FDC_ST0_SEEK_END) {
 	    /* Make sure we arrived at the desired cylinder */
@@ -454,14 +564,19 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
 	}
     }
 
+    s_driveTable[drive].cylinder = success ? cylinder : -1;
     return success;
 }
 
-static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
+/*
+ * Transfer consecutive sectors of one track between the disk
+ * and the track buffer.  The motor must be running.
+ */
+static int Floppy_Transfer(int direction, int driveNum, int cylinder, int head,
+    int sector, int numSectors, uchar_t *dmaBuf)
 {
     struct Floppy_Drive *drive = &s_driveTable[driveNum];
     struct Floppy_Parameters *params = drive->params;
-    int cylinder, head, sector;
     enum DMA_Direction dmaDirection =
 	direction == FLOPPY_READ ? DMA_READ : DMA_WRITE;
     uchar_t command;
@@ -471,8 +586,7 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     KASSERT(driveNum == 0);  /* FIXME */
     KASSERT(direction == FLOPPY_READ || direction == FLOPPY_WRITE);
     KASSERT(params != 0);
-
-    LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+    KASSERT(sector >= 1 && sector + numSectors - 1 <= params->sectors);
 
     if (!Floppy_Seek(driveNum, cylinder, head))
 	return -1;
@@ -480,16 +594,7 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Disable_Interrupts();
 
     /* Set up DMA for transfer */
-    Setup_DMA(dmaDirection, FDC_DMA, s_transferBuf, SECTOR_SIZE);
-
-    /* Turn the floppy motor on */
-    Start_Motor(driveNum);
-
-    /*
-     * According to The Undocumented PC, we should wait 8 millis
-     * before attempting a read or write.
-     */
-    Micro_Delay(8000);
+    Setup_DMA(dmaDirection, FDC_DMA, dmaBuf, numSectors * SECTOR_SIZE);
 
     if (direction == FLOPPY_READ)
 	command = FDC_COMMAND_READ_SECTOR | FDC_MFM | FDC_SKIP_DELETED;
@@ -503,7 +608,7 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Floppy_Out(head);
     Floppy_Out(sector);
     Floppy_Out(params->sectorSizeCode);
-    Floppy_Out(params->sectors);
+    Floppy_Out(sector + numSectors - 1);  /* last sector to transfer */
     Floppy_Out(params->gapLengthCode);
     Floppy_Out(0xFF);  /* DTL */
 
@@ -520,11 +625,12 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Floppy_In();  /* sector number */
     Floppy_In();  /* sector size */
 
-    Stop_Motor(driveNum);
-
     if (FDC_ST0_IS_SUCCESS(st0)) {
 	Debug("Floppy_Transfer: successful transfer!\n");
 	result = 0;
+    } else {
+	/* Don't trust the head position after an error */
+	drive->cylinder = -1;
     }
 
     Enable_Interrupts();
@@ -533,36 +639,88 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     return result;
 }
 
-static int Floppy_Read(int driveNum, int blockNum, char *buffer)
+/*
+ * Read blocks, fetching whole tracks into the track cache
+ * and copying out of it.
+ */
+static int Floppy_Read(int driveNum, int blockNum, int numBlocks, char *buffer)
 {
+    struct Floppy_Parameters *params = s_driveTable[driveNum].params;
+    int cylinder, head, sector, count;
     int rc;
 
-    Debug("Floppy_Read(%d,%d,%x)\n", driveNum, blockNum, buffer);
-
-#ifndef NDEBUG
-    memset(buffer, (char) 0xcd, SECTOR_SIZE);
-    memset(s_transferBuf, (char) 0xcd, SECTOR_SIZE);
-#endif
-
-    rc = Floppy_Transfer(FLOPPY_READ, driveNum, blockNum, buffer);
+    Debug("Floppy_Read(%d,%d,%d,%x)\n", driveNum, blockNum, numBlocks, buffer);
+
+    while (numBlocks > 0) {
+	LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+
+	if (!s_trackValid || s_trackDrive != driveNum ||
+	    s_trackCylinder != cylinder || s_trackHead != head) {
+	    s_trackValid = false;
+	    rc = Floppy_Transfer(FLOPPY_READ, driveNum, cylinder, head, 1, params->sectors, s_trackBuf);
+	    if (rc != 0)
+		return rc;
+	    s_trackValid = true;
+	    s_trackDrive = driveNum;
+	    s_trackCylinder = cylinder;
+	    s_trackHead = head;
+	}
 
-    if (rc == 0) {
 	/*
 	 * Successful transfer!
-	 * Copy data from transfer buffer into caller's buffer.
+	 * Copy data from track cache into caller's buffer.
 	 */
-	memcpy(buffer, s_transferBuf, SECTOR_SIZE);
+	count = params->sectors - sector + 1;
+	if (count > numBlocks)
+	    count = numBlocks;
+	memcpy(buffer, s_trackBuf + (sector - 1) * SECTOR_SIZE, count * SECTOR_SIZE);
+
+	blockNum += count;
+	numBlocks -= count;
+	buffer += count * SECTOR_SIZE;
     }
 
-    return rc;
+    return 0;
 }
 
-static int Floppy_Write(int driveNum, int blockNum, char *buffer)
+/*
+ * Write blocks.  Data is written through the track cache,
+ * so a cached copy of the track stays up to date.
+ */
+static int Floppy_Write(int driveNum, int blockNum, int numBlocks, char *buffer)
 {
-    Debug("Floppy_Write(%d,%d,%x)\n", driveNum, blockNum, buffer);
+    struct Floppy_Parameters *params = s_driveTable[driveNum].params;
+    int cylinder, head, sector, count;
+    uchar_t *slot;
+    int rc;
+
+    Debug("Floppy_Write(%d,%d,%d,%x)\n", driveNum, blockNum, numBlocks, buffer);
 
-    memcpy(s_transferBuf, buffer, SECTOR_SIZE);
-    return Floppy_Transfer(FLOPPY_WRITE, driveNum, blockNum, buffer);
+    while (numBlocks > 0) {
+	LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+
+	/* Writing to another track clobbers the cached one */
+	if (s_trackDrive != driveNum || s_trackCylinder != cylinder || s_trackHead != head)
+	    s_trackValid = false;
+
+	count = params->sectors - sector + 1;
+	if (count > numBlocks)
+	    count = numBlocks;
+	slot = s_trackBuf + (sector - 1) * SECTOR_SIZE;
+	memcpy(slot, buffer, count * SECTOR_SIZE);
+
+	rc = Floppy_Transfer(FLOPPY_WRITE, driveNum, cylinder, head, sector, count, slot);
+	if (rc != 0) {
+	    s_trackValid = false;
+	    return rc;
+	}
+
+	blockNum += count;
+	numBlocks -= count;
+	buffer += count * SECTOR_SIZE;
+    }
+
+    return 0;
 }
 
 /*
@@ -584,10 +742,12 @@ static void Floppy_Request_Thread(ulong_t arg)
 	KASSERT(request->type == BLOCK_READ || request->type == BLOCK_WRITE);
 
 	/* Perform the I/O. */
+	Motor_On(request->dev->unit);
 	if (request->type == BLOCK_READ)
-	    rc = Floppy_Read(request->dev->unit, request->blockNum, request->buf);
+	    rc = Floppy_Read(request->dev->unit, request->blockNum, request->xferBlocks, request->buf);
 	else
-	    rc = Floppy_Write(request->dev->unit, request->blockNum, request->buf);
+	    rc = Floppy_Write(request->dev->unit, request->blockNum, request->xferBlocks, request->buf);
+	Motor_Idle(request->dev->unit);
 
 	/* Notify the requesting thread of the outcome of the I/O. */
 	Debug("FRQ: Notifying requesting thread...\n");
@@ -612,7 +772,11 @@ void Init_Floppy(void)
     Print("Initializing floppy controller...\n");
 
     /* Allocate memory for DMA transfers */
-    s_transferBuf = (uchar_t*) Alloc_Page();
+    s_trackBuf = (uchar_t*) Alloc_DMA_Buffer(FLOPPY_MAX_SECTORS * SECTOR_SIZE);
+    if (s_trackBuf == 0) {
+	Print("  Could not allocate track buffer\n");
+	goto done;
+    }
 
     /* Use CMOS to get floppy configuration */
     Out_Byte(CMOS_OUT, CMOS_FLOPPY_INDEX);
@@ -627,7 +791,10 @@ void Init_Floppy(void)
     /* Reset and calibrate the controller. */
     Disable_Interrupts();
     good = Reset_Controller();
+    s_motorOn = true;
+    s_driveTable[0].cylinder = good ? 0 : -1;
     Enable_Interrupts();
+    Motor_Idle(0);
     if (!good) {
 	Print("  Failed to reset controller!\n");
 	goto done;
@@ -0,0 +1,2237 @@
+/*
+ * GeekOS filesystem
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <limits.h>
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/string.h>
+#include <geekos/malloc.h>
+#include <geekos/blockdev.h>
+#include <geekos/bufcache.h>
+#include <geekos/bitset.h>
+#include <geekos/pagecache.h>
+#include <geekos/crc32.h>
+#include <geekos/vfs.h>
+#include <geekos/list.h>
+#include <geekos/synch.h>
+#include <geekos/gosfs.h>
+
+/*
+ * Metadata blocks are read through the buffer cache, but are never
+ * marked dirty there: a block changed by an operation is kept pinned
+ * in the current transaction, and written only once the transaction
+ * is in the journal.  The bitmaps are kept in memory, and logged
+ * from there.  File data bypasses the journal; it is written through
+ * the page cache before the metadata referring to it is committed.
+ */
+
+/* ----------------------------------------------------------------------
+ * Private functions
+ * ---------------------------------------------------------------------- */
+
+int debugGOSFS = 0;
+#define Debug(args...) if (debugGOSFS) Print("GOSFS: " args)
+
+/*
+ * Number of pages GOSFS_Read() and GOSFS_Write() transfer at a time.
+ */
+#define GOSFS_BATCH_PAGES		8
+
+/*
+ * Number of closed files whose GOSFS_File objects (and cached
+ * pages) are kept, in case they are opened again.
+ */
+#define GOSFS_MAX_IDLE_FILES		16
+
+/*
+ * Smallest number of hash chains in a directory index.
+ */
+#define GOSFS_MIN_HASH_SIZE		16
+
+/* validMask of a cached page holding a whole block */
+#define GOSFS_PAGE_VALID		((1 << BLOCKS_PER_PAGE) - 1)
+
+/* hashNext of a free directory slot */
+#define GOSFS_SLOT_FREE			(-2)
+
+/*
+ * Most blocks each kind of operation adds to a transaction.
+ * Allocating a run of blocks for a file changes up to two bitmap
+ * blocks, a third for a new extent block, the inode and the extent
+ * block.  Creating a file may also add a block to its directory,
+ * and changes the new inode, the inode bitmap and a directory
+ * block.  Freeing a file's blocks may change every bitmap block.
+ */
+#define GOSFS_INODE_LOG_BLOCKS		2
+#define GOSFS_GROW_LOG_BLOCKS		5
+#define GOSFS_CREATE_LOG_BLOCKS		(GOSFS_GROW_LOG_BLOCKS + 4)
+#define GOSFS_FREE_LOG_BLOCKS(instance)	((instance)->super.bitmapBlocks + 3)
+
+struct GOSFS_File;
+DEFINE_LIST(GOSFS_File_List, GOSFS_File);
+
+/*
+ * A run of file blocks which are consecutive on the device.
+ */
+struct GOSFS_File_Extent {
+    ulong_t fileBlock;			 /* First file block in the run */
+    ulong_t devBlock;			 /* Device block holding it */
+    ulong_t numBlocks;			 /* Length of the run */
+};
+
+/*
+ * Index of the entries of a directory by a hash of their names.
+ * Only the hashes are kept in memory; the entries themselves are
+ * read through the buffer cache, and only when the hash matches.
+ * Protected by the instance lock.
+ */
+struct GOSFS_Dir {
+    int numSlots;			 /* Slots in the directory, used or free */
+    int maxSlots;			 /* Room in hashNext and nameHash */
+    int numUsed;
+    int firstFree;			 /* No free slot comes before this one */
+    int hashSize;			 /* Number of chains, a power of two */
+    int *hash;				 /* Chains of slot numbers, ending with -1 */
+    int *hashNext;			 /* Next slot in chain, or GOSFS_SLOT_FREE */
+    ulong_t *nameHash;			 /* Hash of the name in each used slot */
+};
+
+/*
+ * In-memory information for a file or directory.
+ * The contents of files are cached in the page cache,
+ * with the GOSFS_File as the owner of the pages.
+ * Kept in fsData field of File.
+ */
+struct GOSFS_File {
+    ulong_t inodeNum;
+    struct GOSFS_Inode inode;		 /* Copy of the inode, kept up to date */
+    struct GOSFS_File_Extent *extentList; /* Blocks of the file, in file order */
+    int numExtents;
+    int maxExtents;			 /* Room in extentList */
+    struct GOSFS_Dir *dir;		 /* Index of a directory, 0 for a file */
+    int refCount;			 /* Number of File objects using it */
+    struct Mutex lock;			 /* Synchronize accesses to file data */
+    DEFINE_LINK(GOSFS_File_List, GOSFS_File);
+};
+IMPLEMENT_LIST(GOSFS_File_List, GOSFS_File);
+
+/*
+ * A block changed by the current transaction.
+ */
+struct GOSFS_Log_Entry {
+    ulong_t blockNum;			 /* Home of the block */
+    struct FS_Buffer *buf;		 /* Buffer holding it, 0 for a bitmap block */
+    void *data;
+};
+
+/*
+ * In-memory information describing a mounted GOSFS filesystem.
+ * This is kept in the fsData field of the Mount_Point.
+ */
+struct GOSFS_Instance {
+    struct GOSFS_Superblock super;
+    struct Block_Device *dev;
+    struct FS_Buffer_Cache *fsCache;	 /* cache of inode, directory and extent blocks */
+
+    /* Allocation state */
+    void *bitmap;			 /* Block bitmap, as the current transaction leaves it */
+    void *allocMap;			 /* Same, but blocks it frees are still in use */
+    ulong_t numFreeBlocks;		 /* Blocks free in allocMap */
+    ulong_t numPendingFree;		 /* Blocks freed by the current transaction */
+    void *inodeMap;			 /* Inode bitmap */
+
+    /* Current transaction */
+    struct GOSFS_Log_Entry logList[GOSFS_MAX_TRANSACTION_BLOCKS];
+    int numLogged;
+    ulong_t sequence;
+    struct GOSFS_Journal_Header *journalHeader; /* a whole block */
+    struct Block_Request *requestList[GOSFS_MAX_TRANSACTION_BLOCKS];
+
+    struct Mutex lock;
+    struct GOSFS_File_List fileList;	 /* Open files, then idle ones by age */
+    int numIdleFiles;
+    struct GOSFS_File_List dirList;	 /* Directories used so far */
+};
+
+static int GOSFS_Sync(struct Mount_Point *mountPoint);
+
+/*
+ * Copy file metadata from an inode into
+ * struct VFS_File_Stat object.
+ */
+static void GOSFS_Copy_Stat(struct VFS_File_Stat *stat, struct GOSFS_Inode *inode)
+{
+    stat->size = inode->size;
+    stat->isDirectory = (inode->type == GOSFS_INODE_DIRECTORY);
+
+    stat->isSetuid = 0;
+    memset(&stat->acls, '\0', sizeof(stat->acls));
+    stat->acls[0].uid = 0;
+    stat->acls[0].permission = O_READ | O_WRITE;
+}
+
+/*
+ * Read or write a filesystem block synchronously.
+ */
+static int GOSFS_Read_Block(struct Block_Device *dev, ulong_t blockNum, void *data)
+{
+    return Block_Read_Range(dev, blockNum * GOSFS_SECTORS_PER_BLOCK, GOSFS_SECTORS_PER_BLOCK, data);
+}
+
+static int GOSFS_Write_Block(struct Block_Device *dev, ulong_t blockNum, void *data)
+{
+    return Block_Write_Range(dev, blockNum * GOSFS_SECTORS_PER_BLOCK, GOSFS_SECTORS_PER_BLOCK, data);
+}
+
+/*
+ * Start transferring a filesystem block without waiting,
+ * adding the request to requestList.  Devices which can't
+ * transfer a whole block in one request are handled
+ * synchronously instead.
+ * Returns 0 if successful, error code on error.
+ */
+static int GOSFS_Submit_Block_IO(struct Block_Device *dev, enum Request_Type type, ulong_t blockNum,
+    void *data, struct Block_Request **requestList, int *pNumRequests)
+{
+    struct Block_Request *request;
+
+    if (GOSFS_SECTORS_PER_BLOCK > Get_Max_Request_Blocks(dev))
+	return type == BLOCK_READ
+	    ? GOSFS_Read_Block(dev, blockNum, data)
+	    : GOSFS_Write_Block(dev, blockNum, data);
+
+    request = Create_Range_Request(dev, type, blockNum * GOSFS_SECTORS_PER_BLOCK,
+	GOSFS_SECTORS_PER_BLOCK, data);
+    if (request == 0)
+	return ENOMEM;
+    Submit_Block_Request(request, 0, 0);
+    requestList[(*pNumRequests)++] = request;
+    return 0;
+}
+
+/*
+ * Wait for the requests started by GOSFS_Submit_Block_IO(),
+ * and release them.
+ * Returns 0 if they were all successful, otherwise the
+ * error code of the first one that failed.
+ */
+static int GOSFS_Wait_For_Block_IO(struct Block_Request **requestList, int numRequests)
+{
+    int rc = Wait_For_Requests(requestList, numRequests);
+    int i;
+
+    for (i = 0; i < numRequests; ++i)
+	Release_Request(requestList[i]);
+    return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * Journal
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Find the entry for given block in the current transaction.
+ */
+static struct GOSFS_Log_Entry *GOSFS_Find_Logged(struct GOSFS_Instance *instance, ulong_t blockNum)
+{
+    int i;
+
+    for (i = 0; i < instance->numLogged; ++i) {
+	if (instance->logList[i].blockNum == blockNum)
+	    return &instance->logList[i];
+    }
+    return 0;
+}
+
+/*
+ * Add a metadata buffer the caller has changed to the current
+ * transaction.  This takes over the caller's reference to the
+ * buffer, which stays pinned until the transaction is written.
+ * Called with the instance lock held.
+ */
+static void GOSFS_Log_Buffer(struct GOSFS_Instance *instance, struct FS_Buffer *buf)
+{
+    struct GOSFS_Log_Entry *entry;
+
+    if (GOSFS_Find_Logged(instance, buf->fsBlockNum) != 0) {
+	Release_FS_Buffer(instance->fsCache, buf);
+	return;
+    }
+
+    KASSERT(instance->numLogged < GOSFS_MAX_TRANSACTION_BLOCKS);
+    entry = &instance->logList[instance->numLogged++];
+    entry->blockNum = buf->fsBlockNum;
+    entry->buf = buf;
+    entry->data = buf->data;
+}
+
+/*
+ * Add the block of an in-memory bitmap holding given bit
+ * to the current transaction.  The bitmap's first block
+ * is at firstBlock on the device.
+ * Called with the instance lock held.
+ */
+static void GOSFS_Log_Bitmap(struct GOSFS_Instance *instance, ulong_t firstBlock, void *map, ulong_t bit)
+{
+    ulong_t block = bit / GOSFS_BITS_PER_BLOCK;
+    struct GOSFS_Log_Entry *entry;
+
+    if (GOSFS_Find_Logged(instance, firstBlock + block) != 0)
+	return;
+
+    KASSERT(instance->numLogged < GOSFS_MAX_TRANSACTION_BLOCKS);
+    entry = &instance->logList[instance->numLogged++];
+    entry->blockNum = firstBlock + block;
+    entry->buf = 0;
+    entry->data = (char*) map + block * GOSFS_BLOCK_SIZE;
+}
+
+/*
+ * Write the current transaction: its blocks go to the journal,
+ * then the header which commits them, then the blocks go to
+ * their home locations.  Blocks freed by the transaction can be
+ * allocated again once it is written.  If anything fails, the
+ * transaction is kept, and is written again by the next commit.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Commit(struct GOSFS_Instance *instance)
+{
+    struct GOSFS_Superblock *super = &instance->super;
+    struct GOSFS_Journal_Header *header = instance->journalHeader;
+    ulong_t checksum = 0;
+    int numRequests = 0, rc = 0, rc2, i;
+
+    KASSERT(IS_HELD(&instance->lock));
+
+    if (instance->numLogged == 0)
+	return 0;
+    Debug("Committing transaction %lu (%d blocks)\n", instance->sequence, instance->numLogged);
+
+    for (i = 0; i < instance->numLogged && rc == 0; ++i) {
+	struct GOSFS_Log_Entry *entry = &instance->logList[i];
+
+	checksum = crc32(checksum, (char*) entry->data, GOSFS_BLOCK_SIZE);
+	rc = GOSFS_Submit_Block_IO(instance->dev, BLOCK_WRITE, super->journalStart + 1 + i,
+	    entry->data, instance->requestList, &numRequests);
+    }
+    rc2 = GOSFS_Wait_For_Block_IO(instance->requestList, numRequests);
+    if (rc == 0)
+	rc = rc2;
+    if (rc != 0)
+	return rc;
+
+    memset(header, '\0', GOSFS_BLOCK_SIZE);
+    header->magic = GOSFS_JOURNAL_MAGIC;
+    header->sequence = instance->sequence;
+    header->numBlocks = instance->numLogged;
+    header->checksum = checksum;
+    for (i = 0; i < instance->numLogged; ++i)
+	header->homeBlock[i] = instance->logList[i].blockNum;
+    if ((rc = GOSFS_Write_Block(instance->dev, super->journalStart, header)) != 0)
+	return rc;
+
+    /*
+     * The transaction is committed.  The header is left as it is:
+     * replaying it again would only write the same blocks, and the
+     * next transaction's blocks won't match its checksum.
+     */
+    numRequests = 0;
+    for (i = 0; i < instance->numLogged && rc == 0; ++i) {
+	struct GOSFS_Log_Entry *entry = &instance->logList[i];
+
+	rc = GOSFS_Submit_Block_IO(instance->dev, BLOCK_WRITE, entry->blockNum,
+	    entry->data, instance->requestList, &numRequests);
+    }
+    rc2 = GOSFS_Wait_For_Block_IO(instance->requestList, numRequests);
+    if (rc == 0)
+	rc = rc2;
+    if (rc != 0)
+	return rc;
+
+    for (i = 0; i < instance->numLogged; ++i) {
+	if (instance->logList[i].buf != 0)
+	    Release_FS_Buffer(instance->fsCache, instance->logList[i].buf);
+    }
+    instance->numLogged = 0;
+    ++instance->sequence;
+
+    if (instance->numPendingFree > 0) {
+	memcpy(instance->allocMap, instance->bitmap, super->bitmapBlocks * GOSFS_BLOCK_SIZE);
+	instance->numFreeBlocks += instance->numPendingFree;
+	instance->numPendingFree = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Start an operation which changes up to numBlocks metadata
+ * blocks, and allocates up to numAlloc blocks.  The current
+ * transaction is committed first if it lacks room for the changes,
+ * or if the operation needs blocks which it frees.  Operations are
+ * never split between transactions, so after a crash each is found
+ * either complete or not done at all.  Operations may nest, if the
+ * outer one has made room for the inner one.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Begin(struct GOSFS_Instance *instance, int numBlocks, ulong_t numAlloc)
+{
+    KASSERT(numBlocks <= GOSFS_MAX_TRANSACTION_BLOCKS);
+
+    if (instance->numLogged + numBlocks > GOSFS_MAX_TRANSACTION_BLOCKS ||
+	(numAlloc > instance->numFreeBlocks && instance->numPendingFree > 0))
+	return GOSFS_Commit(instance);
+    return 0;
+}
+
+/*
+ * Replay the transaction in the journal, if all of its blocks
+ * were written.  Called when mounting, before anything else
+ * is read from the filesystem.
+ */
+static int GOSFS_Replay_Journal(struct GOSFS_Instance *instance)
+{
+    struct GOSFS_Superblock *super = &instance->super;
+    struct GOSFS_Journal_Header *header = instance->journalHeader;
+    ulong_t checksum = 0;
+    char *block;
+    int i, rc;
+
+    if ((rc = GOSFS_Read_Block(instance->dev, super->journalStart, header)) != 0)
+	return rc;
+    if (header->magic != GOSFS_JOURNAL_MAGIC || header->numBlocks == 0)
+	return 0;
+    instance->sequence = header->sequence + 1;
+    if (header->numBlocks > GOSFS_MAX_TRANSACTION_BLOCKS)
+	return EINVALIDFS;
+
+    block = (char*) Malloc(GOSFS_BLOCK_SIZE);
+    if (block == 0)
+	return ENOMEM;
+
+    /* A transaction whose blocks don't match its checksum was never committed */
+    for (i = 0; i < header->numBlocks && rc == 0; ++i) {
+	if (header->homeBlock[i] < super->bitmapStart || header->homeBlock[i] >= super->numBlocks)
+	    rc = EINVALIDFS;
+	else if ((rc = GOSFS_Read_Block(instance->dev, super->journalStart + 1 + i, block)) == 0)
+	    checksum = crc32(checksum, block, GOSFS_BLOCK_SIZE);
+    }
+    if (rc != 0 || checksum != header->checksum)
+	goto done;
+
+    Print("GOSFS: replaying %u blocks from journal on %s\n", header->numBlocks, instance->dev->name);
+    for (i = 0; i < header->numBlocks && rc == 0; ++i) {
+	rc = GOSFS_Read_Block(instance->dev, super->journalStart + 1 + i, block);
+	if (rc == 0)
+	    rc = GOSFS_Write_Block(instance->dev, header->homeBlock[i], block);
+    }
+
+    /* Once the blocks are home, there is nothing to replay */
+    if (rc == 0) {
+	header->numBlocks = 0;
+	rc = GOSFS_Write_Block(instance->dev, super->journalStart, header);
+    }
+
+done:
+    Free(block);
+    return rc;
+}
+
+/* ----------------------------------------------------------------------
+ * Block and inode allocation
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Allocate a run of up to want blocks: those from goal onwards if
+ * goal (when not 0) is free, otherwise the first free run long
+ * enough, otherwise the first free run of any length.
+ * want is at most GOSFS_BITS_PER_BLOCK, so the run changes at most
+ * two bitmap blocks.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Alloc_Blocks(struct GOSFS_Instance *instance, ulong_t goal, ulong_t want,
+    ulong_t *pStart, ulong_t *pCount)
+{
+    ulong_t numBlocks = instance->super.numBlocks;
+    ulong_t start = goal, count = 0, i;
+
+    KASSERT(want > 0 && want <= GOSFS_BITS_PER_BLOCK);
+
+    if (instance->numFreeBlocks == 0)
+	return ENOSPACE;
+
+    if (goal != 0) {
+	while (count < want && start + count < numBlocks &&
+	       !Is_Bit_Set(instance->allocMap, start + count))
+	    ++count;
+    }
+    if (count == 0) {
+	int found = Find_First_N_Free(instance->allocMap, want, numBlocks);
+
+	if (found < 0)
+	    found = Find_First_Free_Bit(instance->allocMap, numBlocks);
+	KASSERT(found >= 0);  /* numFreeBlocks says there is one */
+	start = found;
+	while (count < want && start + count < numBlocks &&
+	       !Is_Bit_Set(instance->allocMap, start + count))
+	    ++count;
+    }
+
+    for (i = 0; i < count; ++i) {
+	Set_Bit(instance->bitmap, start + i);
+	Set_Bit(instance->allocMap, start + i);
+    }
+    GOSFS_Log_Bitmap(instance, instance->super.bitmapStart, instance->bitmap, start);
+    GOSFS_Log_Bitmap(instance, instance->super.bitmapStart, instance->bitmap, start + count - 1);
+    instance->numFreeBlocks -= count;
+
+    Debug("Allocated blocks %lu..%lu\n", start, start + count - 1);
+    *pStart = start;
+    *pCount = count;
+    return 0;
+}
+
+/*
+ * Free a run of blocks.  They can't be allocated again until the
+ * transaction freeing them is written, as until then they still
+ * belong to their old file on the device.
+ * Called with the instance lock held.
+ */
+static void GOSFS_Free_Blocks(struct GOSFS_Instance *instance, ulong_t start, ulong_t count)
+{
+    struct GOSFS_Superblock *super = &instance->super;
+    ulong_t i;
+
+    if (count == 0)
+	return;
+    if (start < super->dataStart || start + count > super->numBlocks || start + count < start) {
+	Print("GOSFS: not freeing invalid blocks %lu..%lu\n", start, start + count - 1);
+	return;  /* probable filesystem corruption */
+    }
+
+    for (i = 0; i < count; ++i)
+	Clear_Bit(instance->bitmap, start + i);
+    for (i = start / GOSFS_BITS_PER_BLOCK; i <= (start + count - 1) / GOSFS_BITS_PER_BLOCK; ++i)
+	GOSFS_Log_Bitmap(instance, super->bitmapStart, instance->bitmap, i * GOSFS_BITS_PER_BLOCK);
+    instance->numPendingFree += count;
+}
+
+/*
+ * Allocate an inode.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Alloc_Inode(struct GOSFS_Instance *instance, ulong_t *pInodeNum)
+{
+    int found = Find_First_Free_Bit(instance->inodeMap, instance->super.numInodes);
+
+    if (found < 0)
+	return ENOSPACE;
+    Set_Bit(instance->inodeMap, found);
+    GOSFS_Log_Bitmap(instance, instance->super.inodeBitmapStart, instance->inodeMap, found);
+    *pInodeNum = found;
+    return 0;
+}
+
+/*
+ * Free an inode.
+ * Called with the instance lock held.
+ */
+static void GOSFS_Free_Inode(struct GOSFS_Instance *instance, ulong_t inodeNum)
+{
+    Clear_Bit(instance->inodeMap, inodeNum);
+    GOSFS_Log_Bitmap(instance, instance->super.inodeBitmapStart, instance->inodeMap, inodeNum);
+}
+
+/* ----------------------------------------------------------------------
+ * Inodes and extents
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Get the buffer holding an inode.
+ */
+static int GOSFS_Get_Inode_Buffer(struct GOSFS_Instance *instance, ulong_t inodeNum,
+    struct FS_Buffer **pBuf, struct GOSFS_Inode **pInode)
+{
+    int rc;
+
+    if (inodeNum == 0 || inodeNum >= instance->super.numInodes) {
+	Print("GOSFS: invalid inode number %lu\n", inodeNum);
+	return EIO;  /* probable filesystem corruption */
+    }
+
+    rc = Get_FS_Buffer(instance->fsCache,
+	instance->super.inodeStart + inodeNum / GOSFS_INODES_PER_BLOCK, pBuf);
+    if (rc == 0)
+	*pInode = (struct GOSFS_Inode*) (*pBuf)->data + inodeNum % GOSFS_INODES_PER_BLOCK;
+    return rc;
+}
+
+/*
+ * Read an inode.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Read_Inode(struct GOSFS_Instance *instance, ulong_t inodeNum, struct GOSFS_Inode *inode)
+{
+    struct FS_Buffer *buf;
+    struct GOSFS_Inode *ptr;
+    int rc;
+
+    if ((rc = GOSFS_Get_Inode_Buffer(instance, inodeNum, &buf, &ptr)) != 0)
+	return rc;
+    memcpy(inode, ptr, sizeof(*inode));
+    Release_FS_Buffer(instance->fsCache, buf);
+    return 0;
+}
+
+/*
+ * Write an inode, as part of the current transaction.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Write_Inode(struct GOSFS_Instance *instance, ulong_t inodeNum, struct GOSFS_Inode *inode)
+{
+    struct FS_Buffer *buf;
+    struct GOSFS_Inode *ptr;
+    int rc;
+
+    if ((rc = GOSFS_Get_Inode_Buffer(instance, inodeNum, &buf, &ptr)) != 0)
+	return rc;
+    memcpy(ptr, inode, sizeof(*inode));
+    GOSFS_Log_Buffer(instance, buf);
+    return 0;
+}
+
+/*
+ * Write a file's inode, and its extent block if it has one,
+ * from the GOSFS_File.  Changes up to GOSFS_INODE_LOG_BLOCKS blocks.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Update_Inode(struct GOSFS_Instance *instance, struct GOSFS_File *gfile)
+{
+    struct GOSFS_Inode *inode = &gfile->inode;
+    int i, rc;
+
+    inode->numExtents = gfile->numExtents;
+    memset(inode->extents, '\0', sizeof(inode->extents));
+    for (i = 0; i < gfile->numExtents && i < GOSFS_NUM_DIRECT_EXTENTS; ++i) {
+	inode->extents[i].start = gfile->extentList[i].devBlock;
+	inode->extents[i].length = gfile->extentList[i].numBlocks;
+    }
+
+    if (gfile->numExtents > GOSFS_NUM_DIRECT_EXTENTS) {
+	struct FS_Buffer *buf;
+	struct GOSFS_Extent *extents;
+
+	KASSERT(inode->extentBlock != 0);
+	if ((rc = Get_FS_Buffer(instance->fsCache, inode->extentBlock, &buf)) != 0)
+	    return rc;
+	extents = (struct GOSFS_Extent*) buf->data;
+	memset(extents, '\0', GOSFS_BLOCK_SIZE);
+	for (i = GOSFS_NUM_DIRECT_EXTENTS; i < gfile->numExtents; ++i) {
+	    extents[i - GOSFS_NUM_DIRECT_EXTENTS].start = gfile->extentList[i].devBlock;
+	    extents[i - GOSFS_NUM_DIRECT_EXTENTS].length = gfile->extentList[i].numBlocks;
+	}
+	GOSFS_Log_Buffer(instance, buf);
+    }
+
+    return GOSFS_Write_Inode(instance, gfile->inodeNum, inode);
+}
+
+/*
+ * Find the extent containing given file block.
+ * Returns its index, or numExtents if the block
+ * is beyond the last extent.
+ */
+static int GOSFS_Find_Extent(struct GOSFS_File *gfile, ulong_t fileBlock)
+{
+    struct GOSFS_File_Extent *extentList = gfile->extentList;
+    int low = 0, high = gfile->numExtents;
+
+    /* Find the last extent starting at or before the block */
+    while (high - low > 1) {
+	int mid = (low + high) / 2;
+	if (extentList[mid].fileBlock <= fileBlock)
+	    low = mid;
+	else
+	    high = mid;
+    }
+
+    if (low < gfile->numExtents &&
+	fileBlock - extentList[low].fileBlock < extentList[low].numBlocks)
+	return low;
+    return gfile->numExtents;
+}
+
+/*
+ * Find the device block holding given file block.
+ */
+static int GOSFS_Map_Block(struct GOSFS_File *gfile, ulong_t fileBlock, ulong_t *pDevBlock)
+{
+    int extent = GOSFS_Find_Extent(gfile, fileBlock);
+    struct GOSFS_File_Extent *ext;
+
+    if (extent >= gfile->numExtents) {
+	Print("GOSFS: block %lu of inode %lu is not mapped\n", fileBlock, gfile->inodeNum);
+	return EIO;  /* probable filesystem corruption */
+    }
+    ext = &gfile->extentList[extent];
+    *pDevBlock = ext->devBlock + (fileBlock - ext->fileBlock);
+    return 0;
+}
+
+/*
+ * Add a run of device blocks to the end of a file's extent list.
+ */
+static int GOSFS_Add_Extent(struct GOSFS_File *gfile, ulong_t devBlock, ulong_t numBlocks)
+{
+    struct GOSFS_File_Extent *ext;
+
+    if (gfile->numExtents > 0) {
+	ext = &gfile->extentList[gfile->numExtents - 1];
+	if (ext->devBlock + ext->numBlocks == devBlock) {
+	    ext->numBlocks += numBlocks;
+	    return 0;
+	}
+    }
+
+    if (gfile->numExtents == GOSFS_MAX_EXTENTS)
+	return ENOSPACE;
+
+    if (gfile->numExtents == gfile->maxExtents) {
+	int maxExtents = gfile->maxExtents > 0 ? gfile->maxExtents * 2 : 4;
+	struct GOSFS_File_Extent *extentList;
+
+	extentList = (struct GOSFS_File_Extent*) Malloc(maxExtents * sizeof(*extentList));
+	if (extentList == 0)
+	    return ENOMEM;
+	if (gfile->extentList != 0) {
+	    memcpy(extentList, gfile->extentList, gfile->numExtents * sizeof(*extentList));
+	    Free(gfile->extentList);
+	}
+	gfile->extentList = extentList;
+	gfile->maxExtents = maxExtents;
+    }
+
+    ext = &gfile->extentList[gfile->numExtents++];
+    ext->fileBlock = gfile->inode.numBlocks;
+    ext->devBlock = devBlock;
+    ext->numBlocks = numBlocks;
+    return 0;
+}
+
+/*
+ * Allocate blocks at the end of a file until it has numBlocks blocks.
+ * Each run allocated is a separate operation, so after a crash the
+ * file may have some of the new blocks, beyond its size.
+ * Called with the instance lock held, and the GOSFS_File's lock
+ * for a regular file.
+ */
+static int GOSFS_Grow_File(struct GOSFS_Instance *instance, struct GOSFS_File *gfile, ulong_t numBlocks)
+{
+    struct GOSFS_Inode *inode = &gfile->inode;
+
+    if (numBlocks <= inode->numBlocks)
+	return 0;
+    if (numBlocks - inode->numBlocks > instance->numFreeBlocks + instance->numPendingFree)
+	return ENOSPACE;
+
+    while (inode->numBlocks < numBlocks) {
+	ulong_t need = MIN(numBlocks - inode->numBlocks, (ulong_t) GOSFS_BITS_PER_BLOCK);
+	ulong_t goal = 0, start, count;
+	int rc;
+
+	if ((rc = GOSFS_Begin(instance, GOSFS_GROW_LOG_BLOCKS, need + 1)) != 0)
+	    return rc;
+
+	/* Continue the last extent if the blocks after it are free */
+	if (gfile->numExtents > 0) {
+	    struct GOSFS_File_Extent *ext = &gfile->extentList[gfile->numExtents - 1];
+	    goal = ext->devBlock + ext->numBlocks;
+	}
+	if ((rc = GOSFS_Alloc_Blocks(instance, goal, need, &start, &count)) != 0)
+	    return rc;
+
+	/* Extents past the direct ones need the extent block */
+	if (start != goal && gfile->numExtents >= GOSFS_NUM_DIRECT_EXTENTS &&
+	    gfile->numExtents < GOSFS_MAX_EXTENTS && inode->extentBlock == 0) {
+	    ulong_t extentBlock, one;
+
+	    rc = GOSFS_Alloc_Blocks(instance, 0, 1, &extentBlock, &one);
+	    if (rc == 0)
+		inode->extentBlock = extentBlock;
+	}
+	if (rc == 0)
+	    rc = GOSFS_Add_Extent(gfile, start, count);
+	if (rc != 0) {
+	    GOSFS_Free_Blocks(instance, start, count);
+	    return rc;
+	}
+	inode->numBlocks += count;
+
+	if ((rc = GOSFS_Update_Inode(instance, gfile)) != 0)
+	    return rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Free the blocks of a file beyond the first numBlocks, and its
+ * extent block if it is no longer needed.
+ * Called with the instance lock held, in an operation with room for
+ * GOSFS_FREE_LOG_BLOCKS, and the GOSFS_File's lock for a regular file.
+ */
+static int GOSFS_Shrink_File(struct GOSFS_Instance *instance, struct GOSFS_File *gfile, ulong_t numBlocks)
+{
+    struct GOSFS_Inode *inode = &gfile->inode;
+
+    while (gfile->numExtents > 0) {
+	struct GOSFS_File_Extent *ext = &gfile->extentList[gfile->numExtents - 1];
+	ulong_t count;
+
+	if (ext->fileBlock + ext->numBlocks <= numBlocks)
+	    break;
+	count = MIN(ext->numBlocks, ext->fileBlock + ext->numBlocks - numBlocks);
+	GOSFS_Free_Blocks(instance, ext->devBlock + ext->numBlocks - count, count);
+	ext->numBlocks -= count;
+	if (ext->numBlocks == 0)
+	    --gfile->numExtents;
+    }
+    if (inode->numBlocks > numBlocks)
+	inode->numBlocks = numBlocks;
+
+    if (gfile->numExtents <= GOSFS_NUM_DIRECT_EXTENTS && inode->extentBlock != 0) {
+	GOSFS_Free_Blocks(instance, inode->extentBlock, 1);
+	inode->extentBlock = 0;
+    }
+
+    return GOSFS_Update_Inode(instance, gfile);
+}
+
+/* ----------------------------------------------------------------------
+ * File operations
+ * ---------------------------------------------------------------------- */
+
+/*
+ * FStat function for GOSFS files.
+ */
+static int GOSFS_FStat(struct File *file, struct VFS_File_Stat *stat)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) file->mountPoint->fsData;
+    struct GOSFS_File *gfile = (struct GOSFS_File*) file->fsData;
+
+    Mutex_Lock(&instance->lock);
+    GOSFS_Copy_Stat(stat, &gfile->inode);
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * Read function for GOSFS files.
+ * Each page of the page cache holds one filesystem block.
+ */
+static int GOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct GOSFS_File *gfile = (struct GOSFS_File*) file->fsData;
+    struct Block_Device *dev = file->mountPoint->dev;
+    struct Cache_Page *pageList[GOSFS_BATCH_PAGES];
+    struct Block_Request *requestList[GOSFS_BATCH_PAGES];
+    ulong_t start = file->filePos;
+    ulong_t end = file->filePos + numBytes;
+    ulong_t pageIndex, endPage;
+    int rc = 0;
+
+    /* Special case: can't handle reads longer than INT_MAX */
+    if (numBytes > INT_MAX || end < start)
+	return EINVALID;
+
+    Mutex_Lock(&gfile->lock);
+
+    /*
+     * The file may have been written since it was opened.
+     * Reads stop at the end of the file.
+     */
+    file->endPos = gfile->inode.size;
+    if (start >= file->endPos) {
+	Mutex_Unlock(&gfile->lock);
+	return 0;
+    }
+    if (end > file->endPos) {
+	end = file->endPos;
+	numBytes = end - start;
+    }
+    endPage = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    /*
+     * Work through the pages a batch at a time: read all the
+     * blocks missing from the batch together, then copy the
+     * data to the caller's buffer.
+     */
+    for (pageIndex = start / PAGE_SIZE; pageIndex < endPage && rc == 0; ) {
+	int numPages = 0, numRequests = 0, rc2, i;
+
+	for (; pageIndex < endPage && numPages < GOSFS_BATCH_PAGES; ++pageIndex) {
+	    struct Cache_Page *page;
+	    ulong_t devBlock;
+
+	    rc = Get_Cache_Page(gfile, pageIndex, &page);
+	    if (rc != 0)
+		break;
+	    pageList[numPages++] = page;
+	    if (page->validMask == GOSFS_PAGE_VALID)
+		continue;
+	    rc = GOSFS_Map_Block(gfile, pageIndex, &devBlock);
+	    if (rc == 0)
+		rc = GOSFS_Submit_Block_IO(dev, BLOCK_READ, devBlock, page->data,
+		    requestList, &numRequests);
+	    if (rc != 0)
+		break;
+	}
+
+	rc2 = GOSFS_Wait_For_Block_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+
+	for (i = 0; i < numPages; ++i) {
+	    struct Cache_Page *page = pageList[i];
+
+	    if (rc == 0) {
+		ulong_t pageStart = page->index * PAGE_SIZE;
+		ulong_t from = MAX(start, pageStart);
+		ulong_t to = MIN(end, pageStart + PAGE_SIZE);
+
+		page->validMask = GOSFS_PAGE_VALID;
+		memcpy((char*) buf + (from - start), page->data + (from - pageStart), to - from);
+	    }
+	    Release_Cache_Page(page);
+	}
+    }
+    if (rc == 0)
+	file->filePos = end;
+    Mutex_Unlock(&gfile->lock);
+
+    return rc == 0 ? (int) numBytes : rc;
+}
+
+/*
+ * Write function for GOSFS files.
+ * Blocks are allocated in as few extents as possible, and the data
+ * is written through the page cache to the device before the new
+ * size is logged, so a committed size never covers unwritten data.
+ * The size and blocks are committed by GOSFS_Sync(), or when the
+ * file is closed.
+ */
+static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) file->mountPoint->fsData;
+    struct GOSFS_File *gfile = (struct GOSFS_File*) file->fsData;
+    struct Block_Device *dev = file->mountPoint->dev;
+    struct Cache_Page *pageList[GOSFS_BATCH_PAGES];
+    struct Block_Request *requestList[GOSFS_BATCH_PAGES];
+    ulong_t start = file->filePos;
+    ulong_t end = file->filePos + numBytes;
+    ulong_t startPage, endPage, pageIndex, oldBlocks, oldSize;
+    int rc = 0;
+
+    if (!(file->mode & O_WRITE))
+	return EACCESS;
+
+    /* Special case: can't handle writes longer than INT_MAX */
+    if (numBytes > INT_MAX || end < start)
+	return EINVALID;
+    if (numBytes == 0)
+	return 0;
+
+    startPage = start / PAGE_SIZE;
+    endPage = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    Mutex_Lock(&gfile->lock);
+
+    /* Allocate the blocks the write adds to the file */
+    oldBlocks = gfile->inode.numBlocks;
+    oldSize = gfile->inode.size;
+    Mutex_Lock(&instance->lock);
+    rc = GOSFS_Grow_File(instance, gfile, endPage);
+    Mutex_Unlock(&instance->lock);
+
+    /*
+     * Work through the pages a batch at a time: read in the blocks
+     * at either end that are only partly overwritten, copy the
+     * caller's data into the pages, then write them out together.
+     */
+    for (pageIndex = startPage; pageIndex < endPage && rc == 0; ) {
+	int numPages = 0, numRequests = 0, rc2, i;
+
+	for (; pageIndex < endPage && numPages < GOSFS_BATCH_PAGES; ++pageIndex) {
+	    struct Cache_Page *page;
+	    bool partial = (pageIndex == startPage && start % PAGE_SIZE != 0) ||
+		(pageIndex == endPage - 1 && end % PAGE_SIZE != 0);
+
+	    rc = Get_Cache_Page(gfile, pageIndex, &page);
+	    if (rc != 0)
+		break;
+	    pageList[numPages++] = page;
+	    if (!partial || page->validMask == GOSFS_PAGE_VALID)
+		continue;
+
+	    if (pageIndex < oldBlocks) {
+		ulong_t devBlock;
+
+		rc = GOSFS_Map_Block(gfile, pageIndex, &devBlock);
+		if (rc == 0)
+		    rc = GOSFS_Submit_Block_IO(dev, BLOCK_READ, devBlock, page->data,
+			requestList, &numRequests);
+		if (rc != 0)
+		    break;
+	    } else
+		memset(page->data, '\0', PAGE_SIZE);
+	}
+	rc2 = GOSFS_Wait_For_Block_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+
+	numRequests = 0;
+	for (i = 0; i < numPages && rc == 0; ++i) {
+	    struct Cache_Page *page = pageList[i];
+	    ulong_t pageStart = page->index * PAGE_SIZE;
+	    ulong_t from = MAX(start, pageStart);
+	    ulong_t to = MIN(end, pageStart + PAGE_SIZE);
+	    ulong_t devBlock;
+
+	    memcpy(page->data + (from - pageStart), (char*) buf + (from - start), to - from);
+	    page->validMask = GOSFS_PAGE_VALID;
+	    rc = GOSFS_Map_Block(gfile, page->index, &devBlock);
+	    if (rc == 0)
+		rc = GOSFS_Submit_Block_IO(dev, BLOCK_WRITE, devBlock, page->data,
+		    requestList, &numRequests);
+	}
+	rc2 = GOSFS_Wait_For_Block_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+
+	for (i = 0; i < numPages; ++i)
+	    Release_Cache_Page(pageList[i]);
+    }
+
+    Mutex_Lock(&instance->lock);
+    if (rc == 0 && end > oldSize) {
+	rc = GOSFS_Begin(instance, GOSFS_INODE_LOG_BLOCKS, 0);
+	if (rc == 0) {
+	    gfile->inode.size = end;
+	    rc = GOSFS_Update_Inode(instance, gfile);
+	    if (rc != 0)
+		gfile->inode.size = oldSize;
+	}
+    }
+    if (rc == 0) {
+	file->endPos = gfile->inode.size;
+	file->filePos = end;
+    } else if (gfile->inode.numBlocks > oldBlocks &&
+	       GOSFS_Begin(instance, GOSFS_FREE_LOG_BLOCKS(instance), 0) == 0) {
+	/* Give back the blocks allocated for the failed write */
+	GOSFS_Shrink_File(instance, gfile, oldBlocks);
+	Discard_Cache_Pages(gfile);
+    }
+    Mutex_Unlock(&instance->lock);
+    Mutex_Unlock(&gfile->lock);
+
+    return rc == 0 ? (int) numBytes : rc;
+}
+
+/*
+ * Seek function for GOSFS files.
+ * Seeking to the end of the file is allowed, to append to it.
+ */
+static int GOSFS_Seek(struct File *file, ulong_t pos)
+{
+    if (pos > file->endPos)
+	return EINVALID;
+    file->filePos = pos;
+    return 0;
+}
+
+/*
+ * Truncate function for GOSFS files.
+ * Files can only be made shorter.
+ */
+static int GOSFS_Truncate(struct File *file, ulong_t size)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) file->mountPoint->fsData;
+    struct GOSFS_File *gfile = (struct GOSFS_File*) file->fsData;
+    int rc = 0;
+
+    if (!(file->mode & O_WRITE))
+	return EACCESS;
+
+    Mutex_Lock(&gfile->lock);
+    if (size > gfile->inode.size)
+	rc = EINVALID;
+    else if (size < gfile->inode.size) {
+	/* Cached pages may hold data past the new end */
+	Discard_Cache_Pages(gfile);
+
+	Mutex_Lock(&instance->lock);
+	rc = GOSFS_Begin(instance, GOSFS_FREE_LOG_BLOCKS(instance), 0);
+	if (rc == 0) {
+	    gfile->inode.size = size;
+	    rc = GOSFS_Shrink_File(instance, gfile, (size + GOSFS_BLOCK_SIZE - 1) / GOSFS_BLOCK_SIZE);
+	}
+	Mutex_Unlock(&instance->lock);
+    }
+    file->endPos = gfile->inode.size;
+    if (file->filePos > file->endPos)
+	file->filePos = file->endPos;
+    Mutex_Unlock(&gfile->lock);
+
+    return rc;
+}
+
+static void GOSFS_Put_File(struct GOSFS_Instance *instance, struct GOSFS_File *gfile);
+
+/*
+ * Close function for GOSFS files.
+ */
+static int GOSFS_Close(struct File *file)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) file->mountPoint->fsData;
+    struct GOSFS_File *gfile = (struct GOSFS_File*) file->fsData;
+
+    /*
+     * Commit the file's new size and blocks.
+     * If that fails, the transaction stays pending,
+     * for the next Sync() to retry.
+     */
+    if ((file->mode & O_WRITE) && GOSFS_Sync(file->mountPoint) != 0)
+	Print("Error committing GOSFS metadata on close\n");
+
+    /*
+     * The GOSFS_File object and the cached contents of the file
+     * will remain for a while, to speed up future accesses
+     * to this file.
+     */
+    GOSFS_Put_File(instance, gfile);
+    return 0;
+}
+
+/*
+ * File_Ops for GOSFS files.
+ */
+static struct File_Ops s_gosfsFileOps = {
+    &GOSFS_FStat,
+    &GOSFS_Read,
+    &GOSFS_Write,
+    &GOSFS_Seek,
+    &GOSFS_Close,
+    0, /* Read_Entry */
+    &GOSFS_Truncate,
+};
+
+/* ----------------------------------------------------------------------
+ * Directories
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Hash a file name.
+ */
+static ulong_t GOSFS_Hash_Name(const char *name)
+{
+    ulong_t hash = 0;
+    int i;
+
+    for (i = 0; i <= GOSFS_MAX_NAME_LEN && name[i] != '\0'; ++i)
+	hash = hash * 31 + (uchar_t) name[i];
+    return hash;
+}
+
+/*
+ * Add the entry in given slot of a directory to its hash index.
+ */
+static void GOSFS_Hash_Slot(struct GOSFS_Dir *dir, int slot, ulong_t nameHash)
+{
+    int *chain = &dir->hash[nameHash & (dir->hashSize - 1)];
+
+    dir->nameHash[slot] = nameHash;
+    dir->hashNext[slot] = *chain;
+    *chain = slot;
+}
+
+/*
+ * Remove the entry in given slot of a directory from its hash index,
+ * leaving the slot free.
+ */
+static void GOSFS_Unhash_Slot(struct GOSFS_Dir *dir, int slot)
+{
+    int *link = &dir->hash[dir->nameHash[slot] & (dir->hashSize - 1)];
+
+    while (*link != slot) {
+	KASSERT(*link >= 0);
+	link = &dir->hashNext[*link];
+    }
+    *link = dir->hashNext[slot];
+    dir->hashNext[slot] = GOSFS_SLOT_FREE;
+}
+
+/*
+ * Size the hash table of a directory for its number of entries,
+ * and rebuild the chains.
+ */
+static int GOSFS_Rehash_Dir(struct GOSFS_Dir *dir)
+{
+    int hashSize = GOSFS_MIN_HASH_SIZE;
+    int *hash, i;
+
+    while (hashSize < dir->numUsed)
+	hashSize *= 2;
+    hash = (int*) Malloc(hashSize * sizeof(int));
+    if (hash == 0)
+	return ENOMEM;
+    for (i = 0; i < hashSize; ++i)
+	hash[i] = -1;
+
+    if (dir->hash != 0)
+	Free(dir->hash);
+    dir->hash = hash;
+    dir->hashSize = hashSize;
+
+    /* Insert backwards, so the first of any duplicate names is found first */
+    for (i = dir->numSlots - 1; i >= 0; --i) {
+	if (dir->hashNext[i] != GOSFS_SLOT_FREE)
+	    GOSFS_Hash_Slot(dir, i, dir->nameHash[i]);
+    }
+    return 0;
+}
+
+/*
+ * Make room in a directory index for maxSlots slots.
+ */
+static int GOSFS_Reserve_Slots(struct GOSFS_Dir *dir, int maxSlots)
+{
+    int *hashNext;
+    ulong_t *nameHash;
+
+    if (maxSlots <= dir->maxSlots)
+	return 0;
+    maxSlots = MAX(maxSlots, dir->maxSlots * 2);
+
+    hashNext = (int*) Malloc(maxSlots * sizeof(int));
+    nameHash = (ulong_t*) Malloc(maxSlots * sizeof(ulong_t));
+    if (hashNext == 0 || nameHash == 0) {
+	if (hashNext != 0)
+	    Free(hashNext);
+	if (nameHash != 0)
+	    Free(nameHash);
+	return ENOMEM;
+    }
+
+    if (dir->hashNext != 0) {
+	memcpy(hashNext, dir->hashNext, dir->numSlots * sizeof(int));
+	memcpy(nameHash, dir->nameHash, dir->numSlots * sizeof(ulong_t));
+	Free(dir->hashNext);
+	Free(dir->nameHash);
+    }
+    dir->hashNext = hashNext;
+    dir->nameHash = nameHash;
+    dir->maxSlots = maxSlots;
+    return 0;
+}
+
+/*
+ * Free a directory index.
+ */
+static void GOSFS_Free_Dir(struct GOSFS_Dir *dir)
+{
+    if (dir->hash != 0)
+	Free(dir->hash);
+    if (dir->hashNext != 0)
+	Free(dir->hashNext);
+    if (dir->nameHash != 0)
+	Free(dir->nameHash);
+    Free(dir);
+}
+
+/*
+ * Get the buffer holding given slot of a directory.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Get_Slot(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile, int slot,
+    struct FS_Buffer **pBuf, struct GOSFS_Dir_Entry **pEntry)
+{
+    ulong_t devBlock;
+    int rc;
+
+    if ((rc = GOSFS_Map_Block(dirFile, slot / GOSFS_DIR_ENTRIES_PER_BLOCK, &devBlock)) != 0)
+	return rc;
+    if ((rc = Get_FS_Buffer(instance->fsCache, devBlock, pBuf)) != 0)
+	return rc;
+    *pEntry = (struct GOSFS_Dir_Entry*) (*pBuf)->data + slot % GOSFS_DIR_ENTRIES_PER_BLOCK;
+    return 0;
+}
+
+/*
+ * Build the index of a directory, reading each of its blocks once.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Index_Dir(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile)
+{
+    struct GOSFS_Dir *dir;
+    ulong_t block;
+    int rc, i;
+
+    dir = (struct GOSFS_Dir*) Malloc(sizeof(*dir));
+    if (dir == 0)
+	return ENOMEM;
+    memset(dir, '\0', sizeof(*dir));
+
+    dir->numSlots = dirFile->inode.numBlocks * GOSFS_DIR_ENTRIES_PER_BLOCK;
+    dir->firstFree = dir->numSlots;
+    rc = GOSFS_Reserve_Slots(dir, MAX(dir->numSlots, (int) GOSFS_DIR_ENTRIES_PER_BLOCK));
+
+    for (block = 0; block < dirFile->inode.numBlocks && rc == 0; ++block) {
+	struct FS_Buffer *buf;
+	struct GOSFS_Dir_Entry *entries;
+
+	if ((rc = GOSFS_Get_Slot(instance, dirFile, block * GOSFS_DIR_ENTRIES_PER_BLOCK,
+		&buf, &entries)) != 0)
+	    break;
+	for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	    int slot = block * GOSFS_DIR_ENTRIES_PER_BLOCK + i;
+
+	    if (entries[i].inode != 0) {
+		dir->nameHash[slot] = GOSFS_Hash_Name(entries[i].name);
+		dir->hashNext[slot] = -1;
+		++dir->numUsed;
+	    } else {
+		dir->hashNext[slot] = GOSFS_SLOT_FREE;
+		if (slot < dir->firstFree)
+		    dir->firstFree = slot;
+	    }
+	}
+	Release_FS_Buffer(instance->fsCache, buf);
+    }
+
+    if (rc == 0)
+	rc = GOSFS_Rehash_Dir(dir);
+    if (rc != 0) {
+	GOSFS_Free_Dir(dir);
+	return rc;
+    }
+
+    Debug("Indexed directory inode %lu: %d of %d slots used\n",
+	dirFile->inodeNum, dir->numUsed, dir->numSlots);
+    dirFile->dir = dir;
+    return 0;
+}
+
+/*
+ * Find the entry with given name in a directory.
+ * Only the entries whose names have the same hash are read.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Find_Dir_Entry(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile,
+    const char *name, int *pSlot, ulong_t *pInodeNum)
+{
+    struct GOSFS_Dir *dir = dirFile->dir;
+    ulong_t nameHash = GOSFS_Hash_Name(name);
+    int slot;
+
+    for (slot = dir->hash[nameHash & (dir->hashSize - 1)]; slot >= 0; slot = dir->hashNext[slot]) {
+	struct FS_Buffer *buf;
+	struct GOSFS_Dir_Entry *entry;
+	bool match;
+	int rc;
+
+	if (dir->nameHash[slot] != nameHash)
+	    continue;
+	if ((rc = GOSFS_Get_Slot(instance, dirFile, slot, &buf, &entry)) != 0)
+	    return rc;
+	match = (strncmp(entry->name, name, sizeof(entry->name)) == 0);
+	if (match)
+	    *pInodeNum = entry->inode;
+	Release_FS_Buffer(instance->fsCache, buf);
+
+	if (match) {
+	    *pSlot = slot;
+	    return 0;
+	}
+    }
+    return ENOTFOUND;
+}
+
+/*
+ * Add an entry to a directory, in its first free slot.
+ * A full directory grows by a block.
+ * Called with the instance lock held, in an operation with
+ * room for GOSFS_CREATE_LOG_BLOCKS.
+ */
+static int GOSFS_Add_Dir_Entry(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile,
+    const char *name, ulong_t inodeNum)
+{
+    struct GOSFS_Dir *dir = dirFile->dir;
+    struct FS_Buffer *buf;
+    struct GOSFS_Dir_Entry *entry;
+    int slot, rc, i;
+
+    for (slot = dir->firstFree; slot < dir->numSlots; ++slot) {
+	if (dir->hashNext[slot] == GOSFS_SLOT_FREE)
+	    break;
+    }
+
+    if (slot == dir->numSlots) {
+	ulong_t devBlock;
+
+	if ((rc = GOSFS_Reserve_Slots(dir, dir->numSlots + GOSFS_DIR_ENTRIES_PER_BLOCK)) != 0 ||
+	    (rc = GOSFS_Grow_File(instance, dirFile, dirFile->inode.numBlocks + 1)) != 0 ||
+	    (rc = GOSFS_Map_Block(dirFile, dirFile->inode.numBlocks - 1, &devBlock)) != 0 ||
+	    (rc = Get_FS_Buffer(instance->fsCache, devBlock, &buf)) != 0)
+	    return rc;
+	memset(buf->data, '\0', GOSFS_BLOCK_SIZE);
+	GOSFS_Log_Buffer(instance, buf);
+
+	for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i)
+	    dir->hashNext[dir->numSlots + i] = GOSFS_SLOT_FREE;
+	dir->numSlots += GOSFS_DIR_ENTRIES_PER_BLOCK;
+	dirFile->inode.size = dirFile->inode.numBlocks * GOSFS_BLOCK_SIZE;
+	if ((rc = GOSFS_Update_Inode(instance, dirFile)) != 0)
+	    return rc;
+    }
+
+    if ((rc = GOSFS_Get_Slot(instance, dirFile, slot, &buf, &entry)) != 0)
+	return rc;
+    memset(entry, '\0', sizeof(*entry));
+    entry->inode = inodeNum;
+    strcpy(entry->name, name);
+    GOSFS_Log_Buffer(instance, buf);
+
+    GOSFS_Hash_Slot(dir, slot, GOSFS_Hash_Name(name));
+    ++dir->numUsed;
+    dir->firstFree = slot + 1;
+
+    /* Keep the chains short; if there's no memory, long chains still work */
+    if (dir->numUsed > 2 * dir->hashSize)
+	GOSFS_Rehash_Dir(dir);
+
+    return 0;
+}
+
+/*
+ * Remove the entry in given slot of a directory.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Remove_Dir_Entry(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile, int slot)
+{
+    struct GOSFS_Dir *dir = dirFile->dir;
+    struct FS_Buffer *buf;
+    struct GOSFS_Dir_Entry *entry;
+    int rc;
+
+    if ((rc = GOSFS_Get_Slot(instance, dirFile, slot, &buf, &entry)) != 0)
+	return rc;
+    memset(entry, '\0', sizeof(*entry));
+    GOSFS_Log_Buffer(instance, buf);
+
+    GOSFS_Unhash_Slot(dir, slot);
+    --dir->numUsed;
+    if (slot < dir->firstFree)
+	dir->firstFree = slot;
+    return 0;
+}
+
+/*
+ * FStat function for GOSFS directories.
+ */
+static int GOSFS_FStat_Dir(struct File *dir, struct VFS_File_Stat *stat)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) dir->mountPoint->fsData;
+    struct GOSFS_File *dirFile = (struct GOSFS_File*) dir->fsData;
+
+    Mutex_Lock(&instance->lock);
+    GOSFS_Copy_Stat(stat, &dirFile->inode);
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * Close function for GOSFS directories.
+ */
+static int GOSFS_Close_Dir(struct File *dir)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) dir->mountPoint->fsData;
+    struct GOSFS_File *dirFile = (struct GOSFS_File*) dir->fsData;
+
+    /* The directory stays in memory; it just may be deleted again. */
+    Mutex_Lock(&instance->lock);
+    KASSERT(dirFile->refCount > 0);
+    --dirFile->refCount;
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * Read a directory entry.
+ * filePos is the next slot to look at.
+ */
+static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) dir->mountPoint->fsData;
+    struct GOSFS_File *dirFile = (struct GOSFS_File*) dir->fsData;
+    struct GOSFS_Dir *index = dirFile->dir;
+    struct FS_Buffer *buf;
+    struct GOSFS_Dir_Entry *dirEntry;
+    struct GOSFS_Inode inode;
+    ulong_t inodeNum;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+
+    /* Skip free slots; the directory may have grown. */
+    dir->endPos = index->numSlots;
+    while (dir->filePos < dir->endPos && index->hashNext[dir->filePos] == GOSFS_SLOT_FREE)
+	++dir->filePos;
+    if (dir->filePos >= dir->endPos) {
+	Mutex_Unlock(&instance->lock);
+	return VFS_NO_MORE_DIR_ENTRIES; /* Reached the end of the directory. */
+    }
+
+    rc = GOSFS_Get_Slot(instance, dirFile, dir->filePos, &buf, &dirEntry);
+    if (rc == 0) {
+	memcpy(entry->name, dirEntry->name, sizeof(dirEntry->name));
+	entry->name[GOSFS_MAX_NAME_LEN] = '\0';
+	inodeNum = dirEntry->inode;
+	Release_FS_Buffer(instance->fsCache, buf);
+	rc = GOSFS_Read_Inode(instance, inodeNum, &inode);
+    }
+    if (rc == 0) {
+	GOSFS_Copy_Stat(&entry->stats, &inode);
+	++dir->filePos;
+    }
+
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * File_Ops for GOSFS directories.
+ */
+static struct File_Ops s_gosfsDirOps = {
+    &GOSFS_FStat_Dir,
+    0, /* Read */
+    0, /* Write */
+    0, /* Seek */
+    &GOSFS_Close_Dir,
+    &GOSFS_Read_Entry,
+    0, /* Truncate */
+};
+
+/* ----------------------------------------------------------------------
+ * GOSFS_File objects
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Free a GOSFS_File object, its extent list and directory index,
+ * and its cached pages.
+ */
+static void GOSFS_Free_File(struct GOSFS_File *gfile)
+{
+    KASSERT(gfile->refCount == 0);
+
+    Discard_Cache_Pages(gfile);
+    if (gfile->dir != 0)
+	GOSFS_Free_Dir(gfile->dir);
+    if (gfile->extentList != 0)
+	Free(gfile->extentList);
+    Free(gfile);
+}
+
+/*
+ * Read the inode and extents of a file or directory
+ * into a new GOSFS_File object.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Read_File(struct GOSFS_Instance *instance, ulong_t inodeNum, struct GOSFS_File **pFile)
+{
+    struct GOSFS_File *gfile;
+    struct GOSFS_Inode *inode;
+    struct FS_Buffer *buf = 0;
+    ulong_t fileBlock = 0;
+    int i, rc;
+
+    gfile = (struct GOSFS_File*) Malloc(sizeof(*gfile));
+    if (gfile == 0)
+	return ENOMEM;
+    memset(gfile, '\0', sizeof(*gfile));
+    gfile->inodeNum = inodeNum;
+    Mutex_Init(&gfile->lock);
+    inode = &gfile->inode;
+
+    if ((rc = GOSFS_Read_Inode(instance, inodeNum, inode)) != 0)
+	goto fail;
+    if (inode->type == 0 || inode->numExtents > GOSFS_MAX_EXTENTS ||
+	(inode->numExtents > GOSFS_NUM_DIRECT_EXTENTS && inode->extentBlock == 0)) {
+	Print("GOSFS: invalid inode %lu\n", inodeNum);
+	rc = EIO;  /* probable filesystem corruption */
+	goto fail;
+    }
+
+    if (inode->numExtents > 0) {
+	gfile->extentList = (struct GOSFS_File_Extent*)
+	    Malloc(inode->numExtents * sizeof(*gfile->extentList));
+	if (gfile->extentList == 0) {
+	    rc = ENOMEM;
+	    goto fail;
+	}
+	gfile->maxExtents = inode->numExtents;
+    }
+    if (inode->numExtents > GOSFS_NUM_DIRECT_EXTENTS &&
+	(rc = Get_FS_Buffer(instance->fsCache, inode->extentBlock, &buf)) != 0)
+	goto fail;
+
+    for (i = 0; i < inode->numExtents; ++i) {
+	struct GOSFS_Extent *src = (i < GOSFS_NUM_DIRECT_EXTENTS)
+	    ? &inode->extents[i]
+	    : (struct GOSFS_Extent*) buf->data + (i - GOSFS_NUM_DIRECT_EXTENTS);
+	struct GOSFS_File_Extent *ext = &gfile->extentList[i];
+
+	ext->fileBlock = fileBlock;
+	ext->devBlock = src->start;
+	ext->numBlocks = src->length;
+	fileBlock += src->length;
+    }
+    gfile->numExtents = inode->numExtents;
+    if (buf != 0)
+	Release_FS_Buffer(instance->fsCache, buf);
+
+    if (fileBlock != inode->numBlocks) {
+	Print("GOSFS: extents of inode %lu don't match its size\n", inodeNum);
+	rc = EIO;  /* probable filesystem corruption */
+	goto fail;
+    }
+
+    Debug("Inode %lu has %u blocks in %d extents\n", inodeNum, inode->numBlocks, gfile->numExtents);
+    *pFile = gfile;
+    return 0;
+
+fail:
+    GOSFS_Free_File(gfile);
+    return rc;
+}
+
+/*
+ * Get a GOSFS_File object for the regular file with given inode.
+ * It must be returned with GOSFS_Put_File(), or GOSFS_Release_File()
+ * with the instance lock held.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Get_File(struct GOSFS_Instance *instance, ulong_t inodeNum, struct GOSFS_File **pFile)
+{
+    struct GOSFS_File *gfile;
+    int rc;
+
+    KASSERT(IS_HELD(&instance->lock));
+
+    /*
+     * See if this file has already been opened.
+     * If so, use the existing GOSFS_File object.
+     */
+    for (gfile = Get_Front_Of_GOSFS_File_List(&instance->fileList);
+	 gfile != 0;
+	 gfile = Get_Next_In_GOSFS_File_List(gfile)) {
+	if (gfile->inodeNum == inodeNum)
+	    break;
+    }
+
+    if (gfile != 0) {
+	if (gfile->refCount++ == 0)
+	    --instance->numIdleFiles;
+    } else {
+	if ((rc = GOSFS_Read_File(instance, inodeNum, &gfile)) != 0)
+	    return rc;
+	if (gfile->inode.type != GOSFS_INODE_FILE) {
+	    GOSFS_Free_File(gfile);
+	    return EACCESS;
+	}
+	gfile->refCount = 1;
+	Add_To_Back_Of_GOSFS_File_List(&instance->fileList, gfile);
+    }
+
+    *pFile = gfile;
+    return 0;
+}
+
+/*
+ * Return a GOSFS_File object obtained from GOSFS_Get_File().
+ * Once no File uses it, it is kept idle in case the file is
+ * opened again, until there are too many idle files.
+ * Called with the instance lock held.
+ */
+static void GOSFS_Release_File(struct GOSFS_Instance *instance, struct GOSFS_File *gfile)
+{
+    KASSERT(gfile->refCount > 0);
+    if (--gfile->refCount == 0) {
+	/* Idle files are kept at the back, in the order they were closed */
+	Remove_From_GOSFS_File_List(&instance->fileList, gfile);
+	Add_To_Back_Of_GOSFS_File_List(&instance->fileList, gfile);
+	++instance->numIdleFiles;
+    }
+
+    /* Reclaim the files idle the longest */
+    while (instance->numIdleFiles > GOSFS_MAX_IDLE_FILES) {
+	struct GOSFS_File *idle = Get_Front_Of_GOSFS_File_List(&instance->fileList);
+
+	while (idle->refCount > 0)
+	    idle = Get_Next_In_GOSFS_File_List(idle);
+	Debug("Reclaiming idle file inode %lu\n", idle->inodeNum);
+	Remove_From_GOSFS_File_List(&instance->fileList, idle);
+	--instance->numIdleFiles;
+	GOSFS_Free_File(idle);
+    }
+}
+
+/*
+ * Return a GOSFS_File object obtained from GOSFS_Get_File(),
+ * without the instance lock held.
+ */
+static void GOSFS_Put_File(struct GOSFS_Instance *instance, struct GOSFS_File *gfile)
+{
+    Mutex_Lock(&instance->lock);
+    GOSFS_Release_File(instance, gfile);
+    Mutex_Unlock(&instance->lock);
+}
+
+/*
+ * Get the GOSFS_File object of the directory with given inode,
+ * with its index.  Directories are kept in memory while the
+ * filesystem is mounted, once a path has led through them.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Get_Dir(struct GOSFS_Instance *instance, ulong_t inodeNum, struct GOSFS_File **pDir)
+{
+    struct GOSFS_File *dirFile;
+    int rc;
+
+    for (dirFile = Get_Front_Of_GOSFS_File_List(&instance->dirList);
+	 dirFile != 0;
+	 dirFile = Get_Next_In_GOSFS_File_List(dirFile)) {
+	if (dirFile->inodeNum == inodeNum) {
+	    *pDir = dirFile;
+	    return 0;
+	}
+    }
+
+    if ((rc = GOSFS_Read_File(instance, inodeNum, &dirFile)) != 0)
+	return rc;
+    if (dirFile->inode.type != GOSFS_INODE_DIRECTORY)
+	rc = ENOTDIR;
+    else
+	rc = GOSFS_Index_Dir(instance, dirFile);
+    if (rc != 0) {
+	GOSFS_Free_File(dirFile);
+	return rc;
+    }
+
+    Add_To_Back_Of_GOSFS_File_List(&instance->dirList, dirFile);
+    *pDir = dirFile;
+    return 0;
+}
+
+/*
+ * Look up a path, one component at a time.
+ * On success, *pInodeNum is the inode of the file, whose entry is
+ * in given slot of directory *pDir, or is the root directory if
+ * *pDir is 0.  If only the last component is missing, ENOTFOUND
+ * is returned with *pDir set to the directory it would be in.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Lookup(struct GOSFS_Instance *instance, const char *path,
+    struct GOSFS_File **pDir, int *pSlot, ulong_t *pInodeNum)
+{
+    ulong_t inodeNum = GOSFS_ROOT_INODE;
+    char name[GOSFS_MAX_NAME_LEN + 1];
+
+    KASSERT(*path == '/');
+    *pDir = 0;
+    *pSlot = -1;
+    *pInodeNum = inodeNum;
+
+    /* Special case: root directory. */
+    if (strcmp(path, "/") == 0)
+	return 0;
+
+    for (;;) {
+	struct GOSFS_File *dir;
+	const char *end;
+	int len, slot = -1, rc;
+
+	if ((rc = GOSFS_Get_Dir(instance, inodeNum, &dir)) != 0)
+	    return rc;
+
+	/* Skip '/' character, and find the next one. */
+	++path;
+	end = strchr(path, '/');
+	len = (end != 0) ? end - path : strlen(path);
+
+	if (len > 0 && len < sizeof(name)) {
+	    memcpy(name, path, len);
+	    name[len] = '\0';
+	    rc = GOSFS_Find_Dir_Entry(instance, dir, name, &slot, &inodeNum);
+	} else
+	    rc = ENOTFOUND;
+
+	if (end == 0) {
+	    *pDir = dir;
+	    if (rc == 0) {
+		*pSlot = slot;
+		*pInodeNum = inodeNum;
+	    }
+	    return rc;
+	}
+	if (rc != 0)
+	    return rc;
+	path = end;
+    }
+}
+
+/*
+ * Create a file or directory with given name in a directory.
+ * Called with the instance lock held.
+ */
+static int GOSFS_Create(struct GOSFS_Instance *instance, struct GOSFS_File *dirFile,
+    const char *name, int type, ulong_t *pInodeNum)
+{
+    struct GOSFS_Inode inode;
+    ulong_t inodeNum;
+    int rc;
+
+    if (*name == '\0')
+	return ENOTFOUND;
+    if (strlen(name) > GOSFS_MAX_NAME_LEN)
+	return ENAMETOOLONG;
+
+    /* A new directory block, and the extent block it may need */
+    if ((rc = GOSFS_Begin(instance, GOSFS_CREATE_LOG_BLOCKS, 2)) != 0)
+	return rc;
+    if ((rc = GOSFS_Alloc_Inode(instance, &inodeNum)) != 0)
+	return rc;
+
+    memset(&inode, '\0', sizeof(inode));
+    inode.type = type;
+    if ((rc = GOSFS_Write_Inode(instance, inodeNum, &inode)) != 0 ||
+	(rc = GOSFS_Add_Dir_Entry(instance, dirFile, name, inodeNum)) != 0) {
+	GOSFS_Free_Inode(instance, inodeNum);
+	return rc;
+    }
+
+    Debug("Created inode %lu for %s\n", inodeNum, name);
+    *pInodeNum = inodeNum;
+    return 0;
+}
+
+/* ----------------------------------------------------------------------
+ * Mount point operations
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Open function for GOSFS filesystems.
+ */
+static int GOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    struct GOSFS_File *dir, *gfile;
+    struct File *file;
+    ulong_t inodeNum;
+    int slot, rc;
+
+    Mutex_Lock(&instance->lock);
+
+    /* Look up the file, creating it if requested */
+    rc = GOSFS_Lookup(instance, path, &dir, &slot, &inodeNum);
+    if (rc == ENOTFOUND && dir != 0 && (mode & O_CREATE))
+	rc = GOSFS_Create(instance, dir, strrchr(path, '/') + 1, GOSFS_INODE_FILE, &inodeNum);
+    else if (rc == 0 && (mode & O_CREATE) && (mode & O_EXCL))
+	rc = EEXIST;
+    if (rc != 0)
+	goto done;
+
+    /* Get GOSFS_File object; directories can't be opened this way */
+    if ((rc = GOSFS_Get_File(instance, inodeNum, &gfile)) != 0)
+	goto done;
+
+    /* Create the file object. */
+    file = Allocate_File(&s_gosfsFileOps, 0, gfile->inode.size, gfile, mode, mountPoint);
+    if (file == 0) {
+	GOSFS_Release_File(instance, gfile);
+	rc = ENOMEM;
+	goto done;
+    }
+
+    /* Success! */
+    *pFile = file;
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Create_Directory function for GOSFS filesystems.
+ * The new directory is empty, and has no blocks until
+ * something is created in it.
+ */
+static int GOSFS_Create_Directory(struct Mount_Point *mountPoint, const char *path)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    struct GOSFS_File *dir;
+    ulong_t inodeNum;
+    int slot, rc;
+
+    Mutex_Lock(&instance->lock);
+
+    rc = GOSFS_Lookup(instance, path, &dir, &slot, &inodeNum);
+    if (rc == 0)
+	rc = EEXIST;
+    else if (rc == ENOTFOUND && dir != 0)
+	rc = GOSFS_Create(instance, dir, strrchr(path, '/') + 1, GOSFS_INODE_DIRECTORY, &inodeNum);
+
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Open_Directory function for GOSFS filesystems.
+ */
+static int GOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path, struct File **pDir)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    struct GOSFS_File *parent, *dirFile;
+    struct File *dir;
+    ulong_t inodeNum;
+    int slot, rc;
+
+    Mutex_Lock(&instance->lock);
+
+    rc = GOSFS_Lookup(instance, path, &parent, &slot, &inodeNum);
+    if (rc == 0)
+	rc = GOSFS_Get_Dir(instance, inodeNum, &dirFile);
+    if (rc != 0)
+	goto done;
+
+    dir = Allocate_File(&s_gosfsDirOps, 0, dirFile->dir->numSlots, dirFile, 0, mountPoint);
+    if (dir == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
+    ++dirFile->refCount;
+
+    *pDir = dir;
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Stat function for GOSFS filesystems.
+ */
+static int GOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct VFS_File_Stat *stat)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    struct GOSFS_File *dir;
+    struct GOSFS_Inode inode;
+    ulong_t inodeNum;
+    int slot, rc;
+
+    KASSERT(path != 0);
+    KASSERT(stat != 0);
+
+    Mutex_Lock(&instance->lock);
+    rc = GOSFS_Lookup(instance, path, &dir, &slot, &inodeNum);
+    if (rc == 0)
+	rc = GOSFS_Read_Inode(instance, inodeNum, &inode);
+    if (rc == 0)
+	GOSFS_Copy_Stat(stat, &inode);
+    Mutex_Unlock(&instance->lock);
+
+    return rc;
+}
+
+/*
+ * Sync function for GOSFS filesystems.
+ * File data is written as it changes; this commits the
+ * current transaction.
+ */
+static int GOSFS_Sync(struct Mount_Point *mountPoint)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+    rc = GOSFS_Commit(instance);
+    Mutex_Unlock(&instance->lock);
+
+    return rc;
+}
+
+/*
+ * Delete function for GOSFS filesystems.
+ * Open files, and directories which are open or not empty,
+ * can't be deleted.
+ */
+static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
+{
+    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) mountPoint->fsData;
+    struct GOSFS_File *dir, *gfile;
+    struct GOSFS_Inode inode;
+    ulong_t inodeNum;
+    int slot, rc;
+
+    Mutex_Lock(&instance->lock);
+
+    rc = GOSFS_Lookup(instance, path, &dir, &slot, &inodeNum);
+    if (rc != 0)
+	goto done;
+    if (dir == 0) {
+	rc = EACCESS;  /* the root directory */
+	goto done;
+    }
+    if ((rc = GOSFS_Read_Inode(instance, inodeNum, &inode)) != 0)
+	goto done;
+
+    if (inode.type == GOSFS_INODE_DIRECTORY) {
+	if ((rc = GOSFS_Get_Dir(instance, inodeNum, &gfile)) != 0)
+	    goto done;
+	if (gfile->dir->numUsed > 0 || gfile->refCount > 0) {
+	    rc = EBUSY;
+	    goto done;
+	}
+	Remove_From_GOSFS_File_List(&instance->dirList, gfile);
+    } else {
+	/* Use the file's GOSFS_File object if it has one, unless it is in use */
+	for (gfile = Get_Front_Of_GOSFS_File_List(&instance->fileList);
+	     gfile != 0;
+	     gfile = Get_Next_In_GOSFS_File_List(gfile)) {
+	    if (gfile->inodeNum == inodeNum)
+		break;
+	}
+	if (gfile != 0) {
+	    if (gfile->refCount > 0) {
+		rc = EBUSY;
+		goto done;
+	    }
+	    Remove_From_GOSFS_File_List(&instance->fileList, gfile);
+	    --instance->numIdleFiles;
+	} else if ((rc = GOSFS_Read_File(instance, inodeNum, &gfile)) != 0)
+	    goto done;
+    }
+
+    /* Free the blocks, the directory entry and the inode together */
+    rc = GOSFS_Begin(instance, GOSFS_FREE_LOG_BLOCKS(instance), 0);
+    if (rc == 0)
+	rc = GOSFS_Shrink_File(instance, gfile, 0);
+    if (rc == 0)
+	rc = GOSFS_Remove_Dir_Entry(instance, dir, slot);
+    if (rc == 0) {
+	memset(&gfile->inode, '\0', sizeof(gfile->inode));
+	rc = GOSFS_Write_Inode(instance, inodeNum, &gfile->inode);
+    }
+    if (rc == 0) {
+	GOSFS_Free_Inode(instance, inodeNum);
+	Debug("Deleted inode %lu\n", inodeNum);
+    }
+    GOSFS_Free_File(gfile);
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Mount_Point_Ops for GOSFS filesystem.
+ */
+struct Mount_Point_Ops s_gosfsMountPointOps = {
+    GOSFS_Open,
+    GOSFS_Create_Directory,
+    GOSFS_Open_Directory,
+    GOSFS_Stat,
+    GOSFS_Sync,
+    GOSFS_Delete
+};
+
+/* ----------------------------------------------------------------------
+ * Filesystem operations
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Format function for GOSFS filesystem.
+ * The superblock is written last, so a device which
+ * couldn't be formatted isn't taken for a GOSFS filesystem.
+ */
+static int GOSFS_Format(struct Block_Device *dev)
+{
+    struct GOSFS_Superblock super;
+    struct GOSFS_Inode *root;
+    char *block;
+    ulong_t i;
+    int rc = 0;
+
+    GOSFS_Init_Superblock(&super, Get_Num_Blocks(dev) / GOSFS_SECTORS_PER_BLOCK);
+    if (super.numBlocks < super.dataStart + GOSFS_MIN_DATA_BLOCKS)
+	return ENOSPACE;
+
+    block = (char*) Malloc(GOSFS_BLOCK_SIZE);
+    if (block == 0)
+	return ENOMEM;
+
+    /* Empty journal, and the inode table with just the root directory */
+    memset(block, '\0', GOSFS_BLOCK_SIZE);
+    rc = GOSFS_Write_Block(dev, super.journalStart, block);
+    for (i = 1; i < super.inodeBlocks && rc == 0; ++i)
+	rc = GOSFS_Write_Block(dev, super.inodeStart + i, block);
+    if (rc == 0) {
+	root = (struct GOSFS_Inode*) block + GOSFS_ROOT_INODE;
+	root->type = GOSFS_INODE_DIRECTORY;
+	rc = GOSFS_Write_Block(dev, super.inodeStart, block);
+    }
+
+    /* The blocks holding the filesystem itself are in use, as are inodes 0 and 1 */
+    for (i = 0; i < super.bitmapBlocks && rc == 0; ++i) {
+	GOSFS_Init_Bitmap_Block((uchar_t*) block, i, super.dataStart, super.numBlocks);
+	rc = GOSFS_Write_Block(dev, super.bitmapStart + i, block);
+    }
+    for (i = 0; i < super.inodeBitmapBlocks && rc == 0; ++i) {
+	GOSFS_Init_Bitmap_Block((uchar_t*) block, i, GOSFS_ROOT_INODE + 1, super.numInodes);
+	rc = GOSFS_Write_Block(dev, super.inodeBitmapStart + i, block);
+    }
+
+    if (rc == 0) {
+	memset(block, '\0', GOSFS_BLOCK_SIZE);
+	memcpy(block, &super, sizeof(super));
+	rc = GOSFS_Write_Block(dev, 0, block);
+    }
+
+    Free(block);
+    return rc;
+}
+
+/*
+ * Mount function for GOSFS filesystem.
+ */
+static int GOSFS_Mount(struct Mount_Point *mountPoint)
+{
+    struct Block_Device *dev = mountPoint->dev;
+    struct GOSFS_Instance *instance = 0;
+    struct GOSFS_Superblock *super, expected;
+    ulong_t i;
+    int rc;
+
+    /* Allocate instance. */
+    instance = (struct GOSFS_Instance*) Malloc(sizeof(*instance));
+    if (instance == 0)
+	goto memfail;
+    memset(instance, '\0', sizeof(*instance));
+    super = &instance->super;
+    instance->dev = dev;
+
+    instance->journalHeader = (struct GOSFS_Journal_Header*) Malloc(GOSFS_BLOCK_SIZE);
+    if (instance->journalHeader == 0)
+	goto memfail;
+
+    /* Read the superblock, into the journal header's buffer for now */
+    if ((rc = GOSFS_Read_Block(dev, 0, instance->journalHeader)) != 0)
+	goto fail;
+    memcpy(super, instance->journalHeader, sizeof(*super));
+
+    /* Does magic number match? */
+    if (super->magic != GOSFS_MAGIC) {
+	Print("Bad magic number (%x) for GOSFS filesystem\n", super->magic);
+	goto invalidfs;
+    }
+
+    /* Is the layout the one Format() would have made? */
+    GOSFS_Init_Superblock(&expected, super->numBlocks);
+    if (memcmp(&expected, super, sizeof(expected)) != 0 ||
+	super->numBlocks > Get_Num_Blocks(dev) / GOSFS_SECTORS_PER_BLOCK) {
+	Print("Invalid parameters for GOSFS filesystem\n");
+	goto invalidfs;
+    }
+
+    /* Finish the last transaction, if it was committed */
+    if ((rc = GOSFS_Replay_Journal(instance)) != 0)
+	goto fail;
+
+    /* Metadata blocks are read through the buffer cache */
+    instance->fsCache = Create_FS_Buffer_Cache(dev, GOSFS_BLOCK_SIZE);
+    if (instance->fsCache == 0)
+	goto memfail;
+
+    /* Read the bitmaps */
+    instance->bitmap = Malloc(super->bitmapBlocks * GOSFS_BLOCK_SIZE);
+    instance->allocMap = Malloc(super->bitmapBlocks * GOSFS_BLOCK_SIZE);
+    instance->inodeMap = Malloc(super->inodeBitmapBlocks * GOSFS_BLOCK_SIZE);
+    if (instance->bitmap == 0 || instance->allocMap == 0 || instance->inodeMap == 0)
+	goto memfail;
+    if ((rc = Block_Read_Range(dev, super->bitmapStart * GOSFS_SECTORS_PER_BLOCK,
+	    super->bitmapBlocks * GOSFS_SECTORS_PER_BLOCK, instance->bitmap)) != 0 ||
+	(rc = Block_Read_Range(dev, super->inodeBitmapStart * GOSFS_SECTORS_PER_BLOCK,
+	    super->inodeBitmapBlocks * GOSFS_SECTORS_PER_BLOCK, instance->inodeMap)) != 0)
+	goto fail;
+    memcpy(instance->allocMap, instance->bitmap, super->bitmapBlocks * GOSFS_BLOCK_SIZE);
+    for (i = super->dataStart; i < super->numBlocks; ++i) {
+	if (!Is_Bit_Set(instance->bitmap, i))
+	    ++instance->numFreeBlocks;
+    }
+    Debug("%lu free blocks\n", instance->numFreeBlocks);
+
+    /* Initialize instance lock, and GOSFS_File lists. */
+    Mutex_Init(&instance->lock);
+    Clear_GOSFS_File_List(&instance->fileList);
+    Clear_GOSFS_File_List(&instance->dirList);
+
+    /*
+     * Success!
+     * This mount point is now ready
+     * to handle file accesses.
+     */
+    mountPoint->ops = &s_gosfsMountPointOps;
+    mountPoint->fsData = instance;
+    return 0;
+
+memfail:
+    rc = ENOMEM; goto fail;
+invalidfs:
+    rc = EINVALIDFS; goto fail;
+fail:
+    if (instance != 0) {
+	if (instance->journalHeader != 0)
+	    Free(instance->journalHeader);
+	if (instance->bitmap != 0)
+	    Free(instance->bitmap);
+	if (instance->allocMap != 0)
+	    Free(instance->allocMap);
+	if (instance->inodeMap != 0)
+	    Free(instance->inodeMap);
+	if (instance->fsCache != 0)
+	    Destroy_FS_Buffer_Cache(instance->fsCache);
+	Free(instance);
+    }
+    return rc;
+}
+
+static struct Filesystem_Ops s_gosfsFilesystemOps = {
+    &GOSFS_Format,
+    &GOSFS_Mount,
+};
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+void Init_GOSFS(void)
+{
+    /* Each cached page of a file holds exactly one block */
+    KASSERT(GOSFS_BLOCK_SIZE == PAGE_SIZE);
+
+    Register_Filesystem("gosfs", &s_gosfsFilesystemOps);
+}
@@ -12,8 +12,16 @@
  * NOTES:
  * 12/22/03 - Converted to use new block device layer with queued requests
  *  1/20/04 - Changed probing of drives to work on Bochs 2.0 with 2 drives
+ *
+ * Transfers use bus master DMA when a PCI IDE controller with
+ * bus mastering (such as the PIIX3/4) is found and the drive supports
+ * DMA; otherwise, and for buffers DMA can't reach, PIO is used.
+ * Information sources:
+ * - Programming Interface for Bus Master IDE Controller, Revision 1.0
+ *   (SFF-8038i)
  */
 
+#include <limits.h>
 #include <geekos/ktypes.h>
 #include <geekos/kassert.h>
 #include <geekos/errno.h>
@@ -21,10 +29,13 @@
 #include <geekos/string.h>
 #include <geekos/io.h>
 #include <geekos/int.h>
+#include <geekos/irq.h>
 #include <geekos/screen.h>
 #include <geekos/timer.h>
 #include <geekos/kthread.h>
 #include <geekos/blockdev.h>
+#include <geekos/dma.h>
+#include <geekos/pci.h>
 #include <geekos/ide.h>
 
 /* Registers */
@@ -39,10 +50,12 @@
 #define IDE_STATUS_REGISTER		0x1f7
 #define IDE_COMMAND_REGISTER		0x1f7
 #define IDE_DEVICE_CONTROL_REGISTER	0x3F6
+#define IDE_ALT_STATUS_REGISTER		0x3F6
 
 /* Drives */
 #define IDE_DRIVE_0			0xa0
 #define IDE_DRIVE_1			0xb0
+#define IDE_DRIVE_LBA			0x40	/* address is a logical block number */
 
 /* Commands */
 #define IDE_COMMAND_IDENTIFY_DRIVE	0xEC
@@ -51,6 +64,17 @@
 #define IDE_COMMAND_READ_BUFFER		0xE4
 #define IDE_COMMAND_WRITE_SECTORS	0x30
 #define IDE_COMMAND_WRITE_BUFFER	0xE8
+#define IDE_COMMAND_READ_MULTIPLE	0xC4
+#define IDE_COMMAND_WRITE_MULTIPLE	0xC5
+#define IDE_COMMAND_SET_MULTIPLE_MODE	0xC6
+#define IDE_COMMAND_READ_DMA		0xC8
+#define IDE_COMMAND_WRITE_DMA		0xCA
+#define IDE_COMMAND_READ_SECTORS_EXT	0x24
+#define IDE_COMMAND_READ_DMA_EXT	0x25
+#define IDE_COMMAND_READ_MULTIPLE_EXT	0x29
+#define IDE_COMMAND_WRITE_SECTORS_EXT	0x34
+#define IDE_COMMAND_WRITE_DMA_EXT	0x35
+#define IDE_COMMAND_WRITE_MULTIPLE_EXT	0x39
 #define IDE_COMMAND_DIAGNOSTIC		0x90
 #define IDE_COMMAND_ATAPI_IDENT_DRIVE	0xA1
 
@@ -60,6 +84,21 @@
 #define	IDE_INDENTIFY_NUM_BYTES_TRACK	0x04
 #define	IDE_INDENTIFY_NUM_BYTES_SECTOR	0x05
 #define	IDE_INDENTIFY_NUM_SECTORS_TRACK	0x06
+#define	IDE_INDENTIFY_MAX_MULTIPLE	0x2F
+#define	IDE_INDENTIFY_CAPABILITIES	0x31
+#define	IDE_INDENTIFY_LBA_SECTORS	0x3C	/* two words, low word first */
+#define	IDE_INDENTIFY_COMMAND_SETS	0x53
+#define	IDE_INDENTIFY_LBA48_SECTORS	0x64	/* four words, low word first */
+
+/* bits of the Capabilities word */
+#define IDE_CAPABILITY_DMA		0x0100
+#define IDE_CAPABILITY_LBA		0x0200
+
+/* bits of the Command Sets Supported word */
+#define IDE_COMMAND_SET_LBA48		0x0400
+
+/* Blocks beyond this can only be reached with 48 bit commands */
+#define IDE_LBA28_MAX_BLOCKS		0x10000000UL
 
 /* bits of Status Register */
 #define IDE_STATUS_DRIVE_BUSY		0x80
@@ -80,6 +119,7 @@
 #define	IDE_ERROR_BAD_DRIVE	-1
 #define	IDE_ERROR_INVALID_BLOCK	-2
 #define	IDE_ERROR_DRIVE_ERROR	-3
+#define	IDE_ERROR_NO_DMA	-4	/* transfer must be done with PIO */
 
 /* Control register bits */
 #define IDE_CONTROL_REGISTER		0x3F6
@@ -91,11 +131,65 @@
 
 #define IDE_MAX_DRIVES			2
 
+/*
+ * Most sectors moved by one request.  The sector count
+ * register holds 8 bits, so this must not exceed 256.
+ */
+#define IDE_MAX_REQUEST_BLOCKS		128
+
+/* Most sectors per interrupt we ask for with READ/WRITE MULTIPLE */
+#define IDE_MAX_MULTIPLE_SECTORS	16
+
+/* The primary channel interrupts on IRQ 14 */
+#define IDE_IRQ				14
+
+/* PCI class and subclass of IDE controllers */
+#define IDE_PCI_CLASS			0x01
+#define IDE_PCI_SUBCLASS		0x01
+#define IDE_PCI_PROG_IF_BUS_MASTER	0x80
+#define IDE_PCI_BUS_MASTER_BAR		4
+
+/* Bus master registers of the primary channel, relative to BAR 4 */
+#define IDE_BM_COMMAND_REGISTER		0x00
+#define IDE_BM_STATUS_REGISTER		0x02
+#define IDE_BM_PRD_ADDRESS_REGISTER	0x04
+
+/* Bits of the bus master Command Register */
+#define IDE_BM_COMMAND_START		0x01
+#define IDE_BM_COMMAND_READ		0x08	/* drive to memory */
+
+/* Bits of the bus master Status Register */
+#define IDE_BM_STATUS_ACTIVE		0x01
+#define IDE_BM_STATUS_ERROR		0x02
+#define IDE_BM_STATUS_INTERRUPT		0x04
+
+/*
+ * Physical Region Descriptor: one contiguous piece of a DMA
+ * buffer.  A byte count of 0 means 64K.
+ */
+struct IDE_PRD {
+    ulong_t address;
+    ushort_t byteCount;
+    ushort_t flags;
+};
+#define IDE_PRD_END_OF_TABLE		0x8000
+
+/*
+ * A request is at most 64K, which can straddle one 64K boundary,
+ * so it never needs more than two PRDs.
+ */
+#define IDE_MAX_PRD_ENTRIES		4
+
 typedef struct {
     short num_Cylinders;
     short num_Heads;
     short num_SectorsPerTrack;
     short num_BytesPerSector;
+    short num_MultipleSectors;	/* sectors per interrupt, 0 if no READ MULTIPLE */
+    int num_Blocks;
+    bool useLBA;
+    bool useLBA48;
+    bool useDMA;
 } ideDisk;
 
 int ideDebug = 0;
@@ -105,169 +199,375 @@ static ideDisk drives[IDE_MAX_DRIVES];
 struct Thread_Queue s_ideWaitQueue;
 struct Block_Request_List s_ideRequestQueue;
 
+/*
+ * The request thread waits here for the drive to interrupt.
+ */
+static struct Thread_Queue s_ideInterruptWaitQueue;
+static volatile bool s_ideInterruptReceived;
+static volatile int s_ideStatus;
+
+/*
+ * I/O port base of the bus master registers, or 0 if there is
+ * no bus master controller.  The PRD table must be dword aligned
+ * and must not cross a 64K boundary; aligning it to its own size
+ * takes care of both.
+ */
+static ushort_t s_ideBusMasterBase;
+static struct IDE_PRD s_idePRDTable[IDE_MAX_PRD_ENTRIES]
+    __attribute__ ((aligned (sizeof(struct IDE_PRD) * IDE_MAX_PRD_ENTRIES)));
+
 /*
  * return the number of logical blocks for a particular drive.
  *
  */
 static int IDE_getNumBlocks(int driveNum)
 {
-    if (driveNum < 0 || driveNum > IDE_MAX_DRIVES) {
+    if (driveNum < 0 || driveNum >= IDE_MAX_DRIVES) {
         return IDE_ERROR_BAD_DRIVE;
     }
 
-    return (drives[driveNum].num_Heads * 
-            drives[driveNum].num_SectorsPerTrack *
-	    drives[driveNum].num_Cylinders);
+    return drives[driveNum].num_Blocks;
 }
 
 /*
- * Read a block at the logical block number indicated.
+ * Interrupt handler.
+ * Reading the status register acknowledges the interrupt;
+ * the status is saved for the request thread to examine.
  */
-static int IDE_Read(int driveNum, int blockNum, char *buffer)
+static void IDE_Interrupt_Handler(struct Interrupt_State* state)
 {
-    int i;
-    int head;
-    int sector;
-    int cylinder;
-    short *bufferW;
-    int reEnable = 0;
+    Begin_IRQ(state);
+    s_ideStatus = In_Byte(IDE_STATUS_REGISTER);
+    s_ideInterruptReceived = true;
+    Wake_Up(&s_ideInterruptWaitQueue);
+    End_IRQ(state);
+}
+
+/*
+ * Wait for the drive to raise IRQ 14, and return the status
+ * it reported.  The request thread sleeps meanwhile, so other
+ * threads run while the drive seeks and transfers.
+ * Must be called with interrupts disabled, after
+ * clearing s_ideInterruptReceived and issuing the command.
+ */
+static int IDE_Wait_For_Interrupt(void)
+{
+    KASSERT(!Interrupts_Enabled());
+
+    while (!s_ideInterruptReceived)
+	Wait(&s_ideInterruptWaitQueue);
+    s_ideInterruptReceived = false;
+
+    return s_ideStatus;
+}
 
+/*
+ * Check that the drive exists, and the given range of
+ * blocks is on it.
+ */
+static int IDE_Check_Request(int driveNum, int blockNum, int numBlocks)
+{
     if (driveNum < 0 || driveNum > (numDrives-1)) {
 	if (ideDebug) Print("ide: invalid drive %d\n", driveNum);
         return IDE_ERROR_BAD_DRIVE;
     }
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
-	if (ideDebug) Print("ide: invalid block %d\n", blockNum);
+    if (blockNum < 0 || numBlocks < 1 || numBlocks > IDE_MAX_REQUEST_BLOCKS ||
+	numBlocks > IDE_getNumBlocks(driveNum) - blockNum) {
+	if (ideDebug) Print("ide: invalid block %d (count %d)\n", blockNum, numBlocks);
         return IDE_ERROR_INVALID_BLOCK;
     }
 
-    if (Interrupts_Enabled()) {
-	Disable_Interrupts();
-	reEnable = 1;
-    }
-
-    /* now compute the head, cylinder, and sector */
-    sector = blockNum % drives[driveNum].num_SectorsPerTrack + 1;
-    cylinder = blockNum / (drives[driveNum].num_Heads * 
-     	drives[driveNum].num_SectorsPerTrack);
-    head = (blockNum / drives[driveNum].num_SectorsPerTrack) % 
-        drives[driveNum].num_Heads;
-
-    if (ideDebug >= 2) {
-	Print ("request to read block %d\n", blockNum);
-	Print ("    head %d\n", head);
-	Print ("    cylinder %d\n", cylinder);
-	Print ("    sector %d\n", sector);
-    }
+    return IDE_ERROR_NO_ERROR;
+}
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
-    Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
-    Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
-    Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
-    if (driveNum == 0) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_0 | head);
-    } else if (driveNum == 1) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_1 | head);
+/*
+ * Translate a command to its 48 bit address form.
+ */
+static int IDE_Ext_Command(int command)
+{
+    switch (command) {
+    case IDE_COMMAND_READ_SECTORS: return IDE_COMMAND_READ_SECTORS_EXT;
+    case IDE_COMMAND_READ_MULTIPLE: return IDE_COMMAND_READ_MULTIPLE_EXT;
+    case IDE_COMMAND_READ_DMA: return IDE_COMMAND_READ_DMA_EXT;
+    case IDE_COMMAND_WRITE_SECTORS: return IDE_COMMAND_WRITE_SECTORS_EXT;
+    case IDE_COMMAND_WRITE_MULTIPLE: return IDE_COMMAND_WRITE_MULTIPLE_EXT;
+    case IDE_COMMAND_WRITE_DMA: return IDE_COMMAND_WRITE_DMA_EXT;
+    default: KASSERT(false); return command;
     }
+}
 
-    Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_READ_SECTORS);
+/*
+ * Load the address of the first block and the number of
+ * blocks into the task file, and issue given command.
+ * The drive moves on to the following sectors by itself.
+ * Must be called with interrupts disabled.
+ */
+static void IDE_Start_Command(int driveNum, int blockNum, int numBlocks, int command)
+{
+    int select = (driveNum == 0) ? IDE_DRIVE_0 : IDE_DRIVE_1;
+    ulong_t lba = (ulong_t) blockNum;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (ideDebug >= 2)
+	Print ("request: command %x, %d blocks at %d\n", command, numBlocks, blockNum);
+
+    if (drives[driveNum].useLBA48 && lba + numBlocks > IDE_LBA28_MAX_BLOCKS) {
+	/*
+	 * 48 bit address: each register is a two byte FIFO,
+	 * written high order byte first.
+	 */
+	Out_Byte(IDE_SECTOR_COUNT_REGISTER, HIGH_BYTE(numBlocks));
+	Out_Byte(IDE_SECTOR_NUMBER_REGISTER, (lba >> 24) & 0xff);
+	Out_Byte(IDE_CYLINDER_LOW_REGISTER, 0);	/* block numbers fit in 32 bits */
+	Out_Byte(IDE_CYLINDER_HIGH_REGISTER, 0);
+	Out_Byte(IDE_SECTOR_COUNT_REGISTER, LOW_BYTE(numBlocks));
+	Out_Byte(IDE_SECTOR_NUMBER_REGISTER, lba & 0xff);
+	Out_Byte(IDE_CYLINDER_LOW_REGISTER, (lba >> 8) & 0xff);
+	Out_Byte(IDE_CYLINDER_HIGH_REGISTER, (lba >> 16) & 0xff);
+	Out_Byte(IDE_DRIVE_HEAD_REGISTER, select | IDE_DRIVE_LBA);
+	command = IDE_Ext_Command(command);
+    } else if (drives[driveNum].useLBA) {
+	/* 28 bit address: the top four bits go in the drive/head register */
+	Out_Byte(IDE_SECTOR_COUNT_REGISTER, LOW_BYTE(numBlocks));
+	Out_Byte(IDE_SECTOR_NUMBER_REGISTER, lba & 0xff);
+	Out_Byte(IDE_CYLINDER_LOW_REGISTER, (lba >> 8) & 0xff);
+	Out_Byte(IDE_CYLINDER_HIGH_REGISTER, (lba >> 16) & 0xff);
+	Out_Byte(IDE_DRIVE_HEAD_REGISTER, select | IDE_DRIVE_LBA | ((lba >> 24) & 0x0f));
+    } else {
+	int head;
+	int sector;
+	int cylinder;
+
+	/* now compute the head, cylinder, and sector */
+	sector = blockNum % drives[driveNum].num_SectorsPerTrack + 1;
+	cylinder = blockNum / (drives[driveNum].num_Heads * 
+	    drives[driveNum].num_SectorsPerTrack);
+	head = (blockNum / drives[driveNum].num_SectorsPerTrack) % 
+	    drives[driveNum].num_Heads;
+
+	if (ideDebug >= 2) {
+	    Print ("    head %d\n", head);
+	    Print ("    cylinder %d\n", cylinder);
+	    Print ("    sector %d\n", sector);
+	}
 
-    if (ideDebug > 2) Print("About to wait for Read \n");
+	Out_Byte(IDE_SECTOR_COUNT_REGISTER, LOW_BYTE(numBlocks));
+	Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
+	Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
+	Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
+	Out_Byte(IDE_DRIVE_HEAD_REGISTER, select | head);
+    }
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+    s_ideInterruptReceived = false;
+    Out_Byte(IDE_COMMAND_REGISTER, command);
+}
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
+/*
+ * Fill in the PRD table to describe given buffer.
+ * The kernel runs with flat segments and no paging, so buffer
+ * addresses are physical addresses.
+ * Returns false if the buffer can't be described (it must be
+ * word aligned, and split into few enough pieces).
+ */
+static bool IDE_Build_PRD_Table(char *buffer, ulong_t numBytes)
+{
+    int i = 0;
+
+    if (((ulong_t) buffer & 1) != 0)
+	return false;
+
+    while (numBytes > 0) {
+	ulong_t count = DMA_Bytes_Before_Boundary(buffer, numBytes);
+
+	if (i == IDE_MAX_PRD_ENTRIES)
+	    return false;
+	s_idePRDTable[i].address = (ulong_t) buffer;
+	s_idePRDTable[i].byteCount = count & 0xFFFF;
+	s_idePRDTable[i].flags = 0;
+	buffer += count;
+	numBytes -= count;
+	++i;
     }
+    s_idePRDTable[i-1].flags = IDE_PRD_END_OF_TABLE;
 
-    if (ideDebug > 2) Print("got buffer \n");
+    return true;
+}
 
-    bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        bufferW[i] = In_Word(IDE_DATA_REGISTER);
+/*
+ * Transfer numBlocks blocks between the drive and buffer with
+ * bus master DMA.  The request thread sleeps until the drive
+ * interrupts at the end of the whole transfer.
+ * Returns IDE_ERROR_NO_DMA if the transfer should be retried with PIO.
+ */
+static int IDE_DMA_Transfer(int driveNum, int blockNum, int numBlocks, char *buffer, bool write)
+{
+    ushort_t base = s_ideBusMasterBase;
+    uchar_t direction = write ? 0 : IDE_BM_COMMAND_READ;
+    int status, bmStatus;
+    int rc = IDE_ERROR_NO_ERROR;
+
+    if (!IDE_Build_PRD_Table(buffer, numBlocks * SECTOR_SIZE))
+	return IDE_ERROR_NO_DMA;
+
+    Disable_Interrupts();
+
+    /* Point the controller at the PRD table and clear old status */
+    Out_DWord(base + IDE_BM_PRD_ADDRESS_REGISTER, (ulong_t) s_idePRDTable);
+    Out_Byte(base + IDE_BM_COMMAND_REGISTER, direction);
+    Out_Byte(base + IDE_BM_STATUS_REGISTER, In_Byte(base + IDE_BM_STATUS_REGISTER) |
+	IDE_BM_STATUS_ERROR | IDE_BM_STATUS_INTERRUPT);
+
+    IDE_Start_Command(driveNum, blockNum, numBlocks,
+	write ? IDE_COMMAND_WRITE_DMA : IDE_COMMAND_READ_DMA);
+    Out_Byte(base + IDE_BM_COMMAND_REGISTER, direction | IDE_BM_COMMAND_START);
+
+    status = IDE_Wait_For_Interrupt();
+
+    /* Stop the bus master and acknowledge its status */
+    Out_Byte(base + IDE_BM_COMMAND_REGISTER, direction);
+    bmStatus = In_Byte(base + IDE_BM_STATUS_REGISTER);
+    Out_Byte(base + IDE_BM_STATUS_REGISTER, bmStatus | IDE_BM_STATUS_ERROR | IDE_BM_STATUS_INTERRUPT);
+
+    Enable_Interrupts();
+
+    if (bmStatus & IDE_BM_STATUS_ERROR) {
+	/* The controller couldn't do the transfer; stick to PIO from now on */
+	Print("ide%d: bus master error %x, disabling DMA\n", driveNum, bmStatus);
+	drives[driveNum].useDMA = false;
+	rc = IDE_ERROR_NO_DMA;
+    } else if (status & (IDE_STATUS_DRIVE_ERROR | IDE_STATUS_DRIVE_WRITE_FAULT)) {
+	Print("ERROR: Got DMA %s %d\n", write ? "Write" : "Read", status);
+	rc = IDE_ERROR_DRIVE_ERROR;
     }
 
-    if (reEnable) Enable_Interrupts();
-
-    return IDE_ERROR_NO_ERROR;
+    return rc;
 }
 
 /*
- * Write a block at the logical block number indicated.
+ * Read numBlocks blocks starting at the logical block number indicated.
+ * The drive interrupts once for each sector, or once for each
+ * group of sectors if it supports READ MULTIPLE.
  */
-static int IDE_Write(int driveNum, int blockNum, char *buffer)
+static int IDE_Read(int driveNum, int blockNum, int numBlocks, char *buffer)
 {
     int i;
-    int head;
-    int sector;
-    int cylinder;
+    int rc;
+    int status;
+    int perInterrupt;
     short *bufferW;
-    int reEnable = 0;
 
-    if (driveNum < 0 || driveNum > (numDrives-1)) {
-        return IDE_ERROR_BAD_DRIVE;
-    }
+    rc = IDE_Check_Request(driveNum, blockNum, numBlocks);
+    if (rc != IDE_ERROR_NO_ERROR)
+	return rc;
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
-        return IDE_ERROR_INVALID_BLOCK;
+    if (drives[driveNum].useDMA) {
+	rc = IDE_DMA_Transfer(driveNum, blockNum, numBlocks, buffer, false);
+	if (rc != IDE_ERROR_NO_DMA)
+	    return rc;
+	rc = IDE_ERROR_NO_ERROR;
     }
 
-    if (Interrupts_Enabled()) {
-	Disable_Interrupts();
-	reEnable = 1;
-    }
+    perInterrupt = drives[driveNum].num_MultipleSectors;
 
-    /* now compute the head, cylinder, and sector */
-    sector = blockNum % drives[driveNum].num_SectorsPerTrack + 1;
-    cylinder = blockNum / (drives[driveNum].num_Heads * 
-     	drives[driveNum].num_SectorsPerTrack);
-    head = (blockNum / drives[driveNum].num_SectorsPerTrack) % 
-        drives[driveNum].num_Heads;
-
-    if (ideDebug) {
-	Print ("request to write block %d\n", blockNum);
-	Print ("    head %d\n", head);
-	Print ("    cylinder %d\n", cylinder);
-	Print ("    sector %d\n", sector);
-    }
+    Disable_Interrupts();
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
-    Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
-    Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
-    Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
-    if (driveNum == 0) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_0 | head);
-    } else if (driveNum == 1) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_1 | head);
-    }
+    IDE_Start_Command(driveNum, blockNum, numBlocks,
+	perInterrupt > 0 ? IDE_COMMAND_READ_MULTIPLE : IDE_COMMAND_READ_SECTORS);
+    if (perInterrupt == 0)
+	perInterrupt = 1;
 
-    Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_WRITE_SECTORS);
+    bufferW = (short *) buffer;
+    while (numBlocks > 0) {
+	int count = numBlocks < perInterrupt ? numBlocks : perInterrupt;
 
+	if (ideDebug > 2) Print("About to wait for Read \n");
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+	/* The drive interrupts when the next sectors are in its buffer */
+	status = IDE_Wait_For_Interrupt();
+	if (status & IDE_STATUS_DRIVE_ERROR) {
+	    Print("ERROR: Got Read %d\n", status);
+	    rc = IDE_ERROR_DRIVE_ERROR;
+	    break;
+	}
 
-    bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        Out_Word(IDE_DATA_REGISTER, bufferW[i]);
+	if (ideDebug > 2) Print("got buffer \n");
+
+	for (i=0; i < count * 256; i++) {
+	    bufferW[i] = In_Word(IDE_DATA_REGISTER);
+	}
+	bufferW += count * 256;
+	numBlocks -= count;
     }
 
-    if (ideDebug) Print("About to wait for Write \n");
+    Enable_Interrupts();
+    return rc;
+}
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+/*
+ * Write numBlocks blocks starting at the logical block number indicated.
+ */
+static int IDE_Write(int driveNum, int blockNum, int numBlocks, char *buffer)
+{
+    int i;
+    int rc;
+    int status;
+    int perInterrupt;
+    short *bufferW;
+
+    rc = IDE_Check_Request(driveNum, blockNum, numBlocks);
+    if (rc != IDE_ERROR_NO_ERROR)
+	return rc;
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
+    if (drives[driveNum].useDMA) {
+	rc = IDE_DMA_Transfer(driveNum, blockNum, numBlocks, buffer, true);
+	if (rc != IDE_ERROR_NO_DMA)
+	    return rc;
+	rc = IDE_ERROR_NO_ERROR;
     }
 
-    if (reEnable) Enable_Interrupts();
+    perInterrupt = drives[driveNum].num_MultipleSectors;
 
-    return IDE_ERROR_NO_ERROR;
+    Disable_Interrupts();
+
+    IDE_Start_Command(driveNum, blockNum, numBlocks,
+	perInterrupt > 0 ? IDE_COMMAND_WRITE_MULTIPLE : IDE_COMMAND_WRITE_SECTORS);
+    if (perInterrupt == 0)
+	perInterrupt = 1;
+
+    /*
+     * The drive asks for the first data right away, without an
+     * interrupt, so this wait is short.
+     */
+    while (In_Byte(IDE_ALT_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+
+    bufferW = (short *) buffer;
+    while (numBlocks > 0) {
+	int count = numBlocks < perInterrupt ? numBlocks : perInterrupt;
+
+	for (i=0; i < count * 256; i++) {
+	    Out_Word(IDE_DATA_REGISTER, bufferW[i]);
+	}
+	bufferW += count * 256;
+	numBlocks -= count;
+
+	if (ideDebug) Print("About to wait for Write \n");
+
+	/*
+	 * The drive interrupts once these sectors are written,
+	 * and is then ready for the next ones.
+	 */
+	status = IDE_Wait_For_Interrupt();
+	if (status & (IDE_STATUS_DRIVE_ERROR | IDE_STATUS_DRIVE_WRITE_FAULT)) {
+	    Print("ERROR: Got Write %d\n", status);
+	    rc = IDE_ERROR_DRIVE_ERROR;
+	    break;
+	}
+    }
+
+    Enable_Interrupts();
+    return rc;
 }
 
 static int IDE_Open(struct Block_Device *dev)
@@ -291,6 +591,7 @@ static struct Block_Device_Ops s_ideDeviceOps = {
     IDE_Open,
     IDE_Close,
     IDE_Get_Num_Blocks,
+    IDE_MAX_REQUEST_BLOCKS,
 };
 
 static void IDE_Request_Thread(ulong_t arg)
@@ -304,15 +605,85 @@ static void IDE_Request_Thread(ulong_t arg)
 
 	/* Do the I/O */
 	if (request->type == BLOCK_READ)
-	    rc = IDE_Read(request->dev->unit, request->blockNum, request->buf);
+	    rc = IDE_Read(request->dev->unit, request->blockNum, request->xferBlocks, request->buf);
 	else
-	    rc = IDE_Write(request->dev->unit, request->blockNum, request->buf);
+	    rc = IDE_Write(request->dev->unit, request->blockNum, request->xferBlocks, request->buf);
 
 	/* Notify requesting thread of final status */
 	Notify_Request_Completion(request, rc == 0 ? COMPLETED : ERROR, rc);
     }
 }
 
+/*
+ * Enable READ/WRITE MULTIPLE on a drive which supports up to
+ * maxSectors sectors per interrupt.
+ * Returns the number of sectors per interrupt the drive was
+ * set to, or 0 if it will only transfer a sector at a time.
+ */
+static int setMultipleMode(int drive, int maxSectors)
+{
+    int count = 1;
+    int status;
+
+    if (maxSectors < 2)
+	return 0;
+
+    /* Largest power of two the drive and the driver agree on */
+    while (count * 2 <= maxSectors && count * 2 <= IDE_MAX_MULTIPLE_SECTORS)
+	count *= 2;
+
+    Out_Byte(IDE_DRIVE_HEAD_REGISTER, (drive == 0) ? IDE_DRIVE_0 : IDE_DRIVE_1);
+    Out_Byte(IDE_SECTOR_COUNT_REGISTER, count);
+    Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_SET_MULTIPLE_MODE);
+    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+
+    status = In_Byte(IDE_STATUS_REGISTER);
+    if (status & IDE_STATUS_DRIVE_ERROR) {
+	if (ideDebug) Print("ide: drive %d rejected multiple mode %d\n", drive, count);
+	return 0;
+    }
+
+    if (ideDebug) Print("ide: drive %d transfers %d sectors per interrupt\n", drive, count);
+    return count;
+}
+
+/*
+ * Work out the addressing mode and size of a drive from its
+ * IDENTIFY data.  LBA is used whenever the drive supports it;
+ * only old drives are addressed by cylinder, head and sector.
+ */
+static void setDriveCapacity(int drive, short *info)
+{
+    ushort_t *words = (ushort_t *) info;
+    ulong_t lbaBlocks;
+
+    drives[drive].useLBA = (words[IDE_INDENTIFY_CAPABILITIES] & IDE_CAPABILITY_LBA) != 0;
+    drives[drive].useLBA48 = drives[drive].useLBA &&
+	(words[IDE_INDENTIFY_COMMAND_SETS] & IDE_COMMAND_SET_LBA48) != 0;
+
+    if (drives[drive].useLBA48) {
+	/* Block numbers are ints, so only the first 2^31 blocks are usable */
+	lbaBlocks = words[IDE_INDENTIFY_LBA48_SECTORS] |
+	    ((ulong_t) words[IDE_INDENTIFY_LBA48_SECTORS + 1] << 16);
+	if (words[IDE_INDENTIFY_LBA48_SECTORS + 2] != 0 ||
+	    words[IDE_INDENTIFY_LBA48_SECTORS + 3] != 0 || lbaBlocks > INT_MAX)
+	    lbaBlocks = INT_MAX;
+    } else if (drives[drive].useLBA) {
+	lbaBlocks = words[IDE_INDENTIFY_LBA_SECTORS] |
+	    ((ulong_t) words[IDE_INDENTIFY_LBA_SECTORS + 1] << 16);
+	if (lbaBlocks > IDE_LBA28_MAX_BLOCKS)
+	    lbaBlocks = IDE_LBA28_MAX_BLOCKS;
+    }
+
+    if (drives[drive].useLBA && lbaBlocks > 0) {
+	drives[drive].num_Blocks = lbaBlocks;
+    } else {
+	drives[drive].useLBA = drives[drive].useLBA48 = false;
+	drives[drive].num_Blocks = drives[drive].num_Heads *
+	    drives[drive].num_SectorsPerTrack * drives[drive].num_Cylinders;
+    }
+}
+
 static int readDriveConfig(int drive)
 {
     int i;
@@ -343,6 +714,11 @@ static int readDriveConfig(int drive)
 	drives[drive].num_Heads = info[IDE_INDENTIFY_NUM_HEADS];
 	drives[drive].num_SectorsPerTrack = info[IDE_INDENTIFY_NUM_SECTORS_TRACK];
 	drives[drive].num_BytesPerSector = info[IDE_INDENTIFY_NUM_BYTES_SECTOR];
+	drives[drive].num_MultipleSectors = setMultipleMode(drive,
+	    info[IDE_INDENTIFY_MAX_MULTIPLE] & 0xff);
+	drives[drive].useDMA = s_ideBusMasterBase != 0 &&
+	    (info[IDE_INDENTIFY_CAPABILITIES] & IDE_CAPABILITY_DMA) != 0;
+	setDriveCapacity(drive, info);
     } else {
        /* try for ATAPI */
        Out_Byte(IDE_FEATURE_REG, 0);		 /* disable dma & overlap */
@@ -355,18 +731,49 @@ static int readDriveConfig(int drive)
        return -1;
     }
 
-    Print("    ide%d: cyl=%d, heads=%d, sectors=%d\n", drive, drives[drive].num_Cylinders,
-	drives[drive].num_Heads, drives[drive].num_SectorsPerTrack);
+    Print("    ide%d: cyl=%d, heads=%d, sectors=%d, blocks=%d%s%s\n", drive,
+	drives[drive].num_Cylinders, drives[drive].num_Heads, drives[drive].num_SectorsPerTrack,
+	drives[drive].num_Blocks,
+	drives[drive].useLBA48 ? ", lba48" : drives[drive].useLBA ? ", lba" : "",
+	drives[drive].useDMA ? ", dma" : "");
 
     /* Register the drive as a block device */
     snprintf(devname, sizeof(devname), "ide%d", drive);
-    rc = Register_Block_Device(devname, &s_ideDeviceOps, drive, 0, &s_ideWaitQueue, &s_ideRequestQueue);
+    rc = Register_Block_Device(devname, &s_ideDeviceOps, drive, 0, &s_ideWaitQueue, &s_ideRequestQueue,
+	BLOCK_SCHED_DEADLINE);
     if (rc != 0)
 	Print("  Error: could not create block device for %s\n", devname);
 
     return 0;
 }
 
+/*
+ * Look for a PCI IDE controller that can act as bus master,
+ * and enable bus mastering on it.
+ */
+static void findBusMaster(void)
+{
+    struct PCI_Device pciDev;
+    ulong_t bar, command;
+
+    if (!Find_PCI_Device(IDE_PCI_CLASS, IDE_PCI_SUBCLASS, &pciDev) ||
+	(pciDev.progIf & IDE_PCI_PROG_IF_BUS_MASTER) == 0) {
+	if (ideDebug) Print("ide: no bus master controller, using PIO\n");
+	return;
+    }
+
+    bar = PCI_Read_Config(&pciDev, PCI_BAR(IDE_PCI_BUS_MASTER_BAR));
+    if ((bar & PCI_BAR_IO) == 0 || (bar & PCI_BAR_IO_MASK) == 0)
+	return;
+
+    /* The upper half is the status register, which must not be written back */
+    command = PCI_Read_Config(&pciDev, PCI_COMMAND) & 0xFFFF;
+    PCI_Write_Config(&pciDev, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    s_ideBusMasterBase = bar & PCI_BAR_IO_MASK;
+    Print("    ide: bus master controller %x:%x, registers at %x\n",
+	pciDev.vendorId, pciDev.deviceId, s_ideBusMasterBase);
+}
 
 void Init_IDE(void)
 {
@@ -397,12 +804,23 @@ void Init_IDE(void)
     if (ideDebug > 1) Print("ide: ide error register = %x\n", errorCode);
 
     /* Probe and register drives */
+    findBusMaster();
     if (readDriveConfig(0) == 0)
 	++numDrives;
     if (readDriveConfig(1) == 0)
 	++numDrives;
     if (ideDebug) Print("Found %d IDE drives\n", numDrives);
 
+    /*
+     * Probing was done by polling; from now on, the drives
+     * signal completion on IRQ 14.
+     */
+    if (numDrives > 0) {
+	Install_IRQ(IDE_IRQ, &IDE_Interrupt_Handler);
+	Enable_IRQ(IDE_IRQ);
+	Out_Byte(IDE_DEVICE_CONTROL_REGISTER, 0);
+    }
+
     /* Start request thread */
     if (numDrives > 0)
 	Start_Kernel_Thread(IDE_Request_Thread, 0, PRIORITY_NORMAL, true);
@@ -17,6 +17,7 @@
 #include <geekos/kthread.h>
 #include <geekos/malloc.h>
 #include <geekos/user.h> 
+#include <geekos/memstat.h>
 
 
 /* ----------------------------------------------------------------------
@@ -105,6 +106,7 @@ static tlocal_destructor_t s_tlocalDestructors[MAX_TLOCAL_KEYS];
 
 /*
  * Initialize a new Kernel_Thread.
+ * The thread object must already be filled with zeroes.
  */
 static void Init_Thread(struct Kernel_Thread* kthread, void* stackPage,
 	int priority, bool detached)
@@ -113,7 +115,6 @@ static void Init_Thread(struct Kernel_Thread* kthread, void* stackPage,
 
     struct Kernel_Thread* owner = detached ? (struct Kernel_Thread*)0 : g_currentThread;
 
-    memset(kthread, '\0', sizeof(*kthread));
     kthread->stackPage = stackPage;
     kthread->esp = ((ulong_t) kthread->stackPage) + PAGE_SIZE;
     kthread->numTicks = 0;
@@ -147,9 +148,10 @@ static struct Kernel_Thread* Create_Thread(int priority, bool detached)
 
     /*
      * For now, just allocate one page each for the thread context
-     * object and the thread's stack.
+     * object and the thread's stack.  The context object must start
+     * out zeroed, which the idle thread has usually done already.
      */
-    kthread = Alloc_Page();
+    kthread = Alloc_Zeroed_Page();
     if (kthread != 0)
         stackPage = Alloc_Page();    
 
@@ -195,6 +197,9 @@ static __inline__ void Push(struct Kernel_Thread* kthread, ulong_t value)
 static void Destroy_Thread(struct Kernel_Thread* kthread)
 {
 
+    /* Release the thread's user context. */
+    Detach_User_Context(kthread);
+
     /* Dispose of the thread's memory. */
     Disable_Interrupts();
     Free_Page(kthread->stackPage);
@@ -396,8 +401,14 @@ static void Setup_Kernel_Thread(
  */
 static void Idle(ulong_t arg)
 {
-    while (true)
+    /*
+     * Time nobody else wants is spent zeroing free pages,
+     * one per turn, for Alloc_Zeroed_Page().
+     */
+    while (true) {
+	Zero_Free_Page();
 	Yield();
+    }
 }
 
 /*
@@ -523,6 +534,7 @@ void Init_Scheduler(void)
      * Create initial kernel thread context object and stack,
      * and make them current.
      */
+    memset(mainThread, '\0', sizeof(*mainThread));
     Init_Thread(mainThread, (void *) KERN_STACK, PRIORITY_NORMAL, true);
     g_currentThread = mainThread;
     Add_To_Back_Of_All_Thread_List(&s_allThreadList, mainThread);
@@ -531,7 +543,7 @@ void Init_Scheduler(void)
      * Create the idle thread.
      */
     /*Print("starting idle thread\n");*/
-    Start_Kernel_Thread(Idle, 0, PRIORITY_IDLE, true);
+    IdleThread = Start_Kernel_Thread(Idle, 0, PRIORITY_IDLE, true);
 
     /*
      * Create the reaper thread.
@@ -612,6 +624,55 @@ Start_User_Thread(struct User_Context* userContext, bool detached)
     return kthread; 
 }
 
+/*
+ * Start a user thread which is a copy of the current one.
+ * The new thread will return to user mode with the registers
+ * given in state (those of the current thread when it made
+ * the Fork system call), except that eax, the system call
+ * result, is 0.
+ */
+struct Kernel_Thread*
+Start_Forked_User_Thread(struct User_Context* userContext,
+    struct Interrupt_State* state, bool detached)
+{
+    struct User_Interrupt_State *userState = (struct User_Interrupt_State*) state;
+    struct Kernel_Thread* kthread;
+
+    KASSERT(Is_User_Interrupt(state));
+
+    kthread = Create_Thread(PRIORITY_USER, detached);
+    if (kthread == 0)
+	return 0;
+
+    Attach_User_Context(kthread, userContext);
+
+    /* Same frame as Setup_User_Thread(), with the parent's values */
+    Push(kthread, userState->ssUser);
+    Push(kthread, userState->espUser);
+    Push(kthread, state->eflags);
+    Push(kthread, state->cs);
+    Push(kthread, state->eip);
+    Push(kthread, 0);  /* error code */
+    Push(kthread, 0);  /* interrupt number */
+
+    Push(kthread, 0);  /* eax: child's return value */
+    Push(kthread, state->ebx);
+    Push(kthread, state->ecx);
+    Push(kthread, state->edx);
+    Push(kthread, state->esi);
+    Push(kthread, state->edi);
+    Push(kthread, state->ebp);
+
+    Push(kthread, state->ds);
+    Push(kthread, state->es);
+    Push(kthread, state->fs);
+    Push(kthread, state->gs);
+
+    Make_Runnable_Atomic(kthread);
+
+    return kthread;
+}
+
 /*
  * Add given thread to the run queue, so that it
  * may be scheduled.  Must be called with interrupts disabled!
@@ -790,6 +851,16 @@ void Exit(int exitCode)
 {
     struct Kernel_Thread* current = g_currentThread;
 
+    /*
+     * Close the files of a user process now, rather than when the
+     * reaper destroys it, since nobody may ever wait for it.
+     */
+    if (current->userContext != 0) {
+	if (!Interrupts_Enabled())
+	    Enable_Interrupts();
+	Close_User_Files(current->userContext);
+    }
+
     if (Interrupts_Enabled())
 	Disable_Interrupts();
 
@@ -880,6 +951,33 @@ struct Kernel_Thread* Lookup_Thread(int pid)
     return result;
 }
 
+/*
+ * Report the memory used by each live user process,
+ * for the MemStats system call.
+ * Returns the number of processes stored in procList.
+ */
+int Get_Process_Mem_Stats(struct Process_Mem_Stats *procList, int maxProcs)
+{
+    struct Kernel_Thread *kthread;
+    int count = 0;
+
+    bool iflag = Begin_Int_Atomic();
+
+    kthread = Get_Front_Of_All_Thread_List(&s_allThreadList);
+    while (kthread != 0 && count < maxProcs) {
+	if (kthread->alive && kthread->userContext != 0) {
+	    procList[count].pid = kthread->pid;
+	    procList[count].size = kthread->userContext->size;
+	    ++count;
+	}
+	kthread = Get_Next_In_All_Thread_List(kthread);
+    }
+
+    End_Int_Atomic(iflag);
+
+    return count;
+}
+
 
 /*
  * Wait on given wait queue.
@@ -23,7 +23,11 @@
 #include <geekos/dma.h>
 #include <geekos/ide.h>
 #include <geekos/floppy.h>
+#include <geekos/ramdisk.h>
+#include <geekos/bufcache.h>
+#include <geekos/pagecache.h>
 #include <geekos/pfat.h>
+#include <geekos/gosfs.h>
 #include <geekos/vfs.h>
 #include <geekos/user.h>
 
@@ -35,9 +39,18 @@
  */
 /*#define FD_BOOT*/
 
+/*
+ * Define this to copy the IDE disk into the RAM disk at boot,
+ * and mount the root filesystem from the RAM disk.
+ */
+/*#define RAMDISK_BOOT*/
+
 #ifdef FD_BOOT
 #  define ROOT_DEVICE "fd0"
 #  define ROOT_PREFIX "a"
+#elif defined(RAMDISK_BOOT)
+#  define ROOT_DEVICE "ram0"
+#  define ROOT_PREFIX "c"
 #else
 #  define ROOT_DEVICE "ide0"
 #  define ROOT_PREFIX "c"
@@ -70,7 +83,11 @@ void Main(struct Boot_Info* bootInfo)
     Init_DMA();
     Init_Floppy();
     Init_IDE();
+    Init_Ramdisk();
+    Init_Buffer_Cache();
+    Init_Page_Cache();
     Init_PFAT();
+    Init_GOSFS();
 
     Mount_Root_Filesystem();
 
@@ -91,11 +108,24 @@ void Main(struct Boot_Info* bootInfo)
 
 static void Mount_Root_Filesystem(void)
 {
-    if (Mount(ROOT_DEVICE, ROOT_PREFIX, "pfat") != 0)
+    const char *rootDevice = ROOT_DEVICE;
+
+#ifdef RAMDISK_BOOT
+    if (Load_Ramdisk("ide0") != 0) {
+	Print("Failed to load RAM disk from ide0; mounting ide0 instead\n");
+	rootDevice = "ide0";
+    }
+#endif
+
+    if (Mount(rootDevice, ROOT_PREFIX, "pfat") != 0)
 	Print("Failed to mount /" ROOT_PREFIX " filesystem\n");
     else
 	Print("Mounted /" ROOT_PREFIX " filesystem!\n");
 
+    /* The second disk, if any, holds a GOSFS filesystem */
+    if (Mount("ide1", "d", "gosfs") == 0)
+	Print("Mounted /d filesystem!\n");
+
 }
 
 
@@ -11,16 +11,152 @@
 #include <geekos/int.h>
 #include <geekos/bget.h>
 #include <geekos/kassert.h>
+#include <geekos/mem.h>
+#include <geekos/memstat.h>
 #include <geekos/malloc.h>
 
+/*
+ * Small requests are served by a segregated-fit front end:
+ * power-of-two size classes from 16 to 2048 bytes, each carved out
+ * of whole pages obtained from Alloc_Page().  The bookkeeping for
+ * a size class page lives in its struct Page, so a block carries no
+ * header, and Free() can tell the two kinds of buffer apart by the
+ * PAGE_MALLOC flag.  Larger requests go to bget.
+ */
+#define MIN_SIZE_CLASS   16
+#define MAX_SIZE_CLASS   2048
+#define NUM_SIZE_CLASSES 8
+
+/*
+ * For each size class, the pages which have at least one free block.
+ * Pages with no free blocks are not on any list.  (The Page_List link
+ * fields are otherwise only used for the freelist, and a page
+ * owned by Malloc() is never on the freelist.)
+ */
+static struct Page_List s_partialPages[NUM_SIZE_CLASSES];
+
+/*
+ * Size of the bget heap.
+ */
+static ulong_t s_heapSize;
+
+/*
+ * Find the smallest size class which can hold given number of bytes.
+ */
+static __inline__ int Size_Class_Index(ulong_t size)
+{
+    int index = 0;
+    ulong_t blockSize = MIN_SIZE_CLASS;
+
+    while (blockSize < size) {
+	blockSize <<= 1;
+	++index;
+    }
+    return index;
+}
+
+/*
+ * Carve a fresh page into blocks for given size class.
+ * Returns the page, or null if no page could be allocated.
+ * Must be called with interrupts disabled.
+ */
+static struct Page* Grow_Size_Class(int index)
+{
+    ulong_t blockSize = MIN_SIZE_CLASS << index;
+    char *pageAddr, *block;
+    struct Page *page;
+
+    pageAddr = Alloc_Page();
+    if (pageAddr == 0)
+	return 0;
+
+    page = Get_Page((ulong_t) pageAddr);
+    page->flags |= PAGE_MALLOC;
+    page->numInUse = 0;
+    page->sizeClass = index;
+
+    /* Thread the blocks together, lowest address first */
+    page->freeBlocks = 0;
+    for (block = pageAddr + PAGE_SIZE - blockSize; block >= pageAddr; block -= blockSize) {
+	*((void**) block) = page->freeBlocks;
+	page->freeBlocks = block;
+    }
+
+    Add_To_Front_Of_Page_List(&s_partialPages[index], page);
+    return page;
+}
+
+/*
+ * Allocate a block from given size class.
+ * Must be called with interrupts disabled.
+ */
+static void* Alloc_From_Size_Class(int index)
+{
+    struct Page *page;
+    void *block;
+
+    page = Get_Front_Of_Page_List(&s_partialPages[index]);
+    if (page == 0) {
+	page = Grow_Size_Class(index);
+	if (page == 0)
+	    return 0;
+    }
+
+    block = page->freeBlocks;
+    page->freeBlocks = *((void**) block);
+    ++page->numInUse;
+
+    /* A full page leaves the partial list until a block is freed */
+    if (page->freeBlocks == 0)
+	Remove_From_Page_List(&s_partialPages[index], page);
+
+    return block;
+}
+
+/*
+ * Return a block to the size class page it came from.
+ * Must be called with interrupts disabled.
+ */
+static void Free_To_Size_Class(struct Page *page, void *block)
+{
+    struct Page_List *list = &s_partialPages[page->sizeClass];
+
+    KASSERT(page->numInUse > 0);
+
+    if (page->freeBlocks == 0)
+	Add_To_Front_Of_Page_List(list, page);
+    *((void**) block) = page->freeBlocks;
+    page->freeBlocks = block;
+    --page->numInUse;
+
+    /*
+     * Give an empty page back to the page allocator, unless it is
+     * the only partial page of its size class: keeping one around
+     * avoids thrashing when a single block is repeatedly allocated
+     * and freed.
+     */
+    if (page->numInUse == 0 &&
+	(Get_Front_Of_Page_List(list) != page || Get_Next_In_Page_List(page) != 0)) {
+	Remove_From_Page_List(list, page);
+	page->flags &= ~(PAGE_MALLOC);
+	Free_Page((void*) Get_Page_Address(page));
+    }
+}
+
 /*
  * Initialize the heap starting at given address and occupying
  * specified number of bytes.
  */
 void Init_Heap(ulong_t start, ulong_t size)
 {
+    int i;
+
     /*Print("Creating kernel heap: start=%lx, size=%ld\n", start, size);*/
     bpool((void*) start, size);
+    s_heapSize = size;
+
+    for (i = 0; i < NUM_SIZE_CLASSES; ++i)
+	Clear_Page_List(&s_partialPages[i]);
 }
 
 /*
@@ -36,7 +172,11 @@ void* Malloc(ulong_t size)
     KASSERT(size > 0);
 
     iflag = Begin_Int_Atomic();
-    result = bget(size);
+    result = 0;
+    if (size <= MAX_SIZE_CLASS)
+	result = Alloc_From_Size_Class(Size_Class_Index(size));
+    if (result == 0)
+	result = bget(size);
     End_Int_Atomic(iflag);
 
     return result;
@@ -47,9 +187,41 @@ void* Malloc(ulong_t size)
  */
 void Free(void* buf)
 {
+    struct Page *page;
     bool iflag;
 
+    KASSERT(buf != 0);
+
     iflag = Begin_Int_Atomic();
-    brel(buf);
+    page = Get_Page((ulong_t) buf);
+    if (page->flags & PAGE_MALLOC)
+	Free_To_Size_Class(page, buf);
+    else
+	brel(buf);
     End_Int_Atomic(iflag);
 }
+
+/*
+ * Get usage statistics for the bget heap, for the MemStats
+ * system call.  (Memory in size class pages is counted
+ * by Get_Page_Stats().)
+ */
+void Get_Heap_Stats(struct Mem_Stats *stats)
+{
+    bufsize curalloc, totfree, maxfree, peakalloc;
+    long nget, nrel;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    bstats(&curalloc, &totfree, &maxfree, &nget, &nrel);
+    bstatspeak(&peakalloc);
+    End_Int_Atomic(iflag);
+
+    stats->heapSize = s_heapSize;
+    stats->heapInUse = curalloc;
+    stats->heapPeak = peakalloc;
+    stats->heapFree = totfree;
+    stats->heapLargestFree = maxfree < 0 ? 0 : maxfree;
+    stats->numHeapAllocs = nget;
+    stats->numHeapFrees = nrel;
+}
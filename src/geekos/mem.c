@@ -17,6 +17,7 @@
 #include <geekos/int.h>
 #include <geekos/malloc.h>
 #include <geekos/string.h>
+#include <geekos/memstat.h>
 #include <geekos/mem.h>
 
 /* ----------------------------------------------------------------------
@@ -33,6 +34,12 @@ struct Page* g_pageList;
  */
 uint_t g_freePageCount = 0;
 
+/*
+ * Number of free pages which have already been filled with zeroes.
+ * These are included in g_freePageCount.
+ */
+uint_t g_zeroedPageCount = 0;
+
 /* ----------------------------------------------------------------------
  * Private data and functions
  * ---------------------------------------------------------------------- */
@@ -48,6 +55,17 @@ extern int debugFaults;
  */
 static struct Page_List s_freeList;
 
+/*
+ * Free pages which the idle thread has filled with zeroes,
+ * so Alloc_Zeroed_Page() doesn't have to.
+ */
+static struct Page_List s_zeroedList;
+
+/*
+ * The idle thread stops zeroing pages when this many are ready.
+ */
+#define ZEROED_POOL_SIZE 64
+
 /*
  * Total number of physical pages.
  */
@@ -170,34 +188,147 @@ void Init_BSS(void)
     memset(&BSS_START, '\0', &BSS_END - &BSS_START);
 }
 
+/*
+ * Take the first page from given list and mark it allocated.
+ * Returns null if the list is empty.
+ * Must be called with interrupts disabled.
+ */
+static void* Take_Page(struct Page_List *list)
+{
+    struct Page* page;
+
+    if (Is_Page_List_Empty(list))
+	return 0;
+
+    /* Remove the first page on the list. */
+    page = Get_Front_Of_Page_List(list);
+    KASSERT((page->flags & PAGE_ALLOCATED) == 0);
+    Remove_From_Front_Of_Page_List(list);
+
+    /* Mark page as having been allocated. */
+    page->flags |= PAGE_ALLOCATED;
+    g_freePageCount--;
+    return (void*) Get_Page_Address(page);
+}
+
 /*
  * Allocate a page of physical memory.
  */
 void* Alloc_Page(void)
 {
-    struct Page* page;
-    void *result = 0;
+    void *result;
 
     bool iflag = Begin_Int_Atomic();
 
-    /* See if we have a free page */
-    if (!Is_Page_List_Empty(&s_freeList)) {
-	/* Remove the first page on the freelist. */
-	page = Get_Front_Of_Page_List(&s_freeList);
-	KASSERT((page->flags & PAGE_ALLOCATED) == 0);
-	Remove_From_Front_Of_Page_List(&s_freeList);
-
-	/* Mark page as having been allocated. */
-	page->flags |= PAGE_ALLOCATED;
-	g_freePageCount--;
-	result = (void*) Get_Page_Address(page);
-    }
+    /* Use up pages nobody has bothered to zero first */
+    result = Take_Page(&s_freeList);
+    if (result == 0 && (result = Take_Page(&s_zeroedList)) != 0)
+	g_zeroedPageCount--;
 
     End_Int_Atomic(iflag);
 
     return result;
 }
 
+/*
+ * Allocate a page of physical memory filled with zeroes.
+ * Uses a page zeroed in the background by the idle thread
+ * if one is available, otherwise zeroes one on the spot.
+ */
+void* Alloc_Zeroed_Page(void)
+{
+    void *result;
+
+    bool iflag = Begin_Int_Atomic();
+    result = Take_Page(&s_zeroedList);
+    if (result != 0)
+	g_zeroedPageCount--;
+    End_Int_Atomic(iflag);
+
+    if (result == 0) {
+	result = Alloc_Page();
+	if (result != 0)
+	    memset(result, '\0', PAGE_SIZE);
+    }
+
+    return result;
+}
+
+/*
+ * Count pages by type of use, for the MemStats system call.
+ */
+void Get_Page_Stats(struct Mem_Stats *stats)
+{
+    ulong_t i;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+
+    stats->numPages = s_numPages;
+    stats->freePages = g_freePageCount;
+    stats->zeroedPages = g_zeroedPageCount;
+    stats->kernelPages = stats->heapPages = stats->hardwarePages = 0;
+    stats->allocatedPages = stats->mallocPages = stats->unusedPages = 0;
+
+    for (i = 0; i < s_numPages; ++i) {
+	unsigned flags = g_pageList[i].flags;
+
+	if (flags & PAGE_ALLOCATED) {
+	    ++stats->allocatedPages;
+	    if (flags & PAGE_MALLOC)
+		++stats->mallocPages;
+	} else if (flags & PAGE_KERN)
+	    ++stats->kernelPages;
+	else if (flags & PAGE_HEAP)
+	    ++stats->heapPages;
+	else if (flags & PAGE_HW)
+	    ++stats->hardwarePages;
+	else if (flags & PAGE_UNUSED)
+	    ++stats->unusedPages;
+    }
+
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Move one page from the freelist to the pool of zeroed pages.
+ * Called from the idle thread, with interrupts enabled, so the
+ * zeroing itself does not hold off other threads.
+ * Returns true if a page was zeroed, false if the pool is full
+ * or there are no free pages.
+ */
+bool Zero_Free_Page(void)
+{
+    struct Page *page;
+
+    KASSERT(Interrupts_Enabled());
+
+    Disable_Interrupts();
+    if (g_zeroedPageCount >= ZEROED_POOL_SIZE || Is_Page_List_Empty(&s_freeList)) {
+	Enable_Interrupts();
+	return false;
+    }
+    page = Get_Front_Of_Page_List(&s_freeList);
+    Remove_From_Front_Of_Page_List(&s_freeList);
+
+    /*
+     * While it is being zeroed, the page is on neither list;
+     * anyone who needs it will find it on the zeroed list shortly.
+     */
+    page->flags |= PAGE_ALLOCATED;
+    Enable_Interrupts();
+
+    memset((void*) Get_Page_Address(page), '\0', PAGE_SIZE);
+
+    Disable_Interrupts();
+    page->flags &= ~(PAGE_ALLOCATED);
+    Add_To_Back_Of_Page_List(&s_zeroedList, page);
+    g_zeroedPageCount++;
+    Enable_Interrupts();
+
+    return true;
+}
+
 /*
  * Free a page of physical memory.
  */
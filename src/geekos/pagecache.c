@@ -0,0 +1,215 @@
+/*
+ * File page cache
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * NOTES:
+ * - Filesystems cache file contents here a page at a time, so only
+ *   the parts of a file which are actually read take up memory.
+ * - The number of pages is bounded by g_pageCacheMaxPages.  Unused
+ *   pages are kept on a single LRU list, and the least recently used
+ *   one is reclaimed when a new page would exceed the limit, or when
+ *   the page allocator runs out of memory.  Pages in use are never
+ *   reclaimed, so the limit may be exceeded while many are in use.
+ */
+
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/malloc.h>
+#include <geekos/mem.h>
+#include <geekos/synch.h>
+#include <geekos/pagecache.h>
+
+/*#define PAGECACHE_DEBUG */
+#ifdef PAGECACHE_DEBUG
+#  define Debug(args...) Print(args)
+#else
+#  define Debug(args...)
+#endif
+
+/* ----------------------------------------------------------------------
+ * Private data and functions
+ * ---------------------------------------------------------------------- */
+
+#define PAGE_HASH_SIZE	256
+
+ulong_t g_pageCacheMaxPages = PAGE_CACHE_DEFAULT_MAX_PAGES;
+
+/*
+ * Protects the hash table, the LRU list and page reference counts.
+ */
+static struct Mutex s_pageCacheLock;
+
+static struct Cache_Page *s_pageHash[PAGE_HASH_SIZE];
+static struct Cache_Page_List s_lruList;
+static ulong_t s_numPages;
+
+static __inline__ struct Cache_Page **Hash_Chain(void *owner, ulong_t index)
+{
+    return &s_pageHash[(((ulong_t) owner >> 4) ^ index) % PAGE_HASH_SIZE];
+}
+
+static struct Cache_Page *Find_Page(void *owner, ulong_t index)
+{
+    struct Cache_Page *page;
+
+    for (page = *Hash_Chain(owner, index); page != 0; page = page->hashNext) {
+	if (page->owner == owner && page->index == index)
+	    break;
+    }
+    return page;
+}
+
+static void Remove_From_Hash(struct Cache_Page *page)
+{
+    struct Cache_Page **pPage = Hash_Chain(page->owner, page->index);
+
+    while (*pPage != page)
+	pPage = &(*pPage)->hashNext;
+    *pPage = page->hashNext;
+}
+
+/*
+ * Free an unused page, which must already be
+ * off the LRU list and out of the hash table.
+ */
+static void Free_Cache_Page(struct Cache_Page *page)
+{
+    KASSERT(page->refCount == 0);
+    --s_numPages;
+    Free_Page(page->data);
+    Free(page);
+}
+
+/*
+ * Reclaim the least recently used page.
+ * Returns false if every page is in use.
+ */
+static bool Reclaim_Page(void)
+{
+    struct Cache_Page *page;
+
+    KASSERT(IS_HELD(&s_pageCacheLock));
+
+    if (Is_Cache_Page_List_Empty(&s_lruList))
+	return false;
+
+    page = Get_Front_Of_Cache_Page_List(&s_lruList);
+    Debug("Reclaiming page %lu of %p\n", page->index, page->owner);
+    Remove_From_Front_Of_Cache_Page_List(&s_lruList);
+    Remove_From_Hash(page);
+    Free_Cache_Page(page);
+    return true;
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Initialize the page cache.
+ */
+void Init_Page_Cache(void)
+{
+    Mutex_Init(&s_pageCacheLock);
+}
+
+/*
+ * Get the cached page with given index for given owner,
+ * allocating an empty one if it isn't cached.
+ * The page stays in use until Release_Cache_Page() is called.
+ * Returns 0 if successful, ENOMEM if no page could be allocated.
+ */
+int Get_Cache_Page(void *owner, ulong_t index, struct Cache_Page **pPage)
+{
+    struct Cache_Page *page;
+    int rc = 0;
+
+    Mutex_Lock(&s_pageCacheLock);
+
+    page = Find_Page(owner, index);
+    if (page != 0) {
+	if (page->refCount++ == 0)
+	    Remove_From_Cache_Page_List(&s_lruList, page);
+	goto done;
+    }
+
+    /* Make room within the limit */
+    while (s_numPages >= g_pageCacheMaxPages && Reclaim_Page())
+	;
+
+    page = (struct Cache_Page*) Malloc(sizeof(*page));
+    if (page == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
+
+    /* If memory is short, give up cached pages until we get one */
+    while ((page->data = Alloc_Page()) == 0) {
+	if (!Reclaim_Page()) {
+	    Free(page);
+	    page = 0;
+	    rc = ENOMEM;
+	    goto done;
+	}
+    }
+
+    page->owner = owner;
+    page->index = index;
+    page->validMask = 0;
+    page->refCount = 1;
+    page->hashNext = *Hash_Chain(owner, index);
+    *Hash_Chain(owner, index) = page;
+    ++s_numPages;
+
+done:
+    if (rc == 0)
+	*pPage = page;
+    Mutex_Unlock(&s_pageCacheLock);
+    return rc;
+}
+
+/*
+ * Stop using a page obtained from Get_Cache_Page().
+ * It stays cached until it is reclaimed or discarded.
+ */
+void Release_Cache_Page(struct Cache_Page *page)
+{
+    Mutex_Lock(&s_pageCacheLock);
+    KASSERT(page->refCount > 0);
+    if (--page->refCount == 0)
+	Add_To_Back_Of_Cache_Page_List(&s_lruList, page);
+    Mutex_Unlock(&s_pageCacheLock);
+}
+
+/*
+ * Discard all cached pages belonging to given owner,
+ * none of which may be in use.
+ */
+void Discard_Cache_Pages(void *owner)
+{
+    int i;
+
+    Mutex_Lock(&s_pageCacheLock);
+    for (i = 0; i < PAGE_HASH_SIZE; ++i) {
+	struct Cache_Page **pPage = &s_pageHash[i];
+
+	while (*pPage != 0) {
+	    struct Cache_Page *page = *pPage;
+
+	    if (page->owner != owner) {
+		pPage = &page->hashNext;
+		continue;
+	    }
+	    KASSERT(page->refCount == 0);
+	    *pPage = page->hashNext;
+	    Remove_From_Cache_Page_List(&s_lruList, page);
+	    Free_Cache_Page(page);
+	}
+    }
+    Mutex_Unlock(&s_pageCacheLock);
+}
@@ -0,0 +1,145 @@
+/*
+ * PCI configuration space access
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * Information sources:
+ * - PCI Local Bus Specification, Revision 2.2, section 3.2.2.3.2
+ *   (configuration mechanism #1)
+ */
+
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/io.h>
+#include <geekos/int.h>
+#include <geekos/pci.h>
+
+/* ----------------------------------------------------------------------
+ * Definitions
+ * ---------------------------------------------------------------------- */
+
+#define PCI_CONFIG_ADDRESS	0xCF8
+#define PCI_CONFIG_DATA		0xCFC
+
+#define PCI_MAX_BUS		256
+#define PCI_MAX_SLOT		32
+#define PCI_MAX_FUNC		8
+
+/* Header type bit for devices with more than one function */
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+/*#define DEBUG_PCI */
+#ifdef DEBUG_PCI
+#  define Debug(args...) Print(args)
+#else
+#  define Debug(args...)
+#endif
+
+/* ----------------------------------------------------------------------
+ * Private functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Select a double word of a function's configuration space.
+ */
+static void Select_Config(int bus, int slot, int func, int offset)
+{
+    Out_DWord(PCI_CONFIG_ADDRESS, 0x80000000UL |
+	((ulong_t) bus << 16) | ((ulong_t) slot << 11) |
+	((ulong_t) func << 8) | (offset & 0xFC));
+}
+
+static ulong_t Read_Config(int bus, int slot, int func, int offset)
+{
+    bool iflag = Begin_Int_Atomic();
+    ulong_t value;
+
+    Select_Config(bus, slot, func, offset);
+    value = In_DWord(PCI_CONFIG_DATA);
+
+    End_Int_Atomic(iflag);
+    return value;
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Read the double word at given offset (a multiple of 4)
+ * in the configuration space of a PCI function.
+ */
+ulong_t PCI_Read_Config(struct PCI_Device *dev, int offset)
+{
+    KASSERT((offset & 3) == 0);
+    return Read_Config(dev->bus, dev->slot, dev->func, offset);
+}
+
+/*
+ * Write the double word at given offset (a multiple of 4)
+ * in the configuration space of a PCI function.
+ */
+void PCI_Write_Config(struct PCI_Device *dev, int offset, ulong_t value)
+{
+    bool iflag;
+
+    KASSERT((offset & 3) == 0);
+
+    iflag = Begin_Int_Atomic();
+    Select_Config(dev->bus, dev->slot, dev->func, offset);
+    Out_DWord(PCI_CONFIG_DATA, value);
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Scan the PCI buses for the first function with given
+ * class and subclass.
+ * Returns true and fills in dev if one was found,
+ * false otherwise.
+ */
+bool Find_PCI_Device(uchar_t classCode, uchar_t subclass, struct PCI_Device *dev)
+{
+    int bus, slot, func;
+
+    for (bus = 0; bus < PCI_MAX_BUS; ++bus) {
+	for (slot = 0; slot < PCI_MAX_SLOT; ++slot) {
+	    for (func = 0; func < PCI_MAX_FUNC; ++func) {
+		ulong_t id = Read_Config(bus, slot, func, PCI_VENDOR_ID);
+		ulong_t class;
+
+		if ((id & 0xFFFF) == 0xFFFF) {
+		    /* No function here; an empty function 0 means an empty slot */
+		    if (func == 0)
+			break;
+		    continue;
+		}
+
+		class = Read_Config(bus, slot, func, PCI_PROG_IF & ~3);
+		Debug("pci %d:%d.%d: vendor %x device %x class %x\n",
+		    bus, slot, func, id & 0xFFFF, id >> 16, class >> 8);
+
+		if (((class >> 24) & 0xFF) == classCode && ((class >> 16) & 0xFF) == subclass) {
+		    dev->bus = bus;
+		    dev->slot = slot;
+		    dev->func = func;
+		    dev->vendorId = id & 0xFFFF;
+		    dev->deviceId = id >> 16;
+		    dev->classCode = classCode;
+		    dev->subclass = subclass;
+		    dev->progIf = (class >> 8) & 0xFF;
+		    return true;
+		}
+
+		/* Only look at other functions of multifunction devices */
+		if (func == 0 &&
+		    !((Read_Config(bus, slot, 0, PCI_HEADER_TYPE & ~3) >> 16) & PCI_HEADER_MULTIFUNCTION))
+		    break;
+	    }
+	}
+    }
+
+    return false;
+}
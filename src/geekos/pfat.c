@@ -15,7 +15,9 @@
 #include <geekos/malloc.h>
 #include <geekos/ide.h>
 #include <geekos/blockdev.h>
+#include <geekos/bufcache.h>
 #include <geekos/bitset.h>
+#include <geekos/pagecache.h>
 #include <geekos/vfs.h>
 #include <geekos/list.h>
 #include <geekos/synch.h>
@@ -29,11 +31,6 @@
  *   allocating them repeatedly
  */
 
-/*
- * TODO:
- * - Support hierarchical directories
- */
-
 /* ----------------------------------------------------------------------
  * Private functions
  * ---------------------------------------------------------------------- */
@@ -43,8 +40,72 @@
 int debugPFAT = 0;
 #define Debug(args...) if (debugPFAT) Print("PFAT: " args)
 
+/*
+ * Readahead: once a file is being read sequentially, blocks beyond
+ * the ones requested are fetched in the background.  The window
+ * starts at PFAT_READAHEAD_MIN blocks and doubles with each
+ * sequential read, up to PFAT_READAHEAD_MAX blocks.
+ */
+#define PFAT_READAHEAD_MIN		8
+#define PFAT_READAHEAD_MAX		128
+#define PFAT_READAHEAD_MAX_PAGES	(PFAT_READAHEAD_MAX / BLOCKS_PER_PAGE + 1)
+#define PFAT_READAHEAD_MAX_REQUESTS	32
+
+/*
+ * Number of pages PFAT_Read() fills at a time.
+ */
+#define PFAT_READ_BATCH_PAGES		8
+
+/*
+ * Number of closed files whose PFAT_File objects (and cached
+ * pages) are kept, in case they are opened again.
+ */
+#define PFAT_MAX_IDLE_FILES		16
+
+/*
+ * Number of hash chains in the index of each directory.
+ */
+#define PFAT_DIR_HASH_SIZE		64
+
 struct PFAT_File;
 DEFINE_LIST(PFAT_File_List, PFAT_File);
+struct PFAT_Dir;
+DEFINE_LIST(PFAT_Dir_List, PFAT_Dir);
+
+/*
+ * A run of file blocks which are consecutive on the device.
+ */
+struct PFAT_Extent {
+    ulong_t fileBlock;			 /* First file block in the run */
+    ulong_t devBlock;			 /* Device block holding it */
+    ulong_t numBlocks;			 /* Length of the run */
+};
+
+/*
+ * In-memory copy of a directory, indexed by a hash of the names.
+ * The root directory is a single array of entries, read when the
+ * filesystem is mounted.  Subdirectories are files whose blocks
+ * each hold PFAT_DIR_ENTRIES_PER_BLOCK entries; they are read
+ * the first time a path leads through them, and kept while the
+ * filesystem is mounted.
+ * Protected by the instance lock.
+ */
+struct PFAT_Dir {
+    directoryEntry *entry;		 /* Entry of the directory in its parent */
+    struct PFAT_File *file;		 /* Blocks of a subdirectory, null for the root */
+    directoryEntry *entries;		 /* Entries of the root directory */
+    char **blockList;			 /* Blocks of a subdirectory... */
+    bool *dirtyList;			 /* ...and whether they were modified */
+    int numBlocks;
+    int maxBlocks;			 /* Room in blockList and dirtyList */
+    int numEntries;			 /* Slots in the directory, used or free */
+    int maxEntries;			 /* Room in hashNext */
+    int hash[PFAT_DIR_HASH_SIZE];	 /* Chains of entry numbers, ending with -1 */
+    int *hashNext;			 /* Next entry in chain, for each slot */
+    int refCount;			 /* Number of File objects using it */
+    DEFINE_LINK(PFAT_Dir_List, PFAT_Dir);
+};
+IMPLEMENT_LIST(PFAT_Dir_List, PFAT_Dir);
 
 /*
  * In-memory information describing a mounted PFAT filesystem.
@@ -55,26 +116,64 @@ struct PFAT_Instance {
     int *fat;
     directoryEntry *rootDir;
     directoryEntry rootDirEntry;
+    struct Block_Device *dev;
+    struct FS_Buffer_Cache *fsCache;	 /* cache of filesystem metadata blocks */
+
+    /* Block allocation state */
+    ulong_t numFatEntries;		 /* blocks covered by the FAT and the device */
+    ulong_t firstDataBlock;		 /* first block following the root directory */
+    void *freeMap;			 /* bit set of blocks in use or reserved */
+    ulong_t numFreeBlocks;
+
+    /* Metadata modified in memory, not yet written to the device */
+    void *fatDirtySet;			 /* bit set of FAT sectors */
+    void *dirDirtySet;			 /* bit set of root directory sectors */
+    int rootDirSectors;
+
+    struct PFAT_Dir root;
+    struct PFAT_Dir_List dirList;	 /* Subdirectories read so far */
+
     struct Mutex lock;
-    struct PFAT_File_List fileList;
+    struct PFAT_File_List fileList;	 /* Open files, then idle ones by age */
+    int numIdleFiles;
 };
 
 /*
- * In-memory information for a particular open file.
- * In particular, this object contains a cache of the contents
- * of the file.
+ * In-memory information for a particular file.
+ * The contents of the file are cached in the page cache,
+ * with the PFAT_File as the owner of the pages.
  * Kept in fsInfo field of File.
  */
 struct PFAT_File {
-    directoryEntry *entry;		 /* Directory entry of the file */
+    directoryEntry *entry;		 /* Directory entry of the file... */
+    struct PFAT_Dir *dir;		 /* ...which is in this directory */
+    int index;				 /* ...at this slot */
     ulong_t numBlocks;			 /* Number of blocks used by file */
-    char *fileDataCache;		 /* File data cache */
-    struct Bit_Set *validBlockSet;	 /* Which data blocks of cache are valid */
+    int refCount;			 /* Number of File objects using it */
+    struct PFAT_Extent *extentList;	 /* Blocks of the file, in file order */
+    int numExtents;
+    int maxExtents;			 /* Room in extentList */
+
+    /* Readahead state */
+    ulong_t nextBlock;			 /* Block following the last one read */
+    ulong_t readaheadWindow;		 /* Blocks to read ahead, 0 if not sequential */
+    ulong_t readaheadStart;		 /* Blocks being read ahead... */
+    ulong_t readaheadEnd;		 /* ...and the one following them */
+    struct Cache_Page *readaheadPages[PFAT_READAHEAD_MAX_PAGES];
+    int numReadaheadPages;
+    struct Block_Request *readaheadList[PFAT_READAHEAD_MAX_REQUESTS];
+    int numReadaheadRequests;
+
     struct Mutex lock;			 /* Synchronize concurrent accesses */
     DEFINE_LINK(PFAT_File_List, PFAT_File);
 };
 IMPLEMENT_LIST(PFAT_File_List, PFAT_File);
 
+static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, struct PFAT_Dir *dir, int index);
+static void Release_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile);
+static void Put_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile);
+static int PFAT_Sync(struct Mount_Point *mountPoint);
+
 /*
  * Copy file metadata from directory entry into
  * struct VFS_File_Stat object.
@@ -92,6 +191,23 @@ static void Copy_Stat(struct VFS_File_Stat *stat, directoryEntry *entry)
 	stat->acls[0].permission |= O_WRITE;
 }
 
+/*
+ * Get the entry in given slot of a directory, or the
+ * directory's own entry if index is -1.
+ */
+static directoryEntry *PFAT_Dir_Entry(struct PFAT_Dir *dir, int index)
+{
+    KASSERT(index >= -1 && index < dir->numEntries);
+
+    if (index < 0)
+	return dir->entry;
+    else if (dir->file == 0)
+	return &dir->entries[index];
+    else
+	return (directoryEntry*) dir->blockList[index / PFAT_DIR_ENTRIES_PER_BLOCK] +
+	    index % PFAT_DIR_ENTRIES_PER_BLOCK;
+}
+
 /*
  * FStat function for PFAT files.
  */
@@ -102,240 +218,1249 @@ static int PFAT_FStat(struct File *file, struct VFS_File_Stat *stat)
     return 0;
 }
 
+/*
+ * Follow the FAT chain of a file once, recording its blocks as a
+ * list of extents.  Stops early if the chain is shorter than the
+ * file, so that reading past the last extent reports the problem.
+ * Returns the number of extents stored, or counts them
+ * if extentList is null.
+ */
+static int PFAT_Walk_Extents(struct PFAT_Instance *instance, directoryEntry *entry,
+    ulong_t numBlocks, struct PFAT_Extent *extentList)
+{
+    ulong_t numFatEntries = instance->fsinfo.fileAllocationLength * (SECTOR_SIZE / sizeof(int));
+    ulong_t curBlock = entry->firstBlock, prevBlock = 0;
+    ulong_t i;
+    int numExtents = 0;
+
+    for (i = 0; i < numBlocks; ++i) {
+	if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF || curBlock >= numFatEntries)
+	    break;  /* probable filesystem corruption */
+
+	if (numExtents > 0 && curBlock == prevBlock + 1) {
+	    if (extentList != 0)
+		++extentList[numExtents-1].numBlocks;
+	} else {
+	    if (extentList != 0) {
+		extentList[numExtents].fileBlock = i;
+		extentList[numExtents].devBlock = curBlock;
+		extentList[numExtents].numBlocks = 1;
+	    }
+	    ++numExtents;
+	}
+
+	prevBlock = curBlock;
+	curBlock = instance->fat[curBlock];
+    }
+
+    return numExtents;
+}
+
+/*
+ * Find the extent containing given file block.
+ * Returns its index, or numExtents if the block
+ * is beyond the last extent.
+ */
+static int PFAT_Find_Extent(struct PFAT_File *pfatFile, ulong_t fileBlock)
+{
+    struct PFAT_Extent *extentList = pfatFile->extentList;
+    int low = 0, high = pfatFile->numExtents;
+
+    /* Find the last extent starting at or before the block */
+    while (high - low > 1) {
+	int mid = (low + high) / 2;
+	if (extentList[mid].fileBlock <= fileBlock)
+	    low = mid;
+	else
+	    high = mid;
+    }
+
+    if (low < pfatFile->numExtents &&
+	fileBlock - extentList[low].fileBlock < extentList[low].numBlocks)
+	return low;
+    return pfatFile->numExtents;
+}
+
+/*
+ * Note that the FAT entry for given block has changed.
+ */
+static void Mark_FAT_Dirty(struct PFAT_Instance *instance, ulong_t block)
+{
+    Set_Bit(instance->fatDirtySet, block / (SECTOR_SIZE / sizeof(int)));
+}
+
+/*
+ * Note that the entry in given slot of a directory has changed.
+ */
+static void Mark_Dir_Entry_Dirty(struct PFAT_Instance *instance, struct PFAT_Dir *dir, int index)
+{
+    KASSERT(index >= 0 && index < dir->numEntries);
+
+    if (dir->file == 0) {
+	ulong_t offset = index * sizeof(directoryEntry);
+
+	Set_Bit(instance->dirDirtySet, offset / SECTOR_SIZE);
+	Set_Bit(instance->dirDirtySet, (offset + sizeof(directoryEntry) - 1) / SECTOR_SIZE);
+    } else
+	dir->dirtyList[index / PFAT_DIR_ENTRIES_PER_BLOCK] = true;
+}
+
+/*
+ * Write the sectors marked in dirtySet from a metadata buffer
+ * whose first sector belongs at device block firstBlock.
+ * Consecutive dirty sectors are written together.
+ */
+static int PFAT_Write_Dirty_Sectors(struct Block_Device *dev, void *dirtySet,
+    int numSectors, ulong_t firstBlock, void *data)
+{
+    int i = 0;
+
+    while (i < numSectors) {
+	int count, rc;
+
+	if (!Is_Bit_Set(dirtySet, i)) {
+	    ++i;
+	    continue;
+	}
+	for (count = 1; i + count < numSectors && Is_Bit_Set(dirtySet, i + count); ++count)
+	    ;
+
+	Debug("Writing metadata blocks %lu..%lu\n", firstBlock + i, firstBlock + i + count - 1);
+	rc = Block_Write_Range(dev, firstBlock + i, count, (char*) data + i * SECTOR_SIZE);
+	if (rc != 0)
+	    return rc;
+	for (; count > 0; --count)
+	    Clear_Bit(dirtySet, i++);
+    }
+
+    return 0;
+}
+
+/*
+ * Write modified FAT and directory sectors to the device.
+ * The FAT goes first, so the directories never refer to blocks
+ * the FAT on the device doesn't have allocated, and the root
+ * directory last, as the subdirectories hang from it.
+ * Called with the instance lock held.
+ */
+static int PFAT_Flush_Metadata(struct Block_Device *dev, struct PFAT_Instance *instance)
+{
+    bootSector *fsinfo = &instance->fsinfo;
+    struct PFAT_Dir *dir;
+    int rc, i;
+
+    rc = PFAT_Write_Dirty_Sectors(dev, instance->fatDirtySet,
+	fsinfo->fileAllocationLength, fsinfo->fileAllocationOffset, instance->fat);
+    if (rc != 0)
+	return rc;
+
+    for (dir = Get_Front_Of_PFAT_Dir_List(&instance->dirList);
+	 dir != 0;
+	 dir = Get_Next_In_PFAT_Dir_List(dir)) {
+	for (i = 0; i < dir->numBlocks; ++i) {
+	    struct PFAT_Extent *ext;
+	    int extent;
+
+	    if (!dir->dirtyList[i])
+		continue;
+	    extent = PFAT_Find_Extent(dir->file, i);
+	    if (extent >= dir->file->numExtents)
+		return EIO;  /* probable filesystem corruption */
+	    ext = &dir->file->extentList[extent];
+	    rc = Block_Write(dev, ext->devBlock + (i - ext->fileBlock), dir->blockList[i]);
+	    if (rc != 0)
+		return rc;
+	    dir->dirtyList[i] = false;
+	}
+    }
+
+    return PFAT_Write_Dirty_Sectors(dev, instance->dirDirtySet,
+	instance->rootDirSectors, fsinfo->rootDirectoryOffset, instance->rootDir);
+}
+
+/*
+ * Add a run of device blocks to the end of a file's extent list.
+ */
+static int PFAT_Add_Extent(struct PFAT_File *pfatFile, ulong_t devBlock, ulong_t numBlocks)
+{
+    struct PFAT_Extent *ext;
+
+    if (pfatFile->numExtents > 0) {
+	ext = &pfatFile->extentList[pfatFile->numExtents - 1];
+	if (ext->devBlock + ext->numBlocks == devBlock) {
+	    ext->numBlocks += numBlocks;
+	    return 0;
+	}
+    }
+
+    if (pfatFile->numExtents == pfatFile->maxExtents) {
+	int maxExtents = pfatFile->maxExtents > 0 ? pfatFile->maxExtents * 2 : 4;
+	struct PFAT_Extent *extentList;
+
+	extentList = (struct PFAT_Extent*) Malloc(maxExtents * sizeof(*extentList));
+	if (extentList == 0)
+	    return ENOMEM;
+	if (pfatFile->extentList != 0) {
+	    memcpy(extentList, pfatFile->extentList, pfatFile->numExtents * sizeof(*extentList));
+	    Free(pfatFile->extentList);
+	}
+	pfatFile->extentList = extentList;
+	pfatFile->maxExtents = maxExtents;
+    }
+
+    ext = &pfatFile->extentList[pfatFile->numExtents++];
+    ext->fileBlock = pfatFile->numBlocks;
+    ext->devBlock = devBlock;
+    ext->numBlocks = numBlocks;
+    return 0;
+}
+
+/*
+ * Allocate blocks at the end of a file until it has numBlocks blocks.
+ * Blocks are taken in runs, to keep the file in few extents: first
+ * the free blocks following the file's last block, otherwise the
+ * first free run long enough for the rest of the file, otherwise
+ * the first free run of any length.
+ * Called with the PFAT_File's lock and the instance lock held.
+ */
+static int PFAT_Grow_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile, ulong_t numBlocks)
+{
+    directoryEntry *entry = pfatFile->entry;
+
+    if (numBlocks <= pfatFile->numBlocks)
+	return 0;
+    if (numBlocks - pfatFile->numBlocks > instance->numFreeBlocks)
+	return ENOSPACE;
+
+    /* Don't extend a file whose FAT chain is broken */
+    if (pfatFile->numExtents > 0 ?
+	    pfatFile->extentList[pfatFile->numExtents-1].fileBlock +
+	    pfatFile->extentList[pfatFile->numExtents-1].numBlocks != pfatFile->numBlocks :
+	    pfatFile->numBlocks != 0)
+	return EIO;
+
+    /* An empty file may still own the block it was created with */
+    if (pfatFile->numBlocks == 0 && entry->firstBlock >= instance->firstDataBlock &&
+	entry->firstBlock < instance->numFatEntries &&
+	Is_Bit_Set(instance->freeMap, entry->firstBlock)) {
+	int rc = PFAT_Add_Extent(pfatFile, entry->firstBlock, 1);
+
+	if (rc != 0)
+	    return rc;
+	instance->fat[entry->firstBlock] = FAT_ENTRY_EOF;
+	Mark_FAT_Dirty(instance, entry->firstBlock);
+	pfatFile->numBlocks = 1;
+    }
+
+    while (pfatFile->numBlocks < numBlocks) {
+	ulong_t need = numBlocks - pfatFile->numBlocks;
+	ulong_t lastBlock = 0, start = 0, count = 0, i;
+	int rc;
+
+	if (pfatFile->numExtents > 0) {
+	    struct PFAT_Extent *ext = &pfatFile->extentList[pfatFile->numExtents-1];
+
+	    lastBlock = ext->devBlock + ext->numBlocks - 1;
+	    start = lastBlock + 1;
+	    while (count < need && start + count < instance->numFatEntries &&
+		   !Is_Bit_Set(instance->freeMap, start + count))
+		++count;
+	}
+	if (count == 0) {
+	    int found = Find_First_N_Free(instance->freeMap, need, instance->numFatEntries);
+
+	    if (found < 0)
+		found = Find_First_Free_Bit(instance->freeMap, instance->numFatEntries);
+	    KASSERT(found >= 0);  /* numFreeBlocks says there is one */
+	    start = found;
+	    while (count < need && start + count < instance->numFatEntries &&
+		   !Is_Bit_Set(instance->freeMap, start + count))
+		++count;
+	}
+
+	rc = PFAT_Add_Extent(pfatFile, start, count);
+	if (rc != 0)
+	    return rc;
+	Debug("Allocated blocks %lu..%lu for %s\n", start, start + count - 1, entry->fileName);
+
+	/* Chain the run onto the end of the file */
+	if (pfatFile->numBlocks == 0) {
+	    entry->firstBlock = start;
+	    Mark_Dir_Entry_Dirty(instance, pfatFile->dir, pfatFile->index);
+	} else {
+	    instance->fat[lastBlock] = start;
+	    Mark_FAT_Dirty(instance, lastBlock);
+	}
+	for (i = 0; i < count; ++i) {
+	    Set_Bit(instance->freeMap, start + i);
+	    instance->fat[start + i] = (i + 1 < count) ? start + i + 1 : FAT_ENTRY_EOF;
+	    Mark_FAT_Dirty(instance, start + i);
+	}
+	instance->numFreeBlocks -= count;
+	pfatFile->numBlocks += count;
+    }
+
+    return 0;
+}
+
+/*
+ * Release the blocks of a file beyond the first numBlocks.
+ * Called with the PFAT_File's lock and the instance lock held.
+ */
+static void PFAT_Shrink_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile, ulong_t numBlocks)
+{
+    directoryEntry *entry = pfatFile->entry;
+
+    while (pfatFile->numExtents > 0) {
+	struct PFAT_Extent *ext = &pfatFile->extentList[pfatFile->numExtents-1];
+	ulong_t i, count;
+
+	if (ext->fileBlock + ext->numBlocks <= numBlocks)
+	    break;
+	count = MIN(ext->numBlocks, ext->fileBlock + ext->numBlocks - numBlocks);
+	for (i = 0; i < count; ++i) {
+	    ulong_t block = ext->devBlock + ext->numBlocks - 1 - i;
+
+	    Clear_Bit(instance->freeMap, block);
+	    instance->fat[block] = FAT_ENTRY_FREE;
+	    Mark_FAT_Dirty(instance, block);
+	}
+	instance->numFreeBlocks += count;
+	ext->numBlocks -= count;
+	if (ext->numBlocks == 0)
+	    --pfatFile->numExtents;
+    }
+
+    /* Terminate the chain at the new last block */
+    if (pfatFile->numExtents == 0) {
+	entry->firstBlock = 0;
+	Mark_Dir_Entry_Dirty(instance, pfatFile->dir, pfatFile->index);
+    } else {
+	struct PFAT_Extent *ext = &pfatFile->extentList[pfatFile->numExtents-1];
+	ulong_t block = ext->devBlock + ext->numBlocks - 1;
+
+	instance->fat[block] = FAT_ENTRY_EOF;
+	Mark_FAT_Dirty(instance, block);
+    }
+
+    if (pfatFile->numBlocks > numBlocks)
+	pfatFile->numBlocks = numBlocks;
+}
+
+/*
+ * Start transferring the blocks of a cached page from fileBlock
+ * up to endBlock, without waiting.  Reads skip the blocks which
+ * are valid already; writes write them all.
+ * The requests are added to requestList, which must have room
+ * for BLOCKS_PER_PAGE more.
+ * Called with the PFAT_File's lock held.
+ * Returns 0 if successful, error code on error.
+ */
+static int PFAT_Submit_Page_IO(struct Block_Device *dev, struct PFAT_File *pfatFile,
+    struct Cache_Page *page, enum Request_Type type, ulong_t fileBlock, ulong_t endBlock,
+    struct Block_Request **requestList, int *pNumRequests)
+{
+    ulong_t maxBlocks = Get_Max_Request_Blocks(dev);
+
+    while (fileBlock < endBlock) {
+	int extent;
+	struct PFAT_Extent *ext;
+	ulong_t runEnd, count;
+	struct Block_Request *request;
+
+	if (type == BLOCK_READ && (page->validMask & (1 << (fileBlock % BLOCKS_PER_PAGE)))) {
+	    ++fileBlock;
+	    continue;
+	}
+
+	extent = PFAT_Find_Extent(pfatFile, fileBlock);
+	if (extent >= pfatFile->numExtents) {
+	    Print("Unexpected end of file in FAT at file block %lu\n", fileBlock);
+	    return EIO;  /* probable filesystem corruption */
+	}
+	ext = &pfatFile->extentList[extent];
+	runEnd = MIN(ext->fileBlock + ext->numBlocks, endBlock);
+
+	/* Transfer the blocks which follow on the device together */
+	for (count = 1;
+	     fileBlock + count < runEnd && count < maxBlocks &&
+		(type == BLOCK_WRITE ||
+		 !(page->validMask & (1 << ((fileBlock + count) % BLOCKS_PER_PAGE))));
+	     ++count)
+	    ;
+
+	Debug("%s file blocks %lu..%lu (device block %lu)\n",
+	    type == BLOCK_READ ? "Reading" : "Writing", fileBlock,
+	    fileBlock + count - 1, ext->devBlock + (fileBlock - ext->fileBlock));
+	request = Create_Range_Request(dev, type,
+	    ext->devBlock + (fileBlock - ext->fileBlock), count,
+	    page->data + (fileBlock % BLOCKS_PER_PAGE) * SECTOR_SIZE);
+	if (request == 0)
+	    return ENOMEM;
+	Submit_Block_Request(request, 0, page);
+	requestList[(*pNumRequests)++] = request;
+	fileBlock += count;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the requests started by PFAT_Submit_Page_IO(),
+ * and mark the blocks read as valid in their pages.
+ * Called with the PFAT_File's lock held.
+ * Returns 0 if they were all successful, otherwise the
+ * error code of the first one that failed.
+ */
+static int PFAT_Wait_For_Page_IO(struct Block_Request **requestList, int numRequests)
+{
+    int i, rc = 0;
+
+    for (i = 0; i < numRequests; ++i) {
+	struct Block_Request *request = requestList[i];
+	struct Cache_Page *page = (struct Cache_Page*) request->callbackData;
+	int rc2 = Wait_For_Request(request);
+
+	if (rc2 == 0 && request->type == BLOCK_READ) {
+	    int first = ((char*) request->buf - page->data) / SECTOR_SIZE;
+	    int j;
+
+	    for (j = 0; j < request->numBlocks && first + j < BLOCKS_PER_PAGE; ++j)
+		page->validMask |= 1 << (first + j);
+	} else if (rc2 != 0 && rc == 0)
+	    rc = rc2;
+	Release_Request(request);
+    }
+
+    return rc;
+}
+
+/*
+ * Wait for the file's readahead requests, and release the
+ * pages they read into.  Blocks which could not be read are
+ * left to be read again on demand.
+ * Called with the PFAT_File's lock held.
+ */
+static void PFAT_Finish_Readahead(struct PFAT_File *pfatFile)
+{
+    int i;
+
+    PFAT_Wait_For_Page_IO(pfatFile->readaheadList, pfatFile->numReadaheadRequests);
+    pfatFile->numReadaheadRequests = 0;
+
+    for (i = 0; i < pfatFile->numReadaheadPages; ++i)
+	Release_Cache_Page(pfatFile->readaheadPages[i]);
+    pfatFile->numReadaheadPages = 0;
+}
+
+/*
+ * Start reading the blocks from fileBlock up to endBlock
+ * which aren't cached, without waiting.
+ * Called with the PFAT_File's lock held, and no readahead
+ * requests outstanding.
+ */
+static void PFAT_Start_Readahead(struct Block_Device *dev, struct PFAT_File *pfatFile,
+    ulong_t fileBlock, ulong_t endBlock)
+{
+    KASSERT(pfatFile->numReadaheadRequests == 0);
+    KASSERT(pfatFile->numReadaheadPages == 0);
+
+    pfatFile->readaheadStart = fileBlock;
+    while (fileBlock < endBlock) {
+	ulong_t pageEnd = MIN((fileBlock / BLOCKS_PER_PAGE + 1) * BLOCKS_PER_PAGE, endBlock);
+	int numRequests = pfatFile->numReadaheadRequests;
+	struct Cache_Page *page;
+
+	/* Out of room: read ahead only this far for now */
+	if (pfatFile->numReadaheadPages == PFAT_READAHEAD_MAX_PAGES ||
+	    numRequests + BLOCKS_PER_PAGE > PFAT_READAHEAD_MAX_REQUESTS)
+	    break;
+
+	if (Get_Cache_Page(pfatFile, fileBlock / BLOCKS_PER_PAGE, &page) != 0)
+	    break;
+	if (PFAT_Submit_Page_IO(dev, pfatFile, page, BLOCK_READ, fileBlock, pageEnd,
+		pfatFile->readaheadList, &pfatFile->numReadaheadRequests) != 0) {
+	    /* Keep the page until whatever was submitted completes */
+	    pfatFile->readaheadPages[pfatFile->numReadaheadPages++] = page;
+	    break;
+	}
+
+	if (pfatFile->numReadaheadRequests > numRequests)
+	    pfatFile->readaheadPages[pfatFile->numReadaheadPages++] = page;
+	else
+	    Release_Cache_Page(page);  /* already cached */
+	fileBlock = pageEnd;
+    }
+    pfatFile->readaheadEnd = fileBlock;
+}
+
+/*
+ * Update the file's readahead window after a read of the blocks
+ * from startBlock up to endBlock, and read ahead once the reader
+ * gets within half a window of the blocks already read ahead.
+ * Called with the PFAT_File's lock held.
+ */
+static void PFAT_Readahead(struct Block_Device *dev, struct PFAT_File *pfatFile,
+    ulong_t startBlock, ulong_t endBlock)
+{
+    /* A small read may continue in the last block read. */
+    if (startBlock == pfatFile->nextBlock || startBlock + 1 == pfatFile->nextBlock) {
+	if (pfatFile->readaheadWindow == 0)
+	    pfatFile->readaheadWindow = PFAT_READAHEAD_MIN;
+	else if (pfatFile->readaheadWindow < PFAT_READAHEAD_MAX)
+	    pfatFile->readaheadWindow *= 2;
+    } else {
+	pfatFile->readaheadWindow = 0;
+	pfatFile->readaheadEnd = endBlock;
+    }
+    pfatFile->nextBlock = endBlock;
+
+    if (pfatFile->readaheadWindow > 0 && endBlock < pfatFile->numBlocks &&
+	endBlock + pfatFile->readaheadWindow / 2 >= pfatFile->readaheadEnd) {
+	ulong_t from = MAX(endBlock, pfatFile->readaheadEnd);
+	ulong_t to = MIN(endBlock + pfatFile->readaheadWindow, pfatFile->numBlocks);
+
+	PFAT_Finish_Readahead(pfatFile);
+	if (from < to)
+	    PFAT_Start_Readahead(dev, pfatFile, from, to);
+    }
+}
+
 /*
  * Read function for PFAT files.
  */
 static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
 {
     struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
-    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+    struct Block_Device *dev = file->mountPoint->dev;
+    struct Cache_Page *pageList[PFAT_READ_BATCH_PAGES];
+    struct Block_Request *requestList[PFAT_READ_BATCH_PAGES * BLOCKS_PER_PAGE];
     ulong_t start = file->filePos;
     ulong_t end = file->filePos + numBytes;
-    ulong_t startBlock, endBlock, curBlock;
-    ulong_t i;
+    ulong_t startBlock, endBlock, pageIndex, endPage;
+    int rc = 0;
 
     /* Special case: can't handle reads longer than INT_MAX */
-    if (numBytes > INT_MAX)
+    if (numBytes > INT_MAX || end < start)
 	return EINVALID;
 
-    /* Make sure request represents a valid range within the file */
-    if (start >= file->endPos || end > file->endPos || end < start) {
-	Debug("Invalid read position: filePos=%lu, numBytes=%lu, endPos=%lu\n",
-	    file->filePos, numBytes, file->endPos);
-	return EINVALID;
-    }
+    Mutex_Lock(&pfatFile->lock);
 
     /*
-     * Now the complicated part; ensure that all blocks containing the
-     * data we need are in the file data cache.
+     * The file may have been written since it was opened.
+     * Reads stop at the end of the file.
      */
-    startBlock = (start % SECTOR_SIZE) / SECTOR_SIZE;
+    file->endPos = pfatFile->entry->fileSize;
+    if (start >= file->endPos) {
+	Mutex_Unlock(&pfatFile->lock);
+	return 0;
+    }
+    if (end > file->endPos) {
+	end = file->endPos;
+	numBytes = end - start;
+    }
+
+    startBlock = start / SECTOR_SIZE;
     endBlock = Round_Up_To_Block(end) / SECTOR_SIZE;
+    endPage = (endBlock + BLOCKS_PER_PAGE - 1) / BLOCKS_PER_PAGE;
+
+    /* Blocks still being read ahead must arrive before we look at them */
+    if (pfatFile->numReadaheadRequests > 0 &&
+	startBlock < pfatFile->readaheadEnd && endBlock > pfatFile->readaheadStart)
+	PFAT_Finish_Readahead(pfatFile);
 
     /*
-     * Traverse the FAT finding the blocks of the file.
-     * As we encounter requested blocks that aren't in the
-     * file data cache, we issue requests to read them.
+     * Work through the pages holding the requested data a batch
+     * at a time: read all the blocks missing from the batch's
+     * pages together, then copy the data to the caller's buffer.
      */
-    curBlock = pfatFile->entry->firstBlock;
-    for (i = 0; i < endBlock; ++i) {
-	/* Are we at a valid block? */
-	if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF) {
-	    Print("Unexpected end of file in FAT at file block %lu\n", i);
-	    return EIO;  /* probable filesystem corruption */
-	}
+    for (pageIndex = startBlock / BLOCKS_PER_PAGE; pageIndex < endPage && rc == 0; ) {
+	int numPages = 0, numRequests = 0, rc2, i;
 
-	/* Do we need to read this block? */
-	if (i >= startBlock) {
-	    int rc = 0;
+	for (; pageIndex < endPage && numPages < PFAT_READ_BATCH_PAGES; ++pageIndex) {
+	    ulong_t first = MAX(pageIndex * BLOCKS_PER_PAGE, startBlock);
+	    ulong_t last = MIN((pageIndex + 1) * BLOCKS_PER_PAGE, endBlock);
 
-	    /* Only allow one thread at a time to read this block. */
-	    Mutex_Lock(&pfatFile->lock);
+	    rc = Get_Cache_Page(pfatFile, pageIndex, &pageList[numPages]);
+	    if (rc != 0)
+		break;
+	    rc = PFAT_Submit_Page_IO(dev, pfatFile, pageList[numPages++], BLOCK_READ,
+		first, last, requestList, &numRequests);
+	    if (rc != 0)
+		break;
+	}
 
-	    if (!Is_Bit_Set(pfatFile->validBlockSet, i)) {
-		/* Read block into the file data cache */
-		Debug("Reading file block %lu (device block %lu)\n", i, curBlock);
-		rc = Block_Read(file->mountPoint->dev, curBlock, pfatFile->fileDataCache + i*SECTOR_SIZE);
+	rc2 = PFAT_Wait_For_Page_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
 
-		if (rc == 0)
-		    /* Mark as having read this block */
-		    Set_Bit(pfatFile->validBlockSet, i);
-	    }
+	for (i = 0; i < numPages; ++i) {
+	    struct Cache_Page *page = pageList[i];
 
-	    /* Done attempting to fetch the block */
-	    Mutex_Unlock(&pfatFile->lock);
+	    if (rc == 0) {
+		ulong_t pageStart = page->index * PAGE_SIZE;
+		ulong_t from = MAX(start, pageStart);
+		ulong_t to = MIN(end, pageStart + PAGE_SIZE);
 
-	    if (rc != 0)
-		return rc;
+		memcpy((char*) buf + (from - start), page->data + (from - pageStart), to - from);
+	    }
+	    Release_Cache_Page(page);
 	}
-
-	/* Continue to next block */
-	ulong_t nextBlock = instance->fat[curBlock];
-	curBlock = nextBlock;
     }
+    if (rc == 0) {
+	PFAT_Readahead(dev, pfatFile, startBlock, endBlock);
+	file->filePos = end;
+    }
+    Mutex_Unlock(&pfatFile->lock);
 
-    /*
-     * All cached data we need is up to date,
-     * so just copy it into the caller's buffer.
-     */
-    memcpy(buf, pfatFile->fileDataCache + start, numBytes);
+    if (rc != 0)
+	return rc;
 
     Debug("Read satisfied!\n");
 
     return numBytes;
 }
 
+/*
+ * Get a block which a write only partly covers ready in its
+ * cached page: blocks the file already had are read in, new
+ * ones are zero filled.
+ * Called with the PFAT_File's lock held.
+ */
+static int PFAT_Prepare_Partial_Block(struct Block_Device *dev, struct PFAT_File *pfatFile,
+    struct Cache_Page *page, ulong_t fileBlock, ulong_t oldBlocks,
+    struct Block_Request **requestList, int *pNumRequests)
+{
+    int bit = 1 << (fileBlock % BLOCKS_PER_PAGE);
+
+    if (page->validMask & bit)
+	return 0;
+    if (fileBlock < oldBlocks)
+	return PFAT_Submit_Page_IO(dev, pfatFile, page, BLOCK_READ, fileBlock, fileBlock + 1,
+	    requestList, pNumRequests);
+
+    memset(page->data + (fileBlock % BLOCKS_PER_PAGE) * SECTOR_SIZE, '\0', SECTOR_SIZE);
+    page->validMask |= bit;
+    return 0;
+}
+
 /*
  * Write function for PFAT files.
+ * Data is written through the page cache to the device before
+ * returning; the FAT and directory changes are written back by
+ * PFAT_Sync(), or when the file is closed.
  */
 static int PFAT_Write(struct File *file, void *buf, ulong_t numBytes)
 {
-    /* Read only fs: writes not allowed */
-    return EACCESS;
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+    struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
+    struct Block_Device *dev = file->mountPoint->dev;
+    struct Cache_Page *pageList[PFAT_READ_BATCH_PAGES];
+    struct Block_Request *requestList[PFAT_READ_BATCH_PAGES * BLOCKS_PER_PAGE];
+    ulong_t start = file->filePos;
+    ulong_t end = file->filePos + numBytes;
+    ulong_t startBlock, endBlock, pageIndex, endPage, oldBlocks;
+    int rc = 0;
+
+    if (!(file->mode & O_WRITE))
+	return EACCESS;
+
+    /* Special case: can't handle writes longer than INT_MAX */
+    if (numBytes > INT_MAX || end < start)
+	return EINVALID;
+    if (numBytes == 0)
+	return 0;
+
+    startBlock = start / SECTOR_SIZE;
+    endBlock = Round_Up_To_Block(end) / SECTOR_SIZE;
+    endPage = (endBlock + BLOCKS_PER_PAGE - 1) / BLOCKS_PER_PAGE;
+
+    Mutex_Lock(&pfatFile->lock);
+
+    /* Readahead must not fill pages under the new data */
+    PFAT_Finish_Readahead(pfatFile);
+    pfatFile->readaheadWindow = 0;
+
+    /* Allocate the blocks the write adds to the file */
+    oldBlocks = pfatFile->numBlocks;
+    Mutex_Lock(&instance->lock);
+    rc = PFAT_Grow_File(instance, pfatFile, endBlock);
+    Mutex_Unlock(&instance->lock);
+
+    /*
+     * Work through the pages a batch at a time: read in the blocks
+     * at either end that are only partly overwritten, copy the
+     * caller's data into the pages, then write the blocks out.
+     */
+    for (pageIndex = startBlock / BLOCKS_PER_PAGE; pageIndex < endPage && rc == 0; ) {
+	int numPages = 0, numRequests = 0, rc2, i;
+
+	for (; pageIndex < endPage && numPages < PFAT_READ_BATCH_PAGES; ++pageIndex) {
+	    struct Cache_Page *page;
+
+	    rc = Get_Cache_Page(pfatFile, pageIndex, &page);
+	    if (rc != 0)
+		break;
+	    pageList[numPages++] = page;
+
+	    if (start % SECTOR_SIZE != 0 && startBlock / BLOCKS_PER_PAGE == pageIndex)
+		rc = PFAT_Prepare_Partial_Block(dev, pfatFile, page, startBlock, oldBlocks,
+		    requestList, &numRequests);
+	    if (rc == 0 && end % SECTOR_SIZE != 0 && (endBlock - 1) / BLOCKS_PER_PAGE == pageIndex &&
+		(start % SECTOR_SIZE == 0 || endBlock - 1 != startBlock))
+		rc = PFAT_Prepare_Partial_Block(dev, pfatFile, page, endBlock - 1, oldBlocks,
+		    requestList, &numRequests);
+	    if (rc != 0)
+		break;
+	}
+	rc2 = PFAT_Wait_For_Page_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+
+	numRequests = 0;
+	for (i = 0; i < numPages && rc == 0; ++i) {
+	    struct Cache_Page *page = pageList[i];
+	    ulong_t pageStart = page->index * PAGE_SIZE;
+	    ulong_t from = MAX(start, pageStart);
+	    ulong_t to = MIN(end, pageStart + PAGE_SIZE);
+	    ulong_t first = MAX(page->index * BLOCKS_PER_PAGE, startBlock);
+	    ulong_t last = MIN((page->index + 1) * BLOCKS_PER_PAGE, endBlock);
+	    ulong_t block;
+
+	    memcpy(page->data + (from - pageStart), (char*) buf + (from - start), to - from);
+	    for (block = first; block < last; ++block)
+		page->validMask |= 1 << (block % BLOCKS_PER_PAGE);
+	    rc = PFAT_Submit_Page_IO(dev, pfatFile, page, BLOCK_WRITE, first, last,
+		requestList, &numRequests);
+	}
+	rc2 = PFAT_Wait_For_Page_IO(requestList, numRequests);
+	if (rc == 0)
+	    rc = rc2;
+
+	for (i = 0; i < numPages; ++i)
+	    Release_Cache_Page(pageList[i]);
+    }
+
+    Mutex_Lock(&instance->lock);
+    if (rc == 0) {
+	if (end > pfatFile->entry->fileSize) {
+	    pfatFile->entry->fileSize = end;
+	    Mark_Dir_Entry_Dirty(instance, pfatFile->dir, pfatFile->index);
+	}
+	file->endPos = pfatFile->entry->fileSize;
+	file->filePos = end;
+    } else if (pfatFile->numBlocks > oldBlocks) {
+	/* Give back the blocks allocated for the failed write */
+	PFAT_Shrink_File(instance, pfatFile, oldBlocks);
+	Discard_Cache_Pages(pfatFile);
+    }
+    Mutex_Unlock(&instance->lock);
+    Mutex_Unlock(&pfatFile->lock);
+
+    return rc == 0 ? (int) numBytes : rc;
 }
 
 /*
  * Seek function for PFAT files.
+ * Seeking to the end of the file is allowed, to append to it.
  */
 static int PFAT_Seek(struct File *file, ulong_t pos)
 {
-    if (pos >= file->endPos)
+    if (pos > file->endPos)
 	return EINVALID;
      file->filePos = pos;
      return 0;
 }
 
 /*
- * Close function for PFAT files.
+ * Truncate function for PFAT files.
+ * Files can only be made shorter.
+ */
+static int PFAT_Truncate(struct File *file, ulong_t size)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+    struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
+    int rc = 0;
+
+    if (!(file->mode & O_WRITE))
+	return EACCESS;
+
+    Mutex_Lock(&pfatFile->lock);
+    if (size > pfatFile->entry->fileSize)
+	rc = EINVALID;
+    else if (size < pfatFile->entry->fileSize) {
+	PFAT_Finish_Readahead(pfatFile);
+	pfatFile->readaheadWindow = 0;
+
+	/* Cached pages may hold data past the new end */
+	Discard_Cache_Pages(pfatFile);
+
+	Mutex_Lock(&instance->lock);
+	PFAT_Shrink_File(instance, pfatFile, Round_Up_To_Block(size) / SECTOR_SIZE);
+	pfatFile->entry->fileSize = size;
+	Mark_Dir_Entry_Dirty(instance, pfatFile->dir, pfatFile->index);
+	Mutex_Unlock(&instance->lock);
+    }
+    file->endPos = pfatFile->entry->fileSize;
+    if (file->filePos > file->endPos)
+	file->filePos = file->endPos;
+    Mutex_Unlock(&pfatFile->lock);
+
+    return rc;
+}
+
+/*
+ * Close function for PFAT files.
+ */
+static int PFAT_Close(struct File *file)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
+    struct PFAT_File *pfatFile = (struct PFAT_File*) file->fsData;
+
+    /*
+     * Make the file's new size and blocks permanent.
+     * Sectors which can't be written stay dirty, for the
+     * next Sync() to retry.
+     */
+    if ((file->mode & O_WRITE) && PFAT_Sync(file->mountPoint) != 0)
+	Print("Error writing PFAT metadata on close\n");
+
+    /* Don't leave readahead pages pinned while the file sits idle. */
+    Mutex_Lock(&pfatFile->lock);
+    PFAT_Finish_Readahead(pfatFile);
+    Mutex_Unlock(&pfatFile->lock);
+
+    /*
+     * The PFAT_File object and the cached contents of the file
+     * will remain for a while, to speed up future accesses
+     * to this file.
+     */
+    Put_PFAT_File(instance, pfatFile);
+    return 0;
+}
+
+/*
+ * File_Ops for PFAT files.
+ */
+static struct File_Ops s_pfatFileOps = {
+    &PFAT_FStat,
+    &PFAT_Read,
+    &PFAT_Write,
+    &PFAT_Seek,
+    &PFAT_Close,
+    0, /* Read_Entry */
+    &PFAT_Truncate,
+};
+
+/*
+ * FStat function for PFAT directories.
+ */
+static int PFAT_FStat_Dir(struct File *dir, struct VFS_File_Stat *stat)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) dir->mountPoint->fsData;
+    struct PFAT_Dir *pfatDir = (struct PFAT_Dir*) dir->fsData;
+
+    Mutex_Lock(&instance->lock);
+    Copy_Stat(stat, pfatDir->entry);
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * Close function for PFAT directories.
+ */
+static int PFAT_Close_Dir(struct File *dir)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) dir->mountPoint->fsData;
+    struct PFAT_Dir *pfatDir = (struct PFAT_Dir*) dir->fsData;
+
+    /* The directory stays in memory; it just may be deleted again. */
+    Mutex_Lock(&instance->lock);
+    KASSERT(pfatDir->refCount > 0);
+    --pfatDir->refCount;
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * Read a directory entry.
+ */
+static int PFAT_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+{
+    directoryEntry *pfatDirEntry = 0;
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) dir->mountPoint->fsData;
+    struct PFAT_Dir *pfatDir = (struct PFAT_Dir*) dir->fsData;
+
+    Mutex_Lock(&instance->lock);
+
+    /* Skip the slots of deleted files; the directory may have grown. */
+    dir->endPos = pfatDir->numEntries;
+    while (dir->filePos < dir->endPos) {
+	pfatDirEntry = PFAT_Dir_Entry(pfatDir, dir->filePos++);
+	if (pfatDirEntry->fileName[0] != '\0')
+	    break;
+	pfatDirEntry = 0;
+    }
+
+    if (pfatDirEntry == 0) {
+	Mutex_Unlock(&instance->lock);
+	return VFS_NO_MORE_DIR_ENTRIES; /* Reached the end of the directory. */
+    }
+
+    /*
+     * Note: we don't need to bounds check here, because
+     * generic struct VFS_Dir_Entry objects have much more space for filenames
+     * than PFAT directoryEntry objects.
+     */
+    strncpy(entry->name, pfatDirEntry->fileName, sizeof(pfatDirEntry->fileName));
+    entry->name[sizeof(pfatDirEntry->fileName)] = '\0';
+
+    Copy_Stat(&entry->stats, pfatDirEntry);
+
+    Mutex_Unlock(&instance->lock);
+    return 0;
+}
+
+/*
+ * File_Ops for PFAT directories.
+ */
+static struct File_Ops s_pfatDirOps = {
+    &PFAT_FStat_Dir,
+    0, /* Read */
+    0, /* Write */
+    0, /* Seek */
+    &PFAT_Close_Dir,
+    &PFAT_Read_Entry,
+    0, /* Truncate */
+};
+
+/*
+ * Hash a file name, of at most the length of a directoryEntry's.
+ */
+static int PFAT_Hash_Name(const char *name)
+{
+    ulong_t hash = 0;
+    int i;
+
+    for (i = 0; i < sizeof(((directoryEntry*) 0)->fileName) && name[i] != '\0'; ++i)
+	hash = hash * 31 + (uchar_t) name[i];
+    return hash % PFAT_DIR_HASH_SIZE;
+}
+
+/*
+ * Add the entry in given slot of a directory to its hash index.
+ * Called with the instance lock held.
+ */
+static void PFAT_Hash_Dir_Entry(struct PFAT_Dir *dir, int index)
+{
+    int *chain = &dir->hash[PFAT_Hash_Name(PFAT_Dir_Entry(dir, index)->fileName)];
+
+    dir->hashNext[index] = *chain;
+    *chain = index;
+}
+
+/*
+ * Remove the entry in given slot of a directory from its hash index.
+ * Called with the instance lock held.
+ */
+static void PFAT_Unhash_Dir_Entry(struct PFAT_Dir *dir, int index)
+{
+    int *link = &dir->hash[PFAT_Hash_Name(PFAT_Dir_Entry(dir, index)->fileName)];
+
+    while (*link != index) {
+	KASSERT(*link >= 0);
+	link = &dir->hashNext[*link];
+    }
+    *link = dir->hashNext[index];
+}
+
+/*
+ * Build the hash index of a directory.
+ * Called with the instance lock held.
+ */
+static void PFAT_Index_Dir(struct PFAT_Dir *dir)
+{
+    int i;
+
+    for (i = 0; i < PFAT_DIR_HASH_SIZE; ++i)
+	dir->hash[i] = -1;
+
+    /* Insert backwards, so the first of any duplicate names is found first */
+    for (i = dir->numEntries - 1; i >= 0; --i) {
+	if (PFAT_Dir_Entry(dir, i)->fileName[0] != '\0')
+	    PFAT_Hash_Dir_Entry(dir, i);
+    }
+}
+
+/*
+ * Find the slot of the entry with given name in a directory.
+ * Returns -1 if there is none.
+ * Called with the instance lock held.
  */
-static int PFAT_Close(struct File *file)
+static int PFAT_Find_Dir_Entry(struct PFAT_Dir *dir, const char *name)
 {
-    /*
-     * The PFAT_File object caching the contents of the file
-     * will remain in the PFAT_Instance object, to speed up
-     * future accesses to this file.
-     */
-    return 0;
+    int i;
+
+    /* Names longer than a directory entry holds can't match. */
+    if (*name == '\0' || strlen(name) > sizeof(dir->entry->fileName))
+	return -1;
+
+    for (i = dir->hash[PFAT_Hash_Name(name)]; i >= 0; i = dir->hashNext[i]) {
+	if (strncmp(PFAT_Dir_Entry(dir, i)->fileName, name, sizeof(dir->entry->fileName)) == 0)
+	    return i;
+    }
+    return -1;
 }
 
 /*
- * File_Ops for PFAT files.
+ * Make room in a subdirectory for maxBlocks blocks.
+ * Called with the instance lock held.
  */
-static struct File_Ops s_pfatFileOps = {
-    &PFAT_FStat,
-    &PFAT_Read,
-    &PFAT_Write,
-    &PFAT_Seek,
-    &PFAT_Close,
-    0, /* Read_Entry */
-};
-
-static int PFAT_FStat_Dir(struct File *dir, struct VFS_File_Stat *stat)
+static int PFAT_Reserve_Dir_Blocks(struct PFAT_Dir *dir, int maxBlocks)
 {
-    /* FIXME: for now, there is only one directory */
-    struct PFAT_Instance *instance = (struct PFAT_Instance*) dir->mountPoint->fsData;
-    Copy_Stat(stat, &instance->rootDirEntry);
+    int maxEntries = maxBlocks * PFAT_DIR_ENTRIES_PER_BLOCK;
+    char **blockList;
+    bool *dirtyList;
+    int *hashNext;
+
+    if (maxBlocks <= dir->maxBlocks)
+	return 0;
+
+    blockList = (char**) Malloc(maxBlocks * sizeof(char*));
+    dirtyList = (bool*) Malloc(maxBlocks * sizeof(bool));
+    hashNext = (int*) Malloc(maxEntries * sizeof(int));
+    if (blockList == 0 || dirtyList == 0 || hashNext == 0) {
+	if (blockList != 0)
+	    Free(blockList);
+	if (dirtyList != 0)
+	    Free(dirtyList);
+	if (hashNext != 0)
+	    Free(hashNext);
+	return ENOMEM;
+    }
+
+    if (dir->maxBlocks > 0) {
+	memcpy(blockList, dir->blockList, dir->numBlocks * sizeof(char*));
+	memcpy(dirtyList, dir->dirtyList, dir->numBlocks * sizeof(bool));
+	memcpy(hashNext, dir->hashNext, dir->numEntries * sizeof(int));
+	Free(dir->blockList);
+	Free(dir->dirtyList);
+	Free(dir->hashNext);
+    }
+    dir->blockList = blockList;
+    dir->dirtyList = dirtyList;
+    dir->hashNext = hashNext;
+    dir->maxBlocks = maxBlocks;
+    dir->maxEntries = maxEntries;
     return 0;
 }
 
 /*
- * Close function for PFAT directories.
+ * Free the in-memory copy of a subdirectory, and release its file.
+ * Called with the instance lock held.
  */
-static int PFAT_Close_Dir(struct File *dir)
+static void PFAT_Free_Dir(struct PFAT_Instance *instance, struct PFAT_Dir *dir)
 {
-    /* This is a no-op. */
-    return 0;
+    int i;
+
+    KASSERT(dir->refCount == 0);
+
+    for (i = 0; i < dir->numBlocks; ++i)
+	Free(dir->blockList[i]);
+    if (dir->maxBlocks > 0) {
+	Free(dir->blockList);
+	Free(dir->dirtyList);
+	Free(dir->hashNext);
+    }
+    Release_PFAT_File(instance, dir->file);
+    Free(dir);
 }
 
 /*
- * Read a directory entry.
+ * Get the in-memory copy of the subdirectory in given slot
+ * of a directory, reading it if this is the first time.
+ * Called with the instance lock held.
  */
-static int PFAT_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
+static int PFAT_Load_Dir(struct PFAT_Instance *instance, struct PFAT_Dir *parent, int index,
+    struct PFAT_Dir **pDir)
 {
-    directoryEntry *pfatDirEntry;
-    struct PFAT_Instance *instance = (struct PFAT_Instance*) dir->mountPoint->fsData;
+    directoryEntry *entry = PFAT_Dir_Entry(parent, index);
+    struct PFAT_Dir *dir;
+    int rc = 0;
 
-    if (dir->filePos >= dir->endPos)
-	return VFS_NO_MORE_DIR_ENTRIES; /* Reached the end of the directory. */
+    if (!entry->directory)
+	return ENOTDIR;
 
-    pfatDirEntry = &instance->rootDir[dir->filePos++];
+    for (dir = Get_Front_Of_PFAT_Dir_List(&instance->dirList);
+	 dir != 0;
+	 dir = Get_Next_In_PFAT_Dir_List(dir)) {
+	if (dir->entry == entry) {
+	    *pDir = dir;
+	    return 0;
+	}
+    }
 
-    /*
-     * Note: we don't need to bounds check here, because
-     * generic struct VFS_Dir_Entry objects have much more space for filenames
-     * than PFAT directoryEntry objects.
-     */
-    strncpy(entry->name, pfatDirEntry->fileName, sizeof(pfatDirEntry->fileName));
-    entry->name[sizeof(pfatDirEntry->fileName)] = '\0';
+    Debug("Reading directory %s\n", entry->fileName);
+    dir = (struct PFAT_Dir*) Malloc(sizeof(*dir));
+    if (dir == 0)
+	return ENOMEM;
+    memset(dir, '\0', sizeof(*dir));
+    dir->entry = entry;
 
-    Copy_Stat(&entry->stats, pfatDirEntry);
+    /* The PFAT_File maps the directory's blocks, and is never idle */
+    dir->file = Get_PFAT_File(instance, parent, index);
+    if (dir->file == 0) {
+	Free(dir);
+	return ENOMEM;
+    }
+
+    rc = PFAT_Reserve_Dir_Blocks(dir, dir->file->numBlocks);
+    while (rc == 0 && dir->numBlocks < dir->file->numBlocks) {
+	int extent = PFAT_Find_Extent(dir->file, dir->numBlocks);
+	struct PFAT_Extent *ext;
+	char *block;
+
+	if (extent >= dir->file->numExtents) {
+	    rc = EIO;  /* probable filesystem corruption */
+	    break;
+	}
+	ext = &dir->file->extentList[extent];
+
+	block = (char*) Malloc(SECTOR_SIZE);
+	if (block == 0) {
+	    rc = ENOMEM;
+	    break;
+	}
+	rc = Block_Read(instance->dev, ext->devBlock + (dir->numBlocks - ext->fileBlock), block);
+	if (rc != 0) {
+	    Free(block);
+	    break;
+	}
+	dir->blockList[dir->numBlocks] = block;
+	dir->dirtyList[dir->numBlocks] = false;
+	++dir->numBlocks;
+    }
+    if (rc != 0) {
+	PFAT_Free_Dir(instance, dir);
+	return rc;
+    }
 
+    dir->numEntries = dir->numBlocks * PFAT_DIR_ENTRIES_PER_BLOCK;
+    PFAT_Index_Dir(dir);
+    Add_To_Back_Of_PFAT_Dir_List(&instance->dirList, dir);
+
+    *pDir = dir;
     return 0;
 }
 
 /*
- * File_Ops for PFAT directories.
+ * Add a block of free slots to a subdirectory.
+ * Called with the instance lock held.
  */
-static struct File_Ops s_pfatDirOps = {
-    &PFAT_FStat_Dir,
-    0, /* Read */
-    0, /* Write */
-    0, /* Seek */
-    &PFAT_Close_Dir,
-    &PFAT_Read_Entry,
-};
+static int PFAT_Grow_Dir(struct PFAT_Instance *instance, struct PFAT_Dir *dir)
+{
+    char *block;
+    int rc;
+
+    if (dir->numBlocks == dir->maxBlocks &&
+	(rc = PFAT_Reserve_Dir_Blocks(dir, dir->maxBlocks > 0 ? dir->maxBlocks * 2 : 1)) != 0)
+	return rc;
+
+    block = (char*) Malloc(SECTOR_SIZE);
+    if (block == 0)
+	return ENOMEM;
+    memset(block, '\0', SECTOR_SIZE);
+
+    rc = PFAT_Grow_File(instance, dir->file, dir->numBlocks + 1);
+    if (rc != 0) {
+	Free(block);
+	return rc;
+    }
+
+    dir->blockList[dir->numBlocks] = block;
+    dir->dirtyList[dir->numBlocks] = true;
+    ++dir->numBlocks;
+    dir->numEntries += PFAT_DIR_ENTRIES_PER_BLOCK;
+
+    dir->entry->fileSize = dir->numBlocks * SECTOR_SIZE;
+    Mark_Dir_Entry_Dirty(instance, dir->file->dir, dir->file->index);
+    return 0;
+}
 
 /*
- * Look up a directory entry in a PFAT filesystem.
+ * Look up a path in a PFAT filesystem, one component at a time.
+ * On success, the entry is in the given slot of *pDir, or is
+ * *pDir itself if *pIndex is -1.  If only the last component
+ * is missing, ENOTFOUND is returned with *pDir set to the
+ * directory it would be in.
+ * Called with the instance lock held.
  */
-static directoryEntry *PFAT_Lookup(struct PFAT_Instance *instance, const char *path)
+static int PFAT_Lookup(struct PFAT_Instance *instance, const char *path,
+    struct PFAT_Dir **pDir, int *pIndex)
 {
-    directoryEntry *rootDir = instance->rootDir;
-    bootSector *fsinfo = &instance->fsinfo;
-    int i;
+    struct PFAT_Dir *dir = &instance->root;
+    char name[sizeof(dir->entry->fileName) + 1];
 
     KASSERT(*path == '/');
+    *pDir = 0;
 
     /* Special case: root directory. */
-    if (strcmp(path, "/") == 0)
-	return &instance->rootDirEntry;
-
-    /* Skip leading '/' character. */
-    ++path;
+    if (strcmp(path, "/") == 0) {
+	*pDir = dir;
+	*pIndex = -1;
+	return 0;
+    }
 
-    /*
-     * FIXME: Eventually, we should try to implement hierarchical
-     * directory structure.  For now, only the root directory
-     * is supported.
-     */
-    for (i = 0; i < fsinfo->rootDirectoryCount; ++i) {
-    	directoryEntry *entry = &rootDir[i];
-	if (strcmp(entry->fileName, path) == 0) {
-	    /* Found it! */
-	    Debug("Found matching dir entry for %s\n", path);
-	    return entry;
+    for (;;) {
+	const char *end;
+	int len, index, rc;
+
+	/* Skip '/' character, and find the next one. */
+	++path;
+	end = strchr(path, '/');
+	len = (end != 0) ? end - path : strlen(path);
+
+	if (len < sizeof(name)) {
+	    memcpy(name, path, len);
+	    name[len] = '\0';
+	    index = PFAT_Find_Dir_Entry(dir, name);
+	} else
+	    index = -1;
+
+	if (end == 0) {
+	    *pDir = dir;
+	    *pIndex = index;
+	    if (index < 0)
+		return ENOTFOUND;
+	    Debug("Found matching dir entry for %s\n", name);
+	    return 0;
 	}
-    }
 
-    /* Not found. */
-    return 0;
+	if (index < 0)
+	    return ENOTFOUND;
+	if ((rc = PFAT_Load_Dir(instance, dir, index, &dir)) != 0)
+	    return rc;
+	path = end;
+    }
 }
 
 /*
  * Get a PFAT_File object representing the file whose directory entry
- * is given.
+ * is in given slot of a directory.  It must be returned with
+ * Put_PFAT_File(), or Release_PFAT_File() with the instance lock held.
+ * Called with the instance lock held.
  */
-static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directoryEntry *entry)
+static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, struct PFAT_Dir *dir, int index)
 {
+    directoryEntry *entry = PFAT_Dir_Entry(dir, index);
     ulong_t numBlocks;
     struct PFAT_File *pfatFile = 0;
-    char *fileDataCache = 0;
-    struct Bit_Set *validBlockSet = 0;
+    struct PFAT_Extent *extentList = 0;
+    int numExtents;
 
     KASSERT(entry != 0);
     KASSERT(instance != 0);
-
-    Mutex_Lock(&instance->lock);
+    KASSERT(IS_HELD(&instance->lock));
 
     /*
      * See if this file has already been opened.
@@ -348,25 +1473,41 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
 	    break;
     }
 
-    if (pfatFile == 0) {
-	/* Determine size of data block cache for file. */
+    if (pfatFile != 0) {
+	if (pfatFile->refCount++ == 0)
+	    --instance->numIdleFiles;
+    } else {
 	numBlocks = Round_Up_To_Block(entry->fileSize) / SECTOR_SIZE;
 
-	/*
-	 * Allocate File object, PFAT_File object, file block data cache,
-	 * and valid cache block bitset
-	 */
-	if ((pfatFile = (struct PFAT_File *) Malloc(sizeof(*pfatFile))) == 0 ||
-	    (fileDataCache = Malloc(numBlocks * SECTOR_SIZE)) == 0 ||
-	    (validBlockSet = Create_Bit_Set(numBlocks)) == 0) {
+	/* Allocate PFAT_File object. */
+	if ((pfatFile = (struct PFAT_File *) Malloc(sizeof(*pfatFile))) == 0)
 	    goto memfail;
+
+	/* Map the file's blocks, so reads need not follow the FAT */
+	numExtents = PFAT_Walk_Extents(instance, entry, numBlocks, 0);
+	if (numExtents > 0) {
+	    extentList = (struct PFAT_Extent*) Malloc(numExtents * sizeof(*extentList));
+	    if (extentList == 0)
+		goto memfail;
+	    PFAT_Walk_Extents(instance, entry, numBlocks, extentList);
 	}
+	Debug("File has %lu blocks in %d extents\n", numBlocks, numExtents);
 
 	/* Populate PFAT_File */
 	pfatFile->entry = entry;
+	pfatFile->dir = dir;
+	pfatFile->index = index;
 	pfatFile->numBlocks = numBlocks;
-	pfatFile->fileDataCache = fileDataCache;
-	pfatFile->validBlockSet = validBlockSet;
+	pfatFile->refCount = 1;
+	pfatFile->extentList = extentList;
+	pfatFile->numExtents = numExtents;
+	pfatFile->maxExtents = numExtents;
+	pfatFile->nextBlock = 0;
+	pfatFile->readaheadWindow = 0;
+	pfatFile->readaheadStart = 0;
+	pfatFile->readaheadEnd = 0;
+	pfatFile->numReadaheadPages = 0;
+	pfatFile->numReadaheadRequests = 0;
 	Mutex_Init(&pfatFile->lock);
 
 	/* Add to instance's list of PFAT_File objects. */
@@ -380,16 +1521,121 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
 memfail:
     if (pfatFile != 0)
 	Free(pfatFile);
-    if (fileDataCache != 0)
-	Free(fileDataCache);
-    if (validBlockSet != 0)
-	Free(validBlockSet);
+    pfatFile = 0;
 
 done:
-    Mutex_Unlock(&instance->lock);
     return pfatFile;
 }
 
+/*
+ * Free an idle PFAT_File object, and its cached pages.
+ * Called with the instance lock held.
+ */
+static void Free_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile)
+{
+    KASSERT(pfatFile->refCount == 0);
+
+    Debug("Reclaiming idle file %s\n", pfatFile->entry->fileName);
+    Remove_From_PFAT_File_List(&instance->fileList, pfatFile);
+    --instance->numIdleFiles;
+
+    PFAT_Finish_Readahead(pfatFile);
+    Discard_Cache_Pages(pfatFile);
+    if (pfatFile->extentList != 0)
+	Free(pfatFile->extentList);
+    Free(pfatFile);
+}
+
+/*
+ * Return a PFAT_File object obtained from Get_PFAT_File().
+ * Once no File uses it, it is kept idle in case the file is
+ * opened again, until there are too many idle files.
+ * Called with the instance lock held.
+ */
+static void Release_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile)
+{
+    KASSERT(pfatFile->refCount > 0);
+    if (--pfatFile->refCount == 0) {
+	/* Idle files are kept at the back, in the order they were closed */
+	Remove_From_PFAT_File_List(&instance->fileList, pfatFile);
+	Add_To_Back_Of_PFAT_File_List(&instance->fileList, pfatFile);
+	++instance->numIdleFiles;
+    }
+
+    /* Reclaim the files idle the longest */
+    while (instance->numIdleFiles > PFAT_MAX_IDLE_FILES) {
+	struct PFAT_File *idle = Get_Front_Of_PFAT_File_List(&instance->fileList);
+
+	while (idle->refCount > 0)
+	    idle = Get_Next_In_PFAT_File_List(idle);
+	Free_PFAT_File(instance, idle);
+    }
+}
+
+/*
+ * Return a PFAT_File object obtained from Get_PFAT_File(),
+ * without the instance lock held.
+ */
+static void Put_PFAT_File(struct PFAT_Instance *instance, struct PFAT_File *pfatFile)
+{
+    Mutex_Lock(&instance->lock);
+    Release_PFAT_File(instance, pfatFile);
+    Mutex_Unlock(&instance->lock);
+}
+
+/*
+ * Find a free slot in a directory for a new entry with given
+ * name, growing the directory if needed.  The root directory
+ * can only grow into the unused part of its last sector.
+ * Called with the instance lock held.
+ */
+static int PFAT_Create_Entry(struct PFAT_Instance *instance, struct PFAT_Dir *dir,
+    const char *name, int *pIndex)
+{
+    bootSector *fsinfo = &instance->fsinfo;
+    int index, rc;
+
+    if (*name == '\0')
+	return ENOTFOUND;
+    if (strlen(name) >= sizeof(dir->entry->fileName))
+	return ENAMETOOLONG;
+
+    for (index = 0; index < dir->numEntries; ++index) {
+	if (PFAT_Dir_Entry(dir, index)->fileName[0] == '\0')
+	    break;
+    }
+
+    if (index == dir->numEntries) {
+	if (dir->file != 0) {
+	    if ((rc = PFAT_Grow_Dir(instance, dir)) != 0)
+		return rc;
+	} else {
+	    struct FS_Buffer *bootSect;
+
+	    if (dir->numEntries >= dir->maxEntries)
+		return ENOSPACE;
+
+	    /* The entry count lives in the boot sector */
+	    if ((rc = Get_FS_Buffer(instance->fsCache, 0, &bootSect)) != 0)
+		return rc;
+	    dir->numEntries = ++fsinfo->rootDirectoryCount;
+	    instance->rootDirEntry.fileSize = fsinfo->rootDirectoryCount * sizeof(directoryEntry);
+	    memcpy(((char*) bootSect->data) + PFAT_BOOT_RECORD_OFFSET, fsinfo, sizeof(bootSector));
+	    Modify_FS_Buffer(instance->fsCache, bootSect);
+	    Release_FS_Buffer(instance->fsCache, bootSect);
+	}
+    }
+
+    memset(PFAT_Dir_Entry(dir, index), '\0', sizeof(directoryEntry));
+    strcpy(PFAT_Dir_Entry(dir, index)->fileName, name);
+    Mark_Dir_Entry_Dirty(instance, dir, index);
+    PFAT_Hash_Dir_Entry(dir, index);
+
+    Debug("Created directory entry for %s\n", name);
+    *pIndex = index;
+    return 0;
+}
+
 /*
  * Open function for PFAT filesystems.
  */
@@ -397,31 +1643,47 @@ static int PFAT_Open(struct Mount_Point *mountPoint, const char *path, int mode,
 {
     int rc = 0;
     struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
+    struct PFAT_Dir *dir;
+    int index;
     directoryEntry *entry;
     struct PFAT_File *pfatFile = 0;
     struct File *file = 0;
 
-    /* Reject attempts to create or write */
-    if ((mode & (O_WRITE | O_CREATE)) != 0)
-	return EACCESS;
+    Mutex_Lock(&instance->lock);
 
-    /* Look up the directory entry */
-    entry = PFAT_Lookup(instance, path);
-    if (entry == 0)
-	return ENOTFOUND;
+    /* Look up the directory entry, creating it if requested */
+    rc = PFAT_Lookup(instance, path, &dir, &index);
+    if (rc == ENOTFOUND && dir != 0 && (mode & O_CREATE))
+	rc = PFAT_Create_Entry(instance, dir, strrchr(path, '/') + 1, &index);
+    else if (rc == 0 && (mode & O_CREATE) && (mode & O_EXCL))
+	rc = EEXIST;
+    if (rc != 0)
+	goto done;
+    entry = PFAT_Dir_Entry(dir, index);
 
     /* Make sure the entry is not a directory. */
-    if (entry->directory)
-	return EACCESS;
+    if (entry->directory) {
+	rc = EACCESS;
+	goto done;
+    }
+
+    /* Read only files can't be written. */
+    if ((mode & O_WRITE) && entry->readOnly) {
+	rc = EACCESS;
+	goto done;
+    }
 
     /* Get PFAT_File object */
-    pfatFile = Get_PFAT_File(instance, entry);
-    if (pfatFile == 0)
+    pfatFile = Get_PFAT_File(instance, dir, index);
+    if (pfatFile == 0) {
+	rc = ENOMEM;
 	goto done;
+    }
 
     /* Create the file object. */
-    file = Allocate_File(&s_pfatFileOps, 0, entry->fileSize, pfatFile, 0, 0);
+    file = Allocate_File(&s_pfatFileOps, 0, entry->fileSize, pfatFile, mode, mountPoint);
     if (file == 0) {
+	Release_PFAT_File(instance, pfatFile);
 	rc = ENOMEM;
 	goto done;
     }
@@ -430,36 +1692,72 @@ static int PFAT_Open(struct Mount_Point *mountPoint, const char *path, int mode,
     *pFile = file;
 
 done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+/*
+ * Create_Directory function for PFAT filesystems.
+ * The new directory is empty, and has no blocks until
+ * something is created in it.
+ */
+static int PFAT_Create_Directory(struct Mount_Point *mountPoint, const char *path)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
+    struct PFAT_Dir *dir;
+    int index, rc;
+
+    Mutex_Lock(&instance->lock);
+
+    rc = PFAT_Lookup(instance, path, &dir, &index);
+    if (rc == 0)
+	rc = EEXIST;
+    else if (rc == ENOTFOUND && dir != 0) {
+	rc = PFAT_Create_Entry(instance, dir, strrchr(path, '/') + 1, &index);
+	if (rc == 0)
+	    PFAT_Dir_Entry(dir, index)->directory = 1;
+    }
+
+    Mutex_Unlock(&instance->lock);
     return rc;
 }
 
 /*
  * Open_Directory function for PFAT filesystems.
+ * We just store the current cursor index in the File object.
  */
 static int PFAT_Open_Directory(struct Mount_Point *mountPoint, const char *path, struct File **pDir)
 {
-    /*
-     * FIXME: for now, we only support a single directory.
-     * This makes this function pretty simple.
-     * We just store the current cursor index in the File object.
-     */
     struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
+    struct PFAT_Dir *pfatDir;
     struct File *dir;
+    int index, rc;
 
-    if (strcmp(path, "/") != 0)
-	return ENOTFOUND;
+    Mutex_Lock(&instance->lock);
+
+    rc = PFAT_Lookup(instance, path, &pfatDir, &index);
+    if (rc == 0 && index >= 0)
+	rc = PFAT_Load_Dir(instance, pfatDir, index, &pfatDir);
+    if (rc != 0)
+	goto done;
 
     dir = (struct File*) Malloc(sizeof(*dir));
-    if (dir == 0)
-	return ENOMEM;
+    if (dir == 0) {
+	rc = ENOMEM;
+	goto done;
+    }
 
     dir->ops = &s_pfatDirOps;
     dir->filePos = 0; /* next dir entry to be read */
-    dir->endPos = instance->fsinfo.rootDirectoryCount; /* number of directory entries */
-    dir->fsData = 0;
+    dir->endPos = pfatDir->numEntries; /* number of directory entries */
+    dir->fsData = pfatDir;
+    ++pfatDir->refCount;
 
     *pDir = dir;
-    return 0;
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
 }
 
 /*
@@ -468,29 +1766,127 @@ static int PFAT_Open_Directory(struct Mount_Point *mountPoint, const char *path,
 static int PFAT_Stat(struct Mount_Point *mountPoint, const char *path, struct VFS_File_Stat *stat)
 {
     struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
-    directoryEntry *entry;
+    struct PFAT_Dir *dir;
+    int index, rc;
 
     KASSERT(path != 0);
     KASSERT(stat != 0);
 
     Debug("PFAT_Stat(%s)\n", path);
 
-    entry = PFAT_Lookup(instance, path);
-    if (entry == 0)
-	return ENOTFOUND;
-
-    Copy_Stat(stat, entry);
+    Mutex_Lock(&instance->lock);
+    rc = PFAT_Lookup(instance, path, &dir, &index);
+    if (rc == 0)
+	Copy_Stat(stat, PFAT_Dir_Entry(dir, index));
+    Mutex_Unlock(&instance->lock);
 
-    return 0;
+    return rc;
 }
 
 /*
  * Sync function for PFAT filesystems.
+ * File data is written as it changes; this writes back the
+ * FAT, the directories and the boot sector.
  */
 static int PFAT_Sync(struct Mount_Point *mountPoint)
 {
-    /* Read only filesystem: this is a no-op. */
-    return 0;
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
+    int rc;
+
+    Mutex_Lock(&instance->lock);
+    rc = PFAT_Flush_Metadata(mountPoint->dev, instance);
+    Mutex_Unlock(&instance->lock);
+    if (rc != 0)
+	return rc;
+
+    return Sync_FS_Buffer_Cache(instance->fsCache);
+}
+
+/*
+ * Delete function for PFAT filesystems.
+ * Open files, and directories which are open or not empty,
+ * can't be deleted.
+ */
+static int PFAT_Delete(struct Mount_Point *mountPoint, const char *path)
+{
+    struct PFAT_Instance *instance = (struct PFAT_Instance*) mountPoint->fsData;
+    struct PFAT_Dir *dir;
+    int index;
+    directoryEntry *entry;
+    struct PFAT_File *pfatFile;
+    ulong_t block;
+    int rc = 0;
+
+    Mutex_Lock(&instance->lock);
+
+    rc = PFAT_Lookup(instance, path, &dir, &index);
+    if (rc != 0)
+	goto done;
+    if (index < 0) {
+	rc = EACCESS;  /* the root directory */
+	goto done;
+    }
+    entry = PFAT_Dir_Entry(dir, index);
+    if (entry->readOnly) {
+	rc = EACCESS;
+	goto done;
+    }
+
+    /* Drop the in-memory copy of a directory */
+    if (entry->directory) {
+	struct PFAT_Dir *subdir;
+	int i;
+
+	if ((rc = PFAT_Load_Dir(instance, dir, index, &subdir)) != 0)
+	    goto done;
+	for (i = 0; i < subdir->numEntries; ++i) {
+	    if (PFAT_Dir_Entry(subdir, i)->fileName[0] != '\0')
+		break;
+	}
+	if (i < subdir->numEntries || subdir->refCount > 0) {
+	    rc = EBUSY;
+	    goto done;
+	}
+	Remove_From_PFAT_Dir_List(&instance->dirList, subdir);
+	PFAT_Free_Dir(instance, subdir);
+    }
+
+    /* Drop the file's PFAT_File object, unless it is in use */
+    for (pfatFile = Get_Front_Of_PFAT_File_List(&instance->fileList);
+	 pfatFile != 0;
+	 pfatFile = Get_Next_In_PFAT_File_List(pfatFile)) {
+	if (pfatFile->entry == entry)
+	    break;
+    }
+    if (pfatFile != 0) {
+	if (pfatFile->refCount > 0) {
+	    rc = EBUSY;
+	    goto done;
+	}
+	Free_PFAT_File(instance, pfatFile);
+    }
+
+    /* Free the file's blocks, stopping at anything suspicious */
+    block = entry->firstBlock;
+    while (block >= instance->firstDataBlock && block < instance->numFatEntries &&
+	   Is_Bit_Set(instance->freeMap, block)) {
+	ulong_t next = instance->fat[block];
+
+	Clear_Bit(instance->freeMap, block);
+	instance->fat[block] = FAT_ENTRY_FREE;
+	Mark_FAT_Dirty(instance, block);
+	++instance->numFreeBlocks;
+	block = next;
+    }
+
+    Debug("Deleted %s\n", entry->fileName);
+    PFAT_Unhash_Dir_Entry(dir, index);
+    memset(entry, '\0', sizeof(*entry));
+    Mark_Dir_Entry_Dirty(instance, dir, index);
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
 }
 
 /*
@@ -498,11 +1894,11 @@ static int PFAT_Sync(struct Mount_Point *mountPoint)
  */
 struct Mount_Point_Ops s_pfatMountPointOps = {
     PFAT_Open,
-    0,				/* Create_Directory() */
+    PFAT_Create_Directory,
     PFAT_Open_Directory,
     PFAT_Stat,
     PFAT_Sync,
-    0                          /* Delete */
+    PFAT_Delete
 };
 
 /*
@@ -514,15 +1910,20 @@ static void PFAT_Register_Paging_File(struct Mount_Point *mountPoint, struct PFA
 {
     directoryEntry *pagefileEntry;
     struct Paging_Device *pagedev = 0;
+    struct PFAT_Dir *dir;
     size_t nameLen;
     char *fileName = 0;
+    int index, rc;
 
     if (Get_Paging_Device() != 0)
 	return;  /* A paging device is already registered */
 
-    pagefileEntry = PFAT_Lookup(instance, PAGEFILE_FILENAME);
-    if (pagefileEntry == 0)
+    Mutex_Lock(&instance->lock);
+    rc = PFAT_Lookup(instance, PAGEFILE_FILENAME, &dir, &index);
+    Mutex_Unlock(&instance->lock);
+    if (rc != 0)
 	return;  /* No paging file in this filesystem */
+    pagefileEntry = PFAT_Dir_Entry(dir, index);
 
     /* TODO: verify that paging file is contiguous */
 
@@ -564,10 +1965,10 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
 {
     struct PFAT_Instance *instance = 0;
     bootSector *fsinfo;
-    void *bootSect = 0;
+    struct FS_Buffer *bootSect = 0;
     int rootDirSize;
+    ulong_t i;
     int rc;
-    int i;
 
     /* Allocate instance. */
     instance = (struct PFAT_Instance*) Malloc(sizeof(*instance));
@@ -577,21 +1978,23 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
     fsinfo = &instance->fsinfo;
     Debug("Created instance object\n");
 
+    /* Metadata blocks are read through the buffer cache */
+    instance->fsCache = Create_FS_Buffer_Cache(mountPoint->dev, SECTOR_SIZE);
+    if (instance->fsCache == 0)
+	goto memfail;
+
     /*
-     * Allocate buffer to read bootsector,
+     * Read boot sector,
      * which contains metainformation about the PFAT filesystem.
      */
-    bootSect = Malloc(SECTOR_SIZE);
-    if (bootSect == 0)
-	goto memfail;
-
-    /* Read boot sector */
-    if ((rc = Block_Read(mountPoint->dev, 0, bootSect)) < 0)
+    if ((rc = Get_FS_Buffer(instance->fsCache, 0, &bootSect)) < 0)
 	goto fail;
     Debug("Read boot sector\n");
 
     /* Copy filesystem parameters from boot sector */
-    memcpy(&instance->fsinfo, ((char*)bootSect) + PFAT_BOOT_RECORD_OFFSET, sizeof(bootSector));
+    memcpy(&instance->fsinfo, ((char*)bootSect->data) + PFAT_BOOT_RECORD_OFFSET, sizeof(bootSector));
+    Release_FS_Buffer(instance->fsCache, bootSect);
+    bootSect = 0;
     Debug("Copied boot record\n");
 
     /* Does magic number match? */
@@ -617,25 +2020,22 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
 	goto memfail;
 
     /* Read the FAT */
-    for (i = 0; i < fsinfo->fileAllocationLength; ++i) {
-	int blockNum = fsinfo->fileAllocationOffset + i;
-	char *p = ((char*)instance->fat) + (i * SECTOR_SIZE);
-	if ((rc = Block_Read(mountPoint->dev, blockNum, p)) < 0)
-	    goto fail;
-    }
+    if ((rc = Block_Read_Range(mountPoint->dev, fsinfo->fileAllocationOffset,
+	    fsinfo->fileAllocationLength, instance->fat)) < 0)
+	goto fail;
     Debug("Read FAT successfully!\n");
 
     /* Allocate root directory */
     rootDirSize = Round_Up_To_Block(sizeof(directoryEntry) * fsinfo->rootDirectoryCount);
     instance->rootDir = (directoryEntry*) Malloc(rootDirSize);
+    if (instance->rootDir == 0)
+	goto memfail;
 
     /* Read the root directory */
     Debug("Root directory size = %d\n", rootDirSize);
-    for (i = 0; i < rootDirSize; i += SECTOR_SIZE) {
-	int blockNum = fsinfo->rootDirectoryOffset + i;
-	if ((rc = Block_Read(mountPoint->dev, blockNum, instance->rootDir + (i*SECTOR_SIZE))) < 0)
-	    goto fail;
-    }
+    if ((rc = Block_Read_Range(mountPoint->dev, fsinfo->rootDirectoryOffset,
+	    rootDirSize / SECTOR_SIZE, instance->rootDir)) < 0)
+	goto fail;
     Debug("Read root directory successfully!\n");
 
     /* Create the fake root directory entry. */
@@ -645,9 +2045,43 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
     instance->rootDirEntry.fileSize =
 	instance->fsinfo.rootDirectoryCount * sizeof(directoryEntry);
 
-    /* Initialize instance lock and PFAT_File list. */
+    /*
+     * Find the free blocks.  Blocks the FAT covers past the end of
+     * the device, and those holding the filesystem itself, are
+     * never allocated.
+     */
+    instance->numFatEntries = MIN((ulong_t) fsinfo->fileAllocationLength * (SECTOR_SIZE / sizeof(int)),
+	(ulong_t) Get_Num_Blocks(mountPoint->dev));
+    instance->rootDirSectors = rootDirSize / SECTOR_SIZE;
+    instance->firstDataBlock = fsinfo->rootDirectoryOffset + instance->rootDirSectors;
+    instance->freeMap = Create_Bit_Set(instance->numFatEntries);
+    instance->fatDirtySet = Create_Bit_Set(fsinfo->fileAllocationLength);
+    instance->dirDirtySet = Create_Bit_Set(instance->rootDirSectors);
+    if (instance->freeMap == 0 || instance->fatDirtySet == 0 || instance->dirDirtySet == 0)
+	goto memfail;
+    for (i = 0; i < instance->numFatEntries; ++i) {
+	if (i < instance->firstDataBlock || instance->fat[i] != FAT_ENTRY_FREE)
+	    Set_Bit(instance->freeMap, i);
+	else
+	    ++instance->numFreeBlocks;
+    }
+    Debug("%lu free blocks\n", instance->numFreeBlocks);
+
+    /* Index the root directory, with room for the slots it can grow into */
+    instance->root.entry = &instance->rootDirEntry;
+    instance->root.entries = instance->rootDir;
+    instance->root.numEntries = fsinfo->rootDirectoryCount;
+    instance->root.maxEntries = rootDirSize / sizeof(directoryEntry);
+    instance->root.hashNext = (int*) Malloc(instance->root.maxEntries * sizeof(int));
+    if (instance->root.hashNext == 0)
+	goto memfail;
+    PFAT_Index_Dir(&instance->root);
+
+    /* Initialize instance lock, and PFAT_File and PFAT_Dir lists. */
+    instance->dev = mountPoint->dev;
     Mutex_Init(&instance->lock);
     Clear_PFAT_File_List(&instance->fileList);
+    Clear_PFAT_Dir_List(&instance->dirList);
 
     /* Attempt to register a paging file */
     PFAT_Register_Paging_File(mountPoint, instance);
@@ -671,10 +2105,18 @@ fail:
 	    Free(instance->fat);
 	if (instance->rootDir != 0)
 	    Free(instance->rootDir);
+	if (instance->freeMap != 0)
+	    Destroy_Bit_Set(instance->freeMap);
+	if (instance->fatDirtySet != 0)
+	    Destroy_Bit_Set(instance->fatDirtySet);
+	if (instance->dirDirtySet != 0)
+	    Destroy_Bit_Set(instance->dirDirtySet);
+	if (instance->root.hashNext != 0)
+	    Free(instance->root.hashNext);
+	if (instance->fsCache != 0)
+	    Destroy_FS_Buffer_Cache(instance->fsCache);
 	Free(instance);
     }
-    if (bootSect != 0)
-	Free(bootSect);
     return rc;
 }
 
@@ -0,0 +1,270 @@
+/*
+ * RAM disk driver
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * NOTES:
+ * The RAM disk "ram0" holds its contents in pages, which are
+ * allocated the first time a block in them is written.  Blocks
+ * that were never written read as zeroes, so a large RAM disk
+ * costs little memory until it is used.  Its pages are never
+ * freed while it is in use, so at boot it is sized to at most
+ * half of the free pages, and Load_Ramdisk() shrinks it to the
+ * size of the device it copies.
+ */
+
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/screen.h>
+#include <geekos/string.h>
+#include <geekos/malloc.h>
+#include <geekos/mem.h>
+#include <geekos/kthread.h>
+#include <geekos/memstat.h>
+#include <geekos/blockdev.h>
+#include <geekos/ramdisk.h>
+
+/*#define RAMDISK_DEBUG */
+#ifdef RAMDISK_DEBUG
+#  define Debug(args...) Print(args)
+#else
+#  define Debug(args...)
+#endif
+
+/* ----------------------------------------------------------------------
+ * Variables
+ * ---------------------------------------------------------------------- */
+
+#define BLOCKS_PER_PAGE		(PAGE_SIZE / SECTOR_SIZE)
+#define RAMDISK_MAX_PAGES	(RAMDISK_MAX_BLOCKS / BLOCKS_PER_PAGE)
+
+/*
+ * Most blocks per request.
+ */
+#define RAMDISK_MAX_REQUEST_BLOCKS 128
+
+/*
+ * Pages holding the contents of the RAM disk,
+ * or null for pages never written.
+ */
+static void **s_ramdiskPages;
+
+/*
+ * Size of the RAM disk, in blocks.
+ */
+static int s_numBlocks;
+
+/*
+ * Queue of RAM disk block I/O requests, and thread queue
+ * where the request thread waits for requests.
+ */
+static struct Block_Request_List s_ramdiskRequestQueue;
+static struct Thread_Queue s_ramdiskWaitQueue;
+
+/* ----------------------------------------------------------------------
+ * Private functions
+ * ---------------------------------------------------------------------- */
+
+static int Ramdisk_Open(struct Block_Device *dev)
+{
+    KASSERT(!dev->inUse);
+    return 0;
+}
+
+static int Ramdisk_Close(struct Block_Device *dev)
+{
+    KASSERT(dev->inUse);
+    return 0;
+}
+
+static int Ramdisk_Get_Num_Blocks(struct Block_Device *dev)
+{
+    return s_numBlocks;
+}
+
+static struct Block_Device_Ops s_ramdiskDeviceOps = {
+    Ramdisk_Open,
+    Ramdisk_Close,
+    Ramdisk_Get_Num_Blocks,
+    RAMDISK_MAX_REQUEST_BLOCKS,
+};
+
+/*
+ * Get the page holding given page of the RAM disk,
+ * allocating it if requested.
+ * Returns null if the page doesn't exist (and wasn't
+ * requested, or couldn't be allocated).
+ */
+static char *Get_Ramdisk_Page(int pageNum, bool allocate)
+{
+    if (s_ramdiskPages[pageNum] == 0 && allocate)
+	s_ramdiskPages[pageNum] = Alloc_Zeroed_Page();
+    return (char*) s_ramdiskPages[pageNum];
+}
+
+/*
+ * Copy blocks between the RAM disk and a buffer.
+ */
+static int Ramdisk_Transfer(enum Request_Type type, int blockNum, int numBlocks, char *buf)
+{
+    if (blockNum < 0 || numBlocks < 0 || numBlocks > s_numBlocks - blockNum)
+	return EINVALID;
+
+    while (numBlocks > 0) {
+	int offset = blockNum % BLOCKS_PER_PAGE;
+	int count = BLOCKS_PER_PAGE - offset;
+	char *page = Get_Ramdisk_Page(blockNum / BLOCKS_PER_PAGE, type == BLOCK_WRITE);
+
+	if (count > numBlocks)
+	    count = numBlocks;
+
+	if (type == BLOCK_READ) {
+	    if (page != 0)
+		memcpy(buf, page + offset * SECTOR_SIZE, count * SECTOR_SIZE);
+	    else
+		memset(buf, '\0', count * SECTOR_SIZE);
+	} else {
+	    if (page == 0)
+		return ENOMEM;
+	    memcpy(page + offset * SECTOR_SIZE, buf, count * SECTOR_SIZE);
+	}
+
+	blockNum += count;
+	numBlocks -= count;
+	buf += count * SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Free the pages of the RAM disk, emptying it.
+ */
+static void Free_Ramdisk_Pages(void)
+{
+    int pageNum;
+
+    for (pageNum = 0; pageNum < RAMDISK_MAX_PAGES; ++pageNum) {
+	if (s_ramdiskPages[pageNum] != 0) {
+	    Free_Page(s_ramdiskPages[pageNum]);
+	    s_ramdiskPages[pageNum] = 0;
+	}
+    }
+}
+
+/*
+ * This is the thread which processes RAM disk I/O requests.
+ */
+static void Ramdisk_Request_Thread(ulong_t arg)
+{
+    for (;;) {
+	struct Block_Request *request;
+	int rc;
+
+	/* Wait for a request to arrive */
+	request = Dequeue_Request(&s_ramdiskRequestQueue, &s_ramdiskWaitQueue);
+
+	/* Do the I/O */
+	rc = Ramdisk_Transfer(request->type, request->blockNum, request->xferBlocks, request->buf);
+
+	/* Notify requesting thread of final status */
+	Notify_Request_Completion(request, rc == 0 ? COMPLETED : ERROR, rc);
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Create the RAM disk and register it as block device "ram0".
+ * It may use up to half of the pages which are free now.
+ */
+void Init_Ramdisk(void)
+{
+    struct Mem_Stats stats;
+    int rc;
+
+    Print("Initializing RAM disk...\n");
+
+    s_ramdiskPages = (void**) Malloc(RAMDISK_MAX_PAGES * sizeof(void*));
+    if (s_ramdiskPages == 0) {
+	Print("  Error: could not allocate RAM disk page table\n");
+	return;
+    }
+    memset(s_ramdiskPages, '\0', RAMDISK_MAX_PAGES * sizeof(void*));
+
+    Get_Page_Stats(&stats);
+    s_numBlocks = (stats.freePages / 2) * BLOCKS_PER_PAGE;
+    if (s_numBlocks > RAMDISK_MAX_BLOCKS)
+	s_numBlocks = RAMDISK_MAX_BLOCKS;
+
+    rc = Register_Block_Device("ram0", &s_ramdiskDeviceOps, 0, 0,
+	&s_ramdiskWaitQueue, &s_ramdiskRequestQueue, BLOCK_SCHED_FIFO);
+    if (rc != 0) {
+	Print("  Error: could not create block device for ram0\n");
+	return;
+    }
+    Print("    ram0: %d blocks\n", s_numBlocks);
+
+    Start_Kernel_Thread(Ramdisk_Request_Thread, 0, PRIORITY_NORMAL, true);
+}
+
+/*
+ * Fill the RAM disk with the contents of given block device,
+ * so that a filesystem image can be mounted from memory.
+ * The RAM disk takes the size of the device.  If the device
+ * doesn't fit, or can't be read, the RAM disk is left empty.
+ * Must be called before the RAM disk is used.
+ * Returns 0 if successful, error code otherwise.
+ */
+int Load_Ramdisk(const char *devName)
+{
+    struct Block_Device *dev;
+    int numBlocks, pageNum;
+    int rc;
+
+    if (s_ramdiskPages == 0)
+	return ENODEV;
+
+    rc = Open_Block_Device(devName, &dev);
+    if (rc != 0)
+	return rc;
+
+    numBlocks = Get_Num_Blocks(dev);
+    if (numBlocks > s_numBlocks) {
+	Print("%s has %d blocks, more than the RAM disk can hold (%d)\n",
+	    devName, numBlocks, s_numBlocks);
+	Close_Block_Device(dev);
+	return ENOSPACE;
+    }
+    Print("Loading %d blocks from %s into RAM disk...\n", numBlocks, devName);
+
+    /* Read the device a page at a time, straight into the RAM disk pages */
+    for (pageNum = 0; pageNum * BLOCKS_PER_PAGE < numBlocks; ++pageNum) {
+	int count = numBlocks - pageNum * BLOCKS_PER_PAGE;
+	char *page = Get_Ramdisk_Page(pageNum, true);
+
+	if (page == 0) {
+	    rc = ENOMEM;
+	    break;
+	}
+	if (count > BLOCKS_PER_PAGE)
+	    count = BLOCKS_PER_PAGE;
+
+	rc = Block_Read_Range(dev, pageNum * BLOCKS_PER_PAGE, count, page);
+	if (rc != 0)
+	    break;
+    }
+
+    Close_Block_Device(dev);
+
+    if (rc == 0)
+	s_numBlocks = numBlocks;
+    else
+	Free_Ramdisk_Pages();
+    return rc;
+}
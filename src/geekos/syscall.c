@@ -21,6 +21,10 @@
 #include <geekos/timer.h>
 #include <geekos/vfs.h>
 #include <geekos/synch.h>
+#include <geekos/mem.h>
+#include <geekos/memstat.h>
+#include <geekos/blockdev.h>
+#include <geekos/fileio.h>
 
 
 #define ROUND_ROBIN         0 
@@ -74,7 +78,8 @@ static int Sys_Null(struct Interrupt_State* state)
 
 /*
  * Exit system call.
- * The interrupted user process is terminated.
+ * The interrupted user process is terminated, and the
+ * files it left open are closed.
  * Params:
  *   state->ebx - process exit code
  * Returns:
@@ -212,6 +217,33 @@ static int Sys_Spawn(struct Interrupt_State* state)
 	return res;
 }
 
+/*
+ * Create a copy of the current process.
+ * The child gets a copy of the parent's memory, but no open
+ * files: a File has a single position and owner, so file
+ * descriptors are not inherited.
+ * Params:
+ *   state - processor registers from user mode; the child
+ *     resumes with the same registers, apart from eax
+ * Returns: the pid of the child to the parent, 0 to the child,
+ *   or an error code (< 0) if the process couldn't be created
+ */
+static int Sys_Fork(struct Interrupt_State* state)
+{
+    int res;
+    struct Kernel_Thread *process;
+
+    Enable_Interrupts();
+    res = Fork(state, &process);
+    if (res == 0) {
+	KASSERT(process != 0);
+	res = process->pid;
+    }
+    Disable_Interrupts();
+
+    return res;
+}
+
 /*
  * Wait for a process to exit.
  * Params:
@@ -285,6 +317,80 @@ static int Sys_GetTimeOfDay(struct Interrupt_State* state)
      return g_numTicks; 
 }
 
+/*
+ * Get memory usage statistics.
+ * Params:
+ *   state->ebx - user address of struct Mem_Stats to fill in
+ *   state->ecx - user address of array of struct Process_Mem_Stats
+ *     to fill in, one per user process
+ *   state->edx - number of elements in that array
+ * Returns: the number of processes stored in the array,
+ *   or error code (< 0) on error
+ */
+static int Sys_MemStats(struct Interrupt_State* state)
+{
+    struct Mem_Stats stats;
+    struct Process_Mem_Stats *procList;
+    int maxProcs = state->edx, numProcs;
+    int rc = 0;
+
+    if (maxProcs < 0)
+	return EINVALID;
+    if (maxProcs > MEMSTAT_MAX_PROCESSES)
+	maxProcs = MEMSTAT_MAX_PROCESSES;
+
+    procList = (struct Process_Mem_Stats*) Malloc(sizeof(*procList) * MEMSTAT_MAX_PROCESSES);
+    if (procList == 0)
+	return ENOMEM;
+
+    Get_Page_Stats(&stats);
+    Get_Heap_Stats(&stats);
+    numProcs = Get_Process_Mem_Stats(procList, maxProcs);
+
+    if (!Copy_To_User(state->ebx, &stats, sizeof(stats)) ||
+	!Copy_To_User(state->ecx, procList, sizeof(*procList) * numProcs))
+	rc = EINVALID;
+
+    Free(procList);
+    return rc == 0 ? numProcs : rc;
+}
+
+/*
+ * Get block device statistics.
+ * Params:
+ *   state->ebx - user address of array of struct Block_Device_Stats
+ *     to fill in, one per block device
+ *   state->ecx - number of elements in that array
+ * Returns: the number of devices stored in the array,
+ *   or error code (< 0) on error
+ */
+static int Sys_IOStats(struct Interrupt_State* state)
+{
+    struct Block_Device_Stats *statsList;
+    int maxDevices = state->ecx, numDevices;
+    int rc = 0;
+
+    if (maxDevices < 0)
+	return EINVALID;
+    if (maxDevices > IOSTAT_MAX_DEVICES)
+	maxDevices = IOSTAT_MAX_DEVICES;
+
+    statsList = (struct Block_Device_Stats*) Malloc(sizeof(*statsList) * IOSTAT_MAX_DEVICES);
+    if (statsList == 0)
+	return ENOMEM;
+
+    /* The device list is protected by a mutex */
+    Enable_Interrupts();
+    numDevices = Get_Block_Device_Stats(statsList, maxDevices);
+    Disable_Interrupts();
+
+    if (!Copy_To_User(state->ebx, statsList, sizeof(*statsList) * numDevices))
+	rc = EINVALID;
+
+    Free(statsList);
+    return rc == 0 ? numDevices : rc;
+}
+
 /*
  * Create a semaphore.
  * Params:
@@ -382,6 +488,260 @@ static int Sys_DestroySemaphore(struct Interrupt_State* state)
      return Destroy_Semaphore(state->ebx); 
 }
 
+/*
+ * Get the File open as given file descriptor
+ * in the current process.
+ * Returns: the File, or 0 if the descriptor isn't open
+ */
+static struct File *Get_User_File(int fd)
+{
+    struct User_Context *userContext = g_currentThread->userContext;
+
+    if (fd < 0 || fd >= USER_MAX_FILES)
+	return 0;
+    return userContext->fileList[fd];
+}
+
+/*
+ * Find a free file descriptor in the current process.
+ * Returns: the descriptor, or EMFILE if all are in use
+ */
+static int Find_Free_Descriptor(void)
+{
+    struct User_Context *userContext = g_currentThread->userContext;
+    int fd;
+
+    for (fd = 0; fd < USER_MAX_FILES; ++fd) {
+	if (userContext->fileList[fd] == 0)
+	    return fd;
+    }
+    return EMFILE;
+}
+
+/*
+ * Open a file or directory, and give it a file descriptor.
+ * Params:
+ *   userPath, pathLen - path of the file in user memory
+ *   mode - open flags, or -1 to open a directory
+ * Returns: the file descriptor, or error code (< 0) on error
+ */
+static int Open_User_File(ulong_t userPath, ulong_t pathLen, int mode)
+{
+    struct File *file;
+    char *path = 0;
+    int fd, rc;
+
+    if ((fd = Find_Free_Descriptor()) < 0)
+	return fd;
+    if ((rc = Copy_User_String(userPath, pathLen, VFS_MAX_PATH_LEN, &path)) != 0)
+	return rc;
+
+    Enable_Interrupts();
+    if (mode < 0)
+	rc = Open_Directory(path, &file);
+    else
+	rc = Open(path, mode, &file);
+    Disable_Interrupts();
+
+    Free(path);
+    if (rc != 0)
+	return rc;
+    g_currentThread->userContext->fileList[fd] = file;
+    return fd;
+}
+
+/*
+ * Open a file.
+ * Params:
+ *   state->ebx - user address of path of file
+ *   state->ecx - length of path
+ *   state->edx - open flags: combination of O_CREATE, O_READ,
+ *     O_WRITE, and O_EXCL
+ * Returns: a file descriptor (>= 0) if successful,
+ *   or error code (< 0) on error; EEXIST if O_CREATE and
+ *   O_EXCL are given and the file already exists
+ */
+static int Sys_Open(struct Interrupt_State* state)
+{
+    int mode = state->edx;
+
+    if ((mode & ~(O_CREATE | O_READ | O_WRITE | O_EXCL)) != 0)
+	return EINVALID;
+    return Open_User_File(state->ebx, state->ecx, mode);
+}
+
+/*
+ * Open a directory, to read its entries.
+ * Params:
+ *   state->ebx - user address of path of directory
+ *   state->ecx - length of path
+ * Returns: a file descriptor (>= 0) if successful,
+ *   or error code (< 0) on error
+ */
+static int Sys_OpenDirectory(struct Interrupt_State* state)
+{
+    return Open_User_File(state->ebx, state->ecx, -1);
+}
+
+/*
+ * Close a file or directory.
+ * Params:
+ *   state->ebx - file descriptor
+ * Returns: 0 if successful, error code (< 0) on error
+ */
+static int Sys_Close(struct Interrupt_State* state)
+{
+    struct File *file = Get_User_File(state->ebx);
+    int rc;
+
+    if (file == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Close(file);
+    Disable_Interrupts();
+
+    if (rc == 0)
+	g_currentThread->userContext->fileList[state->ebx] = 0;
+    return rc;
+}
+
+/*
+ * Read from a file.
+ * The filesystem copies the data straight into the
+ * process's memory, from its cache where it can.
+ * Params:
+ *   state->ebx - file descriptor
+ *   state->ecx - user address of buffer to read into
+ *   state->edx - number of bytes to read
+ * Returns: number of bytes read, 0 at end of file,
+ *   or error code (< 0) on error
+ */
+static int Sys_Read(struct Interrupt_State* state)
+{
+    struct File *file = Get_User_File(state->ebx);
+    void *buf;
+    int rc;
+
+    if (file == 0)
+	return EINVALID;
+    if (!(file->mode & O_READ))
+	return EACCESS;
+    if (state->edx == 0)
+	return 0;
+    if ((buf = User_To_Kernel(state->ecx, state->edx)) == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Read(file, buf, state->edx);
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Write to a file.
+ * Params:
+ *   state->ebx - file descriptor
+ *   state->ecx - user address of data to write
+ *   state->edx - number of bytes to write
+ * Returns: number of bytes written, or error code (< 0) on error
+ */
+static int Sys_Write(struct Interrupt_State* state)
+{
+    struct File *file = Get_User_File(state->ebx);
+    void *buf;
+    int rc;
+
+    if (file == 0)
+	return EINVALID;
+    if (state->edx == 0)
+	return 0;
+    if ((buf = User_To_Kernel(state->ecx, state->edx)) == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Write(file, buf, state->edx);
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Set the position in a file.
+ * Params:
+ *   state->ebx - file descriptor
+ *   state->ecx - new position
+ * Returns: 0 if successful, error code (< 0) on error
+ */
+static int Sys_Seek(struct Interrupt_State* state)
+{
+    struct File *file = Get_User_File(state->ebx);
+    int rc;
+
+    if (file == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Seek(file, state->ecx);
+    Disable_Interrupts();
+
+    return rc;
+}
+
+/*
+ * Get metadata of a file or directory.
+ * Params:
+ *   state->ebx - user address of path
+ *   state->ecx - length of path
+ *   state->edx - user address of struct VFS_File_Stat to fill in
+ * Returns: 0 if successful, error code (< 0) on error
+ */
+static int Sys_Stat(struct Interrupt_State* state)
+{
+    struct VFS_File_Stat stat;
+    char *path = 0;
+    int rc;
+
+    if ((rc = Copy_User_String(state->ebx, state->ecx, VFS_MAX_PATH_LEN, &path)) != 0)
+	return rc;
+
+    Enable_Interrupts();
+    rc = Stat(path, &stat);
+    Disable_Interrupts();
+
+    Free(path);
+    if (rc == 0 && !Copy_To_User(state->edx, &stat, sizeof(stat)))
+	rc = EINVALID;
+    return rc;
+}
+
+/*
+ * Read the next entry of a directory.
+ * Params:
+ *   state->ebx - file descriptor of directory
+ *   state->ecx - user address of struct VFS_Dir_Entry to fill in
+ * Returns: 0 if successful, VFS_NO_MORE_DIR_ENTRIES at the end
+ *   of the directory, or error code (< 0) on error
+ */
+static int Sys_ReadEntry(struct Interrupt_State* state)
+{
+    struct File *file = Get_User_File(state->ebx);
+    struct VFS_Dir_Entry *entry;
+    int rc;
+
+    if (file == 0)
+	return EINVALID;
+    if ((entry = User_To_Kernel(state->ecx, sizeof(*entry))) == 0)
+	return EINVALID;
+
+    Enable_Interrupts();
+    rc = Read_Entry(file, entry);
+    Disable_Interrupts();
+
+    return rc;
+}
+
 
 /*
  * Global table of system call handler functions.
@@ -404,6 +764,18 @@ const Syscall g_syscallTable[] = {
     Sys_P,
     Sys_V,
     Sys_DestroySemaphore,
+    Sys_Fork,
+    Sys_MemStats,
+    Sys_IOStats,
+    /* File I/O system calls. */
+    Sys_Open,
+    Sys_OpenDirectory,
+    Sys_Close,
+    Sys_Read,
+    Sys_Write,
+    Sys_Seek,
+    Sys_Stat,
+    Sys_ReadEntry,
 };
 
 /*
@@ -32,6 +32,17 @@ volatile ulong_t g_numTicks;
  */
 static int s_spinCountPerTick;
 
+/*
+ * Number of time stamp counter cycles per microsecond.
+ */
+static ulong_t s_cyclesPerMicrosecond = 1;
+
+/*
+ * Length of a tick, in microseconds, at the default
+ * 1193182/65536 Hz clock.
+ */
+#define MICROSECONDS_PER_TICK	54925
+
 /*
  * Number of ticks to wait before calibrating the delay loop.
  */
@@ -161,6 +172,9 @@ static void Spin(int count)
  */
 static void Calibrate_Delay(void)
 {
+    unsigned long long start;
+    ulong_t cyclesPerTick;
+
     Disable_Interrupts();
 
     /* Install temporarily interrupt handler */
@@ -169,9 +183,19 @@ static void Calibrate_Delay(void)
 
     Enable_Interrupts();
 
-    /* Wait a few ticks */
+    /*
+     * Wait a few ticks, timing all but the first
+     * with the time stamp counter.
+     */
+    while (g_numTicks < 1)
+	;
+    start = Read_TSC();
     while (g_numTicks < CALIBRATE_NUM_TICKS)
 	;
+    cyclesPerTick = (ulong_t) (Read_TSC() - start) / (CALIBRATE_NUM_TICKS - 1);
+    s_cyclesPerMicrosecond = cyclesPerTick / MICROSECONDS_PER_TICK;
+    if (s_cyclesPerMicrosecond == 0)
+	s_cyclesPerMicrosecond = 1;
 
     /*
      * Execute the spin loop.
@@ -212,6 +236,7 @@ void Init_Timer(void)
     /* Calibrate for delay loop */
     Calibrate_Delay();
     Print("Delay loop: %d iterations per tick\n", s_spinCountPerTick);
+    Print("Time stamp counter: %lu cycles per microsecond\n", s_cyclesPerMicrosecond);
 
     /* Install an interrupt handler for the timer IRQ */
     Install_IRQ(TIMER_IRQ, &Timer_Interrupt_Handler);
@@ -290,3 +315,22 @@ void Micro_Delay(int us)
 
     Spin(numSpins);
 }
+
+/*
+ * Convert a time stamp counter interval to microseconds.
+ * Long intervals are scaled down first, so no
+ * 64 bit division is needed.
+ */
+ulong_t Cycles_To_Microseconds(unsigned long long cycles)
+{
+    ulong_t perMicrosecond = s_cyclesPerMicrosecond;
+
+    while ((cycles >> 32) != 0 && perMicrosecond > 1) {
+	cycles >>= 1;
+	perMicrosecond >>= 1;
+    }
+    if ((cycles >> 32) != 0)
+	return ULONG_MAX;
+
+    return (ulong_t) cycles / perMicrosecond;
+}
@@ -14,6 +14,9 @@
 #include <geekos/mem.h>
 #include <geekos/malloc.h>
 #include <geekos/kthread.h>
+#include <geekos/synch.h>
+#include <geekos/string.h>
+#include <geekos/list.h>
 #include <geekos/vfs.h>
 #include <geekos/tss.h>
 #include <geekos/user.h>
@@ -23,6 +26,159 @@
  * mode processes.
  */
 int userDebug = 0;
+
+/*
+ * The User_Context whose address space is currently loaded.
+ * Forgotten when that context is destroyed, since a new context
+ * can be allocated at the same address.
+ */
+static struct User_Context* s_currentUserContext;
+
+/*
+ * Cache of the parsed headers of recently spawned executables,
+ * so spawning the same program again doesn't have to read and
+ * parse them again.  The segments themselves are read from the
+ * file for each spawn, straight into the new process's memory;
+ * the filesystem's page cache keeps that from going to disk.
+ * An entry is identified by the program's path and file size,
+ * and is only used while no file has changed since it was read.
+ */
+struct Exe_Cache_Entry;
+DEFINE_LIST(Exe_Cache_List, Exe_Cache_Entry);
+
+struct Exe_Cache_Entry {
+    char *path;
+    ulong_t exeFileLength;
+    ulong_t changeCount;		 /* Get_File_Change_Count() when read */
+    struct Exe_Format exeFormat;
+    DEFINE_LINK(Exe_Cache_List, Exe_Cache_Entry);
+};
+
+IMPLEMENT_LIST(Exe_Cache_List, Exe_Cache_Entry);
+
+/* Limit on the number of cached executables */
+#define EXE_CACHE_MAX_ENTRIES 16
+
+/* The headers must be in this many bytes at the start of the file */
+#define EXE_HEADER_MAX_BYTES PAGE_SIZE
+
+/* Entries, most recently used first; protected by s_exeCacheLock */
+static struct Exe_Cache_List s_exeCache;
+static int s_exeCacheEntries;
+static struct Mutex s_exeCacheLock = MUTEX_INITIALIZER;
+
+static void Free_Exe_Cache_Entry(struct Exe_Cache_Entry *entry)
+{
+    Free(entry->path);
+    Free(entry);
+}
+
+/*
+ * Remove an entry from the cache, and free it.
+ * Must be called with s_exeCacheLock held.
+ */
+static void Drop_Exe_Cache_Entry(struct Exe_Cache_Entry *entry)
+{
+    Remove_From_Exe_Cache_List(&s_exeCache, entry);
+    --s_exeCacheEntries;
+    Free_Exe_Cache_Entry(entry);
+}
+
+/*
+ * Read the headers at the start of an executable file,
+ * and parse them.
+ * Returns 0 if successful, error code (< 0) if not.
+ */
+static int Read_Exe_Format(struct File *exeFile, ulong_t exeFileLength, struct Exe_Format *exeFormat)
+{
+    ulong_t length = MIN(exeFileLength, (ulong_t) EXE_HEADER_MAX_BYTES);
+    ulong_t numBytesRead = 0;
+    char *buf;
+    int rc = 0;
+
+    buf = (char*) Malloc(length);
+    if (buf == 0)
+	return ENOMEM;
+
+    while (numBytesRead < length && rc >= 0) {
+	rc = Read(exeFile, buf + numBytesRead, length - numBytesRead);
+	if (rc == 0)
+	    rc = ENOEXEC;
+	else if (rc > 0)
+	    numBytesRead += rc;
+    }
+    if (rc >= 0)
+	rc = Parse_ELF_Executable(buf, length, exeFormat);
+
+    Free(buf);
+    return rc;
+}
+
+/*
+ * Get the parsed headers of an executable, from the cache if
+ * possible, otherwise by reading them from the open file.
+ * Returns 0 if successful, error code (< 0) if not.
+ */
+static int Get_Exe_Format(const char *program, struct File *exeFile, struct Exe_Format *exeFormat)
+{
+    struct VFS_File_Stat stat;
+    struct Exe_Cache_Entry *entry, *next;
+    ulong_t changeCount;
+    int rc;
+
+    changeCount = Get_File_Change_Count();
+    if ((rc = FStat(exeFile, &stat)) < 0)
+	return rc;
+    if (stat.size < 0)
+	return ENOEXEC;
+
+    Mutex_Lock(&s_exeCacheLock);
+    for (entry = Get_Front_Of_Exe_Cache_List(&s_exeCache); entry != 0; entry = next) {
+	next = Get_Next_In_Exe_Cache_List(entry);
+	if (strcmp(entry->path, program) != 0)
+	    continue;
+
+	/* The file may have been rewritten since it was read */
+	if (entry->changeCount != changeCount || entry->exeFileLength != stat.size) {
+	    Drop_Exe_Cache_Entry(entry);
+	    continue;
+	}
+
+	Remove_From_Exe_Cache_List(&s_exeCache, entry);
+	Add_To_Front_Of_Exe_Cache_List(&s_exeCache, entry);
+	memcpy(exeFormat, &entry->exeFormat, sizeof(*exeFormat));
+	Mutex_Unlock(&s_exeCacheLock);
+	return 0;
+    }
+    Mutex_Unlock(&s_exeCacheLock);
+
+    /* Not cached: read and parse the headers */
+    if ((rc = Read_Exe_Format(exeFile, stat.size, exeFormat)) != 0)
+	return rc;
+
+    /* Keep them for next time; it's fine to skip this if there's no memory */
+    entry = (struct Exe_Cache_Entry*) Malloc(sizeof(*entry));
+    if (entry == 0)
+	return 0;
+    entry->path = strdup(program);
+    if (entry->path == 0) {
+	Free(entry);
+	return 0;
+    }
+    entry->exeFileLength = stat.size;
+    entry->changeCount = changeCount;
+    memcpy(&entry->exeFormat, exeFormat, sizeof(*exeFormat));
+
+    Mutex_Lock(&s_exeCacheLock);
+    if (s_exeCacheEntries == EXE_CACHE_MAX_ENTRIES)
+	Drop_Exe_Cache_Entry(Get_Back_Of_Exe_Cache_List(&s_exeCache));
+    Add_To_Front_Of_Exe_Cache_List(&s_exeCache, entry);
+    ++s_exeCacheEntries;
+    Mutex_Unlock(&s_exeCacheLock);
+
+    return 0;
+}
+
 /*
  * Associate the given user context with a kernel thread.
  * This makes the thread a user process.
@@ -64,8 +220,11 @@ void Detach_User_Context(struct Kernel_Thread* kthread)
 	Enable_Interrupts();
 
 	/*Print("User context refcount == %d\n", refCount);*/
-        if (refCount == 0)
+        if (refCount == 0) {
+	    if (old == s_currentUserContext)
+		s_currentUserContext = 0;
             Destroy_User_Context(old);
+	}
     }
 }
 
@@ -87,12 +246,11 @@ int Spawn(const char *program, const char *command, struct Kernel_Thread **pThre
 {
     /*
      * Hints:
-     * - Call Read_Fully() to load the entire executable into a memory buffer
-     * - Call Parse_ELF_Executable() to verify that the executable is
-     *   valid, and to populate an Exe_Format data structure describing
-     *   how the executable should be loaded
-     * - Call Load_User_Program() to create a User_Context with the loaded
-     *   program
+     * - Open the executable, and get its parsed headers with
+     *   Get_Exe_Format(), which checks that it is a valid ELF
+     *   executable and describes how it should be loaded
+     * - Call Load_User_Program() to create a User_Context with the
+     *   program, read from the file straight into its memory
      * - Call Start_User_Thread() with the new User_Context
      *
      * If all goes well, store the pointer to the new thread in
@@ -100,44 +258,26 @@ int Spawn(const char *program, const char *command, struct Kernel_Thread **pThre
      */
         int res; 
  
-    /* 读取 ELF 文件 */     
-    char *exeFileData = NULL; 
-    ulong_t exeFileLength = 0;     
-    res = Read_Fully(program, (void**)&exeFileData, &exeFileLength);     
-    if (res != 0)     
-    {         
-//	if (userDebug)             
-//	    Print("Error! Failed to read file %s\n", program);         
-	if (exeFileData != NULL) Free(exeFileData);         
-	return ENOTFOUND;     
-    }     
-//    if (userDebug) Print("Read_Fully OK\n"); 
- 
-    /* 分析 ELF 文件 */     
-    struct Exe_Format exeFormat;     
-    res = Parse_ELF_Executable(exeFileData, exeFileLength, &exeFormat);     
-    if (res != 0)     
-    {         
-//	if (userDebug)             
-//	    Print("Error! Failed to parse ELF file\n");         
-	if (exeFileData != NULL) Free(exeFileData);         
-	return res;     
-    }     
-//    if (userDebug) Print("Parse_ELF_Executable OK\n"); 
+    /* 打开可执行文件 */
+    struct File *exeFile = NULL;
+    if (Open(program, O_READ, &exeFile) != 0)
+	return ENOTFOUND;
+
+    /* 读取并分析 ELF 头部(若已缓存则直接使用缓存) */     
+    struct Exe_Format exeFormat;
+    res = Get_Exe_Format(program, exeFile, &exeFormat);
  
     /* 加载用户程序 */     
     struct User_Context *userContext = NULL;     
-    res = Load_User_Program(exeFileData, exeFileLength, &exeFormat, command, &userContext);     
+    if (res == 0)
+	res = Load_User_Program(exeFile, &exeFormat, command, &userContext);     
+    Close(exeFile);
     if (res != 0)     
     {         
 //	if (userDebug)             
 //	    Print("Error! Failed to Load User Program\n");         
-	if (exeFileData != NULL) Free(exeFileData);         
-	if (userContext != NULL) Destroy_User_Context(userContext);         
 	return res;     
     }     
-    if (exeFileData != NULL) Free(exeFileData);     
-    exeFileData = NULL;     
 //    if (userDebug) Print("Load_User_Program OK\n"); 
  
     /* 开始用户进程 */     
@@ -160,6 +300,41 @@ int Spawn(const char *program, const char *command, struct Kernel_Thread **pThre
     return 0; 
 }
 
+/*
+ * Create a copy of the current user process.
+ * Params:
+ *   state - the registers of the current process at the
+ *     Fork system call, which the child returns with
+ *   pThread - reference to Kernel_Thread pointer where a pointer to
+ *     the new process should be stored
+ * Returns:
+ *   0 if successful, or an error code if the process couldn't
+ *   be created.
+ */
+int Fork(struct Interrupt_State *state, struct Kernel_Thread **pThread)
+{
+    struct User_Context *userContext = NULL;
+    struct Kernel_Thread *thread;
+    int res;
+
+    KASSERT(g_currentThread->userContext != 0);
+
+    /* 复制父进程的用户上下文(整个用户段) */
+    res = Clone_User_Context(g_currentThread->userContext, &userContext);
+    if (res != 0)
+	return res;
+
+    /* 子进程从系统调用返回处开始执行 */
+    thread = Start_Forked_User_Thread(userContext, state, false);
+    if (thread == NULL) {
+	Destroy_User_Context(userContext);
+	return ENOMEM;
+    }
+
+    *pThread = thread;
+    return 0;
+}
+
 /*
  * If the given thread has a User_Context,
  * switch to its memory space.
@@ -176,9 +351,6 @@ void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_Stat
      * the Set_Kernel_Stack_Pointer() and Switch_To_Address_Space()
      * functions.
      */
-//之前最近使用过的 userContxt
- 	static struct User_Context* s_currentUserContext;
-
 	//指向User_Conetxt的指针，并初始化为准备切换的进程
  	struct User_Context* userContext = kthread->userContext;
 
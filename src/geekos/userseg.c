@@ -7,6 +7,7 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <geekos/errno.h>
 #include <geekos/ktypes.h>
 #include <geekos/kassert.h>
 #include <geekos/defs.h>
@@ -19,6 +20,7 @@
 #include <geekos/tss.h>
 #include <geekos/kthread.h>
 #include <geekos/argblock.h>
+#include <geekos/vfs.h>
 #include <geekos/user.h>
 
 /* ----------------------------------------------------------------------
@@ -34,7 +36,9 @@
 int userSegDebug = 0;
 
 /*
- * Create a new user context of given size
+ * Create a new user context of given size.
+ * The memory is not cleared: the caller is responsible for
+ * initializing all of it.
  */
 
 /* TODO: Implement
@@ -58,7 +62,6 @@ static struct User_Context* Create_User_Context(ulong_t size)
 		 Free(userContext);         
 		 return NULL;
 	}     
-	memset(userContext->memory, '\0', size);
 	userContext->size = size; 
  
     /* 新建一个 LDT 描述符 */     
@@ -83,6 +86,8 @@ static struct User_Context* Create_User_Context(ulong_t size)
 	userContext->dsSelector = Selector(USER_PRIVILEGE, false, 1);
 	/* 将引用数清零 */     
 	userContext->refCount = 0; 
+	/* 没有打开的文件 */
+	memset(userContext->fileList, '\0', sizeof(userContext->fileList));
  
 	 if (userSegDebug)     
 	 {       
@@ -94,6 +99,63 @@ static struct User_Context* Create_User_Context(ulong_t size)
 	 return userContext; 
 } 
 
+/*
+ * Zero the parts of a freshly loaded process's memory that were not
+ * copied from the executable: gaps between segments, the zero-fill
+ * tail (bss) of each segment, and everything above the last segment.
+ * This is usually far less than the whole process image.
+ * If the segments are not in ascending order without overlap,
+ * just clear everything.  Must be called before the segments
+ * are copied in.
+ */
+static void Clear_Unloaded_Memory(struct User_Context* userContext,
+    struct Exe_Format *exeFormat)
+{
+    ulong_t cleared = 0;
+    int i;
+
+    for (i = 0; i < exeFormat->numSegments; ++i) {
+	struct Exe_Segment *segment = &exeFormat->segmentList[i];
+	if (segment->sizeInMemory == 0)
+	    continue;
+	if (segment->startAddress < cleared || segment->lengthInFile > segment->sizeInMemory)
+	    break;
+	memset(userContext->memory + cleared, '\0', segment->startAddress - cleared);
+	memset(userContext->memory + segment->startAddress + segment->lengthInFile, '\0',
+	    segment->sizeInMemory - segment->lengthInFile);
+	cleared = segment->startAddress + segment->sizeInMemory;
+    }
+
+    if (i < exeFormat->numSegments)
+	cleared = 0;
+    memset(userContext->memory + cleared, '\0', userContext->size - cleared);
+}
+
+/*
+ * Read the data of a segment from the executable file
+ * straight into its place in the process's memory.
+ * Returns 0 if successful, error code (< 0) if not; ENOEXEC if
+ * the file ends before the segment does.
+ */
+static int Read_Segment(struct File *exeFile, struct Exe_Segment *segment, char *dest)
+{
+    ulong_t numBytesRead = 0;
+    int rc;
+
+    if ((rc = Seek(exeFile, segment->offsetInFile)) < 0)
+	return ENOEXEC;
+
+    while (numBytesRead < segment->lengthInFile) {
+	rc = Read(exeFile, dest + numBytesRead, segment->lengthInFile - numBytesRead);
+	if (rc < 0)
+	    return rc;
+	if (rc == 0)
+	    return ENOEXEC;
+	numBytesRead += rc;
+    }
+    return 0;
+}
+
 static bool Validate_User_Memory(struct User_Context* userContext,
     ulong_t userAddr, ulong_t bufSize)
 {
@@ -113,9 +175,26 @@ static bool Validate_User_Memory(struct User_Context* userContext,
  * Public functions
  * ---------------------------------------------------------------------- */
 
+/*
+ * Close the files a user process left open.
+ * Called with interrupts enabled, since closing a file
+ * may need to wait for the disk.
+ */
+void Close_User_Files(struct User_Context* userContext)
+{
+    int fd;
+
+    KASSERT(Interrupts_Enabled());
+    for (fd = 0; fd < USER_MAX_FILES; ++fd) {
+	if (userContext->fileList[fd] != 0 && Close(userContext->fileList[fd]) == 0)
+	    userContext->fileList[fd] = 0;
+    }
+}
+
 /*
  * Destroy a User_Context object, including all memory
  * and other resources allocated within it.
+ * Called with interrupts enabled.
  */
 void Destroy_User_Context(struct User_Context* userContext)
 {
@@ -125,6 +204,8 @@ void Destroy_User_Context(struct User_Context* userContext)
      * - don't forget to free the segment descriptor allocated
      *   for the process's LDT
      */
+	//Exit()已关闭进程的文件;这里只处理其余情况
+	Close_User_Files(userContext);
  	//释放 LDT descriptor
  	Free_Segment_Descriptor(userContext->ldtDescriptor);
 	userContext->ldtDescriptor=0; 
@@ -136,10 +217,10 @@ void Destroy_User_Context(struct User_Context* userContext)
 
 /*
  * Load a user executable into memory by creating a User_Context
- * data structure.
+ * data structure.  Each segment is read from the file straight
+ * into its place in the process's memory; the rest is cleared.
  * Params:
- * exeFileData - a buffer containing the executable to load
- * exeFileLength - number of bytes in exeFileData
+ * exeFile - the executable to load, open for reading
  * exeFormat - parsed ELF segment information describing how to
  *   load the executable's text and data segments, and the
  *   code entry point address
@@ -152,7 +233,7 @@ void Destroy_User_Context(struct User_Context* userContext)
  * Returns:
  *   0 if successful, or an error code (< 0) if unsuccessful
  */
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext)
 {
@@ -199,14 +280,20 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
 	    return -1;     
 	} 
  
-    /* 将用户程序中的各段内容复制到分配的用户内存空间 */     
-    for (i = 0; i < exeFormat->numSegments; i++)     
-    {        
-	    struct Exe_Segment *segment = &exeFormat->segmentList[i];        
-	    memcpy(userContext->memory + segment->startAddress,                
-			    exeFileData + segment->offsetInFile,                
-			    segment->lengthInFile);    
-	} 
+    /* 清零未由可执行文件填充的部分(段间空隙、bss、堆栈及参数块) */
+    Clear_Unloaded_Memory(userContext, exeFormat);
+
+    /* 从可执行文件中直接读取各段内容到分配的用户内存空间 */
+    for (i = 0; i < exeFormat->numSegments; i++)
+    {
+	    struct Exe_Segment *segment = &exeFormat->segmentList[i];
+	    int rc = Read_Segment(exeFile, segment, userContext->memory + segment->startAddress);
+	    if (rc != 0)
+	    {
+		    Destroy_User_Context(userContext);
+		    return rc;
+	    }
+	}
  
     /* 格式化参数块 */     
     Format_Argument_Block(userContext->memory + argBlockAddr, numArgs, argBlockAddr, command);     
@@ -221,6 +308,40 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
     return 0; 
 }
 
+/*
+ * Create a copy of a user context, for Fork().
+ * Params:
+ * parent - the User_Context to copy
+ * pUserContext - reference to the pointer where the new
+ *   User_Context should be stored
+ *
+ * The segment is copied in full: a segmented address space
+ * has no pages to share copy-on-write.  Because user addresses
+ * are relative to the segment base, the copy is valid at its
+ * new location without any relocation.  Open files are not
+ * inherited, since a File has a single position and owner;
+ * the child starts with no file descriptors.
+ *
+ * Returns:
+ *   0 if successful, or an error code (< 0) if unsuccessful
+ */
+int Clone_User_Context(struct User_Context *parent, struct User_Context **pUserContext)
+{
+    struct User_Context *userContext;
+
+    userContext = Create_User_Context(parent->size);
+    if (userContext == NULL)
+	return ENOMEM;
+
+    memcpy(userContext->memory, parent->memory, parent->size);
+    userContext->entryAddr = parent->entryAddr;
+    userContext->argBlockAddr = parent->argBlockAddr;
+    userContext->stackPointerAddr = parent->stackPointerAddr;
+
+    *pUserContext = userContext;
+    return 0;
+}
+
 /*
  * Copy data from user memory into a kernel buffer.
  * Params:
@@ -282,6 +403,28 @@ bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize)
 	return true; 
 }
 
+/*
+ * Find the kernel address of a user buffer, so that it can be
+ * read or written in place (for example, by a filesystem copying
+ * file data straight from its cache) rather than through a
+ * kernel buffer and Copy_From_User() or Copy_To_User().
+ * Params:
+ * userAddr - address of user buffer
+ * bufSize - size of the buffer
+ *
+ * Returns:
+ *   the kernel address of the buffer, or 0 if it doesn't lie
+ *   entirely in memory belonging to the process
+ */
+void* User_To_Kernel(ulong_t userAddr, ulong_t bufSize)
+{
+    struct User_Context* userContext = g_currentThread->userContext;
+
+    if (!Validate_User_Memory(userContext, userAddr, bufSize))
+	return 0;
+    return userContext->memory + userAddr;
+}
+
 /*
  * Switch to user address space belonging to given
  * User_Context object.
@@ -9,6 +9,7 @@
  */
 
 #include <geekos/errno.h>
+#include <geekos/int.h>
 #include <geekos/list.h>
 #include <geekos/string.h>
 #include <geekos/screen.h>
@@ -60,6 +61,45 @@ static struct Filesystem_List s_filesystemList;
 /* Registered paging device. */
 static struct Paging_Device *s_pagingDevice;
 
+/*
+ * Count of changes to files: writes, creations, deletions.
+ * Lets callers caching things derived from files
+ * (such as loaded executables) notice they may be stale.
+ */
+static ulong_t s_fileChangeCount;
+
+/*
+ * Cache of path lookups, so looking for files which don't exist
+ * (as spawning a program from a search path does) and stat-ing
+ * files repeatedly doesn't reach the filesystem every time.
+ * Negative entries remain valid until the path is created.
+ * Positive entries hold the file's metadata, and are only
+ * valid while no file has changed since it was obtained.
+ */
+#define DENTRY_HASH_SIZE 64
+#define DENTRY_CACHE_MAX 128
+
+struct Dentry;
+DEFINE_LIST(Dentry_List, Dentry);
+
+struct Dentry {
+    struct Mount_Point *mountPoint;
+    char *path;				 /* Path within the filesystem */
+    bool negative;			 /* Path known not to exist? */
+    struct VFS_File_Stat stat;		 /* Metadata, for positive entries */
+    ulong_t changeCount;		 /* s_fileChangeCount when stat was obtained */
+    struct Dentry *hashNext;
+    DEFINE_LINK(Dentry_List, Dentry);
+};
+
+IMPLEMENT_LIST(Dentry_List, Dentry);
+
+/* Protects the dentry hash table and LRU list. */
+static struct Mutex s_dentryLock = MUTEX_INITIALIZER;
+static struct Dentry *s_dentryHash[DENTRY_HASH_SIZE];
+static struct Dentry_List s_dentryList;	 /* most recently used first */
+static int s_numDentries;
+
 #define MAX_PREFIX_LEN 16
 
 /*
@@ -173,6 +213,153 @@ static struct Mount_Point *Lookup_Mount_Point(const char *prefix)
     return mountPoint;
 }
 
+/*
+ * Find the hash chain link pointing to the dentry for given path,
+ * or to the null at the end of the chain if there is none.
+ * Called with s_dentryLock held.
+ */
+static struct Dentry **Find_Dentry(struct Mount_Point *mountPoint, const char *path)
+{
+    ulong_t hash = (ulong_t) mountPoint >> 4;
+    struct Dentry **pDentry;
+    const char *p;
+
+    for (p = path; *p != '\0'; ++p)
+	hash = hash * 31 + (uchar_t) *p;
+
+    pDentry = &s_dentryHash[hash % DENTRY_HASH_SIZE];
+    while (*pDentry != 0 &&
+	   ((*pDentry)->mountPoint != mountPoint || strcmp((*pDentry)->path, path) != 0))
+	pDentry = &(*pDentry)->hashNext;
+    return pDentry;
+}
+
+/*
+ * Remove a dentry from the cache and free it.
+ * Called with s_dentryLock held.
+ */
+static void Free_Dentry(struct Dentry **pDentry)
+{
+    struct Dentry *dentry = *pDentry;
+
+    *pDentry = dentry->hashNext;
+    Remove_From_Dentry_List(&s_dentryList, dentry);
+    --s_numDentries;
+    Free(dentry->path);
+    Free(dentry);
+}
+
+/*
+ * Look up the cached result of looking up given path.
+ * Returns true if it is known, with *pRc set to 0 if the file
+ * exists (and its metadata copied to *stat, if stat is non-null),
+ * or ENOTFOUND if it doesn't.
+ */
+static bool Lookup_Dentry(struct Mount_Point *mountPoint, const char *path,
+    struct VFS_File_Stat *stat, int *pRc)
+{
+    struct Dentry *dentry;
+    bool found = false;
+
+    Mutex_Lock(&s_dentryLock);
+    dentry = *Find_Dentry(mountPoint, path);
+    if (dentry != 0 && (dentry->negative || dentry->changeCount == s_fileChangeCount)) {
+	if (dentry->negative)
+	    *pRc = ENOTFOUND;
+	else {
+	    *pRc = 0;
+	    if (stat != 0)
+		*stat = dentry->stat;
+	}
+	Remove_From_Dentry_List(&s_dentryList, dentry);
+	Add_To_Front_Of_Dentry_List(&s_dentryList, dentry);
+	found = true;
+    }
+    Mutex_Unlock(&s_dentryLock);
+
+    return found;
+}
+
+/*
+ * Remember the result of looking up given path: its metadata,
+ * or that it doesn't exist if stat is null.  changeCount is
+ * the value of s_fileChangeCount before the lookup was made;
+ * if a file has changed since, the result may be stale
+ * and is not kept.
+ */
+static void Add_Dentry(struct Mount_Point *mountPoint, const char *path,
+    const struct VFS_File_Stat *stat, ulong_t changeCount)
+{
+    struct Dentry **pDentry, *dentry;
+
+    Mutex_Lock(&s_dentryLock);
+    if (changeCount != s_fileChangeCount)
+	goto done;
+
+    pDentry = Find_Dentry(mountPoint, path);
+    dentry = *pDentry;
+    if (dentry == 0) {
+	/* Make room by dropping the least recently used entry */
+	if (s_numDentries >= DENTRY_CACHE_MAX) {
+	    struct Dentry *victim = Get_Back_Of_Dentry_List(&s_dentryList);
+
+	    Free_Dentry(Find_Dentry(victim->mountPoint, victim->path));
+	    pDentry = Find_Dentry(mountPoint, path);
+	}
+
+	dentry = (struct Dentry*) Malloc(sizeof(*dentry));
+	if (dentry == 0)
+	    goto done;
+	dentry->path = strdup(path);
+	if (dentry->path == 0) {
+	    Free(dentry);
+	    goto done;
+	}
+	dentry->mountPoint = mountPoint;
+	dentry->hashNext = 0;
+	*pDentry = dentry;
+	Add_To_Front_Of_Dentry_List(&s_dentryList, dentry);
+	++s_numDentries;
+    }
+
+    dentry->negative = (stat == 0);
+    if (stat != 0)
+	dentry->stat = *stat;
+    dentry->changeCount = changeCount;
+
+done:
+    Mutex_Unlock(&s_dentryLock);
+}
+
+/*
+ * Note that a file has been changed.
+ * If a path is given, the file was created or deleted,
+ * and any cached lookup of it is dropped.
+ */
+static void Note_File_Change(struct Mount_Point *mountPoint, const char *path)
+{
+    bool iflag = Begin_Int_Atomic();
+    ++s_fileChangeCount;
+    End_Int_Atomic(iflag);
+
+    /*
+     * Dropping the dentry after changing the count
+     * keeps a lookup made before the change from
+     * adding it back.
+     */
+    if (path != 0) {
+	struct Dentry **pDentry;
+
+	Mutex_Lock(&s_dentryLock);
+	pDentry = Find_Dentry(mountPoint, path);
+	if (*pDentry != 0)
+	    Free_Dentry(pDentry);
+	Mutex_Unlock(&s_dentryLock);
+    }
+}
+
+static int Do_Open_File(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile);
+
 /*
  * Common implementation function for Open() and Open_Directory().
  */
@@ -183,6 +370,8 @@ static int Do_Open(
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    bool openFile = (openFunc == &Do_Open_File && !(mode & O_CREATE));
+    ulong_t changeCount;
     int rc;
 
     if (!Unpack_Path(path, prefix, &suffix))
@@ -193,13 +382,21 @@ static int Do_Open(
     if (mountPoint == 0)
 	return ENOTFOUND;
 
+    /* A file known not to exist can't be opened */
+    if (openFile && Lookup_Dentry(mountPoint, suffix, 0, &rc) && rc != 0)
+	return rc;
+
     /* Call into actual Open() or Open_Directory() function. */
+    changeCount = s_fileChangeCount;
     rc = openFunc(mountPoint, suffix, mode, pFile);
     if (rc == 0) {
 	/* File opened successfully! */
 	(*pFile)->mode = mode;
 	(*pFile)->mountPoint = mountPoint;
-    }
+	if (mode & O_CREATE)
+	    Note_File_Change(mountPoint, suffix);
+    } else if (rc == ENOTFOUND && openFile)
+	Add_Dentry(mountPoint, suffix, 0, changeCount);
     return rc;
 }
 
@@ -420,6 +617,8 @@ int Stat(const char *path, struct VFS_File_Stat *stat)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    ulong_t changeCount;
+    int rc;
 
     if (!Unpack_Path(path, prefix, &suffix))
 	return ENOTFOUND;
@@ -430,11 +629,20 @@ int Stat(const char *path, struct VFS_File_Stat *stat)
     if (mountPoint == 0)
 	return ENOTFOUND;
 
+    if (Lookup_Dentry(mountPoint, suffix, stat, &rc))
+	return rc;
+
     Debug("Stat: found mount point, dispatching to filesystem\n");
     if (mountPoint->ops->Stat == 0)
 	return EUNSUPPORTED;
-    else
-	return mountPoint->ops->Stat(mountPoint, suffix, stat);
+
+    changeCount = s_fileChangeCount;
+    rc = mountPoint->ops->Stat(mountPoint, suffix, stat);
+    if (rc == 0)
+	Add_Dentry(mountPoint, suffix, stat, changeCount);
+    else if (rc == ENOTFOUND)
+	Add_Dentry(mountPoint, suffix, 0, changeCount);
+    return rc;
 }
 
 /*
@@ -531,10 +739,15 @@ int Read(struct File *file, void *buf, ulong_t len)
  */
 int Write(struct File *file, void *buf, ulong_t len)
 {
+    int rc;
+
     if (file->ops->Write == 0)
 	return EUNSUPPORTED;
-    else
-	return file->ops->Write(file, buf, len);
+
+    rc = file->ops->Write(file, buf, len);
+    if (rc > 0)
+	Note_File_Change(0, 0);
+    return rc;
 }
 
 /*
@@ -553,6 +766,27 @@ int Seek(struct File *file, ulong_t len)
 	return file->ops->Seek(file, len);
 }
 
+/*
+ * Change the length of a file.
+ * Params:
+ *   file - the File object
+ *   size - new length of the file
+ * Returns: 0 if successful,
+ *   or error code (< 0) if it fails
+ */
+int Truncate(struct File *file, ulong_t size)
+{
+    int rc;
+
+    if (file->ops->Truncate == 0)
+	return EUNSUPPORTED;
+
+    rc = file->ops->Truncate(file, size);
+    if (rc == 0)
+	Note_File_Change(0, 0);
+    return rc;
+}
+
 /*
  * Completely read named file into a buffer.
  * Params:
@@ -618,6 +852,7 @@ int Create_Directory(const char *path)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    int rc;
 
     /* Split path into prefix and suffix */
     if (!Unpack_Path(path, prefix, &suffix))
@@ -630,8 +865,11 @@ int Create_Directory(const char *path)
 
     if (mountPoint->ops->Create_Directory == 0)
 	return EUNSUPPORTED;
-    else
-	return mountPoint->ops->Create_Directory(mountPoint, suffix);
+
+    rc = mountPoint->ops->Create_Directory(mountPoint, suffix);
+    if (rc == 0)
+	Note_File_Change(mountPoint, suffix);
+    return rc;
 }
 
 /*
@@ -645,6 +883,7 @@ int Delete(const char *path)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    int rc;
 
     /* Split path into prefix and suffix */
     if (!Unpack_Path(path, prefix, &suffix))
@@ -657,8 +896,21 @@ int Delete(const char *path)
 
     if (mountPoint->ops->Delete == 0)
 	return EUNSUPPORTED;
-    else
-	return mountPoint->ops->Delete(mountPoint, suffix);
+
+    rc = mountPoint->ops->Delete(mountPoint, suffix);
+    if (rc == 0)
+	Note_File_Change(mountPoint, suffix);
+    return rc;
+}
+
+/*
+ * Get the number of changes made to files so far.
+ * Something derived from a file can be reused as long as this
+ * hasn't changed since.
+ */
+ulong_t Get_File_Change_Count(void)
+{
+    return s_fileChangeCount;
 }
 
 /*
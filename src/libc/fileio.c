@@ -0,0 +1,33 @@
+/*
+ * User-mode file I/O
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/syscall.h>
+#include <string.h>
+#include <fileio.h>
+
+DEF_SYSCALL(Open,SYS_OPEN,int,(const char *path, int mode),
+    const char *arg0 = path; size_t arg1 = strlen(path); int arg2 = mode;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Open_Directory,SYS_OPENDIRECTORY,int,(const char *path),
+    const char *arg0 = path; size_t arg1 = strlen(path);,
+    SYSCALL_REGS_2)
+DEF_SYSCALL(Close,SYS_CLOSE,int,(int fd),int arg0 = fd;,SYSCALL_REGS_1)
+DEF_SYSCALL(Read,SYS_READ,int,(int fd, void *buf, ulong_t len),
+    int arg0 = fd; void *arg1 = buf; ulong_t arg2 = len;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Write,SYS_WRITE,int,(int fd, const void *buf, ulong_t len),
+    int arg0 = fd; const void *arg1 = buf; ulong_t arg2 = len;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Seek,SYS_SEEK,int,(int fd, ulong_t pos),
+    int arg0 = fd; ulong_t arg1 = pos;,
+    SYSCALL_REGS_2)
+DEF_SYSCALL(Stat,SYS_STAT,int,(const char *path, struct VFS_File_Stat *stat),
+    const char *arg0 = path; size_t arg1 = strlen(path); struct VFS_File_Stat *arg2 = stat;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Read_Entry,SYS_READENTRY,int,(int fd, struct VFS_Dir_Entry *entry),
+    int arg0 = fd; struct VFS_Dir_Entry *arg1 = entry;,
+    SYSCALL_REGS_2)
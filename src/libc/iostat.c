@@ -0,0 +1,14 @@
+/*
+ * Block device statistics
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/syscall.h>
+#include <iostat.h>
+
+DEF_SYSCALL(Get_IO_Stats,SYS_IOSTATS,int,
+    (struct Block_Device_Stats *statsList, int maxDevices),
+    struct Block_Device_Stats *arg0 = statsList; int arg1 = maxDevices;,
+    SYSCALL_REGS_2)
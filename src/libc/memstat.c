@@ -0,0 +1,14 @@
+/*
+ * Memory statistics
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/syscall.h>
+#include <memstat.h>
+
+DEF_SYSCALL(Get_Mem_Stats,SYS_MEMSTATS,int,
+    (struct Mem_Stats *stats, struct Process_Mem_Stats *procList, int maxProcs),
+    struct Mem_Stats *arg0 = stats; struct Process_Mem_Stats *arg1 = procList; int arg2 = maxProcs;,
+    SYSCALL_REGS_3)
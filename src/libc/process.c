@@ -24,6 +24,7 @@ DEF_SYSCALL(Spawn_Program,SYS_SPAWN,int,
     SYSCALL_REGS_4)
 DEF_SYSCALL(Wait,SYS_WAIT,int,(int pid),int arg0 = pid;,SYSCALL_REGS_1)
 DEF_SYSCALL(Get_PID,SYS_GETPID,int,(void),,SYSCALL_REGS_0)
+DEF_SYSCALL(Fork,SYS_FORK,int,(void),,SYSCALL_REGS_0)
 
 #define CMDLEN 79
 
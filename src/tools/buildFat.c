@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
@@ -10,6 +11,15 @@
 
 #define SECTOR_SIZE 512
 
+/* Free root directory slots, for files created later */
+#define SPARE_DIR_ENTRIES 64
+
+static int fd;
+static int *fat;
+static int blocks;
+static int firstFreeBlock;
+static char *imageFile;
+
 int roundToNextBlock(int x)
 {
     if (x % SECTOR_SIZE == 0) {
@@ -19,26 +29,186 @@ int roundToNextBlock(int x)
     }
 }
 
+/*
+ * Allocate numBlocks consecutive blocks (at least one),
+ * chaining them in the FAT.  Returns the first one.
+ */
+int allocateBlocks(int numBlocks)
+{
+    int j;
+    int first = firstFreeBlock;
+
+    if (numBlocks == 0)
+	numBlocks = 1;
+    if (firstFreeBlock + numBlocks > blocks) {
+	printf("Error: %s is full\n", imageFile);
+	exit(-1);
+    }
+
+    for (j=0; j < numBlocks-1; j++) {
+	fat[firstFreeBlock] = firstFreeBlock + 1;
+	++firstFreeBlock;
+    }
+    fat[firstFreeBlock++] = FAT_ENTRY_EOF;
+
+    return first;
+}
+
+/*
+ * Set the name in a directory entry from the last component of a path.
+ */
+void setName(directoryEntry *entry, const char *filename)
+{
+    const char *end = filename + strlen(filename);
+    int len;
+
+    /* Remove trailing '/' characters and leading directory path components */
+    while (end > filename + 1 && end[-1] == '/')
+	--end;
+    len = end - filename;
+    if (memchr(filename, '/', len) != 0) {
+	while (filename[len-1] != '/')
+	    --len;
+	filename += len;
+	len = end - filename;
+    }
+
+    /* Set filename in directory entry */
+    memset(entry->fileName, '\0', sizeof(entry->fileName));
+    memcpy(entry->fileName, filename,
+	len < sizeof(entry->fileName) ? len : sizeof(entry->fileName));
+}
+
+/*
+ * Copy a file to the disk, and fill in its directory entry.
+ */
+void addFile(const char *filename, off_t size, directoryEntry *entry)
+{
+    int j;
+    int ret;
+    int fd2;
+    int numBlocks;
+
+    numBlocks = roundToNextBlock(size)/SECTOR_SIZE;
+    entry->firstBlock = allocateBlocks(numBlocks);
+    entry->fileSize = size;
+    setName(entry, filename);
+
+    printf("file %s starts at block %d\n", filename, entry->firstBlock);
+    lseek(fd, entry->firstBlock * SECTOR_SIZE, SEEK_SET);
+
+    /* copy the file to the disk */
+    fd2 = open(filename, O_RDONLY, 0);
+    assert(fd2 >= 0);
+    for (j=0; j < numBlocks; j++) {
+	int ret2;
+	char buffer[SECTOR_SIZE];
+
+	ret = read(fd2, buffer, SECTOR_SIZE);
+	assert(ret >= 0);
+	ret2 = write(fd, buffer, ret);
+	assert(ret2 == ret);
+    }
+    close(fd2);
+}
+
+void addPath(const char *path, directoryEntry *entry);
+
+/*
+ * Copy a directory tree to the disk, and fill in the directory entry
+ * of its top.  A subdirectory is a file holding directory entries,
+ * PFAT_DIR_ENTRIES_PER_BLOCK to a block.  An empty one has no blocks.
+ */
+void addDirectory(const char *dirname, directoryEntry *entry)
+{
+    int i;
+    int count;
+    int numBlocks;
+    DIR *dir;
+    struct dirent *ent;
+    directoryEntry *entries;
+
+    dir = opendir(dirname);
+    if (dir == 0) {
+	perror(dirname);
+	exit(-1);
+    }
+    count = 0;
+    while ((ent = readdir(dir)) != 0) {
+	if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+	    ++count;
+    }
+
+    numBlocks = (count + PFAT_DIR_ENTRIES_PER_BLOCK - 1) / PFAT_DIR_ENTRIES_PER_BLOCK;
+    entries = (directoryEntry*) calloc(numBlocks * PFAT_DIR_ENTRIES_PER_BLOCK + 1, sizeof(directoryEntry));
+
+    /* The contents go first, then the directory itself */
+    rewinddir(dir);
+    i = 0;
+    while ((ent = readdir(dir)) != 0 && i < count) {
+	char *path;
+
+	if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+	    continue;
+	path = (char*) malloc(strlen(dirname) + strlen(ent->d_name) + 2);
+	sprintf(path, "%s/%s", dirname, ent->d_name);
+	addPath(path, &entries[i++]);
+	free(path);
+    }
+    closedir(dir);
+
+    entry->directory = 1;
+    entry->fileSize = numBlocks * SECTOR_SIZE;
+    entry->firstBlock = numBlocks > 0 ? allocateBlocks(numBlocks) : 0;
+    setName(entry, dirname);
+
+    printf("directory %s starts at block %d\n", dirname, entry->firstBlock);
+    for (i=0; i < numBlocks; i++) {
+	char buffer[SECTOR_SIZE];
+
+	memset(buffer, '\0', SECTOR_SIZE);
+	memcpy(buffer, &entries[i * PFAT_DIR_ENTRIES_PER_BLOCK],
+	    PFAT_DIR_ENTRIES_PER_BLOCK * sizeof(directoryEntry));
+	lseek(fd, (entry->firstBlock + i) * SECTOR_SIZE, SEEK_SET);
+	write(fd, buffer, SECTOR_SIZE);
+    }
+    free(entries);
+}
+
+/*
+ * Copy a file or directory tree to the disk.
+ */
+void addPath(const char *path, directoryEntry *entry)
+{
+    struct stat sbuf;
+
+    if (stat(path, &sbuf) != 0) {
+	printf("Error stating %s\n", path);
+	exit(-1);
+    }
+
+    if (S_ISDIR(sbuf.st_mode))
+	addDirectory(path, entry);
+    else
+	addFile(path, sbuf.st_size, entry);
+}
+
 int main(int argc, char *argv[])
 {
     int i;
-    int fd;
     int fd2;
     int ret;
     int curr;
-    int *fat;
-    int blocks;
     int diskSize;
     int fileCount;
-    char *imageFile;
+    int dirCount;
     struct stat sbuf;
-    int firstFreeBlock;
     bootSector bSector;
     directoryEntry *directory;
     int writeBoot = 0;
 
     if (argc <= 1) {
-        printf("usage: buildFat [-b <boot block> ] <diskImage> <files>\n");
+        printf("usage: buildFat [-b <boot block> ] <diskImage> <files or directories>\n");
 	exit(-1);
     }
 
@@ -73,7 +243,8 @@ int main(int argc, char *argv[])
     bSector.fileAllocationLength = roundToNextBlock(blocks)/SECTOR_SIZE*4;
     fat = (int *) calloc(blocks, sizeof(int));
     bSector.rootDirectoryOffset = bSector.fileAllocationLength + 1;
-    bSector.rootDirectoryCount = fileCount;
+    dirCount = fileCount + SPARE_DIR_ENTRIES;
+    bSector.rootDirectoryCount = dirCount;
 
     fd = open(imageFile, O_WRONLY, 0);
     if (fd < 0) {
@@ -103,79 +274,28 @@ int main(int argc, char *argv[])
     }
 
     firstFreeBlock = bSector.rootDirectoryOffset + 
-        roundToNextBlock(sizeof(directoryEntry) * fileCount)/ SECTOR_SIZE;
+        roundToNextBlock(sizeof(directoryEntry) * dirCount)/ SECTOR_SIZE;
     printf("first data blocks is %d\n", firstFreeBlock);
 
-    directory = (directoryEntry*) malloc(sizeof(directoryEntry) * fileCount);
+    directory = (directoryEntry*) calloc(dirCount, sizeof(directoryEntry));
     for (i=0; i < fileCount; i++) {
-	int j;
-	int numBlocks;
-	const char *filename = argv[i+curr];
-
-	directory[i].firstBlock = firstFreeBlock;
-
-	ret = stat(filename, &sbuf);
-	if (ret != 0) {
-	    printf("Error stating %s\n", filename);
-	    exit(-1);
-	}
-	assert(ret == 0);
-	numBlocks = roundToNextBlock(sbuf.st_size)/SECTOR_SIZE;
-	directory[i].fileSize = sbuf.st_size;
+	addPath(argv[i+curr], &directory[i]);
 
         if (writeBoot) {
 	   if (i== 0) {
 	       /* setup.bin */
-	       bSector.setupStart = firstFreeBlock;
-	       bSector.setupSize = numBlocks;
+	       bSector.setupStart = directory[i].firstBlock;
+	       bSector.setupSize = roundToNextBlock(directory[i].fileSize)/SECTOR_SIZE;
 	       printf("setup file starts at %d, %d sectors long\n",
 		   bSector.setupStart, bSector.setupSize);
 	   } else if (i==1) {
 	       /* kernel.exe */
-	       bSector.kernelStart = firstFreeBlock;
-	       bSector.kernelSize = numBlocks;
+	       bSector.kernelStart = directory[i].firstBlock;
+	       bSector.kernelSize = roundToNextBlock(directory[i].fileSize)/SECTOR_SIZE;
 	       printf("kernel file starts at %d, %d sectors long\n",
 		   bSector.kernelStart, bSector.kernelSize);
 	   }
 	}
-	for (j=0; j < numBlocks-1; j++) {
-	    fat[firstFreeBlock] = firstFreeBlock + 1;
-	    ++firstFreeBlock;
-
-	    if (firstFreeBlock > (diskSize/SECTOR_SIZE)) {
-		printf("Error: %s is full\n", imageFile);
-		exit(-1);
-	    }
-	}
-	fat[firstFreeBlock++] = FAT_ENTRY_EOF;
-
-	lseek(fd, directory[i].firstBlock * SECTOR_SIZE, SEEK_SET);
-
-	/* copy the file to the disk */
-	fd2 = open(filename, O_RDONLY, 0);
-	assert(fd2);
-
-	/* Remove leading directory path components */
-	if (strrchr(filename, '/') != 0)
-	    filename = strrchr(filename, '/') + 1;
-
-	/* Set filename in directory entry */
-	strncpy(directory[i].fileName, filename, sizeof(directory[i].fileName));
-
-	printf("file %s starts at block %d\n", directory[i].fileName, directory[i].firstBlock);
-	lseek(fd, directory[i].firstBlock * SECTOR_SIZE, SEEK_SET);
-
-	/* copy the file to the disk */
-	for (j=0; j < numBlocks; j++) {
-	    int ret2;
-	    char buffer[SECTOR_SIZE];
-
-	    ret = read(fd2, buffer, SECTOR_SIZE);
-	    assert(ret >= 0);
-	    ret2 = write(fd, buffer, ret);
-	    assert(ret2 == ret);
-	}
-	close(fd2);
     }
 
     lseek(fd, SECTOR_SIZE, SEEK_SET);
@@ -183,7 +303,7 @@ int main(int argc, char *argv[])
 
     lseek(fd, bSector.rootDirectoryOffset * SECTOR_SIZE, SEEK_SET);
     printf("putting the directory at sector %d\n", bSector.rootDirectoryOffset);
-    write(fd, directory, sizeof(directoryEntry) * fileCount);
+    write(fd, directory, sizeof(directoryEntry) * dirCount);
 
     /* write out boot record */
     lseek(fd, PFAT_BOOT_RECORD_OFFSET, SEEK_SET);
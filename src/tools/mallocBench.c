@@ -0,0 +1,232 @@
+/*
+ * Host-side microbenchmark for the kernel heap
+ *
+ * Links the kernel's malloc.c and bget.c into an ordinary host
+ * program, and runs the same random allocate/free workload against
+ * plain bget (the allocator Malloc() used to be) and against
+ * Malloc()/Free() with its size class front end.  For each it
+ * reports the throughput, and how much memory the allocator is
+ * holding for the live buffers at the end of the run.
+ *
+ * usage: mallocBench [<number of operations>]
+ */
+
+#include <geekos/int.h>
+#include <geekos/mem.h>
+#include <geekos/bget.h>
+#include <geekos/malloc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define HEAP_SIZE   KERNEL_HEAP_SIZE
+#define NUM_PAGES   4096
+#define NUM_SLOTS   2000
+#define DEFAULT_OPS 2000000
+
+/* Place the arena low, so Page_Index() fits in an int */
+#define ARENA_HINT  0x10000000UL
+
+/* ----------------------------------------------------------------------
+ * Stand-ins for the kernel services malloc.c and bget.c rely on
+ * ---------------------------------------------------------------------- */
+
+struct Kernel_Thread *g_currentThread;
+struct Page *g_pageList;
+static struct Page_List s_freeList;
+
+bool Interrupts_Enabled(void)
+{
+    return false;
+}
+
+void Set_Current_Attr(uchar_t attrib)
+{
+}
+
+void Print(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+void* Alloc_Page(void)
+{
+    struct Page *page;
+
+    if (Is_Page_List_Empty(&s_freeList))
+	return 0;
+    page = Get_Front_Of_Page_List(&s_freeList);
+    Remove_From_Front_Of_Page_List(&s_freeList);
+    page->flags |= PAGE_ALLOCATED;
+    return (void*) Get_Page_Address(page);
+}
+
+void Free_Page(void* pageAddr)
+{
+    struct Page *page = Get_Page((ulong_t) pageAddr);
+
+    page->flags &= ~(PAGE_ALLOCATED);
+    Add_To_Front_Of_Page_List(&s_freeList, page);
+}
+
+/* ----------------------------------------------------------------------
+ * Benchmark
+ * ---------------------------------------------------------------------- */
+
+static char *s_arena;
+static void *s_slot[NUM_SLOTS];
+static ulong_t s_slotSize[NUM_SLOTS];
+static ulong_t s_seed;
+
+static ulong_t Random(void)
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return (s_seed >> 16) & 0x7fff;
+}
+
+/*
+ * Mostly small buffers (strings, request objects), some medium,
+ * and a few large ones (bitsets, file buffers).
+ */
+static ulong_t Random_Size(void)
+{
+    ulong_t r = Random() % 100;
+
+    if (r < 70)
+	return 1 + Random() % 128;
+    else if (r < 90)
+	return 129 + Random() % 896;
+    else if (r < 98)
+	return 1025 + Random() % 1024;
+    else
+	return 4096 + Random() % 12288;
+}
+
+/*
+ * Set up the heap and page freelist.
+ */
+static void Init_Arena(void)
+{
+    ulong_t addr;
+
+    for (addr = (ulong_t) s_arena + HEAP_SIZE;
+	 addr < (ulong_t) s_arena + HEAP_SIZE + NUM_PAGES * PAGE_SIZE;
+	 addr += PAGE_SIZE) {
+	Get_Page(addr)->flags = PAGE_AVAIL;
+	Add_To_Back_Of_Page_List(&s_freeList, Get_Page(addr));
+    }
+}
+
+static void* Bget_Alloc(ulong_t size)
+{
+    bool iflag = Begin_Int_Atomic();
+    void *result = bget(size);
+    End_Int_Atomic(iflag);
+    return result;
+}
+
+static void Bget_Free(void *buf)
+{
+    bool iflag = Begin_Int_Atomic();
+    brel(buf);
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * bget has no way to discard a pool, so each run gets a fresh
+ * copy of the allocator state in its own process.
+ */
+static void Run(const char *name, void* (*alloc)(ulong_t), void (*release)(void*), long numOps)
+{
+    struct timespec start, finish;
+    bufsize curalloc, totfree, maxfree;
+    long nget, nrel, i, failures = 0;
+    ulong_t liveBytes = 0, numPages = 0, addr;
+    double secs;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid != 0) {
+	waitpid(pid, 0, 0);
+	return;
+    }
+
+    Init_Arena();
+    Init_Heap((ulong_t) s_arena, HEAP_SIZE);
+    s_seed = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < numOps; ++i) {
+	int n = Random() % NUM_SLOTS;
+
+	if (s_slot[n] != 0) {
+	    release(s_slot[n]);
+	    s_slot[n] = 0;
+	} else {
+	    s_slotSize[n] = Random_Size();
+	    s_slot[n] = alloc(s_slotSize[n]);
+	    if (s_slot[n] == 0)
+		++failures;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    secs = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = 0; i < NUM_SLOTS; ++i)
+	if (s_slot[i] != 0)
+	    liveBytes += s_slotSize[i];
+    for (addr = (ulong_t) s_arena; addr < (ulong_t) s_arena + HEAP_SIZE + NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE)
+	if (Get_Page(addr)->flags & PAGE_MALLOC)
+	    ++numPages;
+    bstats(&curalloc, &totfree, &maxfree, &nget, &nrel);
+
+    printf("%s:\n", name);
+    printf("  %ld operations in %.3f s, %.1f ns/operation, %ld failed allocations\n",
+	numOps, secs, secs * 1e9 / numOps, failures);
+    printf("  %lu bytes live, %ld bytes in bget heap, %lu bytes in size class pages\n",
+	liveBytes, (long) curalloc, numPages * PAGE_SIZE);
+    printf("  overhead %.1f%%, largest free heap block %ld of %ld free bytes\n",
+	100.0 * ((double) curalloc + numPages * PAGE_SIZE - liveBytes) / liveBytes,
+	(long) maxfree, (long) totfree);
+
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    ulong_t arenaSize = HEAP_SIZE + NUM_PAGES * PAGE_SIZE;
+    long numOps = DEFAULT_OPS;
+
+    if (argc > 1)
+	numOps = atol(argv[1]);
+
+    s_arena = mmap((void*) ARENA_HINT, arenaSize, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s_arena == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    if (Page_Index((ulong_t) s_arena + arenaSize) < 0) {
+	fprintf(stderr, "arena mapped too high (%p)\n", s_arena);
+	exit(1);
+    }
+    g_pageList = calloc(Page_Index((ulong_t) s_arena + arenaSize), sizeof(struct Page));
+    if (g_pageList == 0) {
+	perror("calloc");
+	exit(1);
+    }
+
+    Run("bget", Bget_Alloc, Bget_Free, numOps);
+    Run("Malloc", Malloc, Free, numOps);
+
+    return 0;
+}
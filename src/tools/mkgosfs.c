@@ -0,0 +1,94 @@
+/*
+ * Create an empty GOSFS filesystem on a disk image
+ *
+ * The filesystem fills the image (up to the largest size GOSFS
+ * supports), and has the same layout GOSFS_Format() creates.
+ *
+ * usage: mkgosfs <diskImage>
+ */
+
+#include <geekos/gosfs.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int fd;
+static char *imageFile;
+
+/*
+ * Write a filesystem block to the image.
+ */
+void writeBlock(unsigned int blockNum, void *block)
+{
+    if (lseek(fd, (off_t) blockNum * GOSFS_BLOCK_SIZE, SEEK_SET) < 0 ||
+	write(fd, block, GOSFS_BLOCK_SIZE) != GOSFS_BLOCK_SIZE) {
+	perror(imageFile);
+	exit(-1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct GOSFS_Superblock super;
+    struct GOSFS_Inode *root;
+    struct stat sbuf;
+    unsigned char block[GOSFS_BLOCK_SIZE];
+    unsigned int i;
+
+    if (argc != 2) {
+        printf("usage: mkgosfs <diskImage>\n");
+	exit(-1);
+    }
+
+    imageFile = argv[1];
+    if (stat(imageFile, &sbuf) != 0) {
+        perror("stat");
+	exit(-1);
+    }
+
+    GOSFS_Init_Superblock(&super, sbuf.st_size / GOSFS_BLOCK_SIZE);
+    if (super.numBlocks < super.dataStart + GOSFS_MIN_DATA_BLOCKS) {
+        printf("image is too small for a GOSFS filesystem\n");
+	exit(-1);
+    }
+
+    fd = open(imageFile, O_WRONLY, 0);
+    if (fd < 0) {
+        perror("image File open:");
+	exit(-1);
+    }
+
+    /* Empty journal, and the inode table with just the root directory */
+    memset(block, '\0', sizeof(block));
+    writeBlock(super.journalStart, block);
+    for (i = 1; i < super.inodeBlocks; i++)
+	writeBlock(super.inodeStart + i, block);
+    root = (struct GOSFS_Inode*) block + GOSFS_ROOT_INODE;
+    root->type = GOSFS_INODE_DIRECTORY;
+    writeBlock(super.inodeStart, block);
+
+    /* The blocks holding the filesystem itself are in use, as are inodes 0 and 1 */
+    for (i = 0; i < super.bitmapBlocks; i++) {
+	GOSFS_Init_Bitmap_Block(block, i, super.dataStart, super.numBlocks);
+	writeBlock(super.bitmapStart + i, block);
+    }
+    for (i = 0; i < super.inodeBitmapBlocks; i++) {
+	GOSFS_Init_Bitmap_Block(block, i, GOSFS_ROOT_INODE + 1, super.numInodes);
+	writeBlock(super.inodeBitmapStart + i, block);
+    }
+
+    memset(block, '\0', sizeof(block));
+    memcpy(block, &super, sizeof(super));
+    writeBlock(0, block);
+
+    printf("%s: %u blocks, %u inodes, data starts at block %u\n",
+	imageFile, super.numBlocks, super.numInodes, super.dataStart);
+
+    close(fd);
+
+    exit(0);
+}
@@ -0,0 +1,36 @@
+/*
+ * Print the contents of files
+ */
+
+#include <conio.h>
+#include <fileio.h>
+
+#define BUF_SIZE 4096
+
+static char s_buf[BUF_SIZE + 1];
+
+int main(int argc, char** argv)
+{
+    int i, fd, n, rc = 0;
+
+    for (i = 1; i < argc; ++i) {
+	fd = Open(argv[i], O_READ);
+	if (fd < 0) {
+	    Print("%s: %s\n", argv[i], Get_Error_String(fd));
+	    rc = 1;
+	    continue;
+	}
+
+	while ((n = Read(fd, s_buf, BUF_SIZE)) > 0) {
+	    s_buf[n] = '\0';
+	    Print_String(s_buf);
+	}
+	if (n < 0) {
+	    Print("%s: %s\n", argv[i], Get_Error_String(n));
+	    rc = 1;
+	}
+	Close(fd);
+    }
+
+    return rc;
+}
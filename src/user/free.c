@@ -0,0 +1,49 @@
+/*
+ * Report kernel memory usage
+ *
+ * Shows physical pages by type of use, kernel heap usage,
+ * and the memory of each user process.
+ */
+
+#include <conio.h>
+#include <memstat.h>
+
+#define KB(pages) ((pages) * 4)
+
+int main(int argc, char** argv)
+{
+    struct Mem_Stats stats;
+    struct Process_Mem_Stats procList[MEMSTAT_MAX_PROCESSES];
+    int numProcs, i;
+    unsigned long totalSize = 0;
+
+    numProcs = Get_Mem_Stats(&stats, procList, MEMSTAT_MAX_PROCESSES);
+    if (numProcs < 0) {
+	Print("Could not get memory statistics: %d\n", numProcs);
+	return 1;
+    }
+
+    Print("Pages (4KB):  total %lu, free %lu (%lu zeroed)\n",
+	stats.numPages, stats.freePages, stats.zeroedPages);
+    Print("  kernel %lu, heap %lu, hardware %lu, unused %lu\n",
+	stats.kernelPages, stats.heapPages, stats.hardwarePages, stats.unusedPages);
+    Print("  allocated %lu (%lu in Malloc size classes)\n",
+	stats.allocatedPages, stats.mallocPages);
+
+    Print("Heap: %luKB, in use %lu bytes (peak %lu)\n",
+	stats.heapSize / 1024, stats.heapInUse, stats.heapPeak);
+    Print("  free %lu bytes, largest free block %lu\n",
+	stats.heapFree, stats.heapLargestFree);
+    Print("  %lu allocations, %lu releases\n",
+	stats.numHeapAllocs, stats.numHeapFrees);
+
+    Print("Processes:\n  PID     SIZE\n");
+    for (i = 0; i < numProcs; ++i) {
+	Print("  %3d %7luK\n", procList[i].pid, procList[i].size / 1024);
+	totalSize += procList[i].size;
+    }
+    Print("  total %luK in %d processes; %luK of memory free\n",
+	totalSize / 1024, numProcs, KB(stats.freePages));
+
+    return 0;
+}
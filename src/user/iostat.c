@@ -0,0 +1,75 @@
+/*
+ * Report block device activity
+ *
+ * Shows the requests and transfers of each block device, how busy
+ * it has been since boot, and a histogram of request latencies.
+ */
+
+#include <conio.h>
+#include <sched.h>
+#include <iostat.h>
+
+/* Milliseconds per timer tick */
+#define MS_PER_TICK 55
+
+static void Print_Histogram(const char *what, const unsigned long *hist)
+{
+    int i, first = -1, last = -1;
+
+    for (i = 0; i < IOSTAT_NUM_BUCKETS; ++i) {
+	if (hist[i] != 0) {
+	    if (first < 0)
+		first = i;
+	    last = i;
+	}
+    }
+    if (first < 0)
+	return;
+
+    Print("  %s latency (us):\n", what);
+    for (i = first; i <= last; ++i) {
+	if (i == IOSTAT_NUM_BUCKETS - 1)
+	    Print("    %7lu+       %lu\n", 1UL << i, hist[i]);
+	else
+	    Print("    %7lu-%-7lu %lu\n", i == 0 ? 0UL : 1UL << i, (2UL << i) - 1, hist[i]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct Block_Device_Stats statsList[IOSTAT_MAX_DEVICES];
+    unsigned long uptime = Get_Time_Of_Day() * MS_PER_TICK;
+    int numDevices, i;
+
+    numDevices = Get_IO_Stats(statsList, IOSTAT_MAX_DEVICES);
+    if (numDevices < 0) {
+	Print("Could not get block device statistics: %d\n", numDevices);
+	return 1;
+    }
+
+    Print("DEVICE  REQS  MERGED   READS  KB READ  WRITES KB WRITTEN ERRS QUEUE  WAIT(ms) UTIL\n");
+    for (i = 0; i < numDevices; ++i) {
+	struct Block_Device_Stats *stats = &statsList[i];
+	unsigned long waitAvg = stats->numRequests == 0 ? 0
+	    : stats->waitTime / 1000 / stats->numRequests;
+	unsigned long util = uptime == 0 ? 0 : (stats->busyTime / 1000) * 100 / uptime;
+
+	Print("%-6s %5lu %7lu %7lu %8lu %7lu %10lu %4lu %2d/%-2d %9lu %3lu%%\n",
+	    stats->name, stats->numRequests, stats->numMerges,
+	    stats->numReads, stats->sectorsRead / 2,
+	    stats->numWrites, stats->sectorsWritten / 2, stats->numErrors,
+	    stats->queueDepth, stats->maxQueueDepth, waitAvg, util);
+    }
+
+    for (i = 0; i < numDevices; ++i) {
+	struct Block_Device_Stats *stats = &statsList[i];
+
+	if (stats->numReads + stats->numWrites == 0)
+	    continue;
+	Print("%s:\n", stats->name);
+	Print_Histogram("Read", stats->readLatency);
+	Print_Histogram("Write", stats->writeLatency);
+    }
+
+    return 0;
+}
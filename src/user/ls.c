@@ -0,0 +1,48 @@
+/*
+ * List the entries of directories
+ */
+
+#include <conio.h>
+#include <fileio.h>
+
+static struct VFS_Dir_Entry s_entry;
+
+static int List(const char *path)
+{
+    int fd, rc;
+
+    fd = Open_Directory(path);
+    if (fd < 0) {
+	Print("%s: %s\n", path, Get_Error_String(fd));
+	return 1;
+    }
+
+    while ((rc = Read_Entry(fd, &s_entry)) == 0) {
+	if (s_entry.stats.isDirectory)
+	    Print("%s/\n", s_entry.name);
+	else
+	    Print("%s %d\n", s_entry.name, s_entry.stats.size);
+    }
+    Close(fd);
+
+    if (rc < 0) {
+	Print("%s: %s\n", path, Get_Error_String(rc));
+	return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int i, rc = 0;
+
+    if (argc < 2)
+	return List("/c");
+
+    for (i = 1; i < argc; ++i) {
+	if (argc > 2)
+	    Print("%s:\n", argv[i]);
+	rc |= List(argv[i]);
+    }
+    return rc;
+}